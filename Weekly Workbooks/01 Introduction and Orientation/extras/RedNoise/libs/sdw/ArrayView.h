@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// A read-only run of values that something else owns: a vector, or a section of a mapped file (see ModelCache). It is
+// two words to pass around and is only valid for as long as the storage it points into.
+template<typename T>
+class ArrayView {
+public:
+	ArrayView() = default;
+	ArrayView(const T *start, size_t length) : items(start), count(length) {}
+	template<typename Allocator>
+	ArrayView(const std::vector<T, Allocator> &values) : items(values.data()), count(values.size()) {}
+
+	const T &operator[](size_t i) const { return items[i]; }
+	const T *data() const { return items; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	const T *begin() const { return items; }
+	const T *end() const { return items + count; }
+	const T &front() const { return items[0]; }
+	const T &back() const { return items[count - 1]; }
+
+private:
+	const T *items = nullptr;
+	size_t count = 0;
+};
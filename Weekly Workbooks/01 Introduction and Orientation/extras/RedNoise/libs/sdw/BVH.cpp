@@ -0,0 +1,558 @@
+#include "BVH.h"
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <limits>
+#include <numeric>
+#include <thread>
+
+namespace {
+
+const float TRAVERSAL_COST = 1.0f;
+const float INTERSECTION_COST = 1.0f;
+const uint32_t NO_PARENT = UINT32_MAX;
+
+// Leaves are intersected a whole batch of TriangleStore::LANES triangles at a time
+float leafCost(size_t triangleCount) {
+	return INTERSECTION_COST * ((triangleCount + TriangleStore::LANES - 1) / TriangleStore::LANES);
+}
+
+float surfaceArea(const glm::vec3 &boundsMin, const glm::vec3 &boundsMax) {
+	glm::vec3 extent = boundsMax - boundsMin;
+	return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+// Surface area weighted by what it costs to enter the node, summed over all nodes this is the unnormalised SAH cost
+float costWeightedArea(const BVHNode &node) {
+	return surfaceArea(node.boundsMin, node.boundsMax) * (node.isLeaf() ? leafCost(node.triangleCount) : TRAVERSAL_COST);
+}
+
+void triangleBounds(const ModelTriangle &triangle, glm::vec3 &boundsMin, glm::vec3 &boundsMax) {
+	const std::array<glm::vec3, 3> &vertices = triangle.vertices;
+	glm::vec3 low = glm::min(glm::min(vertices[0], vertices[1]), vertices[2]);
+	glm::vec3 high = glm::max(glm::max(vertices[0], vertices[1]), vertices[2]);
+	// Pad the boxes a little so that flat triangles (every wall of the Cornell box) never lose
+	// a hit to rounding in the slab test that the triangle test itself would have accepted
+	float magnitude = std::max(glm::length(low), glm::length(high));
+	glm::vec3 padding(1e-5f * (1.0f + magnitude));
+	boundsMin = low - padding;
+	boundsMax = high + padding;
+}
+
+// Slab test, returns the distance at which the ray enters the box or infinity if it misses it before maxDistance
+float intersectBounds(const BVHNode &node, const glm::vec3 &rayOrigin, const glm::vec3 &inverseDirection, float maxDistance) {
+	glm::vec3 t0 = (node.boundsMin - rayOrigin) * inverseDirection;
+	glm::vec3 t1 = (node.boundsMax - rayOrigin) * inverseDirection;
+	glm::vec3 tNear = glm::min(t0, t1);
+	glm::vec3 tFar = glm::max(t0, t1);
+	float tEnter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+	float tExit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, maxDistance));
+	return tEnter <= tExit ? tEnter : std::numeric_limits<float>::infinity();
+}
+
+}
+
+std::ostream &operator<<(std::ostream &os, const BVHStats &stats) {
+	os << stats.triangleCount << " triangles, " << stats.nodeCount << " nodes (" << stats.leafCount << " leaves), depth "
+	   << stats.maxDepth << ", largest leaf " << stats.maxLeafSize << ", SAH cost " << stats.sahCost;
+	return os;
+}
+
+BVH::BVH() = default;
+
+BVH::BVH(TriangleView triangles, const BVHBuildOptions &options) {
+	build(triangles, options);
+}
+
+struct BVH::BuildState {
+	std::vector<glm::vec3> triangleMin;
+	std::vector<glm::vec3> triangleMax;
+	std::vector<glm::vec3> centroids;
+	BVHBuildOptions options;
+	// Nodes are handed out in pairs from a preallocated array so that subtrees can be built concurrently
+	std::atomic<uint32_t> nodesUsed{0};
+	std::atomic<int> spareThreads{0};
+};
+
+void BVH::build(TriangleView triangles, const BVHBuildOptions &options) {
+	nodes.clear();
+	savedNodes = ArrayView<BVHNode>();
+	parents.clear();
+	triangleIndices.resize(triangles.size());
+	std::iota(triangleIndices.begin(), triangleIndices.end(), 0);
+	stats = BVHStats();
+	stats.triangleCount = triangles.size();
+	buildOptions = options;
+	revision++;
+	if (triangles.empty()) return;
+
+	BuildState state;
+	state.options = options;
+	state.options.maxLeafSize = std::max<size_t>(options.maxLeafSize, 1);
+	size_t threadCount = options.threadCount > 0 ? options.threadCount : std::max(1u, std::thread::hardware_concurrency());
+	state.spareThreads = int(threadCount) - 1;
+	state.triangleMin.resize(triangles.size());
+	state.triangleMax.resize(triangles.size());
+	state.centroids.resize(triangles.size());
+	for (size_t i = 0; i < triangles.size(); i++) {
+		const std::array<glm::vec3, 3> &vertices = triangles[i].vertices;
+		triangleBounds(triangles[i], state.triangleMin[i], state.triangleMax[i]);
+		state.centroids[i] = (vertices[0] + vertices[1] + vertices[2]) / 3.0f;
+	}
+
+	// A binary tree over n triangles never has more than 2n - 1 nodes
+	nodes.resize(2 * triangles.size());
+	nodes[0].leftFirst = 0;
+	nodes[0].triangleCount = triangles.size();
+	state.nodesUsed = 1;
+	subdivide(0, state, 0);
+	nodes.resize(state.nodesUsed);
+
+	// Lay the leaves out one after another in the packed store, each padded to a whole number of batches
+	store.clear();
+	for (BVHNode &node : nodes) {
+		if (node.isLeaf()) node.leftFirst = store.appendBlock(triangles, &triangleIndices[node.leftFirst], node.triangleCount);
+	}
+
+	indexNodes();
+	prepareRefit();
+}
+
+bool BVH::restore(TriangleView triangles, ArrayView<BVHNode> saved, const TriangleStore::Arrays &slots, size_t maxDepth,
+                  const BVHBuildOptions &options) {
+	nodes.clear();
+	savedNodes = ArrayView<BVHNode>();
+	triangleIndices.clear();
+	parents.clear();
+	nodeRevisions.clear();
+	triangleSlots.clear();
+	triangleLeaves.clear();
+	stats = BVHStats();
+	stats.triangleCount = triangles.size();
+	buildOptions = options;
+	revision++;
+	store.clear();
+	if (triangles.empty()) return saved.empty() && slots.triangleIndices.empty();
+
+	// The leaves were laid out one after another in node order, each padded to a whole number of batches
+	size_t nextSlot = 0;
+	size_t placed = 0;
+	bool valid = !saved.empty() && store.view(slots, triangles.size());
+	for (uint32_t i = 0; valid && i < saved.size(); i++) {
+		const BVHNode &node = saved[i];
+		if (!node.isLeaf()) {
+			// Refitting relies on children coming after their parent
+			valid = node.leftFirst > i && node.leftFirst + 1 < saved.size();
+			continue;
+		}
+		size_t paddedCount = (size_t(node.triangleCount) + TriangleStore::LANES - 1) / TriangleStore::LANES * TriangleStore::LANES;
+		valid = node.leftFirst == nextSlot && nextSlot + paddedCount <= store.size();
+		for (uint32_t slot = node.leftFirst; valid && slot < node.leftFirst + node.triangleCount; slot++) {
+			valid = store.getTriangleIndex(slot) != TriangleStore::PADDING_INDEX;
+		}
+		nextSlot += paddedCount;
+		placed += node.triangleCount;
+	}
+	if (valid && placed == triangles.size() && nextSlot == store.size()) {
+		savedNodes = saved;
+		indexNodes();
+		// The traversal stacks only have room for MAX_DEPTH levels, so a deeper tree is a corrupt file whatever its key
+		if (stats.maxDepth <= MAX_DEPTH && stats.maxDepth == maxDepth) return true;
+	}
+	savedNodes = ArrayView<BVHNode>();
+	store.clear();
+	stats = BVHStats();
+	return false;
+}
+
+void BVH::indexNodes() {
+	ArrayView<BVHNode> tree = getNodes();
+	stats.nodeCount = tree.size();
+	stats.maxDepth = 0;
+	weightedArea = 0.0;
+	// Children come after their parent, so a node's depth is final by the time the walk reaches it. It is the
+	// longest way down to the node, in case a saved tree gives a child two parents.
+	std::vector<size_t> depths(tree.size(), 0);
+	for (uint32_t i = 0; i < tree.size(); i++) {
+		const BVHNode &node = tree[i];
+		weightedArea += costWeightedArea(node);
+		stats.maxDepth = std::max(stats.maxDepth, depths[i]);
+		if (node.isLeaf()) {
+			stats.leafCount++;
+			stats.maxLeafSize = std::max<size_t>(stats.maxLeafSize, node.triangleCount);
+		} else {
+			depths[node.leftFirst] = std::max(depths[node.leftFirst], depths[i] + 1);
+			depths[node.leftFirst + 1] = std::max(depths[node.leftFirst + 1], depths[i] + 1);
+		}
+	}
+	updateSahCost();
+	builtSahCost = stats.sahCost;
+}
+
+void BVH::prepareRefit() {
+	if (!savedNodes.empty()) {
+		nodes.assign(savedNodes.begin(), savedNodes.end());
+		savedNodes = ArrayView<BVHNode>();
+	}
+	// Linked up already unless the tree was restored or has just been built
+	if (!parents.empty()) return;
+	parents.assign(nodes.size(), NO_PARENT);
+	nodeRevisions.assign(nodes.size(), 0);
+	triangleSlots.resize(stats.triangleCount);
+	triangleLeaves.resize(stats.triangleCount);
+	for (uint32_t i = 0; i < nodes.size(); i++) {
+		const BVHNode &node = nodes[i];
+		if (node.isLeaf()) {
+			for (uint32_t slot = node.leftFirst; slot < node.leftFirst + node.triangleCount; slot++) {
+				triangleSlots[store.getTriangleIndex(slot)] = slot;
+				triangleLeaves[store.getTriangleIndex(slot)] = i;
+			}
+		} else {
+			parents[node.leftFirst] = i;
+			parents[node.leftFirst + 1] = i;
+		}
+	}
+}
+
+void BVH::refit(TriangleView triangles) {
+	if (getNodes().empty()) return;
+	prepareRefit();
+	for (size_t i = 0; i < triangles.size(); i++) store.update(triangleSlots[i], triangles[i]);
+	// Children are always allocated after their parent, so walking the array backwards visits every child first
+	for (size_t i = nodes.size(); i-- > 0;) refitNode(i, triangles);
+	updateSahCost();
+	revision++;
+}
+
+void BVH::refit(TriangleView triangles, size_t first, size_t count) {
+	if (getNodes().empty() || count == 0) return;
+	prepareRefit();
+	revision++;
+	std::vector<uint32_t> touched;
+	for (size_t i = first; i < first + count; i++) {
+		store.update(triangleSlots[i], triangles[i]);
+		// Stop climbing at the first node another moved triangle has already reached, everything above it is listed
+		for (uint32_t node = triangleLeaves[i]; node != NO_PARENT && nodeRevisions[node] != revision; node = parents[node]) {
+			nodeRevisions[node] = revision;
+			touched.push_back(node);
+		}
+	}
+	// Highest index first is bottom-up for the same reason as in the full refit
+	std::sort(touched.begin(), touched.end(), std::greater<uint32_t>());
+	for (uint32_t node : touched) refitNode(node, triangles);
+	updateSahCost();
+}
+
+bool BVH::update(TriangleView triangles, size_t first, size_t count) {
+	refit(triangles, first, count);
+	if (buildOptions.maxRefitCostRatio <= 0.0f || stats.sahCost <= builtSahCost * buildOptions.maxRefitCostRatio) return false;
+	build(triangles, buildOptions);
+	return true;
+}
+
+void BVH::refitNode(uint32_t nodeIndex, TriangleView triangles) {
+	BVHNode &node = nodes[nodeIndex];
+	weightedArea -= costWeightedArea(node);
+	if (node.isLeaf()) {
+		node.boundsMin = glm::vec3(std::numeric_limits<float>::infinity());
+		node.boundsMax = glm::vec3(-std::numeric_limits<float>::infinity());
+		for (uint32_t slot = node.leftFirst; slot < node.leftFirst + node.triangleCount; slot++) {
+			glm::vec3 low, high;
+			triangleBounds(triangles[store.getTriangleIndex(slot)], low, high);
+			node.boundsMin = glm::min(node.boundsMin, low);
+			node.boundsMax = glm::max(node.boundsMax, high);
+		}
+	} else {
+		const BVHNode &left = nodes[node.leftFirst];
+		const BVHNode &right = nodes[node.leftFirst + 1];
+		node.boundsMin = glm::min(left.boundsMin, right.boundsMin);
+		node.boundsMax = glm::max(left.boundsMax, right.boundsMax);
+	}
+	weightedArea += costWeightedArea(node);
+}
+
+void BVH::updateSahCost() {
+	const BVHNode &root = getNodes()[0];
+	stats.sahCost = float(weightedArea / surfaceArea(root.boundsMin, root.boundsMax));
+}
+
+size_t BVH::subdivide(uint32_t nodeIndex, BuildState &state, size_t depth) {
+	const std::vector<glm::vec3> &triangleMin = state.triangleMin;
+	const std::vector<glm::vec3> &triangleMax = state.triangleMax;
+	const std::vector<glm::vec3> &centroids = state.centroids;
+	// nodes never reallocates during the build, so this reference stays valid while other threads add nodes
+	BVHNode &node = nodes[nodeIndex];
+	size_t first = node.leftFirst;
+	size_t count = node.triangleCount;
+	auto begin = triangleIndices.begin() + first;
+	auto end = begin + count;
+
+	node.boundsMin = glm::vec3(std::numeric_limits<float>::infinity());
+	node.boundsMax = glm::vec3(-std::numeric_limits<float>::infinity());
+	glm::vec3 centroidMin(std::numeric_limits<float>::infinity());
+	glm::vec3 centroidMax(-std::numeric_limits<float>::infinity());
+	for (auto it = begin; it != end; ++it) {
+		node.boundsMin = glm::min(node.boundsMin, triangleMin[*it]);
+		node.boundsMax = glm::max(node.boundsMax, triangleMax[*it]);
+		centroidMin = glm::min(centroidMin, centroids[*it]);
+		centroidMax = glm::max(centroidMax, centroids[*it]);
+	}
+	if (count == 1 || depth >= MAX_DEPTH) return depth;
+
+	// Costs are relative to the area of this node
+	float nodeArea = surfaceArea(node.boundsMin, node.boundsMax);
+	float bestCost = leafCost(count);
+	int bestAxis = -1;
+	size_t bestSplit = 0;
+	auto orderOnAxis = [&](int axis) {
+		return [&centroids, axis](uint32_t a, uint32_t b) {
+			if (centroids[a][axis] == centroids[b][axis]) return a < b;
+			return centroids[a][axis] < centroids[b][axis];
+		};
+	};
+
+	if (state.options.binCount == 0) {
+		// Full sweep over every split position on every axis
+		std::vector<float> rightAreas(count);
+		for (int axis = 0; axis < 3; axis++) {
+			std::sort(begin, end, orderOnAxis(axis));
+			glm::vec3 rightMin(std::numeric_limits<float>::infinity());
+			glm::vec3 rightMax(-std::numeric_limits<float>::infinity());
+			for (size_t i = count - 1; i > 0; i--) {
+				rightMin = glm::min(rightMin, triangleMin[begin[i]]);
+				rightMax = glm::max(rightMax, triangleMax[begin[i]]);
+				rightAreas[i] = surfaceArea(rightMin, rightMax);
+			}
+			glm::vec3 leftMin(std::numeric_limits<float>::infinity());
+			glm::vec3 leftMax(-std::numeric_limits<float>::infinity());
+			for (size_t i = 1; i < count; i++) {
+				leftMin = glm::min(leftMin, triangleMin[begin[i - 1]]);
+				leftMax = glm::max(leftMax, triangleMax[begin[i - 1]]);
+				float cost = TRAVERSAL_COST + (surfaceArea(leftMin, leftMax) * leafCost(i) + rightAreas[i] * leafCost(count - i)) / nodeArea;
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = i;
+				}
+			}
+		}
+		if (bestAxis != -1 && bestAxis != 2) std::sort(begin, end, orderOnAxis(bestAxis));
+	} else {
+		// Binned: the candidate planes are the boundaries of binCount equal slices of the centroid bounds
+		struct Bin {
+			glm::vec3 boundsMin{std::numeric_limits<float>::infinity()};
+			glm::vec3 boundsMax{-std::numeric_limits<float>::infinity()};
+			size_t count = 0;
+		};
+		size_t binCount = state.options.binCount;
+		std::vector<Bin> bins(binCount);
+		std::vector<float> rightAreas(binCount);
+		std::vector<size_t> rightCounts(binCount);
+		size_t bestPlane = 0;
+		for (int axis = 0; axis < 3; axis++) {
+			float extent = centroidMax[axis] - centroidMin[axis];
+			if (extent <= 0.0f) continue;
+			float scale = binCount / extent;
+			std::fill(bins.begin(), bins.end(), Bin());
+			for (auto it = begin; it != end; ++it) {
+				size_t bin = std::min(binCount - 1, size_t((centroids[*it][axis] - centroidMin[axis]) * scale));
+				bins[bin].boundsMin = glm::min(bins[bin].boundsMin, triangleMin[*it]);
+				bins[bin].boundsMax = glm::max(bins[bin].boundsMax, triangleMax[*it]);
+				bins[bin].count++;
+			}
+			glm::vec3 rightMin(std::numeric_limits<float>::infinity());
+			glm::vec3 rightMax(-std::numeric_limits<float>::infinity());
+			size_t rightCount = 0;
+			for (size_t plane = binCount - 1; plane > 0; plane--) {
+				rightMin = glm::min(rightMin, bins[plane].boundsMin);
+				rightMax = glm::max(rightMax, bins[plane].boundsMax);
+				rightCount += bins[plane].count;
+				rightAreas[plane] = surfaceArea(rightMin, rightMax);
+				rightCounts[plane] = rightCount;
+			}
+			glm::vec3 leftMin(std::numeric_limits<float>::infinity());
+			glm::vec3 leftMax(-std::numeric_limits<float>::infinity());
+			size_t leftCount = 0;
+			for (size_t plane = 1; plane < binCount; plane++) {
+				leftMin = glm::min(leftMin, bins[plane - 1].boundsMin);
+				leftMax = glm::max(leftMax, bins[plane - 1].boundsMax);
+				leftCount += bins[plane - 1].count;
+				if (leftCount == 0 || rightCounts[plane] == 0) continue;
+				float cost = TRAVERSAL_COST + (surfaceArea(leftMin, leftMax) * leafCost(leftCount) +
+				                               rightAreas[plane] * leafCost(rightCounts[plane])) / nodeArea;
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestPlane = plane;
+					bestSplit = leftCount;
+				}
+			}
+		}
+		if (bestAxis != -1) {
+			float scale = binCount / (centroidMax[bestAxis] - centroidMin[bestAxis]);
+			std::partition(begin, end, [&](uint32_t index) {
+				return std::min(binCount - 1, size_t((centroids[index][bestAxis] - centroidMin[bestAxis]) * scale)) < bestPlane;
+			});
+		}
+	}
+
+	if (bestAxis == -1) {
+		if (count <= state.options.maxLeafSize) return depth;
+		// Splitting never pays off but the leaf would be too big, fall back to a median split on the widest axis
+		glm::vec3 extent = centroidMax - centroidMin;
+		bestAxis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+		bestSplit = count / 2;
+		std::nth_element(begin, begin + bestSplit, end, orderOnAxis(bestAxis));
+	}
+
+	uint32_t leftIndex = state.nodesUsed.fetch_add(2);
+	nodes[leftIndex].leftFirst = first;
+	nodes[leftIndex].triangleCount = bestSplit;
+	nodes[leftIndex + 1].leftFirst = first + bestSplit;
+	nodes[leftIndex + 1].triangleCount = count - bestSplit;
+	node.leftFirst = leftIndex;
+	node.triangleCount = 0;
+
+	// Hand the left half to another thread if it is worth it and one is free, and build the right half here
+	bool parallel = false;
+	if (std::min(bestSplit, count - bestSplit) >= state.options.parallelThreshold) {
+		parallel = state.spareThreads.fetch_sub(1) > 0;
+		if (!parallel) state.spareThreads++;
+	}
+	if (parallel) {
+		std::future<size_t> left = std::async(std::launch::async, [&]() { return subdivide(leftIndex, state, depth + 1); });
+		size_t rightDepth = subdivide(leftIndex + 1, state, depth + 1);
+		size_t leftDepth = left.get();
+		state.spareThreads++;
+		return std::max(leftDepth, rightDepth);
+	}
+	size_t leftDepth = subdivide(leftIndex, state, depth + 1);
+	size_t rightDepth = subdivide(leftIndex + 1, state, depth + 1);
+	return std::max(leftDepth, rightDepth);
+}
+
+bool BVH::intersect(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, float &t, float &u, float &v, size_t &triangleIndex,
+                    bool cullBackFaces) const {
+	ArrayView<BVHNode> tree = getNodes();
+	if (tree.empty()) return false;
+	glm::vec3 inverseDirection = 1.0f / rayDirection;
+	float closestDistance = std::numeric_limits<float>::infinity();
+	size_t closestIndex = -1;
+
+	struct StackEntry {
+		uint32_t nodeIndex;
+		float entryDistance;
+	};
+	StackEntry stack[MAX_DEPTH + 2];
+	size_t stackSize = 0;
+	float rootDistance = intersectBounds(tree[0], rayOrigin, inverseDirection, closestDistance);
+	if (rootDistance == std::numeric_limits<float>::infinity()) return false;
+	stack[stackSize++] = {0, rootDistance};
+
+	while (stackSize > 0) {
+		StackEntry entry = stack[--stackSize];
+		if (entry.entryDistance > closestDistance) continue;
+		const BVHNode &node = tree[entry.nodeIndex];
+
+		if (node.isLeaf()) {
+			store.intersect(node.leftFirst, node.triangleCount, rayOrigin, rayDirection, closestDistance, closestIndex, u, v, cullBackFaces);
+			continue;
+		}
+
+		// Visit the nearer child first so that the far one can usually be culled against the hit
+		uint32_t nearIndex = node.leftFirst;
+		uint32_t farIndex = node.leftFirst + 1;
+		float nearDistance = intersectBounds(tree[nearIndex], rayOrigin, inverseDirection, closestDistance);
+		float farDistance = intersectBounds(tree[farIndex], rayOrigin, inverseDirection, closestDistance);
+		if (farDistance < nearDistance) {
+			std::swap(nearIndex, farIndex);
+			std::swap(nearDistance, farDistance);
+		}
+		if (farDistance != std::numeric_limits<float>::infinity()) stack[stackSize++] = {farIndex, farDistance};
+		if (nearDistance != std::numeric_limits<float>::infinity()) stack[stackSize++] = {nearIndex, nearDistance};
+	}
+
+	if (closestIndex == size_t(-1)) return false;
+	t = closestDistance;
+	triangleIndex = closestIndex;
+	return true;
+}
+
+void BVH::intersect(RayPacket &packet) const {
+	ArrayView<BVHNode> tree = getNodes();
+	if (tree.empty() || packet.activeMask == 0) return;
+
+	// Each entry carries the lanes that entered its parent, a child can only lose lanes
+	struct StackEntry {
+		uint32_t nodeIndex;
+		uint32_t mask;
+	};
+	StackEntry stack[MAX_DEPTH + 2];
+	size_t stackSize = 0;
+	stack[stackSize++] = {0, packet.activeMask};
+
+	while (stackSize > 0) {
+		StackEntry entry = stack[--stackSize];
+		const BVHNode &node = tree[entry.nodeIndex];
+		if (!packet.frustumOverlaps(node.boundsMin, node.boundsMax)) continue;
+		uint32_t mask = packet.intersectBounds(node.boundsMin, node.boundsMax, entry.mask);
+		if (mask == 0) continue;
+
+		if (node.isLeaf()) {
+			store.intersect(node.leftFirst, node.triangleCount, packet, mask);
+			continue;
+		}
+
+		// The rays are close to parallel, so one near-to-far order along the middle ray serves them all
+		uint32_t nearIndex = node.leftFirst;
+		uint32_t farIndex = node.leftFirst + 1;
+		const glm::vec3 &direction = packet.getCentreDirection();
+		float nearDistance = glm::dot(tree[nearIndex].boundsMin + tree[nearIndex].boundsMax, direction);
+		float farDistance = glm::dot(tree[farIndex].boundsMin + tree[farIndex].boundsMax, direction);
+		if (farDistance < nearDistance) std::swap(nearIndex, farIndex);
+		stack[stackSize++] = {farIndex, mask};
+		stack[stackSize++] = {nearIndex, mask};
+	}
+}
+
+bool BVH::occluded(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, float maxDistance, size_t ignoreIndex,
+                   bool cullBackFaces) const {
+	ArrayView<BVHNode> tree = getNodes();
+	if (tree.empty()) return false;
+	glm::vec3 inverseDirection = 1.0f / rayDirection;
+	uint32_t stack[MAX_DEPTH + 2];
+	size_t stackSize = 0;
+	stack[stackSize++] = 0;
+	while (stackSize > 0) {
+		const BVHNode &node = tree[stack[--stackSize]];
+		if (intersectBounds(node, rayOrigin, inverseDirection, maxDistance) == std::numeric_limits<float>::infinity()) continue;
+		if (node.isLeaf()) {
+			if (store.occluded(node.leftFirst, node.triangleCount, rayOrigin, rayDirection, OCCLUSION_EPSILON, maxDistance, ignoreIndex, cullBackFaces)) return true;
+			continue;
+		}
+		stack[stackSize++] = node.leftFirst + 1;
+		stack[stackSize++] = node.leftFirst;
+	}
+	return false;
+}
+
+const BVHStats &BVH::getStats() const {
+	return stats;
+}
+
+size_t BVH::getTriangleCount() const {
+	return stats.triangleCount;
+}
+
+ArrayView<BVHNode> BVH::getNodes() const {
+	return savedNodes.empty() ? ArrayView<BVHNode>(nodes) : savedNodes;
+}
+
+const TriangleStore &BVH::getStore() const {
+	return store;
+}
+
+size_t BVH::getRevision() const {
+	return revision;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+#include "ArrayView.h"
+#include "ModelTriangle.h"
+#include "RayPacket.h"
+#include "TriangleStore.h"
+
+struct BVHNode {
+	glm::vec3 boundsMin{};
+	glm::vec3 boundsMax{};
+	// Interior nodes: index of the left child (the right child is leftFirst + 1).
+	// Leaves: slot of the first triangle in the BVH's TriangleStore.
+	uint32_t leftFirst{};
+	uint32_t triangleCount{};
+
+	bool isLeaf() const { return triangleCount > 0; }
+};
+
+struct BVHStats {
+	size_t triangleCount{};
+	size_t nodeCount{};
+	size_t leafCount{};
+	size_t maxDepth{};
+	size_t maxLeafSize{};
+	// Expected cost of a random ray, in units of one box test (a batch of TriangleStore::LANES triangles costs the same)
+	float sahCost{};
+};
+
+std::ostream &operator<<(std::ostream &os, const BVHStats &stats);
+
+struct BVHBuildOptions {
+	// Nodes are split until no leaf holds more than this many triangles (unless the depth limit is reached first)
+	size_t maxLeafSize = TriangleStore::LANES;
+	// Split planes tried per axis and node; 0 tries a plane between every pair of neighbouring triangles instead,
+	// which finds slightly better trees but is far slower on large meshes
+	size_t binCount = 16;
+	// Threads the build may use, 0 for one per hardware thread
+	size_t threadCount = 0;
+	// Subtrees with fewer triangles than this are never handed to another thread
+	size_t parallelThreshold = 4096;
+	// update() rebuilds once refitting has made the tree this many times more expensive (by SAH cost) than it was
+	// straight after the last build; 0 only ever refits
+	float maxRefitCostRatio = 1.5f;
+};
+
+const float OCCLUSION_EPSILON = 1e-4f;
+
+class BVH {
+public:
+	// Traversal uses a fixed-size stack, so the build stops splitting below this depth
+	static const size_t MAX_DEPTH = 60;
+
+	BVH();
+	explicit BVH(TriangleView triangles, const BVHBuildOptions &options = BVHBuildOptions());
+
+	// Binned SAH build; the two halves of a large node are built in parallel until every thread is busy
+	void build(TriangleView triangles, const BVHBuildOptions &options = BVHBuildOptions());
+	// Moves the boxes to follow triangles whose vertices have changed since the build, without changing the tree.
+	// The vector must hold the same triangles in the same order; every leaf and node is refitted, bottom-up, in O(n).
+	void refit(TriangleView triangles);
+	// Only triangles [first, first + count) have moved: their leaves and the ancestors of those leaves are refitted
+	void refit(TriangleView triangles, size_t first, size_t count);
+	// Refits for the moved range, then rebuilds from scratch with the last build's options if the refitted tree has got
+	// worse than BVHBuildOptions::maxRefitCostRatio allows. Returns true if it rebuilt.
+	bool update(TriangleView triangles, size_t first, size_t count);
+	// Takes back a tree saved from getNodes and getStore (see ModelCache) instead of building one, and reads it where it
+	// lies: savedNodes and slots have to outlive the BVH, and are only copied in if it is refitted. Returns false,
+	// leaving the BVH empty, if they do not describe a tree over these triangles, or one deeper than MAX_DEPTH or than
+	// the saved maxDepth.
+	bool restore(TriangleView triangles, ArrayView<BVHNode> savedNodes, const TriangleStore::Arrays &slots, size_t maxDepth,
+	             const BVHBuildOptions &options = BVHBuildOptions());
+	// Closest hit with t > 0; ties on t resolve to the lowest triangle index, as a linear scan would. With
+	// cullBackFaces the ray passes through the back of every triangle but glass.
+	bool intersect(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, float &t, float &u, float &v, size_t &triangleIndex,
+	               bool cullBackFaces = false) const;
+	// Closest hit for every active lane of the packet, with the same tie rule. A node is skipped for the whole packet
+	// if it is outside the packet frustum, and otherwise only the lanes whose ray enters it are carried down.
+	void intersect(RayPacket &packet) const;
+	// Shadow-ray query: true as soon as any triangle other than ignoreIndex is hit with OCCLUSION_EPSILON < t < maxDistance.
+	// Nothing is sorted and the first occluder found ends the traversal. Back faces are culled as for intersect.
+	bool occluded(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, float maxDistance, size_t ignoreIndex,
+	              bool cullBackFaces = false) const;
+	const BVHStats &getStats() const;
+	size_t getTriangleCount() const;
+	ArrayView<BVHNode> getNodes() const;
+	const TriangleStore &getStore() const;
+	// Changes with every build and refit, so that structures derived from the tree (WideBVH) can tell they are stale
+	size_t getRevision() const;
+
+private:
+	std::vector<BVHNode> nodes;
+	// The tree restore was given, read in place of nodes until the first refit copies it in
+	ArrayView<BVHNode> savedNodes;
+	std::vector<uint32_t> triangleIndices;
+	TriangleStore store;
+	BVHStats stats;
+	BVHBuildOptions buildOptions;
+	// For refitting: the parent of every node, and the store slot and leaf of every triangle. A restored tree only
+	// works these out when it is first refitted.
+	std::vector<uint32_t> parents;
+	std::vector<uint32_t> triangleSlots;
+	std::vector<uint32_t> triangleLeaves;
+	// The revision in which each node was last refitted, so a partial refit reaches each ancestor only once
+	std::vector<size_t> nodeRevisions;
+	// SAH cost before dividing by the root area, kept up to date node by node as the tree is refitted
+	double weightedArea = 0.0;
+	float builtSahCost = 0.0f;
+	size_t revision = 0;
+
+	struct BuildState;
+
+	// Returns the depth of the deepest leaf below the node
+	size_t subdivide(uint32_t nodeIndex, BuildState &state, size_t depth);
+	// Everything after the store is laid out: statistics (the depth measured from the nodes) and the SAH cost the tree
+	// starts from
+	void indexNodes();
+	// The refit links, after copying a restored tree in
+	void prepareRefit();
+	void refitNode(uint32_t nodeIndex, TriangleView triangles);
+	void updateSahCost();
+};
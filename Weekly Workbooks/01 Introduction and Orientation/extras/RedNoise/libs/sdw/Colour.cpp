@@ -1,11 +1,11 @@
 #include "Colour.h"
-#include <utility>
+#include <cstring>
 
 Colour::Colour() = default;
 Colour::Colour(int r, int g, int b) : red(r), green(g), blue(b) {}
-Colour::Colour(std::string n, int r, int g, int b) :
-		name(std::move(n)),
-		red(r), green(g), blue(b) {}
+Colour::Colour(const std::string &n, int r, int g, int b) : red(r), green(g), blue(b) {
+	std::strncpy(name, n.c_str(), sizeof(name) - 1);
+}
 
 std::ostream &operator<<(std::ostream &os, const Colour &colour) {
 	os << colour.name << " ["
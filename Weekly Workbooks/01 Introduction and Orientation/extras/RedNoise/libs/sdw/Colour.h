@@ -1,15 +1,18 @@
 #pragma once
 
 #include <iostream>
+#include <string>
 
 struct Colour {
-	std::string name;
+	// A fixed array rather than a string so that colours, and the triangles holding them, copy as plain bytes and can
+	// be read straight out of a mapped model cache; longer names are cut short
+	char name[16]{};
 	int red{};
 	int green{};
 	int blue{};
 	Colour();
 	Colour(int r, int g, int b);
-	Colour(std::string n, int r, int g, int b);
+	Colour(const std::string &n, int r, int g, int b);
 };
 
 std::ostream &operator<<(std::ostream &os, const Colour &colour);
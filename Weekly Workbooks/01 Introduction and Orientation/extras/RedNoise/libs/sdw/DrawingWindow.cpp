@@ -1,10 +1,11 @@
 #include <array>
+#include <mutex>
 #include "DrawingWindow.h"
 // On some platforms you may need to include <cstring> (if you compiler can't find memset !)
 
 DrawingWindow::DrawingWindow() {}
 
-DrawingWindow::DrawingWindow(int w, int h, bool fullscreen) : width(w), height(h), pixelBuffer(w * h) {
+DrawingWindow::DrawingWindow(int w, int h, bool fullscreen) : width(w), height(h), pixelBuffer(w * h), frontBuffer(w * h) {
 	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) != 0) printMessageAndQuit("Could not initialise SDL: ", SDL_GetError());
 	uint32_t flags = SDL_WINDOW_OPENGL;
 	if (fullscreen) flags |= SDL_WINDOW_FULLSCREEN_DESKTOP;
@@ -24,21 +25,32 @@ DrawingWindow::DrawingWindow(int w, int h, bool fullscreen) : width(w), height(h
 	if (!texture) printMessageAndQuit("Could not allocate texture: ", SDL_GetError());
 }
 
+DrawingWindow::DrawingWindow(size_t w, size_t h) : width(w), height(h), pixelBuffer(w * h), frontBuffer(w * h) {}
+
 void DrawingWindow::renderFrame() {
-	SDL_UpdateTexture(texture, nullptr, pixelBuffer.data(), width * sizeof(uint32_t));
+	std::shared_lock<std::shared_timed_mutex> lock(frontBufferMutex);
+	SDL_UpdateTexture(texture, nullptr, frontBuffer.data(), width * sizeof(uint32_t));
+	lock.unlock();
 	SDL_RenderClear(renderer);
 	SDL_RenderCopy(renderer, texture, nullptr, nullptr);
 	SDL_RenderPresent(renderer);
 }
 
+void DrawingWindow::completeFrame() {
+	std::lock_guard<std::shared_timed_mutex> lock(frontBufferMutex);
+	frontBuffer = pixelBuffer;
+}
+
 void DrawingWindow::saveBMP(const std::string &filename) const {
-	auto surface = SDL_CreateRGBSurfaceFrom((void *) pixelBuffer.data(), width, height, 32,
+	std::shared_lock<std::shared_timed_mutex> lock(frontBufferMutex);
+	auto surface = SDL_CreateRGBSurfaceFrom((void *) frontBuffer.data(), width, height, 32,
 	                                        width * sizeof(uint32_t),
 	                                        0xFF << 16, 0xFF << 8, 0xFF << 0, 0xFF << 24);
 	SDL_SaveBMP(surface, filename.c_str());
 }
 
 void DrawingWindow::savePPM(const std::string &filename) const {
+	std::shared_lock<std::shared_timed_mutex> lock(frontBufferMutex);
 	std::ofstream outputStream(filename, std::ofstream::out);
 	outputStream << "P6\n";
 	outputStream << width << " " << height << "\n";
@@ -46,9 +58,9 @@ void DrawingWindow::savePPM(const std::string &filename) const {
 
 	for (size_t i = 0; i < width * height; i++) {
 		std::array<char, 3> rgb {{
-				static_cast<char> ((pixelBuffer[i] >> 16) & 0xFF),
-				static_cast<char> ((pixelBuffer[i] >> 8) & 0xFF),
-				static_cast<char> ((pixelBuffer[i] >> 0) & 0xFF)
+				static_cast<char> ((frontBuffer[i] >> 16) & 0xFF),
+				static_cast<char> ((frontBuffer[i] >> 8) & 0xFF),
+				static_cast<char> ((frontBuffer[i] >> 0) & 0xFF)
 		}};
 		outputStream.write(rgb.data(), 3);
 	}
@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <fstream>
+#include <shared_mutex>
 #include <vector>
 #include "SDL.h"
 
@@ -12,15 +13,24 @@ public:
 	size_t height;
 
 private:
-	SDL_Window *window;
-	SDL_Renderer *renderer;
-	SDL_Texture *texture;
+	SDL_Window *window = nullptr;
+	SDL_Renderer *renderer = nullptr;
+	SDL_Texture *texture = nullptr;
+	// What setPixelColour draws into
 	std::vector<uint32_t> pixelBuffer;
+	// The last completed frame, which is what renderFrame shows and savePPM and saveBMP write. Frames can then be
+	// drawn on another thread while the window keeps showing the previous one.
+	std::vector<uint32_t> frontBuffer;
+	mutable std::shared_timed_mutex frontBufferMutex;
 
 public:
 	DrawingWindow();
 	DrawingWindow(int w, int h, bool fullscreen);
+	// Pixels to draw into off screen, with no SDL window to show them in: not for renderFrame or pollForInputEvents
+	DrawingWindow(size_t w, size_t h);
 	void renderFrame();
+	// Makes the pixels drawn so far the frame that is shown and saved
+	void completeFrame();
 	void savePPM(const std::string &filename) const;
 	void saveBMP(const std::string &filename) const;
 	bool pollForInputEvents(SDL_Event &event);
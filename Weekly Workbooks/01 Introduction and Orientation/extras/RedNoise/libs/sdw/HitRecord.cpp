@@ -0,0 +1,40 @@
+#include "HitRecord.h"
+#include <limits>
+
+HitRecord::HitRecord() : t(std::numeric_limits<float>::infinity()), triangleIndex(-1), tintTriangleIndex(-1) {}
+
+HitRecord::HitRecord(const glm::vec3 &point, float distance, size_t index, float hitU, float hitV) :
+		intersectionPoint(point), t(distance), triangleIndex(index), u(hitU), v(hitV), tintTriangleIndex(-1) {}
+
+bool HitRecord::isHit() const {
+	return triangleIndex != size_t(-1);
+}
+
+const ModelTriangle &HitRecord::triangle(TriangleView triangles) const {
+	static const ModelTriangle missed;
+	return isHit() ? triangles[triangleIndex] : missed;
+}
+
+const Colour &HitRecord::colour(TriangleView triangles) const {
+	return triangle(triangles).colour;
+}
+
+const glm::vec3 &HitRecord::normal(TriangleView triangles) const {
+	return triangle(triangles).normal;
+}
+
+void HitRecord::resolveTextureCoords(TriangleView triangles) {
+	if (!isHit()) return;
+	const std::array<TexturePoint, 3> &texturePoints = triangles[triangleIndex].texturePoints;
+	float w = 1 - u - v;
+	textureCoords = w * glm::vec2(texturePoints[0].x, texturePoints[0].y) +
+	                u * glm::vec2(texturePoints[1].x, texturePoints[1].y) +
+	                v * glm::vec2(texturePoints[2].x, texturePoints[2].y);
+	hasTextureCoords = true;
+}
+
+std::ostream &operator<<(std::ostream &os, const HitRecord &hit) {
+	if (!hit.isHit()) return os << "Miss";
+	os << "Hit on triangle " << hit.triangleIndex << " at a distance of " << hit.t << " (u " << hit.u << ", v " << hit.v << ")";
+	return os;
+}
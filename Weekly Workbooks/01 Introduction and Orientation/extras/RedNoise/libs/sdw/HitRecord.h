@@ -0,0 +1,34 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <iostream>
+#include <vector>
+#include "ModelTriangle.h"
+
+// What a ray query needs to remember about a hit: where it is, which triangle and where on that triangle.
+// Colour, normal and material stay in the scene and are only looked up once shading asks for them.
+struct HitRecord {
+	// After a bounce this is on the last ray segment, not on the ray the query started with
+	glm::vec3 intersectionPoint{};
+	float t;
+	// Index into the triangle vector that was traced, size_t(-1) on a miss
+	size_t triangleIndex;
+	// Barycentric weights of vertices[1] and vertices[2]
+	float u{};
+	float v{};
+	// Only filled in by queries that texture the hit, see resolveTextureCoords
+	bool hasTextureCoords = false;
+	glm::vec2 textureCoords{};
+	// A metal surface on the last bounce tints what it reflects with its own colour; index of that surface or size_t(-1)
+	size_t tintTriangleIndex;
+
+	HitRecord();
+	HitRecord(const glm::vec3 &point, float distance, size_t index, float hitU, float hitV);
+	bool isHit() const;
+	// The hit triangle, or a default constructed (black, non-reflective) one on a miss
+	const ModelTriangle &triangle(TriangleView triangles) const;
+	const Colour &colour(TriangleView triangles) const;
+	const glm::vec3 &normal(TriangleView triangles) const;
+	void resolveTextureCoords(TriangleView triangles);
+	friend std::ostream &operator<<(std::ostream &os, const HitRecord &hit);
+};
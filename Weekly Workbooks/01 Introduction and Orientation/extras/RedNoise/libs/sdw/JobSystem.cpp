@@ -0,0 +1,210 @@
+#include "JobSystem.h"
+#include <algorithm>
+
+struct Job {
+	std::function<void()> work;
+	// Not having been submitted yet counts as one, every unfinished dependency as another
+	std::atomic<int> blockers{1};
+	std::mutex mutex;
+	// Jobs to release when this one finishes
+	std::vector<JobHandle> dependents;
+	std::atomic<bool> finished{false};
+	// Set once a thread sleeps in wait on this job, so that finishing it wakes that thread
+	std::atomic<bool> awaited{false};
+};
+
+namespace {
+
+// The system and queue the current thread is a worker of
+thread_local const JobSystem *workerSystem = nullptr;
+thread_local size_t workerQueue = 0;
+thread_local uint32_t stealState = 0;
+
+// Xorshift, only used to pick where to start looking for a job to steal
+uint32_t nextStealStart() {
+	if (stealState == 0) stealState = uint32_t(std::hash<std::thread::id>()(std::this_thread::get_id())) | 1u;
+	stealState ^= stealState << 13;
+	stealState ^= stealState >> 17;
+	stealState ^= stealState << 5;
+	return stealState;
+}
+
+}
+
+JobSystem::JobSystem(size_t threadCount) {
+	startWorkers(threadCount);
+}
+
+JobSystem::~JobSystem() {
+	stopWorkers();
+}
+
+void JobSystem::setThreadCount(size_t threadCount) {
+	stopWorkers();
+	startWorkers(threadCount);
+}
+
+size_t JobSystem::getThreadCount() const {
+	return workers.size() + 1;
+}
+
+void JobSystem::startWorkers(size_t threadCount) {
+	if (threadCount == 0) threadCount = std::max(1u, std::thread::hardware_concurrency());
+	stopping = false;
+	// The thread that waits runs jobs too, so it takes the place of one worker
+	queues.clear();
+	for (size_t i = 0; i < threadCount; i++) queues.emplace_back(new Queue());
+	for (size_t i = 0; i + 1 < threadCount; i++) workers.emplace_back(&JobSystem::workerLoop, this, i);
+}
+
+void JobSystem::stopWorkers() {
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread &worker : workers) worker.join();
+	workers.clear();
+}
+
+void JobSystem::workerLoop(size_t queue) {
+	workerSystem = this;
+	workerQueue = queue;
+	while (true) {
+		if (JobHandle job = takeJob(queue)) {
+			execute(job);
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		sleepers++;
+		wake.wait(lock, [&] { return stopping || queuedJobs > 0; });
+		sleepers--;
+		// Whatever was scheduled before stopping still runs
+		if (stopping && queuedJobs == 0) return;
+	}
+}
+
+size_t JobSystem::currentQueue() const {
+	return workerSystem == this ? workerQueue : queues.size() - 1;
+}
+
+JobHandle JobSystem::create(std::function<void()> work) {
+	JobHandle job = std::make_shared<Job>();
+	job->work = std::move(work);
+	return job;
+}
+
+void JobSystem::addDependency(const JobHandle &job, const JobHandle &dependency) {
+	std::lock_guard<std::mutex> lock(dependency->mutex);
+	if (dependency->finished) return;
+	job->blockers++;
+	dependency->dependents.push_back(job);
+}
+
+void JobSystem::submit(const JobHandle &job) {
+	release(job);
+}
+
+JobHandle JobSystem::run(std::function<void()> work, std::initializer_list<JobHandle> dependencies) {
+	JobHandle job = create(std::move(work));
+	for (const JobHandle &dependency : dependencies) addDependency(job, dependency);
+	submit(job);
+	return job;
+}
+
+bool JobSystem::isFinished(const JobHandle &job) const {
+	return job->finished;
+}
+
+void JobSystem::release(const JobHandle &job) {
+	if (--job->blockers == 0) schedule(job);
+}
+
+void JobSystem::schedule(const JobHandle &job) {
+	Queue &queue = *queues[currentQueue()];
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.jobs.push_back(job);
+	}
+	queuedJobs++;
+	// A thread going to sleep counts itself before it checks for jobs, so either it sees this one or it is counted here
+	if (sleepers > 0) {
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+		}
+		wake.notify_one();
+	}
+}
+
+JobHandle JobSystem::takeJob(size_t queue) {
+	if (queuedJobs == 0) return nullptr;
+	JobHandle job;
+	{
+		Queue &own = *queues[queue];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.jobs.empty()) {
+			job = std::move(own.jobs.back());
+			own.jobs.pop_back();
+		}
+	}
+	size_t start = nextStealStart() % queues.size();
+	for (size_t i = 0; !job && i < queues.size(); i++) {
+		size_t victim = (start + i) % queues.size();
+		if (victim == queue) continue;
+		Queue &other = *queues[victim];
+		std::lock_guard<std::mutex> lock(other.mutex);
+		if (!other.jobs.empty()) {
+			job = std::move(other.jobs.front());
+			other.jobs.pop_front();
+		}
+	}
+	if (job) queuedJobs--;
+	return job;
+}
+
+void JobSystem::execute(const JobHandle &job) {
+	if (job->work) job->work();
+	// Let go of whatever the work captured now rather than when the last handle goes
+	job->work = nullptr;
+	std::vector<JobHandle> dependents;
+	{
+		std::lock_guard<std::mutex> lock(job->mutex);
+		job->finished = true;
+		dependents.swap(job->dependents);
+	}
+	for (const JobHandle &dependent : dependents) release(dependent);
+	if (job->awaited) {
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+		}
+		wake.notify_all();
+	}
+}
+
+void JobSystem::wait(const JobHandle &job) {
+	size_t queue = currentQueue();
+	while (!job->finished) {
+		if (JobHandle next = takeJob(queue)) {
+			execute(next);
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		job->awaited = true;
+		sleepers++;
+		wake.wait(lock, [&] { return job->finished || queuedJobs > 0; });
+		sleepers--;
+	}
+}
+
+void JobSystem::parallelFor(size_t begin, size_t end, size_t grainSize,
+                            const std::function<void(size_t, size_t)> &body) {
+	grainSize = std::max<size_t>(grainSize, 1);
+	// A join that depends on every range, so waiting on it waits for all of them
+	JobHandle done = create(nullptr);
+	for (size_t first = begin; first < end; first += grainSize) {
+		size_t last = std::min(first + grainSize, end);
+		addDependency(done, run([&body, first, last] { body(first, last); }));
+	}
+	submit(done);
+	wait(done);
+}
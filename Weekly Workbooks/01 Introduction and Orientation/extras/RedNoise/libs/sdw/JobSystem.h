@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A unit of work for a JobSystem, only ever handled through a JobHandle
+struct Job;
+using JobHandle = std::shared_ptr<Job>;
+
+// Runs jobs on a fixed set of worker threads. Every worker has its own deque: jobs a worker creates go on the back of
+// its deque and it takes its next job from the back too, so it stays on work whose data is still in its cache. A
+// worker whose deque is empty steals the oldest job from the front of another deque, starting at a random one so
+// that idle workers don't all queue up on the same victim. Workers with nothing to run or steal sleep until a job is
+// scheduled instead of spinning.
+// A job can depend on other jobs and only starts once all of them have finished, which is how ordering constraints
+// (parse before fit, decode before draw, ...) are expressed; waiting on a job runs other jobs in the meantime.
+class JobSystem {
+public:
+	// threadCount counts the thread that waits on jobs, 0 means one per hardware thread. With a single thread every
+	// job runs inside wait.
+	explicit JobSystem(size_t threadCount = 0);
+	~JobSystem();
+	JobSystem(const JobSystem &) = delete;
+	JobSystem &operator=(const JobSystem &) = delete;
+	// Finishes the jobs already scheduled, then restarts with threadCount threads; not to be called from a job
+	void setThreadCount(size_t threadCount);
+	size_t getThreadCount() const;
+
+	// A job that runs work once it has been submitted and every dependency has finished. work may be empty, for
+	// a job that only joins its dependencies.
+	JobHandle create(std::function<void()> work);
+	// job won't start before dependency has finished. Only allowed until job is submitted.
+	void addDependency(const JobHandle &job, const JobHandle &dependency);
+	void submit(const JobHandle &job);
+	// create, addDependency and submit in one
+	JobHandle run(std::function<void()> work, std::initializer_list<JobHandle> dependencies = {});
+	bool isFinished(const JobHandle &job) const;
+	// Runs scheduled jobs on the calling thread until job has finished; job must have been submitted
+	void wait(const JobHandle &job);
+	// Calls body(first, last) for consecutive ranges of at most grainSize items covering [begin, end), as parallel
+	// jobs, and returns once all of them have run
+	void parallelFor(size_t begin, size_t end, size_t grainSize, const std::function<void(size_t, size_t)> &body);
+
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<JobHandle> jobs;
+	};
+
+	void startWorkers(size_t threadCount);
+	void stopWorkers();
+	void workerLoop(size_t queue);
+	// The queue of the calling worker, or the shared queue for threads that aren't workers
+	size_t currentQueue() const;
+	void schedule(const JobHandle &job);
+	// Removes one blocker from the job and schedules it once none are left
+	void release(const JobHandle &job);
+	JobHandle takeJob(size_t queue);
+	void execute(const JobHandle &job);
+
+	std::vector<std::thread> workers;
+	// One per worker, then one shared by every other thread
+	std::vector<std::unique_ptr<Queue>> queues;
+	// Jobs sitting in the queues, neither running nor waiting on a dependency
+	std::atomic<size_t> queuedJobs{0};
+	std::atomic<size_t> sleepers{0};
+	// Sleeping workers and waiting threads wait on wake for a job to be queued or, when waiting, to finish
+	std::mutex sleepMutex;
+	std::condition_variable wake;
+	bool stopping = false;
+};
@@ -0,0 +1,257 @@
+#include "ModelCache.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
+const uint64_t FNV_PRIME = 1099511628211ull;
+const char MAGIC[8] = {'R', 'N', 'M', 'O', 'D', 'E', 'L', '\0'};
+
+// Every section starts on a multiple of this from the start of the file, which is where a mapping starts, so the packed
+// triangles and the wide nodes can be read where they lie with aligned loads
+const size_t SECTION_ALIGNMENT = 64;
+
+struct CacheHeader {
+	char magic[8];
+	uint32_t version;
+	// Sizes of the records as the writer compiled them, so a build with a different layout misses instead of misreading
+	uint32_t triangleSize;
+	uint32_t nodeSize;
+	uint32_t wideNodeSize;
+	uint32_t maxDepth;
+	uint32_t reserved;
+	uint64_t key;
+	uint64_t triangleCount;
+	uint64_t nodeCount;
+	uint64_t slotCount;
+	uint64_t wideNodeCount;
+};
+
+static_assert(std::is_trivially_copyable<ModelTriangle>::value && std::is_trivially_copyable<BVHNode>::value &&
+              std::is_trivially_copyable<WideBVHNode>::value, "triangles and nodes are written to the cache as they are");
+static_assert(alignof(WideBVHNode) <= SECTION_ALIGNMENT && 32 <= SECTION_ALIGNMENT,
+              "every section of the cache has to start aligned for its records");
+
+// Where each section of a file with the header's counts starts, and where the file ends
+struct CacheLayout {
+	size_t triangles;
+	size_t nodes;
+	// The nine float arrays of the BVH's store, in the order TriangleStore::Arrays lists them
+	size_t columns[9];
+	size_t triangleIndices;
+	size_t twoSided;
+	size_t wideNodes;
+	size_t end;
+};
+
+size_t alignSection(size_t offset) {
+	return (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+}
+
+// The counts have to be bounded by the file size first, so that none of the offsets can overflow
+CacheLayout cacheLayout(const CacheHeader &header) {
+	CacheLayout layout;
+	size_t offset = alignSection(sizeof(CacheHeader));
+	auto place = [&](size_t bytes) {
+		size_t start = offset;
+		offset = alignSection(offset + bytes);
+		return start;
+	};
+	layout.triangles = place(header.triangleCount * sizeof(ModelTriangle));
+	layout.nodes = place(header.nodeCount * sizeof(BVHNode));
+	for (size_t &column : layout.columns) column = place(header.slotCount * sizeof(float));
+	layout.triangleIndices = place(header.slotCount * sizeof(uint32_t));
+	layout.twoSided = place(header.slotCount * sizeof(uint8_t));
+	layout.wideNodes = place(header.wideNodeCount * sizeof(WideBVHNode));
+	layout.end = offset;
+	return layout;
+}
+
+uint64_t fnv1a(const char *bytes, size_t count, uint64_t hash) {
+	for (size_t i = 0; i < count; i++) {
+		hash ^= uint8_t(bytes[i]);
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+template<typename T>
+uint64_t fnv1a(const T &value, uint64_t hash) {
+	return fnv1a(reinterpret_cast<const char *>(&value), sizeof(value), hash);
+}
+
+// The whole file, read-only. Mapped shared where the platform allows it, so only the pages that are used get read and
+// every process mapping the same file shares them; elsewhere it is read into a buffer aligned like a mapping.
+class MappedFile {
+public:
+	explicit MappedFile(const std::string &filename) {
+#ifdef _WIN32
+		std::ifstream file(filename, std::ios::binary);
+		buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		bytes = buffer.data();
+		length = buffer.size();
+#else
+		int descriptor = open(filename.c_str(), O_RDONLY);
+		if (descriptor < 0) return;
+		struct stat status;
+		if (fstat(descriptor, &status) == 0 && status.st_size > 0) {
+			void *mapping = mmap(nullptr, size_t(status.st_size), PROT_READ, MAP_SHARED, descriptor, 0);
+			if (mapping != MAP_FAILED) {
+				bytes = static_cast<const char *>(mapping);
+				length = size_t(status.st_size);
+			}
+		}
+		close(descriptor);
+#endif
+	}
+	~MappedFile() {
+#ifndef _WIN32
+		if (bytes) munmap(const_cast<char *>(bytes), length);
+#endif
+	}
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	const char *data() const { return bytes; }
+	size_t size() const { return length; }
+
+private:
+	const char *bytes = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	std::vector<char, AlignedAllocator<char, SECTION_ALIGNMENT>> buffer;
+#endif
+};
+
+// count records of T starting offset bytes into the file
+template<typename T>
+ArrayView<T> fileSection(const MappedFile &file, size_t offset, uint64_t count) {
+	return ArrayView<T>(reinterpret_cast<const T *>(file.data() + offset), size_t(count));
+}
+
+}
+
+uint64_t modelCacheKey(const std::vector<std::string> &sourceFilenames, const std::string &loader, const BVHBuildOptions &options) {
+	uint64_t hash = fnv1a(MODEL_CACHE_VERSION, FNV_OFFSET_BASIS);
+	for (const std::string &filename : sourceFilenames) {
+		MappedFile file(filename);
+		// The length goes in too, so that moving bytes from one file to the next still changes the key
+		hash = fnv1a(uint64_t(file.size()), hash);
+		if (file.data()) hash = fnv1a(file.data(), file.size(), hash);
+	}
+	hash = fnv1a(loader.data(), loader.size(), hash);
+	// Only the options that change the tree; threads and the refit threshold do not
+	hash = fnv1a(uint64_t(options.maxLeafSize), hash);
+	hash = fnv1a(uint64_t(options.binCount), hash);
+	return hash;
+}
+
+bool loadModelCache(const std::string &cacheFilename, uint64_t key, const BVHBuildOptions &options, CachedModel &model) {
+	std::shared_ptr<const MappedFile> file = std::make_shared<const MappedFile>(cacheFilename);
+	if (!file->data() || file->size() < sizeof(CacheHeader)) return false;
+	const CacheHeader &header = *reinterpret_cast<const CacheHeader *>(file->data());
+	if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != MODEL_CACHE_VERSION ||
+	    header.triangleSize != sizeof(ModelTriangle) || header.nodeSize != sizeof(BVHNode) ||
+	    header.wideNodeSize != sizeof(WideBVHNode) || header.key != key) {
+		return false;
+	}
+	// Bound the counts by the file size first so the offsets below cannot overflow
+	if (header.triangleCount > file->size() / sizeof(ModelTriangle) || header.nodeCount > file->size() / sizeof(BVHNode) ||
+	    header.slotCount > file->size() / sizeof(float) || header.wideNodeCount > file->size() / sizeof(WideBVHNode)) {
+		return false;
+	}
+	const CacheLayout layout = cacheLayout(header);
+	if (layout.end > file->size()) return false;
+
+	TriangleView triangles = fileSection<ModelTriangle>(*file, layout.triangles, header.triangleCount);
+	TriangleStore::Arrays slots;
+	ArrayView<float> *columns[] = {&slots.v0x, &slots.v0y, &slots.v0z, &slots.e0x, &slots.e0y, &slots.e0z, &slots.e1x, &slots.e1y, &slots.e1z};
+	for (size_t i = 0; i < 9; i++) *columns[i] = fileSection<float>(*file, layout.columns[i], header.slotCount);
+	slots.triangleIndices = fileSection<uint32_t>(*file, layout.triangleIndices, header.slotCount);
+	slots.twoSided = fileSection<uint8_t>(*file, layout.twoSided, header.slotCount);
+	BVH bvh;
+	if (!bvh.restore(triangles, fileSection<BVHNode>(*file, layout.nodes, header.nodeCount), slots, header.maxDepth, options)) return false;
+	WideBVH wideBVH;
+	if (!wideBVH.restore(bvh, fileSection<WideBVHNode>(*file, layout.wideNodes, header.wideNodeCount))) return false;
+
+	model.mapping = file;
+	model.triangles = triangles;
+	model.bvh = std::move(bvh);
+	model.wideBVH = std::move(wideBVH);
+	return true;
+}
+
+bool saveModelCache(const std::string &cacheFilename, uint64_t key, TriangleView triangles, const BVH &bvh, const WideBVH &wideBVH) {
+	ArrayView<BVHNode> nodes = bvh.getNodes();
+	TriangleStore::Arrays slots = bvh.getStore().getArrays();
+	ArrayView<WideBVHNode> wideNodes = wideBVH.getNodes();
+
+	CacheHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = MODEL_CACHE_VERSION;
+	header.triangleSize = sizeof(ModelTriangle);
+	header.nodeSize = sizeof(BVHNode);
+	header.wideNodeSize = sizeof(WideBVHNode);
+	header.maxDepth = uint32_t(bvh.getStats().maxDepth);
+	header.key = key;
+	header.triangleCount = triangles.size();
+	header.nodeCount = nodes.size();
+	header.slotCount = slots.triangleIndices.size();
+	header.wideNodeCount = wideNodes.size();
+	const CacheLayout layout = cacheLayout(header);
+
+	// Named after this process, so workers that miss the same cache at once each write their own and the last rename wins
+#ifdef _WIN32
+	const std::string temporaryFilename = cacheFilename + "." + std::to_string(_getpid()) + ".tmp";
+#else
+	const std::string temporaryFilename = cacheFilename + "." + std::to_string(getpid()) + ".tmp";
+#endif
+	{
+		std::ofstream file(temporaryFilename, std::ios::binary | std::ios::trunc);
+		if (!file) return false;
+		// Zeros up to where each section starts
+		size_t written = 0;
+		auto writeSection = [&](size_t offset, const void *data, size_t bytes) {
+			static const char zeros[SECTION_ALIGNMENT] = {};
+			for (; written < offset; written += std::min(offset - written, SECTION_ALIGNMENT)) {
+				file.write(zeros, std::min(offset - written, SECTION_ALIGNMENT));
+			}
+			file.write(static_cast<const char *>(data), bytes);
+			written += bytes;
+		};
+		writeSection(0, &header, sizeof(header));
+		writeSection(layout.triangles, triangles.data(), triangles.size() * sizeof(ModelTriangle));
+		writeSection(layout.nodes, nodes.data(), nodes.size() * sizeof(BVHNode));
+		const ArrayView<float> columns[] = {slots.v0x, slots.v0y, slots.v0z, slots.e0x, slots.e0y, slots.e0z, slots.e1x, slots.e1y, slots.e1z};
+		for (size_t i = 0; i < 9; i++) writeSection(layout.columns[i], columns[i].data(), columns[i].size() * sizeof(float));
+		writeSection(layout.triangleIndices, slots.triangleIndices.data(), slots.triangleIndices.size() * sizeof(uint32_t));
+		writeSection(layout.twoSided, slots.twoSided.data(), slots.twoSided.size() * sizeof(uint8_t));
+		writeSection(layout.wideNodes, wideNodes.data(), wideNodes.size() * sizeof(WideBVHNode));
+		writeSection(layout.end, nullptr, 0);
+		if (!file) {
+			file.close();
+			std::remove(temporaryFilename.c_str());
+			return false;
+		}
+	}
+#ifdef _WIN32
+	// rename does not replace an existing file on Windows, so clear the way first
+	std::remove(cacheFilename.c_str());
+#endif
+	return std::rename(temporaryFilename.c_str(), cacheFilename.c_str()) == 0;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "BVH.h"
+#include "ModelTriangle.h"
+#include "WideBVH.h"
+
+// Version of the cache file layout; bump it whenever ModelTriangle, BVHNode, WideBVHNode or the file itself changes shape
+const uint32_t MODEL_CACHE_VERSION = 2;
+
+// FNV-1a over the bytes of every source file, the name of the loader that turns them into triangles and the build
+// options that shape the BVH, so editing the OBJ or its MTL, or asking for a different tree, changes the key
+uint64_t modelCacheKey(const std::vector<std::string> &sourceFilenames, const std::string &loader, const BVHBuildOptions &options);
+
+// A model as loadModelCache finds it. None of it is a copy: the triangles, the BVH and the wide BVH all read the file
+// through one read-only shared mapping, which stays open for as long as any copy of mapping is held, so every process
+// that loads the same cache traces the same pages of the page cache.
+struct CachedModel {
+	std::shared_ptr<const void> mapping;
+	TriangleView triangles;
+	BVH bvh;
+	WideBVH wideBVH;
+};
+
+// A parsed model with everything derived from it (normals, edges, vertex normals, the BVH with its packed triangles
+// and the wide BVH) in one binary file, written once and then mapped on later runs so that neither the OBJ parser nor
+// any build runs again. Returns false, leaving model untouched, if the file is missing, from another version, has
+// another key or does not describe a model whose trees can be traced safely.
+bool loadModelCache(const std::string &cacheFilename, uint64_t key, const BVHBuildOptions &options, CachedModel &model);
+// Writes to a temporary file and renames it over the cache, so a crash never leaves a half-written cache behind
+bool saveModelCache(const std::string &cacheFilename, uint64_t key, TriangleView triangles, const BVH &bvh, const WideBVH &wideBVH);
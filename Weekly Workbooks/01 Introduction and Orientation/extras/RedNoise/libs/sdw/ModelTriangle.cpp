@@ -4,7 +4,7 @@
 ModelTriangle::ModelTriangle() = default;
 
 ModelTriangle::ModelTriangle(const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2, Colour trigColour) :
-		vertices({{v0, v1, v2}}), texturePoints(), colour(std::move(trigColour)), normal() {}
+		vertices({{v0, v1, v2}}), texturePoints(), colour(std::move(trigColour)), normal(), edge0(v1 - v0), edge1(v2 - v0) {}
 
 std::ostream &operator<<(std::ostream &os, const ModelTriangle &triangle) {
 	os << "(" << triangle.vertices[0].x << ", " << triangle.vertices[0].y << ", " << triangle.vertices[0].z << ")\n";
@@ -3,6 +3,7 @@
 #include <glm/glm.hpp>
 #include <string>
 #include <array>
+#include "ArrayView.h"
 #include "Colour.h"
 #include "TexturePoint.h"
 
@@ -11,14 +12,19 @@ struct ModelTriangle {
 	std::array<TexturePoint, 3> texturePoints{};
 	Colour colour{};
 	glm::vec3 normal{};
+	// vertices[1] - vertices[0] and vertices[2] - vertices[0], set on construction for the intersection kernel
+	glm::vec3 edge0{};
+	glm::vec3 edge1{};
+	// Area-weighted average of the normals of every triangle sharing each vertex, filled in by the loader for smooth shading
+	std::array<glm::vec3, 3> vertexNormals{};
     bool isMirror = false;
     bool isMetal  = false;
 	bool isGlass  = false;
-    bool hasTexture;
-    float reflectivity;
-    float roughness;
-    glm::vec3 metalColor;
-    float refractiveIndex;
+    bool hasTexture = false;
+    float reflectivity{};
+    float roughness{};
+    glm::vec3 metalColor{};
+    float refractiveIndex{};
 
 
     std::array<Colour, 3> vertexColours{};
@@ -28,3 +34,6 @@ struct ModelTriangle {
     ModelTriangle(const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2, Colour trigColour);
 	friend std::ostream &operator<<(std::ostream &os, const ModelTriangle &triangle);
 };
+
+// The triangles of a model wherever they are kept: a vector, or a mapped model cache (see ModelCache)
+using TriangleView = ArrayView<ModelTriangle>;
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include "ModelTriangle.h"
+
+// Solves rayOrigin + t * rayDirection = v0 + u * edge0 + v * edge1, bailing out on the determinant and on each
+// barycentric bound before doing the work for the next one.
+// Accepts exactly what the old glm::inverse(mat3(-d, e0, e1)) solve accepted: 0 <= u, v, u + v <= 1 and t > 0.
+inline bool intersectMollerTrumbore(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, const glm::vec3 &v0,
+                                    const glm::vec3 &edge0, const glm::vec3 &edge1, float &t, float &u, float &v) {
+	glm::vec3 p = glm::cross(rayDirection, edge1);
+	float determinant = glm::dot(edge0, p);
+	// A singular system (ray parallel to the triangle) made the inverse blow up to inf/NaN, which never passed the bounds
+	if (determinant == 0.0f) return false;
+	float inverseDeterminant = 1.0f / determinant;
+
+	glm::vec3 s = rayOrigin - v0;
+	u = glm::dot(s, p) * inverseDeterminant;
+	if (u < 0.0f || u > 1.0f) return false;
+
+	glm::vec3 q = glm::cross(s, edge0);
+	v = glm::dot(rayDirection, q) * inverseDeterminant;
+	if (v < 0.0f || u + v > 1.0f) return false;
+
+	t = glm::dot(edge1, q) * inverseDeterminant;
+	return t > 0.0f;
+}
+
+inline bool intersectMollerTrumbore(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, const ModelTriangle &triangle,
+                                    float &t, float &u, float &v) {
+	return intersectMollerTrumbore(rayOrigin, rayDirection, triangle.vertices[0], triangle.edge0, triangle.edge1, t, u, v);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+
+// PCG32 (O'Neill, "PCG: A Family of Simple Fast Space-Efficient Statistically Good Algorithms for Random Number
+// Generation"): a 64-bit LCG whose state is scrambled by a xorshift and a random rotation on the way out. Sixteen bytes
+// of state and a multiply per draw, so every path can carry its own generator instead of all of them sharing rand().
+class Pcg32 {
+public:
+	Pcg32() = default;
+	// stream picks one of 2^63 sequences that don't overlap for the same seed
+	explicit Pcg32(uint64_t seed, uint64_t stream = 0) {
+		increment = (stream << 1u) | 1u;
+		state = 0;
+		nextUint();
+		state += seed;
+		nextUint();
+	}
+
+	// The generator of one sample: the same pixel, sample and frame always draw the same numbers, whichever thread
+	// traces them and in whatever order
+	static Pcg32 forSample(uint64_t pixel, uint32_t sample, uint32_t frame) {
+		return Pcg32(mix(pixel), (uint64_t(frame) << 32) | sample);
+	}
+
+	uint32_t nextUint() {
+		uint64_t oldState = state;
+		state = oldState * 6364136223846793005ull + increment;
+		uint32_t xorShifted = uint32_t(((oldState >> 18u) ^ oldState) >> 27u);
+		uint32_t rotation = uint32_t(oldState >> 59u);
+		return (xorShifted >> rotation) | (xorShifted << ((32u - rotation) & 31u));
+	}
+
+	// Uniform in [0, 1): the top 24 bits, which a float holds exactly
+	float nextFloat() {
+		return float(nextUint() >> 8) * (1.0f / 16777216.0f);
+	}
+
+private:
+	// SplitMix64's finaliser, so that neighbouring pixels start from unrelated states
+	static uint64_t mix(uint64_t x) {
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+		return x ^ (x >> 31);
+	}
+
+	uint64_t state = 0x853c49e6748fea9bull;
+	uint64_t increment = 0xda3e39cb94b95bdbull;
+};
@@ -0,0 +1,99 @@
+#include "RayPacket.h"
+#include <algorithm>
+#include <limits>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+RayPacket::RayPacket() = default;
+
+RayPacket::RayPacket(const glm::vec3 &rayOrigin) : origin(rayOrigin) {}
+
+void RayPacket::setRay(size_t lane, const glm::vec3 &rayDirection, bool active) {
+	directionX[lane] = rayDirection.x;
+	directionY[lane] = rayDirection.y;
+	directionZ[lane] = rayDirection.z;
+	inverseDirectionX[lane] = 1.0f / rayDirection.x;
+	inverseDirectionY[lane] = 1.0f / rayDirection.y;
+	inverseDirectionZ[lane] = 1.0f / rayDirection.z;
+	if (active) activeMask |= 1u << lane;
+	else activeMask &= ~(1u << lane);
+}
+
+void RayPacket::prepare() {
+	std::fill(t, t + SIZE, std::numeric_limits<float>::infinity());
+	std::fill(u, u + SIZE, 0.0f);
+	std::fill(v, v + SIZE, 0.0f);
+	std::fill(triangleIndex, triangleIndex + SIZE, NO_HIT);
+
+	// Corners in order around the block: top left, top right, bottom right, bottom left
+	std::array<glm::vec3, 4> corners = {{getDirection(0), getDirection(COLUMNS - 1), getDirection(SIZE - 1), getDirection(SIZE - COLUMNS)}};
+	centreDirection = glm::normalize(corners[0] + corners[1] + corners[2] + corners[3]);
+	for (size_t i = 0; i < 4; i++) {
+		glm::vec3 normal = glm::cross(corners[i], corners[(i + 1) % 4]);
+		frustumNormals[i] = glm::dot(normal, centreDirection) < 0.0f ? -normal : normal;
+	}
+}
+
+glm::vec3 RayPacket::getDirection(size_t lane) const {
+	return {directionX[lane], directionY[lane], directionZ[lane]};
+}
+
+const glm::vec3 &RayPacket::getCentreDirection() const {
+	return centreDirection;
+}
+
+bool RayPacket::frustumOverlaps(const glm::vec3 &boundsMin, const glm::vec3 &boundsMax) const {
+	for (const glm::vec3 &normal : frustumNormals) {
+		// The corner furthest along the normal is the last one to leave the plane's inner side
+		glm::vec3 corner(normal.x > 0.0f ? boundsMax.x : boundsMin.x,
+		                 normal.y > 0.0f ? boundsMax.y : boundsMin.y,
+		                 normal.z > 0.0f ? boundsMax.z : boundsMin.z);
+		if (glm::dot(normal, corner - origin) < 0.0f) return false;
+	}
+	return true;
+}
+
+#ifdef __AVX2__
+
+uint32_t RayPacket::intersectBounds(const glm::vec3 &boundsMin, const glm::vec3 &boundsMax, uint32_t mask) const {
+	uint32_t result = 0;
+	for (size_t first = 0; first < SIZE; first += LANES) {
+		if (((mask >> first) & 0xFF) == 0) continue;
+		__m256 inverseX = _mm256_load_ps(&inverseDirectionX[first]);
+		__m256 inverseY = _mm256_load_ps(&inverseDirectionY[first]);
+		__m256 inverseZ = _mm256_load_ps(&inverseDirectionZ[first]);
+		__m256 t0x = _mm256_mul_ps(_mm256_set1_ps(boundsMin.x - origin.x), inverseX);
+		__m256 t0y = _mm256_mul_ps(_mm256_set1_ps(boundsMin.y - origin.y), inverseY);
+		__m256 t0z = _mm256_mul_ps(_mm256_set1_ps(boundsMin.z - origin.z), inverseZ);
+		__m256 t1x = _mm256_mul_ps(_mm256_set1_ps(boundsMax.x - origin.x), inverseX);
+		__m256 t1y = _mm256_mul_ps(_mm256_set1_ps(boundsMax.y - origin.y), inverseY);
+		__m256 t1z = _mm256_mul_ps(_mm256_set1_ps(boundsMax.z - origin.z), inverseZ);
+		__m256 tEnter = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t0x, t1x), _mm256_min_ps(t0y, t1y)),
+		                              _mm256_max_ps(_mm256_min_ps(t0z, t1z), _mm256_setzero_ps()));
+		__m256 tExit = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t0x, t1x), _mm256_max_ps(t0y, t1y)),
+		                             _mm256_min_ps(_mm256_max_ps(t0z, t1z), _mm256_load_ps(&t[first])));
+		result |= uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(tEnter, tExit, _CMP_LE_OQ))) << first;
+	}
+	return result & mask;
+}
+
+#else
+
+uint32_t RayPacket::intersectBounds(const glm::vec3 &boundsMin, const glm::vec3 &boundsMax, uint32_t mask) const {
+	uint32_t result = 0;
+	for (size_t lane = 0; lane < SIZE; lane++) {
+		if (!(mask & (1u << lane))) continue;
+		glm::vec3 inverseDirection(inverseDirectionX[lane], inverseDirectionY[lane], inverseDirectionZ[lane]);
+		glm::vec3 t0 = (boundsMin - origin) * inverseDirection;
+		glm::vec3 t1 = (boundsMax - origin) * inverseDirection;
+		glm::vec3 tNear = glm::min(t0, t1);
+		glm::vec3 tFar = glm::max(t0, t1);
+		float tEnter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+		float tExit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, t[lane]));
+		if (tEnter <= tExit) result |= 1u << lane;
+	}
+	return result;
+}
+
+#endif
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <array>
+#include <cstdint>
+
+// A COLUMNS x ROWS block of rays from one origin through a grid of points on a plane, i.e. the primary rays of a
+// block of pixels; lane i belongs to pixel (i % COLUMNS, i / COLUMNS) of the block. Every ray lies inside the frustum
+// spanned by the four corner rays, which lets a whole box be rejected for the packet with four plane tests.
+// Rays and results are stored one component per aligned array so that LANES rays fill one AVX register.
+struct RayPacket {
+	static const size_t COLUMNS = 4;
+	static const size_t ROWS = 4;
+	static const size_t SIZE = COLUMNS * ROWS;
+	static const size_t LANES = 8;
+	static const uint32_t NO_HIT = UINT32_MAX;
+
+	glm::vec3 origin{};
+	alignas(32) float directionX[SIZE];
+	alignas(32) float directionY[SIZE];
+	alignas(32) float directionZ[SIZE];
+	alignas(32) float inverseDirectionX[SIZE];
+	alignas(32) float inverseDirectionY[SIZE];
+	alignas(32) float inverseDirectionZ[SIZE];
+	// Bit i is set if lane i is traced, lanes whose pixel is off the image are left out
+	uint32_t activeMask{};
+	// Skip triangles the origin sees from behind. Only safe for rays that start outside every closed mesh.
+	bool cullBackFaces = false;
+
+	// Closest hit per lane, triangleIndex is NO_HIT (and t infinity) on a miss
+	alignas(32) float t[SIZE];
+	alignas(32) float u[SIZE];
+	alignas(32) float v[SIZE];
+	uint32_t triangleIndex[SIZE];
+
+	RayPacket();
+	explicit RayPacket(const glm::vec3 &rayOrigin);
+	void setRay(size_t lane, const glm::vec3 &rayDirection, bool active);
+	// Builds the frustum and clears the results, call once every lane has its ray
+	void prepare();
+	glm::vec3 getDirection(size_t lane) const;
+	const glm::vec3 &getCentreDirection() const;
+	// False only if the box lies entirely outside the frustum, in which case no ray in the packet can hit it
+	bool frustumOverlaps(const glm::vec3 &boundsMin, const glm::vec3 &boundsMax) const;
+	// The lanes of mask whose ray enters the box before its current closest hit
+	uint32_t intersectBounds(const glm::vec3 &boundsMin, const glm::vec3 &boundsMax, uint32_t mask) const;
+
+private:
+	// Inward facing normals of the four side planes, all of which pass through the origin
+	std::array<glm::vec3, 4> frustumNormals;
+	glm::vec3 centreDirection{};
+};
@@ -0,0 +1,126 @@
+#include "RayQueue.h"
+#include <algorithm>
+
+namespace {
+
+const int MORTON_BITS = 10;
+// Three octant bits above three interleaved Morton coordinates
+const int KEY_BITS = 3 + 3 * MORTON_BITS;
+
+// Spreads the low 10 bits of value out to every third bit
+uint32_t expandBits(uint32_t value) {
+	value = (value | (value << 16)) & 0x030000FFu;
+	value = (value | (value << 8)) & 0x0300F00Fu;
+	value = (value | (value << 4)) & 0x030C30C3u;
+	value = (value | (value << 2)) & 0x09249249u;
+	return value;
+}
+
+uint32_t mortonCode(const glm::vec3 &point, const glm::vec3 &boundsMin, const glm::vec3 &scale) {
+	const float cells = float(1 << MORTON_BITS);
+	glm::vec3 cell = glm::clamp((point - boundsMin) * scale * cells, glm::vec3(0.0f), glm::vec3(cells - 1.0f));
+	return (expandBits(uint32_t(cell.x)) << 2) | (expandBits(uint32_t(cell.y)) << 1) | expandBits(uint32_t(cell.z));
+}
+
+uint32_t octant(const glm::vec3 &direction) {
+	return (direction.x < 0.0f ? 4u : 0u) | (direction.y < 0.0f ? 2u : 0u) | (direction.z < 0.0f ? 1u : 0u);
+}
+
+glm::vec3 inverseExtent(const glm::vec3 &boundsMin, const glm::vec3 &boundsMax) {
+	glm::vec3 extent = glm::max(boundsMax - boundsMin, glm::vec3(1e-12f));
+	return 1.0f / extent;
+}
+
+}
+
+RayCoherence &RayCoherence::operator+=(const RayCoherence &other) {
+	rayCount += other.rayCount;
+	pairCount += other.pairCount;
+	directionCosineSum += other.directionCosineSum;
+	originGapSum += other.originGapSum;
+	return *this;
+}
+
+std::ostream &operator<<(std::ostream &os, const RayCoherence &coherence) {
+	double pairs = std::max<double>(coherence.pairCount, 1.0);
+	os << "direction cosine " << coherence.directionCosineSum / pairs << ", origin gap " << coherence.originGapSum / pairs
+	   << " of the scene";
+	return os;
+}
+
+RayQueue::RayQueue() = default;
+
+void RayQueue::clear() {
+	rays.clear();
+}
+
+void RayQueue::push(const glm::vec3 &origin, const glm::vec3 &direction, uint32_t path, float maxDistance) {
+	QueuedRay ray;
+	ray.origin = origin;
+	ray.direction = direction;
+	ray.maxDistance = maxDistance;
+	ray.path = path;
+	rays.push_back(ray);
+}
+
+void RayQueue::sort(const glm::vec3 &boundsMin, const glm::vec3 &boundsMax) {
+	glm::vec3 scale = inverseExtent(boundsMin, boundsMax);
+	// The octant goes above the Morton code and the position in the queue below both, so the key alone says where a
+	// ray goes and which one it is
+	keys.resize(rays.size());
+	scratch.resize(rays.size());
+	for (size_t i = 0; i < rays.size(); i++) {
+		uint64_t key = (uint64_t(octant(rays[i].direction)) << (3 * MORTON_BITS)) | mortonCode(rays[i].origin, boundsMin, scale);
+		keys[i] = (key << 32) | i;
+	}
+	// Least significant digit first radix sort over the key bits; every pass is stable, so equal keys keep their order
+	const int digitBits = 11;
+	const size_t digitCount = size_t(1) << digitBits;
+	for (int shift = 32; shift < 32 + KEY_BITS; shift += digitBits) {
+		size_t offsets[digitCount] = {};
+		for (uint64_t key : keys) offsets[(key >> shift) & (digitCount - 1)]++;
+		size_t total = 0;
+		for (size_t &offset : offsets) {
+			size_t count = offset;
+			offset = total;
+			total += count;
+		}
+		for (uint64_t key : keys) scratch[offsets[(key >> shift) & (digitCount - 1)]++] = key;
+		keys.swap(scratch);
+	}
+	sorted.resize(rays.size());
+	for (size_t i = 0; i < rays.size(); i++) sorted[i] = rays[uint32_t(keys[i])];
+	rays.swap(sorted);
+}
+
+RayCoherence RayQueue::measureCoherence(const glm::vec3 &boundsMin, const glm::vec3 &boundsMax) const {
+	RayCoherence coherence;
+	coherence.rayCount = rays.size();
+	coherence.pairCount = rays.empty() ? 0 : rays.size() - 1;
+	float diagonal = std::max(glm::length(boundsMax - boundsMin), 1e-12f);
+	for (size_t i = 1; i < rays.size(); i++) {
+		coherence.directionCosineSum += glm::dot(glm::normalize(rays[i - 1].direction), glm::normalize(rays[i].direction));
+		coherence.originGapSum += glm::length(rays[i].origin - rays[i - 1].origin) / diagonal;
+	}
+	return coherence;
+}
+
+size_t RayQueue::size() const {
+	return rays.size();
+}
+
+bool RayQueue::empty() const {
+	return rays.empty();
+}
+
+const QueuedRay &RayQueue::operator[](size_t index) const {
+	return rays[index];
+}
+
+std::vector<QueuedRay>::const_iterator RayQueue::begin() const {
+	return rays.begin();
+}
+
+std::vector<QueuedRay>::const_iterator RayQueue::end() const {
+	return rays.end();
+}
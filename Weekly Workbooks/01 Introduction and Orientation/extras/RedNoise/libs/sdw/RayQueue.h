@@ -0,0 +1,60 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+struct QueuedRay {
+	glm::vec3 origin{};
+	glm::vec3 direction{};
+	// Shadow rays stop at the light, closest-hit rays go on forever
+	float maxDistance = std::numeric_limits<float>::infinity();
+	// Whatever the caller uses to find the ray's path again, usually a pixel or sample index
+	uint32_t path{};
+};
+
+// How alike neighbouring rays in a queue are. Consecutive rays with similar origins and directions visit the same
+// nodes and triangles, so the second finds them in cache.
+struct RayCoherence {
+	size_t rayCount{};
+	// Neighbouring pairs the sums are over, one fewer than the rays of every queue measured
+	size_t pairCount{};
+	// Cosine of the angle between the directions of consecutive rays, summed over the queue
+	double directionCosineSum{};
+	// Distance between the origins of consecutive rays, relative to the diagonal of the scene box, summed over the queue
+	double originGapSum{};
+
+	RayCoherence &operator+=(const RayCoherence &other);
+};
+
+// Prints the means, which is what is worth comparing between queues of different lengths
+std::ostream &operator<<(std::ostream &os, const RayCoherence &coherence);
+
+// The rays of one bounce depth of a wavefront renderer. Rather than following each pixel's path depth-first, every
+// ray of the depth is queued, sorted so that rays which leave the same part of the scene in the same general
+// direction sit next to each other, and then traced in that order as one batch.
+class RayQueue {
+public:
+	RayQueue();
+	void clear();
+	void push(const glm::vec3 &origin, const glm::vec3 &direction, uint32_t path,
+	          float maxDistance = std::numeric_limits<float>::infinity());
+	// Groups the rays by the octant of their direction and, within an octant, orders them along a Morton curve
+	// through the scene box by origin. Rays with equal keys keep the order they were pushed in.
+	void sort(const glm::vec3 &boundsMin, const glm::vec3 &boundsMax);
+	RayCoherence measureCoherence(const glm::vec3 &boundsMin, const glm::vec3 &boundsMax) const;
+	size_t size() const;
+	bool empty() const;
+	const QueuedRay &operator[](size_t index) const;
+	std::vector<QueuedRay>::const_iterator begin() const;
+	std::vector<QueuedRay>::const_iterator end() const;
+
+private:
+	std::vector<QueuedRay> rays;
+	// Sort scratch, kept so a queue that is refilled every bounce allocates once
+	std::vector<uint64_t> keys;
+	std::vector<uint64_t> scratch;
+	std::vector<QueuedRay> sorted;
+};
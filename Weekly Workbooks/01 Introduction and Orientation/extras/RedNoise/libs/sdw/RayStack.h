@@ -0,0 +1,41 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <array>
+#include <cstddef>
+
+// A branch split off a path, waiting on a RayStack to be traced: the share of the pixel it carries and the bounces
+// already behind it
+struct StackedRay {
+	glm::vec3 origin{};
+	glm::vec3 direction{};
+	float weight = 1.0f;
+	int depth = 0;
+};
+
+// The branches of one path, traced one after another without recursion. The storage is fixed, so a path that splits
+// at every bounce never allocates; push refuses a branch once Capacity are waiting.
+template<size_t Capacity>
+class RayStack {
+public:
+	bool push(const glm::vec3 &origin, const glm::vec3 &direction, float weight, int depth) {
+		if (count == Capacity) return false;
+		StackedRay &ray = rays[count++];
+		ray.origin = origin;
+		ray.direction = direction;
+		ray.weight = weight;
+		ray.depth = depth;
+		return true;
+	}
+	bool pop(StackedRay &ray) {
+		if (count == 0) return false;
+		ray = rays[--count];
+		return true;
+	}
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+private:
+	std::array<StackedRay, Capacity> rays;
+	size_t count = 0;
+};
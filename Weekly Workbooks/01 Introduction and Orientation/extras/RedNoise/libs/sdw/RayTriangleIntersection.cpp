@@ -6,6 +6,12 @@ RayTriangleIntersection::RayTriangleIntersection(const glm::vec3 &point, float d
 		distanceFromCamera(distance),
 		intersectedTriangle(triangle),
 		triangleIndex(index) {}
+RayTriangleIntersection::RayTriangleIntersection(const HitRecord &hit, TriangleView triangles) :
+		intersectionPoint(hit.intersectionPoint),
+		distanceFromCamera(hit.t),
+		intersectedTriangle(hit.triangle(triangles)),
+		triangleIndex(hit.triangleIndex),
+		textureCoords(hit.textureCoords) {}
 
 std::ostream &operator<<(std::ostream &os, const RayTriangleIntersection &intersection) {
 	os << "Intersection is at [" << intersection.intersectionPoint[0] << "," << intersection.intersectionPoint[1] << "," <<
@@ -2,6 +2,7 @@
 
 #include <glm/glm.hpp>
 #include <iostream>
+#include "HitRecord.h"
 #include "ModelTriangle.h"
 
 struct RayTriangleIntersection {
@@ -14,5 +15,7 @@ struct RayTriangleIntersection {
     glm::vec2 textureCoords;
 	RayTriangleIntersection();
 	RayTriangleIntersection(const glm::vec3 &point, float distance, const ModelTriangle &triangle, size_t index);
+	// Copies the hit triangle out of the scene for code that still wants everything in one place
+	RayTriangleIntersection(const HitRecord &hit, TriangleView triangles);
 	friend std::ostream &operator<<(std::ostream &os, const RayTriangleIntersection &intersection);
 };
@@ -0,0 +1,449 @@
+#include "RenderFarm.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <csignal>
+#include <cerrno>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+RenderFarmCoordinator::RenderFarmCoordinator(const FarmJob &job, uint32_t tileSize) : job(job), tileSize(tileSize) {
+	for (uint32_t frame = 0; frame < job.frameCount; frame++) {
+		for (uint32_t y = 0; y < job.height; y += tileSize) {
+			for (uint32_t x = 0; x < job.width; x += tileSize) {
+				leases.push_back({frame, x, y, std::min(x + tileSize, job.width), std::min(y + tileSize, job.height)});
+			}
+		}
+	}
+	tilesPerFrame = job.frameCount == 0 ? 0 : leases.size() / job.frameCount;
+	attempts.assign(leases.size(), 0);
+	for (size_t i = 0; i < leases.size(); i++) pending.push_back(i);
+}
+
+const std::string &RenderFarmCoordinator::getAddress() const {
+	return address;
+}
+
+#ifndef _WIN32
+
+namespace {
+
+// Every message is a header and length bytes of payload, in the byte order of the machine, which both ends share
+enum MessageType : uint32_t {
+	// Worker to coordinator: the worker's process id
+	HELLO = 1,
+	// Coordinator to worker, once on connecting: the FarmJob
+	JOB,
+	// Coordinator to worker: a FarmLease to render
+	LEASE,
+	// Worker to coordinator: the FarmLease and its pixels, row by row
+	RESULT,
+	// Coordinator to worker: the job is done, exit
+	STOP
+};
+
+struct MessageHeader {
+	uint32_t type;
+	uint32_t length;
+};
+
+const char TCP_PREFIX[] = "tcp:";
+// How often the coordinator wakes with nothing to read, to check on leases and worker processes
+const int POLL_INTERVAL_MS = 100;
+
+int64_t nowMs() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool isTcpAddress(const std::string &address) {
+	return address.compare(0, sizeof(TCP_PREFIX) - 1, TCP_PREFIX) == 0;
+}
+
+bool reportError(const std::string &what) {
+	std::cerr << what << ": " << std::strerror(errno) << std::endl;
+	return false;
+}
+
+// Keeps a socket from leaking into the worker processes the coordinator starts
+void closeOnExec(int descriptor) {
+	fcntl(descriptor, F_SETFD, fcntl(descriptor, F_GETFD) | FD_CLOEXEC);
+}
+
+bool sendAll(int socket, const void *data, size_t length) {
+	const char *bytes = static_cast<const char *>(data);
+	while (length > 0) {
+		ssize_t sent = send(socket, bytes, length, 0);
+		if (sent < 0 && errno == EINTR) continue;
+		if (sent <= 0) return false;
+		bytes += sent;
+		length -= size_t(sent);
+	}
+	return true;
+}
+
+bool receiveAll(int socket, void *data, size_t length) {
+	char *bytes = static_cast<char *>(data);
+	while (length > 0) {
+		ssize_t received = recv(socket, bytes, length, 0);
+		if (received < 0 && errno == EINTR) continue;
+		if (received <= 0) return false;
+		bytes += received;
+		length -= size_t(received);
+	}
+	return true;
+}
+
+// Sends a message whose payload is the two parts one after the other
+bool sendMessage(int socket, MessageType type, const void *payload = nullptr, size_t length = 0,
+                 const void *morePayload = nullptr, size_t moreLength = 0) {
+	MessageHeader header{type, uint32_t(length + moreLength)};
+	return sendAll(socket, &header, sizeof(header)) && sendAll(socket, payload, length) &&
+	       sendAll(socket, morePayload, moreLength);
+}
+
+// A connected socket to a coordinator's address, or -1
+int connectTo(const std::string &address) {
+	int descriptor;
+	if (isTcpAddress(address)) {
+		sockaddr_in socketAddress{};
+		socketAddress.sin_family = AF_INET;
+		socketAddress.sin_port = htons(uint16_t(std::stoi(address.substr(sizeof(TCP_PREFIX) - 1))));
+		socketAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		descriptor = socket(AF_INET, SOCK_STREAM, 0);
+		if (descriptor < 0) return -1;
+		int on = 1;
+		setsockopt(descriptor, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		if (connect(descriptor, reinterpret_cast<sockaddr *>(&socketAddress), sizeof(socketAddress)) == 0) return descriptor;
+	} else {
+		sockaddr_un socketAddress{};
+		socketAddress.sun_family = AF_UNIX;
+		if (address.size() >= sizeof(socketAddress.sun_path)) return -1;
+		std::strcpy(socketAddress.sun_path, address.c_str());
+		descriptor = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (descriptor < 0) return -1;
+		if (connect(descriptor, reinterpret_cast<sockaddr *>(&socketAddress), sizeof(socketAddress)) == 0) return descriptor;
+	}
+	close(descriptor);
+	return -1;
+}
+
+}
+
+RenderFarmCoordinator::~RenderFarmCoordinator() {
+	for (const Connection &connection : connections) close(connection.socket);
+	for (int pid : workerPids) {
+		kill(pid, SIGTERM);
+		waitpid(pid, nullptr, 0);
+	}
+	if (listener >= 0) close(listener);
+	if (!socketPath.empty()) unlink(socketPath.c_str());
+}
+
+bool RenderFarmCoordinator::listen(const std::string &address) {
+	// A worker dying mid-write should be a failed send, not the end of the coordinator
+	signal(SIGPIPE, SIG_IGN);
+	auto fail = [&](const std::string &what) {
+		reportError(what);
+		close(listener);
+		listener = -1;
+		return false;
+	};
+	if (isTcpAddress(address)) {
+		sockaddr_in socketAddress{};
+		socketAddress.sin_family = AF_INET;
+		socketAddress.sin_port = htons(uint16_t(std::stoi(address.substr(sizeof(TCP_PREFIX) - 1))));
+		socketAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		listener = socket(AF_INET, SOCK_STREAM, 0);
+		if (listener < 0) return reportError("Couldn't open a socket for " + address);
+		int on = 1;
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		socklen_t length = sizeof(socketAddress);
+		if (bind(listener, reinterpret_cast<sockaddr *>(&socketAddress), sizeof(socketAddress)) != 0 ||
+		    getsockname(listener, reinterpret_cast<sockaddr *>(&socketAddress), &length) != 0) {
+			return fail("Couldn't listen on " + address);
+		}
+		this->address = TCP_PREFIX + std::to_string(ntohs(socketAddress.sin_port));
+	} else {
+		sockaddr_un socketAddress{};
+		socketAddress.sun_family = AF_UNIX;
+		if (address.size() >= sizeof(socketAddress.sun_path)) {
+			std::cerr << "Socket path " << address << " is too long" << std::endl;
+			return false;
+		}
+		std::strcpy(socketAddress.sun_path, address.c_str());
+		listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener < 0) return reportError("Couldn't open a socket for " + address);
+		// Left behind by a coordinator that didn't get to clean up
+		unlink(address.c_str());
+		if (bind(listener, reinterpret_cast<sockaddr *>(&socketAddress), sizeof(socketAddress)) != 0) {
+			return fail("Couldn't listen on " + address);
+		}
+		socketPath = address;
+		this->address = address;
+	}
+	closeOnExec(listener);
+	if (::listen(listener, SOMAXCONN) != 0) return fail("Couldn't listen on " + address);
+	return true;
+}
+
+void RenderFarmCoordinator::startWorkers(const std::vector<std::string> &arguments, size_t count) {
+	workerArguments = arguments;
+	workerCount += count;
+	respawnsLeft += count * MAX_LEASE_ATTEMPTS;
+	for (size_t i = 0; i < count; i++) spawnWorker();
+}
+
+void RenderFarmCoordinator::spawnWorker() {
+	// Built before forking, as the child of a process with threads may only exec
+	std::vector<char *> argv;
+	for (std::string &argument : workerArguments) argv.push_back(&argument[0]);
+	argv.push_back(nullptr);
+	int pid = fork();
+	if (pid == 0) {
+		execv(argv[0], argv.data());
+		_exit(127);
+	}
+	if (pid < 0) reportError("Couldn't start a worker");
+	else workerPids.push_back(pid);
+}
+
+void RenderFarmCoordinator::reapWorkers() {
+	int pid, status;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		auto worker = std::find(workerPids.begin(), workerPids.end(), pid);
+		if (worker == workerPids.end()) continue;
+		workerPids.erase(worker);
+		std::cerr << "Worker " << pid << " exited";
+		if (respawnsLeft > 0) {
+			std::cerr << ", starting another";
+			respawnsLeft--;
+			spawnWorker();
+		}
+		std::cerr << std::endl;
+	}
+}
+
+void RenderFarmCoordinator::acceptWorker() {
+	int descriptor = accept(listener, nullptr, nullptr);
+	if (descriptor < 0) return;
+	closeOnExec(descriptor);
+	if (isTcpAddress(address)) {
+		int on = 1;
+		setsockopt(descriptor, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	}
+	if (!sendMessage(descriptor, JOB, &job, sizeof(job))) {
+		close(descriptor);
+		return;
+	}
+	Connection connection;
+	connection.socket = descriptor;
+	connections.push_back(connection);
+}
+
+bool RenderFarmCoordinator::receive(Connection &connection, const FrameDone &frameDone) {
+	char buffer[64 * 1024];
+	ssize_t received = recv(connection.socket, buffer, sizeof(buffer), 0);
+	if (received < 0 && errno == EINTR) return true;
+	if (received <= 0) return false;
+	connection.received.insert(connection.received.end(), buffer, buffer + received);
+
+	size_t maxLength = sizeof(FarmLease) + size_t(tileSize) * tileSize * sizeof(uint32_t);
+	size_t used = 0;
+	while (connection.received.size() - used >= sizeof(MessageHeader)) {
+		MessageHeader header;
+		std::memcpy(&header, &connection.received[used], sizeof(header));
+		if (header.length > maxLength) return false;
+		if (connection.received.size() - used - sizeof(header) < header.length) break;
+		const char *payload = &connection.received[used + sizeof(header)];
+		used += sizeof(header) + header.length;
+
+		if (header.type == HELLO && header.length == sizeof(uint32_t)) {
+			uint32_t pid;
+			std::memcpy(&pid, payload, sizeof(pid));
+			connection.pid = int(pid);
+		} else if (header.type == RESULT && connection.leased) {
+			const FarmLease &lease = leases[connection.lease];
+			uint32_t tileWidth = lease.x1 - lease.x0, tileHeight = lease.y1 - lease.y0;
+			if (header.length != sizeof(FarmLease) + size_t(tileWidth) * tileHeight * sizeof(uint32_t) ||
+			    std::memcmp(payload, &lease, sizeof(FarmLease)) != 0) {
+				return false;
+			}
+			Frame &frame = frames[lease.frame];
+			const char *pixels = payload + sizeof(FarmLease);
+			for (uint32_t row = 0; row < tileHeight; row++) {
+				std::memcpy(&frame.pixels[size_t(lease.y0 + row) * job.width + lease.x0],
+				            pixels + size_t(row) * tileWidth * sizeof(uint32_t), tileWidth * sizeof(uint32_t));
+			}
+			connection.leased = false;
+			finishedTiles++;
+			if (--frame.remainingTiles == 0) {
+				frameDone(lease.frame, frame.pixels);
+				frames.erase(lease.frame);
+			}
+		} else {
+			return false;
+		}
+	}
+	connection.received.erase(connection.received.begin(), connection.received.begin() + used);
+	return true;
+}
+
+bool RenderFarmCoordinator::lease(Connection &connection) {
+	size_t index = pending.front();
+	pending.pop_front();
+	const FarmLease &lease = leases[index];
+	if (frames.find(lease.frame) == frames.end()) {
+		Frame &frame = frames[lease.frame];
+		frame.pixels.assign(size_t(job.width) * job.height, 0);
+		frame.remainingTiles = tilesPerFrame;
+	}
+	connection.leased = true;
+	connection.lease = index;
+	connection.deadline = nowMs() + LEASE_TIMEOUT_MS;
+	return sendMessage(connection.socket, LEASE, &lease, sizeof(lease));
+}
+
+bool RenderFarmCoordinator::drop(size_t connectionIndex) {
+	Connection connection = connections[connectionIndex];
+	connections.erase(connections.begin() + connectionIndex);
+	close(connection.socket);
+	if (!connection.leased) return true;
+	// Tried again before anything else, so its frame isn't held up behind the ones after it
+	pending.push_front(connection.lease);
+	if (++attempts[connection.lease] < MAX_LEASE_ATTEMPTS) return true;
+	const FarmLease &lease = leases[connection.lease];
+	std::cerr << "Gave up on the tile at (" << lease.x0 << ", " << lease.y0 << ") of frame " << lease.frame << " after "
+	          << MAX_LEASE_ATTEMPTS << " workers were lost with it" << std::endl;
+	return false;
+}
+
+bool RenderFarmCoordinator::run(const FrameDone &frameDone) {
+	if (listener < 0) return false;
+	std::vector<pollfd> descriptors;
+	while (finishedTiles < leases.size()) {
+		reapWorkers();
+		if (workerCount > 0 && workerPids.empty() && connections.empty()) {
+			std::cerr << "Every worker exited before the render was done" << std::endl;
+			return false;
+		}
+
+		for (size_t i = connections.size(); i-- > 0;) {
+			if (connections[i].leased || pending.empty() || lease(connections[i])) continue;
+			if (!drop(i)) return false;
+		}
+
+		descriptors.clear();
+		for (const Connection &connection : connections) descriptors.push_back({connection.socket, POLLIN, 0});
+		descriptors.push_back({listener, POLLIN, 0});
+		if (poll(descriptors.data(), descriptors.size(), POLL_INTERVAL_MS) < 0 && errno != EINTR) {
+			return reportError("Couldn't wait for the workers");
+		}
+
+		// From the back, so dropping a connection doesn't move the ones still to be looked at
+		int64_t now = nowMs();
+		for (size_t i = connections.size(); i-- > 0;) {
+			Connection &connection = connections[i];
+			if (descriptors[i].revents != 0 && !receive(connection, frameDone)) {
+				if (!drop(i)) return false;
+			} else if (connection.leased && now > connection.deadline) {
+				std::cerr << "Worker " << connection.pid << " ran out of time on its tile" << std::endl;
+				if (connection.pid > 0) kill(connection.pid, SIGKILL);
+				if (!drop(i)) return false;
+			}
+		}
+		if (descriptors.back().revents & POLLIN) acceptWorker();
+	}
+
+	for (const Connection &connection : connections) {
+		sendMessage(connection.socket, STOP);
+		close(connection.socket);
+	}
+	connections.clear();
+	for (int pid : workerPids) waitpid(pid, nullptr, 0);
+	workerPids.clear();
+	return true;
+}
+
+std::string getDefaultFarmAddress() {
+	return "/tmp/rednoise-farm-" + std::to_string(getpid()) + ".sock";
+}
+
+bool runRenderFarmWorker(const std::string &address,
+                         const std::function<bool(const FarmJob &job, const FarmLease &lease, uint32_t *pixels)> &renderTile) {
+	signal(SIGPIPE, SIG_IGN);
+	int coordinator = connectTo(address);
+	if (coordinator < 0) return reportError("Couldn't reach the render farm at " + address);
+	uint32_t pid = uint32_t(getpid());
+	bool stopped = false;
+	if (sendMessage(coordinator, HELLO, &pid, sizeof(pid))) {
+		FarmJob job;
+		bool hasJob = false;
+		std::vector<char> payload;
+		std::vector<uint32_t> pixels;
+		MessageHeader header;
+		while (!stopped && receiveAll(coordinator, &header, sizeof(header))) {
+			payload.resize(header.length);
+			if (!receiveAll(coordinator, payload.data(), payload.size())) break;
+			if (header.type == JOB && header.length == sizeof(job)) {
+				std::memcpy(&job, payload.data(), sizeof(job));
+				hasJob = true;
+			} else if (header.type == LEASE && header.length == sizeof(FarmLease) && hasJob) {
+				FarmLease lease;
+				std::memcpy(&lease, payload.data(), sizeof(lease));
+				if (lease.frame >= job.frameCount || lease.x0 >= lease.x1 || lease.x1 > job.width || lease.y0 >= lease.y1 ||
+				    lease.y1 > job.height) {
+					break;
+				}
+				pixels.assign(size_t(lease.x1 - lease.x0) * (lease.y1 - lease.y0), 0);
+				if (!renderTile(job, lease, pixels.data())) break;
+				if (!sendMessage(coordinator, RESULT, &lease, sizeof(lease), pixels.data(), pixels.size() * sizeof(uint32_t))) break;
+			} else if (header.type == STOP) {
+				stopped = true;
+			} else {
+				break;
+			}
+		}
+	}
+	close(coordinator);
+	if (!stopped) std::cerr << "Lost the render farm at " << address << std::endl;
+	return stopped;
+}
+
+#else
+
+// Windows has no fork and no Unix domain sockets, so there are no workers to farm to
+
+RenderFarmCoordinator::~RenderFarmCoordinator() {}
+
+bool RenderFarmCoordinator::listen(const std::string &) {
+	std::cerr << "The render farm needs a POSIX system" << std::endl;
+	return false;
+}
+
+void RenderFarmCoordinator::startWorkers(const std::vector<std::string> &, size_t) {}
+
+bool RenderFarmCoordinator::run(const FrameDone &) {
+	return false;
+}
+
+std::string getDefaultFarmAddress() {
+	return "";
+}
+
+bool runRenderFarmWorker(const std::string &,
+                         const std::function<bool(const FarmJob &job, const FarmLease &lease, uint32_t *pixels)> &) {
+	std::cerr << "The render farm needs a POSIX system" << std::endl;
+	return false;
+}
+
+#endif
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+// What a render farm draws: frameCount frames of width x height, of the scene the number stands for
+struct FarmJob {
+	uint32_t width{};
+	uint32_t height{};
+	uint32_t frameCount{};
+	uint32_t scene{};
+};
+
+// The pixels [x0, x1) x [y0, y1) of one frame, leased to one worker at a time
+struct FarmLease {
+	uint32_t frame{};
+	uint32_t x0{};
+	uint32_t y0{};
+	uint32_t x1{};
+	uint32_t y1{};
+};
+
+// Hands the tiles of every frame of a job out to worker processes on the same machine and puts the frames back
+// together. Workers connect over a Unix domain socket, or TCP on the loopback interface, and are leased one tile at a
+// time. A tile whose worker dies, disconnects or sits on it longer than LEASE_TIMEOUT_MS goes back to the front of the
+// queue for another worker, and local workers that die are started again while there is work left. Only tiles and
+// pixels go over the socket: every worker loads the scene itself, from the model caches the coordinator wrote while
+// loading the scene first. Those are mapped read-only and shared, so no worker parses, builds or copies a model and
+// the page cache holds one copy of each however many workers trace it.
+class RenderFarmCoordinator {
+public:
+	// Called with the pixels of a whole frame, row by row
+	using FrameDone = std::function<void(uint32_t frame, const std::vector<uint32_t> &pixels)>;
+
+	static const int LEASE_TIMEOUT_MS = 5 * 60 * 1000;
+	// A tile that has lost this many workers is given up on along with the render
+	static const uint32_t MAX_LEASE_ATTEMPTS = 3;
+
+	RenderFarmCoordinator(const FarmJob &job, uint32_t tileSize);
+	~RenderFarmCoordinator();
+	RenderFarmCoordinator(const RenderFarmCoordinator &) = delete;
+	RenderFarmCoordinator &operator=(const RenderFarmCoordinator &) = delete;
+
+	// Listens for workers on address: "tcp:PORT" for TCP on 127.0.0.1 (port 0 picks a free one), anything else is
+	// the path of a Unix domain socket. False, with the reason on std::cerr, if the socket can't be set up.
+	bool listen(const std::string &address);
+	// The address workers connect to, with the port filled in for "tcp:0"
+	const std::string &getAddress() const;
+	// Starts count worker processes running arguments (arguments[0] is the program) in the background, and keeps that
+	// many running until the job is done
+	void startWorkers(const std::vector<std::string> &arguments, size_t count);
+	// Renders every frame and calls frameDone with each as its last tile comes in. Frames are leased in order, so they
+	// finish roughly in order. False, with the reason on std::cerr, if a tile failed MAX_LEASE_ATTEMPTS times or every
+	// local worker kept dying.
+	bool run(const FrameDone &frameDone);
+
+private:
+	// A connected worker, and the tile it has if any
+	struct Connection {
+		int socket = -1;
+		// Of the worker process, once it has said hello
+		int pid = 0;
+		std::vector<char> received;
+		bool leased = false;
+		size_t lease = 0;
+		// When the lease runs out, in milliseconds of the steady clock
+		int64_t deadline = 0;
+	};
+	struct Frame {
+		std::vector<uint32_t> pixels;
+		size_t remainingTiles{};
+	};
+
+	void spawnWorker();
+	void reapWorkers();
+	void acceptWorker();
+	// Reads what the worker has sent and takes in any tiles it finished; false if it hung up or sent nonsense
+	bool receive(Connection &connection, const FrameDone &frameDone);
+	// Hands the next tile in the queue to an idle worker; false if it can't be sent
+	bool lease(Connection &connection);
+	// Drops a worker's connection, putting its tile back in the queue; false if that tile has run out of attempts
+	bool drop(size_t connectionIndex);
+
+	FarmJob job;
+	uint32_t tileSize;
+	std::string address;
+	std::string socketPath;
+	int listener = -1;
+	std::vector<std::string> workerArguments;
+	size_t workerCount = 0;
+	size_t respawnsLeft = 0;
+	std::vector<int> workerPids;
+	std::vector<Connection> connections;
+	std::vector<FarmLease> leases;
+	std::vector<uint32_t> attempts;
+	// Indices into leases of the tiles no worker has
+	std::deque<size_t> pending;
+	std::map<uint32_t, Frame> frames;
+	size_t tilesPerFrame = 0;
+	size_t finishedTiles = 0;
+};
+
+// An address for a coordinator on this machine: a Unix domain socket in /tmp named after this process, so farms can
+// run side by side
+std::string getDefaultFarmAddress();
+
+// The worker side: connects to a coordinator listening on address and renders the tiles it leases with renderTile,
+// which fills pixels (lease width x lease height, row by row) for the tile of the job, until the coordinator says the
+// job is done. renderTile returns false for a job it can't draw, and the worker then hangs up, as it does on a lease
+// outside the job's frames. False if the coordinator can't be reached, goes away first or is hung up on.
+bool runRenderFarmWorker(const std::string &address,
+                         const std::function<bool(const FarmJob &job, const FarmLease &lease, uint32_t *pixels)> &renderTile);
@@ -0,0 +1,59 @@
+#include "RenderThread.h"
+
+RenderThread::RenderThread(DrawingWindow &window, TilePool &tilePool) : window(window), tiles(tilePool) {
+	thread = std::thread(&RenderThread::loop, this);
+}
+
+RenderThread::~RenderThread() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pending = nullptr;
+		stopping = true;
+		tiles.cancel();
+	}
+	changed.notify_all();
+	thread.join();
+	tiles.resume();
+}
+
+void RenderThread::start(std::function<void()> render) {
+	cancel();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pending = std::move(render);
+	}
+	changed.notify_all();
+}
+
+void RenderThread::cancel() {
+	std::unique_lock<std::mutex> lock(mutex);
+	pending = nullptr;
+	if (!rendering) return;
+	tiles.cancel();
+	changed.wait(lock, [&] { return !rendering; });
+	tiles.resume();
+}
+
+bool RenderThread::isRendering() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return rendering || pending;
+}
+
+void RenderThread::loop() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		changed.wait(lock, [&] { return stopping || pending; });
+		if (stopping) return;
+		std::function<void()> render = std::move(pending);
+		pending = nullptr;
+		rendering = true;
+		lock.unlock();
+		render();
+		// A cancelled frame is missing tiles, so the window stays on the last one that was finished. The pool stays
+		// cancelled until cancel has seen this frame end, so the check can't miss a cancel that came in during it.
+		if (!tiles.isCancelled()) window.completeFrame();
+		lock.lock();
+		rendering = false;
+		changed.notify_all();
+	}
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include "DrawingWindow.h"
+#include "TilePool.h"
+
+// Draws frames on a thread of its own, so that the event loop keeps handling input and showing the last finished
+// frame while a slow one is traced. A frame that is no longer wanted, because the camera or the light moved, is
+// cancelled through the tile pool: the tiles it hasn't started are skipped and the window keeps showing the frame
+// before it, so the next one starts about a tile's time after the input instead of a whole frame's.
+class RenderThread {
+public:
+	RenderThread(DrawingWindow &window, TilePool &tilePool);
+	~RenderThread();
+	RenderThread(const RenderThread &) = delete;
+	RenderThread &operator=(const RenderThread &) = delete;
+
+	// Cancels the frame in flight, then draws a new one with render on the render thread and completes it in the
+	// window once render returns. render may only draw with the tile pool, or quickly, if it is to be cancelled.
+	void start(std::function<void()> render);
+	// Cancels the frame in flight, if there is one, and returns once the render thread has stopped drawing it, after
+	// which whatever the frame reads may be changed
+	void cancel();
+	bool isRendering() const;
+
+private:
+	void loop();
+
+	DrawingWindow &window;
+	TilePool &tiles;
+	mutable std::mutex mutex;
+	// Signalled when a frame is queued, when one ends and on shutdown
+	std::condition_variable changed;
+	// The frame to draw next, empty if there is none
+	std::function<void()> pending;
+	bool rendering = false;
+	bool stopping = false;
+	std::thread thread;
+};
@@ -0,0 +1,46 @@
+#include "SampleLattice.h"
+#include <algorithm>
+
+size_t SampleLattice::width() const {
+	return imageWidth > offsetX ? (imageWidth - offsetX + step - 1) / step : 0;
+}
+
+size_t SampleLattice::height() const {
+	return imageHeight > offsetY ? (imageHeight - offsetY + step - 1) / step : 0;
+}
+
+std::vector<SampleLattice> getRefinementLattices(size_t width, size_t height, size_t coarsestStep) {
+	std::vector<SampleLattice> lattices;
+	SampleLattice lattice;
+	lattice.imageWidth = width;
+	lattice.imageHeight = height;
+	lattice.step = coarsestStep;
+	lattice.blockSize = coarsestStep;
+	lattices.push_back(lattice);
+	// The pixels half a block right of, below, and diagonally from the ones already drawn
+	for (size_t blockSize = coarsestStep / 2; blockSize >= 1; blockSize /= 2) {
+		lattice.step = blockSize * 2;
+		lattice.blockSize = blockSize;
+		for (size_t offset = 1; offset < 4; offset++) {
+			lattice.offsetX = offset & 1 ? blockSize : 0;
+			lattice.offsetY = offset & 2 ? blockSize : 0;
+			lattices.push_back(lattice);
+		}
+	}
+	return lattices;
+}
+
+void fillBlocks(DrawingWindow &image, DrawingWindow &samples, const SampleLattice &lattice) {
+	for (size_t y = 0; y < lattice.height(); y++) {
+		size_t imageY = lattice.offsetY + y * lattice.step;
+		size_t blockBottom = std::min(imageY + lattice.blockSize, image.height);
+		for (size_t x = 0; x < lattice.width(); x++) {
+			size_t imageX = lattice.offsetX + x * lattice.step;
+			size_t blockRight = std::min(imageX + lattice.blockSize, image.width);
+			uint32_t colour = samples.getPixelColour(x, y);
+			for (size_t blockY = imageY; blockY < blockBottom; blockY++) {
+				for (size_t blockX = imageX; blockX < blockRight; blockX++) image.setPixelColour(blockX, blockY, colour);
+			}
+		}
+	}
+}
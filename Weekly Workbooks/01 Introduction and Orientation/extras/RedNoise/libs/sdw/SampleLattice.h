@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include "DrawingWindow.h"
+
+// Every step-th pixel of every step-th row of an image, starting from (offsetX, offsetY). A progressive renderer draws
+// a lattice as a small image of its own, whose pixel (x, y) is pixel (offsetX + x * step, offsetY + y * step) of the
+// whole image, and fills a blockSize square of the whole image from each of them.
+struct SampleLattice {
+	size_t step = 1;
+	size_t offsetX = 0;
+	size_t offsetY = 0;
+	size_t imageWidth = 0;
+	size_t imageHeight = 0;
+	size_t blockSize = 1;
+
+	// The size of the image the lattice is drawn as
+	size_t width() const;
+	size_t height() const;
+};
+
+// The lattices that refine an image of width x height from one traced pixel in coarsestStep x coarsestStep (a power of
+// two) to all of them, in the order to draw them. The first lattice is every coarsestStep-th pixel; each level after
+// it halves the block size with the three lattices of pixels the level before skipped, so no pixel is in two of them.
+std::vector<SampleLattice> getRefinementLattices(size_t width, size_t height, size_t coarsestStep);
+
+// Fills the block of image below and to the right of each pixel of the lattice with the colour samples has for it
+void fillBlocks(DrawingWindow &image, DrawingWindow &samples, const SampleLattice &lattice);
@@ -0,0 +1,120 @@
+#include "ShadingBatch.h"
+#include <algorithm>
+#include <cmath>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Light intensity over 5 pi, which the attenuation divides by the squared distance to the light
+const float ATTENUATION = float(100.0 / (5.0 * M_PI));
+const float AMBIENT = 0.2f;
+// The highlight is the cosine between the view and reflected light raised to 2^SHININESS_SQUARINGS = 256, which
+// squaring gets to in eight multiplies where std::pow goes through a log and an exp
+const int SHININESS_SQUARINGS = 8;
+
+}
+
+ShadingBatch::ShadingBatch(DrawingWindow &window, const glm::vec3 &lightPosition, const glm::vec3 &cameraPosition) :
+		window(window), lightPosition(lightPosition), cameraPosition(cameraPosition) {}
+
+void ShadingBatch::add(const glm::vec3 &position, const glm::vec3 &normal, const Colour &albedo, size_t x, size_t y) {
+	positionX[count] = position.x;
+	positionY[count] = position.y;
+	positionZ[count] = position.z;
+	normalX[count] = normal.x;
+	normalY[count] = normal.y;
+	normalZ[count] = normal.z;
+	red[count] = float(albedo.red);
+	green[count] = float(albedo.green);
+	blue[count] = float(albedo.blue);
+	pixelX[count] = x;
+	pixelY[count] = y;
+	if (++count == LANES) flush();
+}
+
+void ShadingBatch::flush() {
+	if (count == 0) return;
+	uint32_t colours[LANES];
+	shade(colours);
+	for (size_t lane = 0; lane < count; lane++) window.setPixelColour(pixelX[lane], pixelY[lane], colours[lane]);
+	count = 0;
+}
+
+#ifdef __AVX2__
+
+void ShadingBatch::shade(uint32_t *colours) const {
+	// Unit vectors towards the light and the camera
+	__m256 x = _mm256_load_ps(positionX), y = _mm256_load_ps(positionY), z = _mm256_load_ps(positionZ);
+	__m256 lightX = _mm256_sub_ps(_mm256_set1_ps(lightPosition.x), x);
+	__m256 lightY = _mm256_sub_ps(_mm256_set1_ps(lightPosition.y), y);
+	__m256 lightZ = _mm256_sub_ps(_mm256_set1_ps(lightPosition.z), z);
+	__m256 distance = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lightX, lightX), _mm256_mul_ps(lightY, lightY)), _mm256_mul_ps(lightZ, lightZ)));
+	__m256 inverseDistance = _mm256_div_ps(_mm256_set1_ps(1.0f), distance);
+	lightX = _mm256_mul_ps(lightX, inverseDistance);
+	lightY = _mm256_mul_ps(lightY, inverseDistance);
+	lightZ = _mm256_mul_ps(lightZ, inverseDistance);
+	__m256 viewX = _mm256_sub_ps(_mm256_set1_ps(cameraPosition.x), x);
+	__m256 viewY = _mm256_sub_ps(_mm256_set1_ps(cameraPosition.y), y);
+	__m256 viewZ = _mm256_sub_ps(_mm256_set1_ps(cameraPosition.z), z);
+	__m256 inverseViewLength = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_sqrt_ps(
+			_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(viewX, viewX), _mm256_mul_ps(viewY, viewY)), _mm256_mul_ps(viewZ, viewZ))));
+	viewX = _mm256_mul_ps(viewX, inverseViewLength);
+	viewY = _mm256_mul_ps(viewY, inverseViewLength);
+	viewZ = _mm256_mul_ps(viewZ, inverseViewLength);
+
+	// Diffuse, attenuated and clamped to [AMBIENT, 1]
+	__m256 nX = _mm256_load_ps(normalX), nY = _mm256_load_ps(normalY), nZ = _mm256_load_ps(normalZ);
+	__m256 cosine = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nX, lightX), _mm256_mul_ps(nY, lightY)), _mm256_mul_ps(nZ, lightZ));
+	__m256 attenuation = _mm256_div_ps(_mm256_set1_ps(ATTENUATION), _mm256_mul_ps(distance, distance));
+	__m256 diffuse = _mm256_mul_ps(_mm256_max_ps(cosine, _mm256_setzero_ps()), attenuation);
+	__m256 brightness = _mm256_max_ps(_mm256_set1_ps(AMBIENT), _mm256_min_ps(diffuse, _mm256_set1_ps(1.0f)));
+
+	// The light reflected about the normal, 2 (n.l) n - l, against the view
+	__m256 twiceCosine = _mm256_add_ps(cosine, cosine);
+	__m256 reflectedX = _mm256_sub_ps(_mm256_mul_ps(twiceCosine, nX), lightX);
+	__m256 reflectedY = _mm256_sub_ps(_mm256_mul_ps(twiceCosine, nY), lightY);
+	__m256 reflectedZ = _mm256_sub_ps(_mm256_mul_ps(twiceCosine, nZ), lightZ);
+	__m256 specular = _mm256_max_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(viewX, reflectedX), _mm256_mul_ps(viewY, reflectedY)),
+	                                              _mm256_mul_ps(viewZ, reflectedZ)), _mm256_setzero_ps());
+	for (int i = 0; i < SHININESS_SQUARINGS; i++) specular = _mm256_mul_ps(specular, specular);
+
+	// Each channel is the dimmed albedo plus the white highlight, both truncated and the sum clamped to 255
+	__m256i maximum = _mm256_set1_epi32(255);
+	__m256i highlight = _mm256_min_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(specular, _mm256_set1_ps(255.0f))), maximum);
+	__m256i r = _mm256_min_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(_mm256_load_ps(red), brightness)), highlight), maximum);
+	__m256i g = _mm256_min_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(_mm256_load_ps(green), brightness)), highlight), maximum);
+	__m256i b = _mm256_min_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(_mm256_load_ps(blue), brightness)), highlight), maximum);
+	__m256i packed = _mm256_or_si256(_mm256_or_si256(_mm256_set1_epi32(int(0xFF000000u)), _mm256_slli_epi32(r, 16)),
+	                                 _mm256_or_si256(_mm256_slli_epi32(g, 8), b));
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(colours), packed);
+}
+
+#else
+
+void ShadingBatch::shade(uint32_t *colours) const {
+	for (size_t lane = 0; lane < count; lane++) {
+		glm::vec3 position(positionX[lane], positionY[lane], positionZ[lane]);
+		glm::vec3 normal(normalX[lane], normalY[lane], normalZ[lane]);
+		glm::vec3 toLight = lightPosition - position;
+		float distance = std::sqrt(glm::dot(toLight, toLight));
+		glm::vec3 lightDirection = toLight * (1.0f / distance);
+		glm::vec3 viewDirection = glm::normalize(cameraPosition - position);
+
+		float cosine = glm::dot(normal, lightDirection);
+		float diffuse = std::max(cosine, 0.0f) * (ATTENUATION / (distance * distance));
+		float brightness = std::max(AMBIENT, std::min(diffuse, 1.0f));
+
+		float specular = std::max(glm::dot(viewDirection, 2.0f * cosine * normal - lightDirection), 0.0f);
+		for (int i = 0; i < SHININESS_SQUARINGS; i++) specular *= specular;
+
+		int highlight = std::min(int(specular * 255.0f), 255);
+		int r = std::min(int(red[lane] * brightness) + highlight, 255);
+		int g = std::min(int(green[lane] * brightness) + highlight, 255);
+		int b = std::min(int(blue[lane] * brightness) + highlight, 255);
+		colours[lane] = 0xFF000000u | uint32_t(r << 16) | uint32_t(g << 8) | uint32_t(b);
+	}
+}
+
+#endif
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstddef>
+#include <cstdint>
+#include "Colour.h"
+#include "DrawingWindow.h"
+
+// Lit surface hits of the ray-traced Cornell box scenes, queued up and shaded LANES at a time. The light falls off
+// with the square of its distance, the diffuse term is clamped between the ambient level and one, and a white
+// highlight is added. Hits are stored one component per aligned array so that a batch fills one AVX register per
+// component, and lighting it costs about what lighting a single hit did.
+class ShadingBatch {
+public:
+	static const size_t LANES = 8;
+
+	ShadingBatch(DrawingWindow &window, const glm::vec3 &lightPosition, const glm::vec3 &cameraPosition);
+	ShadingBatch(const ShadingBatch &) = delete;
+	ShadingBatch &operator=(const ShadingBatch &) = delete;
+
+	// Queues the hit seen through pixel (x, y), and draws the whole batch once it is full. The pixels of a batch
+	// must all be ones its thread may write to.
+	void add(const glm::vec3 &position, const glm::vec3 &normal, const Colour &albedo, size_t x, size_t y);
+	// Draws the hits still queued
+	void flush();
+
+private:
+	// The packed ARGB colour of each queued hit
+	void shade(uint32_t *colours) const;
+
+	DrawingWindow &window;
+	glm::vec3 lightPosition;
+	glm::vec3 cameraPosition;
+	size_t count = 0;
+	alignas(32) float positionX[LANES]{};
+	alignas(32) float positionY[LANES]{};
+	alignas(32) float positionZ[LANES]{};
+	alignas(32) float normalX[LANES]{};
+	alignas(32) float normalY[LANES]{};
+	alignas(32) float normalZ[LANES]{};
+	alignas(32) float red[LANES]{};
+	alignas(32) float green[LANES]{};
+	alignas(32) float blue[LANES]{};
+	size_t pixelX[LANES]{};
+	size_t pixelY[LANES]{};
+};
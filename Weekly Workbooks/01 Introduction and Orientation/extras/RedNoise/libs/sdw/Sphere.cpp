@@ -0,0 +1,77 @@
+#include "Sphere.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+Sphere::Sphere() = default;
+
+Sphere::Sphere(const glm::vec3 &sphereCentre, float sphereRadius, Colour sphereColour) :
+		centre(sphereCentre), radius(sphereRadius), colour(std::move(sphereColour)) {}
+
+bool Sphere::intersect(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, float &t) const {
+	// |o + t d - c|^2 = r^2 is a t^2 + 2 b t + c = 0 with the halved b
+	glm::vec3 offset = rayOrigin - centre;
+	float a = glm::dot(rayDirection, rayDirection);
+	float b = glm::dot(offset, rayDirection);
+	float c = glm::dot(offset, offset) - radius * radius;
+	// Both roots are behind the origin when it is outside (c > 0) and the sphere is behind it (b > 0)
+	if (c > 0.0f && b > 0.0f) return false;
+	float discriminant = b * b - a * c;
+	if (discriminant < 0.0f) return false;
+	float root = std::sqrt(discriminant);
+	// The nearer root, unless it is behind the origin because the origin is inside
+	float nearT = (-b - root) / a;
+	t = nearT > 0.0f ? nearT : (-b + root) / a;
+	return t > 0.0f;
+}
+
+glm::vec3 Sphere::normalAt(const glm::vec3 &point) const {
+	return (point - centre) / radius;
+}
+
+glm::vec2 Sphere::textureCoordsAt(const glm::vec3 &point) const {
+	glm::vec3 normal = glm::normalize(point - centre);
+	float u = 0.5f + std::atan2(normal.z, normal.x) / (2.0f * float(M_PI));
+	float v = 0.5f + std::asin(glm::clamp(normal.y, -1.0f, 1.0f)) / float(M_PI);
+	return glm::vec2(u, v);
+}
+
+ModelTriangle Sphere::surfaceAt(const glm::vec3 &point) const {
+	ModelTriangle surface(point, point, point, colour);
+	surface.normal = normalAt(point);
+	surface.vertexNormals = {{surface.normal, surface.normal, surface.normal}};
+	surface.isMirror = isMirror;
+	surface.isMetal = isMetal;
+	surface.isGlass = isGlass;
+	surface.hasTexture = hasTexture;
+	surface.reflectivity = reflectivity;
+	surface.roughness = roughness;
+	surface.metalColor = metalColor;
+	surface.refractiveIndex = refractiveIndex;
+	return surface;
+}
+
+std::ostream &operator<<(std::ostream &os, const Sphere &sphere) {
+	os << "Sphere of radius " << sphere.radius << " around (" << sphere.centre.x << ", " << sphere.centre.y << ", "
+	   << sphere.centre.z << ")";
+	return os;
+}
+
+Sphere fitSphere(const std::vector<ModelTriangle> &triangles) {
+	if (triangles.empty()) return Sphere();
+	glm::vec3 low(std::numeric_limits<float>::infinity());
+	glm::vec3 high(-std::numeric_limits<float>::infinity());
+	for (const ModelTriangle &triangle : triangles) {
+		for (const glm::vec3 &vertex : triangle.vertices) {
+			low = glm::min(low, vertex);
+			high = glm::max(high, vertex);
+		}
+	}
+	glm::vec3 centre = 0.5f * (low + high);
+	float distanceSum = 0.0f;
+	for (const ModelTriangle &triangle : triangles) {
+		for (const glm::vec3 &vertex : triangle.vertices) distanceSum += glm::length(vertex - centre);
+	}
+	return Sphere(centre, distanceSum / (3.0f * triangles.size()), triangles[0].colour);
+}
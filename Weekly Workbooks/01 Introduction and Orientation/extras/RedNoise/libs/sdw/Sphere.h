@@ -0,0 +1,40 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <iostream>
+#include <vector>
+#include "Colour.h"
+#include "ModelTriangle.h"
+
+// An exact sphere. A ray meets it in one quadric solve where a tessellated sphere costs a test per triangle, and the
+// normal and texture coordinates come straight from the point instead of being interpolated across facets.
+// The material fields mean the same as on ModelTriangle.
+struct Sphere {
+	glm::vec3 centre{};
+	float radius = 1.0f;
+	Colour colour{};
+	bool isMirror = false;
+	bool isMetal = false;
+	bool isGlass = false;
+	bool hasTexture = false;
+	float reflectivity = 0.0f;
+	float roughness = 0.0f;
+	glm::vec3 metalColor{};
+	float refractiveIndex = 1.0f;
+
+	Sphere();
+	Sphere(const glm::vec3 &sphereCentre, float sphereRadius, Colour sphereColour);
+	// Nearest t > 0 where the ray meets the surface, the far side if the ray starts inside
+	bool intersect(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, float &t) const;
+	// Outward unit normal at a point on the surface
+	glm::vec3 normalAt(const glm::vec3 &point) const;
+	// Longitude around the y axis for u and latitude from the south pole for v, both in [0, 1]
+	glm::vec2 textureCoordsAt(const glm::vec3 &point) const;
+	// A triangle carrying the sphere's material and, as its face and vertex normals, the normal at point, for shading
+	// code that only knows about triangles. Its vertices are all the point itself.
+	ModelTriangle surfaceAt(const glm::vec3 &point) const;
+	friend std::ostream &operator<<(std::ostream &os, const Sphere &sphere);
+};
+
+// The sphere a tessellated sphere mesh approximates: centred on the middle of its box, through its mean vertex distance
+Sphere fitSphere(const std::vector<ModelTriangle> &triangles);
@@ -0,0 +1,280 @@
+#include "TLAS.h"
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+namespace {
+
+// Instances are few and each one is a whole BVH to traverse, so leaves are kept to a single instance
+const size_t MAX_LEAF_SIZE = 1;
+
+// Slab test, returns the distance at which the ray enters the box or infinity if it misses it before maxDistance
+float intersectBounds(const TLASNode &node, const glm::vec3 &rayOrigin, const glm::vec3 &inverseDirection, float maxDistance) {
+	glm::vec3 t0 = (node.boundsMin - rayOrigin) * inverseDirection;
+	glm::vec3 t1 = (node.boundsMax - rayOrigin) * inverseDirection;
+	glm::vec3 tNear = glm::min(t0, t1);
+	glm::vec3 tFar = glm::max(t0, t1);
+	float tEnter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+	float tExit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, maxDistance));
+	return tEnter <= tExit ? tEnter : std::numeric_limits<float>::infinity();
+}
+
+}
+
+std::ostream &operator<<(std::ostream &os, const TLASStats &stats) {
+	os << stats.instanceCount << " instances of " << stats.meshCount << " meshes, " << stats.instancedTriangleCount
+	   << " triangles placed from " << stats.uniqueTriangleCount << " stored, " << stats.nodeCount << " top-level nodes, "
+	   << stats.meshBytes / 1024 << " KiB of meshes + " << stats.instanceBytes / 1024 << " KiB of instances";
+	return os;
+}
+
+TLAS::TLAS() = default;
+
+uint32_t TLAS::addMesh(TriangleView triangles, const BVHBuildOptions &options) {
+	Mesh mesh;
+	mesh.triangles = triangles;
+	mesh.ownBvh.reset(new BVH(triangles, options));
+	mesh.ownWideBvh.reset(new WideBVH(*mesh.ownBvh));
+	mesh.bvh = mesh.ownBvh.get();
+	mesh.wideBvh = mesh.ownWideBvh.get();
+	meshes.push_back(std::move(mesh));
+	dirty = true;
+	return meshes.size() - 1;
+}
+
+uint32_t TLAS::addMesh(TriangleView triangles, const BVH &bvh, const WideBVH &wideBvh) {
+	Mesh mesh;
+	mesh.triangles = triangles;
+	mesh.bvh = &bvh;
+	mesh.wideBvh = &wideBvh;
+	meshes.push_back(std::move(mesh));
+	dirty = true;
+	return meshes.size() - 1;
+}
+
+uint32_t TLAS::addInstance(uint32_t mesh, const glm::mat4 &transform) {
+	Instance instance;
+	instance.mesh = mesh;
+	instances.push_back(instance);
+	setTransform(instances.size() - 1, transform);
+	return instances.size() - 1;
+}
+
+void TLAS::setTransform(uint32_t index, const glm::mat4 &transform) {
+	Instance &instance = instances[index];
+	instance.objectToWorld = transform;
+	instance.worldToObject = glm::inverse(transform);
+	instance.normalToWorld = glm::transpose(glm::inverse(glm::mat3(transform)));
+	updateBounds(instance);
+	dirty = true;
+}
+
+void TLAS::setMaterial(uint32_t instance, const InstanceMaterial &material) {
+	instances[instance].hasMaterialOverride = true;
+	instances[instance].material = material;
+}
+
+void TLAS::clearMaterial(uint32_t instance) {
+	instances[instance].hasMaterialOverride = false;
+}
+
+void TLAS::updateBounds(Instance &instance) const {
+	instance.boundsMin = glm::vec3(std::numeric_limits<float>::infinity());
+	instance.boundsMax = glm::vec3(-std::numeric_limits<float>::infinity());
+	ArrayView<BVHNode> meshNodes = meshes[instance.mesh].bvh->getNodes();
+	if (meshNodes.empty()) return;
+	// The world box of an instance is the box around its mesh's root box, corner by corner
+	const BVHNode &root = meshNodes[0];
+	for (int corner = 0; corner < 8; corner++) {
+		glm::vec3 point((corner & 1) ? root.boundsMax.x : root.boundsMin.x,
+		                (corner & 2) ? root.boundsMax.y : root.boundsMin.y,
+		                (corner & 4) ? root.boundsMax.z : root.boundsMin.z);
+		glm::vec3 worldPoint = glm::vec3(instance.objectToWorld * glm::vec4(point, 1.0f));
+		instance.boundsMin = glm::min(instance.boundsMin, worldPoint);
+		instance.boundsMax = glm::max(instance.boundsMax, worldPoint);
+	}
+}
+
+void TLAS::build() {
+	if (!dirty) return;
+	dirty = false;
+	nodes.clear();
+	instanceOrder.resize(instances.size());
+	std::iota(instanceOrder.begin(), instanceOrder.end(), 0);
+	if (!instances.empty()) {
+		nodes.reserve(2 * instances.size());
+		TLASNode root;
+		root.leftFirst = 0;
+		root.instanceCount = instances.size();
+		nodes.push_back(root);
+		subdivide(0, 0);
+	}
+
+	stats = TLASStats();
+	stats.meshCount = meshes.size();
+	stats.instanceCount = instances.size();
+	stats.nodeCount = nodes.size();
+	for (const Mesh &mesh : meshes) {
+		stats.uniqueTriangleCount += mesh.bvh->getTriangleCount();
+		stats.meshBytes += mesh.bvh->getNodes().size() * sizeof(BVHNode) + mesh.bvh->getStore().sizeInBytes() +
+		                   mesh.wideBvh->getStats().nodeBytes;
+	}
+	for (const Instance &instance : instances) stats.instancedTriangleCount += meshes[instance.mesh].bvh->getTriangleCount();
+	stats.instanceBytes = instances.size() * (sizeof(Instance) + sizeof(uint32_t)) + nodes.size() * sizeof(TLASNode);
+}
+
+void TLAS::subdivide(uint32_t nodeIndex, size_t depth) {
+	TLASNode &node = nodes[nodeIndex];
+	auto begin = instanceOrder.begin() + node.leftFirst;
+	auto end = begin + node.instanceCount;
+	node.boundsMin = glm::vec3(std::numeric_limits<float>::infinity());
+	node.boundsMax = glm::vec3(-std::numeric_limits<float>::infinity());
+	for (auto it = begin; it != end; ++it) {
+		node.boundsMin = glm::min(node.boundsMin, instances[*it].boundsMin);
+		node.boundsMax = glm::max(node.boundsMax, instances[*it].boundsMax);
+	}
+	if (node.instanceCount <= MAX_LEAF_SIZE || depth >= BVH::MAX_DEPTH) return;
+
+	// Median split on the widest axis of the box centres; there are too few instances for SAH to be worth it
+	glm::vec3 extent = node.boundsMax - node.boundsMin;
+	int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+	size_t split = node.instanceCount / 2;
+	std::nth_element(begin, begin + split, end, [&](uint32_t a, uint32_t b) {
+		float centreA = instances[a].boundsMin[axis] + instances[a].boundsMax[axis];
+		float centreB = instances[b].boundsMin[axis] + instances[b].boundsMax[axis];
+		return centreA == centreB ? a < b : centreA < centreB;
+	});
+
+	uint32_t first = node.leftFirst;
+	uint32_t count = node.instanceCount;
+	uint32_t leftIndex = nodes.size();
+	TLASNode left, right;
+	left.leftFirst = first;
+	left.instanceCount = split;
+	right.leftFirst = first + split;
+	right.instanceCount = count - split;
+	// build reserved room for every node, so push_back never moves node
+	node.leftFirst = leftIndex;
+	node.instanceCount = 0;
+	nodes.push_back(left);
+	nodes.push_back(right);
+	subdivide(leftIndex, depth + 1);
+	subdivide(leftIndex + 1, depth + 1);
+}
+
+bool TLAS::intersect(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, float &t, float &u, float &v,
+                     uint32_t &instanceIndex, size_t &triangleIndex) const {
+	if (nodes.empty()) return false;
+	glm::vec3 inverseDirection = 1.0f / rayDirection;
+	float closestDistance = std::numeric_limits<float>::infinity();
+	uint32_t closestInstance = UINT32_MAX;
+
+	struct StackEntry {
+		uint32_t nodeIndex;
+		float entryDistance;
+	};
+	StackEntry stack[BVH::MAX_DEPTH + 2];
+	size_t stackSize = 0;
+	float rootDistance = intersectBounds(nodes[0], rayOrigin, inverseDirection, closestDistance);
+	if (rootDistance == std::numeric_limits<float>::infinity()) return false;
+	stack[stackSize++] = {0, rootDistance};
+
+	while (stackSize > 0) {
+		StackEntry entry = stack[--stackSize];
+		if (entry.entryDistance > closestDistance) continue;
+		const TLASNode &node = nodes[entry.nodeIndex];
+
+		if (node.isLeaf()) {
+			for (uint32_t i = node.leftFirst; i < node.leftFirst + node.instanceCount; i++) {
+				uint32_t index = instanceOrder[i];
+				const Instance &instance = instances[index];
+				glm::vec3 objectOrigin = glm::vec3(instance.worldToObject * glm::vec4(rayOrigin, 1.0f));
+				glm::vec3 objectDirection = glm::vec3(instance.worldToObject * glm::vec4(rayDirection, 0.0f));
+				float hitT, hitU, hitV;
+				size_t hitTriangle;
+				if (!meshes[instance.mesh].wideBvh->intersect(objectOrigin, objectDirection, hitT, hitU, hitV, hitTriangle)) continue;
+				if (hitT < closestDistance || (hitT == closestDistance && index < closestInstance)) {
+					closestDistance = hitT;
+					closestInstance = index;
+					triangleIndex = hitTriangle;
+					u = hitU;
+					v = hitV;
+				}
+			}
+			continue;
+		}
+
+		uint32_t nearIndex = node.leftFirst;
+		uint32_t farIndex = node.leftFirst + 1;
+		float nearDistance = intersectBounds(nodes[nearIndex], rayOrigin, inverseDirection, closestDistance);
+		float farDistance = intersectBounds(nodes[farIndex], rayOrigin, inverseDirection, closestDistance);
+		if (farDistance < nearDistance) {
+			std::swap(nearIndex, farIndex);
+			std::swap(nearDistance, farDistance);
+		}
+		if (farDistance != std::numeric_limits<float>::infinity()) stack[stackSize++] = {farIndex, farDistance};
+		if (nearDistance != std::numeric_limits<float>::infinity()) stack[stackSize++] = {nearIndex, nearDistance};
+	}
+
+	if (closestInstance == UINT32_MAX) return false;
+	t = closestDistance;
+	instanceIndex = closestInstance;
+	return true;
+}
+
+bool TLAS::occluded(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, float maxDistance,
+                    uint32_t ignoreInstance, size_t ignoreTriangle) const {
+	if (nodes.empty()) return false;
+	glm::vec3 inverseDirection = 1.0f / rayDirection;
+	uint32_t stack[BVH::MAX_DEPTH + 2];
+	size_t stackSize = 0;
+	stack[stackSize++] = 0;
+	while (stackSize > 0) {
+		const TLASNode &node = nodes[stack[--stackSize]];
+		if (intersectBounds(node, rayOrigin, inverseDirection, maxDistance) == std::numeric_limits<float>::infinity()) continue;
+		if (node.isLeaf()) {
+			for (uint32_t i = node.leftFirst; i < node.leftFirst + node.instanceCount; i++) {
+				uint32_t index = instanceOrder[i];
+				const Instance &instance = instances[index];
+				glm::vec3 objectOrigin = glm::vec3(instance.worldToObject * glm::vec4(rayOrigin, 1.0f));
+				glm::vec3 objectDirection = glm::vec3(instance.worldToObject * glm::vec4(rayDirection, 0.0f));
+				size_t ignore = index == ignoreInstance ? ignoreTriangle : size_t(-1);
+				if (meshes[instance.mesh].wideBvh->occluded(objectOrigin, objectDirection, maxDistance, ignore)) return true;
+			}
+			continue;
+		}
+		stack[stackSize++] = node.leftFirst + 1;
+		stack[stackSize++] = node.leftFirst;
+	}
+	return false;
+}
+
+const ModelTriangle &TLAS::getTriangle(uint32_t instance, size_t triangleIndex) const {
+	return meshes[instances[instance].mesh].triangles[triangleIndex];
+}
+
+glm::vec3 TLAS::getWorldNormal(uint32_t instance, size_t triangleIndex) const {
+	return glm::normalize(instances[instance].normalToWorld * getTriangle(instance, triangleIndex).normal);
+}
+
+const Colour &TLAS::getColour(uint32_t instance, size_t triangleIndex) const {
+	if (instances[instance].hasMaterialOverride) return instances[instance].material.colour;
+	return getTriangle(instance, triangleIndex).colour;
+}
+
+bool TLAS::isMirror(uint32_t instance, size_t triangleIndex) const {
+	if (instances[instance].hasMaterialOverride) return instances[instance].material.isMirror;
+	return getTriangle(instance, triangleIndex).isMirror;
+}
+
+const Instance &TLAS::getInstance(uint32_t instance) const {
+	return instances[instance];
+}
+
+size_t TLAS::getInstanceCount() const {
+	return instances.size();
+}
+
+const TLASStats &TLAS::getStats() const {
+	return stats;
+}
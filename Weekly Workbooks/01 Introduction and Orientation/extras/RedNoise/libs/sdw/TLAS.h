@@ -0,0 +1,120 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "BVH.h"
+#include "Colour.h"
+#include "ModelTriangle.h"
+#include "WideBVH.h"
+
+// Surface properties an instance can impose on every triangle of its mesh
+struct InstanceMaterial {
+	Colour colour{};
+	bool isMirror = false;
+	bool isMetal = false;
+	bool isGlass = false;
+};
+
+// One placement of a mesh: only the transform, its box in world space and the material live here, never triangles
+struct Instance {
+	uint32_t mesh{};
+	glm::mat4 objectToWorld{1.0f};
+	glm::mat4 worldToObject{1.0f};
+	// Inverse transpose of the upper 3x3 of objectToWorld, so normals stay perpendicular under non-uniform scaling
+	glm::mat3 normalToWorld{1.0f};
+	glm::vec3 boundsMin{};
+	glm::vec3 boundsMax{};
+	bool hasMaterialOverride = false;
+	InstanceMaterial material;
+};
+
+struct TLASNode {
+	glm::vec3 boundsMin{};
+	glm::vec3 boundsMax{};
+	// Interior nodes: index of the left child (the right child is leftFirst + 1).
+	// Leaves: position of the first instance in the TLAS's instance order.
+	uint32_t leftFirst{};
+	uint32_t instanceCount{};
+
+	bool isLeaf() const { return instanceCount > 0; }
+};
+
+struct TLASStats {
+	size_t meshCount{};
+	size_t instanceCount{};
+	size_t nodeCount{};
+	// Triangles actually stored, once per mesh
+	size_t uniqueTriangleCount{};
+	// Triangles in the scene as rendered, once per instance
+	size_t instancedTriangleCount{};
+	// Bottom-level trees and packed triangles
+	size_t meshBytes{};
+	// Top-level nodes and instances
+	size_t instanceBytes{};
+};
+
+std::ostream &operator<<(std::ostream &os, const TLASStats &stats);
+
+// Two-level scene: every mesh gets its own BVH (the bottom level) once, and a small tree over the instance boxes
+// (the top level) finds the instances a ray may hit. Rays are moved into the object space of each instance they
+// reach instead of moving triangles into the world, so placing a mesh again costs one Instance, not a copy of it.
+// Object-space directions are not renormalised, which keeps every t the same distance along the world-space ray.
+class TLAS {
+public:
+	TLAS();
+
+	// The triangles have to outlive the TLAS, their BVH is built here once however often the mesh is placed
+	uint32_t addMesh(TriangleView triangles, const BVHBuildOptions &options = BVHBuildOptions());
+	// Traces the mesh through trees that already exist, such as a model's mapped from its cache, instead of building
+	// its own; the triangles and both trees have to outlive the TLAS
+	uint32_t addMesh(TriangleView triangles, const BVH &bvh, const WideBVH &wideBvh);
+	uint32_t addInstance(uint32_t mesh, const glm::mat4 &transform);
+	// O(1): updates the instance's matrices and box and leaves the top level to the next call to build
+	void setTransform(uint32_t instance, const glm::mat4 &transform);
+	void setMaterial(uint32_t instance, const InstanceMaterial &material);
+	void clearMaterial(uint32_t instance);
+	// Rebuilds the top level over the instance boxes if instances were added or moved since the last call. No triangle
+	// is touched, so this costs the same for a sphere and a million-triangle mesh. Call it before tracing.
+	void build();
+
+	// Closest hit with t > 0; ties on t go to the lowest instance index and then the lowest triangle index
+	bool intersect(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, float &t, float &u, float &v,
+	               uint32_t &instanceIndex, size_t &triangleIndex) const;
+	// Shadow-ray query with the same rules as BVH::occluded; only triangle ignoreTriangle of instance ignoreInstance is skipped
+	bool occluded(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, float maxDistance,
+	              uint32_t ignoreInstance, size_t ignoreTriangle) const;
+
+	// The triangle as stored, in object space
+	const ModelTriangle &getTriangle(uint32_t instance, size_t triangleIndex) const;
+	glm::vec3 getWorldNormal(uint32_t instance, size_t triangleIndex) const;
+	// The instance's override colour if it has one, the triangle's own otherwise
+	const Colour &getColour(uint32_t instance, size_t triangleIndex) const;
+	bool isMirror(uint32_t instance, size_t triangleIndex) const;
+	const Instance &getInstance(uint32_t instance) const;
+	size_t getInstanceCount() const;
+	const TLASStats &getStats() const;
+
+private:
+	struct Mesh {
+		TriangleView triangles;
+		const BVH *bvh = nullptr;
+		const WideBVH *wideBvh = nullptr;
+		// The trees addMesh built, if it built them. Held by pointer so that the WideBVH's view of its BVH's arrays
+		// survives the mesh list growing
+		std::unique_ptr<BVH> ownBvh;
+		std::unique_ptr<WideBVH> ownWideBvh;
+	};
+
+	std::vector<Mesh> meshes;
+	std::vector<Instance> instances;
+	std::vector<TLASNode> nodes;
+	std::vector<uint32_t> instanceOrder;
+	bool dirty = false;
+	TLASStats stats;
+
+	void updateBounds(Instance &instance) const;
+	void subdivide(uint32_t nodeIndex, size_t depth);
+};
@@ -0,0 +1,47 @@
+#include "TilePool.h"
+#include <algorithm>
+
+size_t Tile::width() const {
+	return x1 - x0;
+}
+
+size_t Tile::height() const {
+	return y1 - y0;
+}
+
+TilePool::TilePool(JobSystem &jobSystem) : jobs(jobSystem) {}
+
+JobSystem &TilePool::getJobSystem() const {
+	return jobs;
+}
+
+void TilePool::render(size_t width, size_t height, const std::function<void(const Tile &)> &renderTile,
+                      size_t tileWidth, size_t tileHeight) const {
+	tileWidth = std::max<size_t>(tileWidth, 1);
+	tileHeight = std::max<size_t>(tileHeight, 1);
+	size_t tileColumns = (width + tileWidth - 1) / tileWidth;
+	size_t tileCount = tileColumns * ((height + tileHeight - 1) / tileHeight);
+	jobs.parallelFor(0, tileCount, 1, [&](size_t first, size_t last) {
+		for (size_t index = first; index < last; index++) {
+			if (cancelled) return;
+			Tile tile;
+			tile.x0 = index % tileColumns * tileWidth;
+			tile.y0 = index / tileColumns * tileHeight;
+			tile.x1 = std::min(tile.x0 + tileWidth, width);
+			tile.y1 = std::min(tile.y0 + tileHeight, height);
+			renderTile(tile);
+		}
+	});
+}
+
+void TilePool::cancel() {
+	cancelled = true;
+}
+
+void TilePool::resume() {
+	cancelled = false;
+}
+
+bool TilePool::isCancelled() const {
+	return cancelled;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include "JobSystem.h"
+
+// The pixels [x0, x1) x [y0, y1) of an image
+struct Tile {
+	size_t x0{};
+	size_t y0{};
+	size_t x1{};
+	size_t y1{};
+
+	size_t width() const;
+	size_t height() const;
+};
+
+// Renders an image as a grid of tiles, one job per tile. Workers take tiles off each other as they run out, so a
+// thread that finishes a cheap tile (empty background, say) moves straight on to more instead of idling while another
+// works through the busy middle of the frame.
+class TilePool {
+public:
+	// Small enough that a frame has several tiles per thread to balance, large enough that a tile is a few hundred
+	// packets of primary rays. A multiple of the packet size, so packets never straddle two tiles.
+	static const size_t TILE_SIZE = 32;
+
+	explicit TilePool(JobSystem &jobSystem);
+	JobSystem &getJobSystem() const;
+	// Calls renderTile once for every tile of a width x height image and returns when all of them are done. Tiles are
+	// rendered concurrently, so renderTile may only write to pixels inside its tile and must not change shared state.
+	// Tile edges fall on multiples of tileWidth and tileHeight.
+	void render(size_t width, size_t height, const std::function<void(const Tile &)> &renderTile,
+	            size_t tileWidth = TILE_SIZE, size_t tileHeight = TILE_SIZE) const;
+	// Makes render skip every tile it hasn't started yet, from any thread, so a frame nobody wants any more ends
+	// within the time of a tile. Stays in force until resume.
+	void cancel();
+	void resume();
+	bool isCancelled() const;
+
+private:
+	JobSystem &jobs;
+	std::atomic<bool> cancelled{false};
+};
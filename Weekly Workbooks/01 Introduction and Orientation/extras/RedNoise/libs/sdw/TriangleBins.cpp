@@ -0,0 +1,33 @@
+#include "TriangleBins.h"
+#include <algorithm>
+
+TriangleBins::TriangleBins(size_t width, size_t height, size_t chunkCount) :
+		width(width),
+		height(height),
+		columns((width + BIN_SIZE - 1) / BIN_SIZE),
+		rows((height + BIN_SIZE - 1) / BIN_SIZE),
+		lists(chunkCount * columns * rows) {}
+
+size_t TriangleBins::getChunkCount() const {
+	return columns * rows == 0 ? 0 : lists.size() / (columns * rows);
+}
+
+void TriangleBins::add(size_t chunk, uint32_t triangle, int minX, int minY, int maxX, int maxY) {
+	if (maxX < 0 || maxY < 0 || minX >= int(width) || minY >= int(height) || minX > maxX || minY > maxY) return;
+	size_t firstColumn = size_t(std::max(minX, 0)) / BIN_SIZE;
+	size_t lastColumn = std::min(size_t(maxX), width - 1) / BIN_SIZE;
+	size_t firstRow = size_t(std::max(minY, 0)) / BIN_SIZE;
+	size_t lastRow = std::min(size_t(maxY), height - 1) / BIN_SIZE;
+	std::vector<uint32_t> *chunkLists = &lists[chunk * columns * rows];
+	for (size_t row = firstRow; row <= lastRow; row++) {
+		for (size_t column = firstColumn; column <= lastColumn; column++) chunkLists[row * columns + column].push_back(triangle);
+	}
+}
+
+size_t TriangleBins::getBin(const Tile &tile) const {
+	return tile.y0 / BIN_SIZE * columns + tile.x0 / BIN_SIZE;
+}
+
+const std::vector<uint32_t> &TriangleBins::getTriangles(size_t chunk, size_t bin) const {
+	return lists[chunk * columns * rows + bin];
+}
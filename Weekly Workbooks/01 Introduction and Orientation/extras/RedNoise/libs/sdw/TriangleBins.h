@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "TilePool.h"
+
+// The screen-space bins of a sort-middle rasteriser: which triangles overlap each BIN_SIZE square of the screen. The
+// triangles are binned in chunks of consecutive ones, one job per chunk, and every chunk has a list of its own in
+// each bin, so binning takes no locks. Reading a bin's lists chunk by chunk gives its triangles in the order they
+// were submitted, whichever thread binned them, so a bin rasterised by one thread comes out the same as drawing every
+// triangle in order on one thread.
+class TriangleBins {
+public:
+	// Twice the ray tracer's tiles: a bin is rasterised by one job with a depth buffer of its own, which is worth
+	// allocating for a few thousand pixels but not a few hundred
+	static const size_t BIN_SIZE = 64;
+
+	TriangleBins(size_t width, size_t height, size_t chunkCount);
+	size_t getChunkCount() const;
+	// Adds triangle to the list chunk has in every bin that the pixels [minX, maxX] x [minY, maxY] overlap. Bounds
+	// off the screen are clipped to it. Only the job binning chunk may add to it.
+	void add(size_t chunk, uint32_t triangle, int minX, int minY, int maxX, int maxY);
+	// The bin that tile covers, for a tile of TilePool::render with BIN_SIZE tiles of the same screen
+	size_t getBin(const Tile &tile) const;
+	// The triangles of chunk that overlap bin, in the order they were added
+	const std::vector<uint32_t> &getTriangles(size_t chunk, size_t bin) const;
+
+private:
+	size_t width;
+	size_t height;
+	size_t columns;
+	size_t rows;
+	// The lists of a chunk are columns * rows consecutive ones, row by row
+	std::vector<std::vector<uint32_t>> lists;
+};
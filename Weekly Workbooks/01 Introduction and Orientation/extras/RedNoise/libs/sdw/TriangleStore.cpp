@@ -0,0 +1,416 @@
+#include "TriangleStore.h"
+#include "MollerTrumbore.h"
+#include <cstdint>
+#include <utility>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace {
+
+void considerHit(float t, float hitU, float hitV, uint32_t index, float &closestT, size_t &closestIndex, float &u, float &v) {
+	if (t < closestT || (t == closestT && index < closestIndex)) {
+		closestT = t;
+		closestIndex = index;
+		u = hitU;
+		v = hitV;
+	}
+}
+
+void considerHit(float t, float hitU, float hitV, uint32_t index, RayPacket &packet, size_t lane) {
+	if (t < packet.t[lane] || (t == packet.t[lane] && index < packet.triangleIndex[lane])) {
+		packet.t[lane] = t;
+		packet.triangleIndex[lane] = index;
+		packet.u[lane] = hitU;
+		packet.v[lane] = hitV;
+	}
+}
+
+}
+
+const uint32_t TriangleStore::PADDING_INDEX;
+
+TriangleStore::TriangleStore() = default;
+
+TriangleStore::TriangleStore(const TriangleStore &other) {
+	*this = other;
+}
+
+TriangleStore::TriangleStore(TriangleStore &&other) {
+	*this = std::move(other);
+}
+
+TriangleStore &TriangleStore::operator=(const TriangleStore &other) {
+	own = other.own;
+	if (other.viewsOwnArrays()) viewOwnArrays();
+	else setArrays(other.getArrays());
+	return *this;
+}
+
+TriangleStore &TriangleStore::operator=(TriangleStore &&other) {
+	bool ownArrays = other.viewsOwnArrays();
+	Arrays arrays = other.getArrays();
+	own = std::move(other.own);
+	if (ownArrays) viewOwnArrays();
+	else setArrays(arrays);
+	other.clear();
+	return *this;
+}
+
+void TriangleStore::clear() {
+	for (FloatArray *array : {&own.v0x, &own.v0y, &own.v0z, &own.e0x, &own.e0y, &own.e0z, &own.e1x, &own.e1y, &own.e1z}) {
+		array->clear();
+	}
+	own.triangleIndices.clear();
+	own.twoSided.clear();
+	setArrays(Arrays());
+}
+
+size_t TriangleStore::appendBlock(TriangleView triangles, const uint32_t *indices, size_t count) {
+	size_t first = size();
+	size_t paddedCount = (count + LANES - 1) / LANES * LANES;
+	for (size_t i = 0; i < paddedCount; i++) {
+		if (i < count) {
+			const ModelTriangle &triangle = triangles[indices[i]];
+			own.v0x.push_back(triangle.vertices[0].x);
+			own.v0y.push_back(triangle.vertices[0].y);
+			own.v0z.push_back(triangle.vertices[0].z);
+			own.e0x.push_back(triangle.edge0.x);
+			own.e0y.push_back(triangle.edge0.y);
+			own.e0z.push_back(triangle.edge0.z);
+			own.e1x.push_back(triangle.edge1.x);
+			own.e1y.push_back(triangle.edge1.y);
+			own.e1z.push_back(triangle.edge1.z);
+			own.triangleIndices.push_back(indices[i]);
+			own.twoSided.push_back(triangle.isGlass);
+		} else {
+			for (FloatArray *array : {&own.v0x, &own.v0y, &own.v0z, &own.e0x, &own.e0y, &own.e0z, &own.e1x, &own.e1y, &own.e1z}) {
+				array->push_back(0.0f);
+			}
+			own.triangleIndices.push_back(PADDING_INDEX);
+			own.twoSided.push_back(false);
+		}
+	}
+	// The vectors may have moved
+	viewOwnArrays();
+	return first;
+}
+
+void TriangleStore::update(size_t slot, const ModelTriangle &triangle) {
+	if (!viewsOwnArrays()) {
+		Arrays arrays = getArrays();
+		own.v0x.assign(arrays.v0x.begin(), arrays.v0x.end());
+		own.v0y.assign(arrays.v0y.begin(), arrays.v0y.end());
+		own.v0z.assign(arrays.v0z.begin(), arrays.v0z.end());
+		own.e0x.assign(arrays.e0x.begin(), arrays.e0x.end());
+		own.e0y.assign(arrays.e0y.begin(), arrays.e0y.end());
+		own.e0z.assign(arrays.e0z.begin(), arrays.e0z.end());
+		own.e1x.assign(arrays.e1x.begin(), arrays.e1x.end());
+		own.e1y.assign(arrays.e1y.begin(), arrays.e1y.end());
+		own.e1z.assign(arrays.e1z.begin(), arrays.e1z.end());
+		own.triangleIndices.assign(arrays.triangleIndices.begin(), arrays.triangleIndices.end());
+		own.twoSided.assign(arrays.twoSided.begin(), arrays.twoSided.end());
+		viewOwnArrays();
+	}
+	own.v0x[slot] = triangle.vertices[0].x;
+	own.v0y[slot] = triangle.vertices[0].y;
+	own.v0z[slot] = triangle.vertices[0].z;
+	own.e0x[slot] = triangle.edge0.x;
+	own.e0y[slot] = triangle.edge0.y;
+	own.e0z[slot] = triangle.edge0.z;
+	own.e1x[slot] = triangle.edge1.x;
+	own.e1y[slot] = triangle.edge1.y;
+	own.e1z[slot] = triangle.edge1.z;
+	own.twoSided[slot] = triangle.isGlass;
+}
+
+bool TriangleStore::view(const Arrays &arrays, size_t triangleCount) {
+	clear();
+	size_t slotCount = arrays.triangleIndices.size();
+	bool valid = slotCount % LANES == 0 && arrays.twoSided.size() == slotCount;
+	for (ArrayView<float> column : {arrays.v0x, arrays.v0y, arrays.v0z, arrays.e0x, arrays.e0y, arrays.e0z, arrays.e1x, arrays.e1y, arrays.e1z}) {
+		// The kernels load whole batches with aligned loads
+		valid = valid && column.size() == slotCount && reinterpret_cast<uintptr_t>(column.data()) % 32 == 0;
+	}
+	for (size_t slot = 0; valid && slot < slotCount; slot++) {
+		if (arrays.triangleIndices[slot] == PADDING_INDEX) {
+			// Padding is only ever skipped because its edges are zero, so a hit on it can't report a triangle
+			valid = arrays.e0x[slot] == 0.0f && arrays.e0y[slot] == 0.0f && arrays.e0z[slot] == 0.0f &&
+			        arrays.e1x[slot] == 0.0f && arrays.e1y[slot] == 0.0f && arrays.e1z[slot] == 0.0f;
+		} else {
+			valid = arrays.triangleIndices[slot] < triangleCount;
+		}
+	}
+	if (valid) setArrays(arrays);
+	return valid;
+}
+
+void TriangleStore::view(const TriangleStore &other) {
+	clear();
+	setArrays(other.getArrays());
+}
+
+TriangleStore::Arrays TriangleStore::getArrays() const {
+	return Arrays{v0x, v0y, v0z, e0x, e0y, e0z, e1x, e1y, e1z, triangleIndices, twoSided};
+}
+
+bool TriangleStore::viewsOwnArrays() const {
+	return triangleIndices.data() == own.triangleIndices.data();
+}
+
+void TriangleStore::viewOwnArrays() {
+	setArrays(Arrays{own.v0x, own.v0y, own.v0z, own.e0x, own.e0y, own.e0z, own.e1x, own.e1y, own.e1z, own.triangleIndices, own.twoSided});
+}
+
+void TriangleStore::setArrays(const Arrays &arrays) {
+	v0x = arrays.v0x;
+	v0y = arrays.v0y;
+	v0z = arrays.v0z;
+	e0x = arrays.e0x;
+	e0y = arrays.e0y;
+	e0z = arrays.e0z;
+	e1x = arrays.e1x;
+	e1y = arrays.e1y;
+	e1z = arrays.e1z;
+	triangleIndices = arrays.triangleIndices;
+	twoSided = arrays.twoSided;
+}
+
+#ifdef __AVX2__
+
+namespace {
+
+// The determinant is positive where a ray meets the front of a triangle (d . (e0 x e1) < 0), so culling keeps the
+// lanes with a positive determinant and the two-sided ones with any non-zero determinant
+__m256 frontOrTwoSided(__m256 determinant, const uint8_t *twoSided) {
+	__m256i sides = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(twoSided)));
+	__m256 twoSidedMask = _mm256_castsi256_ps(_mm256_cmpgt_epi32(sides, _mm256_setzero_si256()));
+	return _mm256_or_ps(_mm256_cmp_ps(determinant, _mm256_setzero_ps(), _CMP_GT_OQ), twoSidedMask);
+}
+
+}
+
+void TriangleStore::intersect(size_t first, size_t count, const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection,
+                              float &closestT, size_t &closestIndex, float &u, float &v, bool cullBackFaces) const {
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 ox = _mm256_set1_ps(rayOrigin.x), oy = _mm256_set1_ps(rayOrigin.y), oz = _mm256_set1_ps(rayOrigin.z);
+	const __m256 dx = _mm256_set1_ps(rayDirection.x), dy = _mm256_set1_ps(rayDirection.y), dz = _mm256_set1_ps(rayDirection.z);
+	alignas(32) float laneT[LANES], laneU[LANES], laneV[LANES];
+
+	for (size_t batch = first; batch < first + count; batch += LANES) {
+		__m256 edge0x = _mm256_load_ps(&e0x[batch]), edge0y = _mm256_load_ps(&e0y[batch]), edge0z = _mm256_load_ps(&e0z[batch]);
+		__m256 edge1x = _mm256_load_ps(&e1x[batch]), edge1y = _mm256_load_ps(&e1y[batch]), edge1z = _mm256_load_ps(&e1z[batch]);
+
+		// p = d x e1, det = e0 . p
+		__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, edge1z), _mm256_mul_ps(dz, edge1y));
+		__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, edge1x), _mm256_mul_ps(dx, edge1z));
+		__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, edge1y), _mm256_mul_ps(dy, edge1x));
+		__m256 determinant = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(edge0x, px), _mm256_mul_ps(edge0y, py)), _mm256_mul_ps(edge0z, pz));
+		__m256 valid = _mm256_cmp_ps(determinant, zero, _CMP_NEQ_OQ);
+		if (cullBackFaces) valid = _mm256_and_ps(valid, frontOrTwoSided(determinant, &twoSided[batch]));
+		if (_mm256_movemask_ps(valid) == 0) continue;
+		__m256 inverseDeterminant = _mm256_div_ps(one, determinant);
+
+		// s = o - v0, u = (s . p) / det
+		__m256 sx = _mm256_sub_ps(ox, _mm256_load_ps(&v0x[batch]));
+		__m256 sy = _mm256_sub_ps(oy, _mm256_load_ps(&v0y[batch]));
+		__m256 sz = _mm256_sub_ps(oz, _mm256_load_ps(&v0z[batch]));
+		__m256 hitU = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz)), inverseDeterminant);
+		valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(hitU, zero, _CMP_GE_OQ), _mm256_cmp_ps(hitU, one, _CMP_LE_OQ)));
+		if (_mm256_movemask_ps(valid) == 0) continue;
+
+		// q = s x e0, v = (d . q) / det
+		__m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, edge0z), _mm256_mul_ps(sz, edge0y));
+		__m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, edge0x), _mm256_mul_ps(sx, edge0z));
+		__m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, edge0y), _mm256_mul_ps(sy, edge0x));
+		__m256 hitV = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inverseDeterminant);
+		valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(hitV, zero, _CMP_GE_OQ),
+		                                           _mm256_cmp_ps(_mm256_add_ps(hitU, hitV), one, _CMP_LE_OQ)));
+		if (_mm256_movemask_ps(valid) == 0) continue;
+
+		// t = (e1 . q) / det, kept only if it is in front of the ray and not behind the current closest hit
+		__m256 hitT = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(edge1x, qx), _mm256_mul_ps(edge1y, qy)), _mm256_mul_ps(edge1z, qz)), inverseDeterminant);
+		valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(hitT, zero, _CMP_GT_OQ),
+		                                           _mm256_cmp_ps(hitT, _mm256_set1_ps(closestT), _CMP_LE_OQ)));
+		int hits = _mm256_movemask_ps(valid);
+		if (hits == 0) continue;
+
+		_mm256_store_ps(laneT, hitT);
+		_mm256_store_ps(laneU, hitU);
+		_mm256_store_ps(laneV, hitV);
+		for (size_t lane = 0; lane < LANES; lane++) {
+			if (hits & (1 << lane)) {
+				considerHit(laneT[lane], laneU[lane], laneV[lane], triangleIndices[batch + lane], closestT, closestIndex, u, v);
+			}
+		}
+	}
+}
+
+void TriangleStore::intersect(size_t first, size_t count, RayPacket &packet, uint32_t mask) const {
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+	alignas(32) float laneT[LANES], laneU[LANES], laneV[LANES];
+
+	for (size_t slot = first; slot < first + count; slot++) {
+		// Padding only ever fills the end of a block
+		if (triangleIndices[slot] == PADDING_INDEX) break;
+		const __m256 edge0x = _mm256_set1_ps(e0x[slot]), edge0y = _mm256_set1_ps(e0y[slot]), edge0z = _mm256_set1_ps(e0z[slot]);
+		const __m256 edge1x = _mm256_set1_ps(e1x[slot]), edge1y = _mm256_set1_ps(e1y[slot]), edge1z = _mm256_set1_ps(e1z[slot]);
+		// Every ray starts at the packet origin, so s = o - v0 is the same for all of them
+		const __m256 sx = _mm256_set1_ps(packet.origin.x - v0x[slot]);
+		const __m256 sy = _mm256_set1_ps(packet.origin.y - v0y[slot]);
+		const __m256 sz = _mm256_set1_ps(packet.origin.z - v0z[slot]);
+		// q = s x e0
+		const __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, edge0z), _mm256_mul_ps(sz, edge0y));
+		const __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, edge0x), _mm256_mul_ps(sx, edge0z));
+		const __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, edge0y), _mm256_mul_ps(sy, edge0x));
+		const __m256 edge1DotQ = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(edge1x, qx), _mm256_mul_ps(edge1y, qy)), _mm256_mul_ps(edge1z, qz));
+		// e1 . q = s . (e0 x e1) has the sign of the determinant of every hit in front of the origin, so when it is
+		// not positive the origin is behind the triangle and any ray that reaches it would hit its back
+		if (packet.cullBackFaces && !twoSided[slot] && _mm256_movemask_ps(_mm256_cmp_ps(edge1DotQ, zero, _CMP_GT_OQ)) == 0) continue;
+
+		for (size_t lane0 = 0; lane0 < RayPacket::SIZE; lane0 += LANES) {
+			int laneMask = (mask >> lane0) & 0xFF;
+			if (laneMask == 0) continue;
+			__m256 dx = _mm256_load_ps(&packet.directionX[lane0]);
+			__m256 dy = _mm256_load_ps(&packet.directionY[lane0]);
+			__m256 dz = _mm256_load_ps(&packet.directionZ[lane0]);
+
+			// p = d x e1, det = e0 . p
+			__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, edge1z), _mm256_mul_ps(dz, edge1y));
+			__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, edge1x), _mm256_mul_ps(dx, edge1z));
+			__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, edge1y), _mm256_mul_ps(dy, edge1x));
+			__m256 determinant = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(edge0x, px), _mm256_mul_ps(edge0y, py)), _mm256_mul_ps(edge0z, pz));
+			__m256 valid = _mm256_cmp_ps(determinant, zero, _CMP_NEQ_OQ);
+			__m256 inverseDeterminant = _mm256_div_ps(one, determinant);
+
+			__m256 hitU = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz)), inverseDeterminant);
+			__m256 hitV = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inverseDeterminant);
+			__m256 hitT = _mm256_mul_ps(edge1DotQ, inverseDeterminant);
+			valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(hitU, zero, _CMP_GE_OQ), _mm256_cmp_ps(hitU, one, _CMP_LE_OQ)));
+			valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(hitV, zero, _CMP_GE_OQ),
+			                                           _mm256_cmp_ps(_mm256_add_ps(hitU, hitV), one, _CMP_LE_OQ)));
+			valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(hitT, zero, _CMP_GT_OQ),
+			                                           _mm256_cmp_ps(hitT, _mm256_load_ps(&packet.t[lane0]), _CMP_LE_OQ)));
+			int hits = _mm256_movemask_ps(valid) & laneMask;
+			if (hits == 0) continue;
+
+			_mm256_store_ps(laneT, hitT);
+			_mm256_store_ps(laneU, hitU);
+			_mm256_store_ps(laneV, hitV);
+			for (size_t lane = 0; lane < LANES; lane++) {
+				if (hits & (1 << lane)) {
+					considerHit(laneT[lane], laneU[lane], laneV[lane], triangleIndices[slot], packet, lane0 + lane);
+				}
+			}
+		}
+	}
+}
+
+bool TriangleStore::occluded(size_t first, size_t count, const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection,
+                             float minT, float maxT, size_t ignoreIndex, bool cullBackFaces) const {
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 ox = _mm256_set1_ps(rayOrigin.x), oy = _mm256_set1_ps(rayOrigin.y), oz = _mm256_set1_ps(rayOrigin.z);
+	const __m256 dx = _mm256_set1_ps(rayDirection.x), dy = _mm256_set1_ps(rayDirection.y), dz = _mm256_set1_ps(rayDirection.z);
+
+	for (size_t batch = first; batch < first + count; batch += LANES) {
+		__m256 edge0x = _mm256_load_ps(&e0x[batch]), edge0y = _mm256_load_ps(&e0y[batch]), edge0z = _mm256_load_ps(&e0z[batch]);
+		__m256 edge1x = _mm256_load_ps(&e1x[batch]), edge1y = _mm256_load_ps(&e1y[batch]), edge1z = _mm256_load_ps(&e1z[batch]);
+		__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, edge1z), _mm256_mul_ps(dz, edge1y));
+		__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, edge1x), _mm256_mul_ps(dx, edge1z));
+		__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, edge1y), _mm256_mul_ps(dy, edge1x));
+		__m256 determinant = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(edge0x, px), _mm256_mul_ps(edge0y, py)), _mm256_mul_ps(edge0z, pz));
+		__m256 valid = _mm256_cmp_ps(determinant, zero, _CMP_NEQ_OQ);
+		if (cullBackFaces) valid = _mm256_and_ps(valid, frontOrTwoSided(determinant, &twoSided[batch]));
+		if (_mm256_movemask_ps(valid) == 0) continue;
+		__m256 inverseDeterminant = _mm256_div_ps(one, determinant);
+
+		__m256 sx = _mm256_sub_ps(ox, _mm256_load_ps(&v0x[batch]));
+		__m256 sy = _mm256_sub_ps(oy, _mm256_load_ps(&v0y[batch]));
+		__m256 sz = _mm256_sub_ps(oz, _mm256_load_ps(&v0z[batch]));
+		__m256 hitU = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz)), inverseDeterminant);
+		valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(hitU, zero, _CMP_GE_OQ), _mm256_cmp_ps(hitU, one, _CMP_LE_OQ)));
+		if (_mm256_movemask_ps(valid) == 0) continue;
+
+		__m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, edge0z), _mm256_mul_ps(sz, edge0y));
+		__m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, edge0x), _mm256_mul_ps(sx, edge0z));
+		__m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, edge0y), _mm256_mul_ps(sy, edge0x));
+		__m256 hitV = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inverseDeterminant);
+		valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(hitV, zero, _CMP_GE_OQ),
+		                                           _mm256_cmp_ps(_mm256_add_ps(hitU, hitV), one, _CMP_LE_OQ)));
+		if (_mm256_movemask_ps(valid) == 0) continue;
+
+		__m256 hitT = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(edge1x, qx), _mm256_mul_ps(edge1y, qy)), _mm256_mul_ps(edge1z, qz)), inverseDeterminant);
+		valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(hitT, _mm256_set1_ps(minT), _CMP_GT_OQ),
+		                                           _mm256_cmp_ps(hitT, _mm256_set1_ps(maxT), _CMP_LT_OQ)));
+		int hits = _mm256_movemask_ps(valid);
+		for (size_t lane = 0; lane < LANES; lane++) {
+			if ((hits & (1 << lane)) && triangleIndices[batch + lane] != ignoreIndex) return true;
+		}
+	}
+	return false;
+}
+
+#else
+
+void TriangleStore::intersect(size_t first, size_t count, const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection,
+                              float &closestT, size_t &closestIndex, float &u, float &v, bool cullBackFaces) const {
+	for (size_t slot = first; slot < first + count; slot++) {
+		glm::vec3 vertex(v0x[slot], v0y[slot], v0z[slot]);
+		glm::vec3 edge0(e0x[slot], e0y[slot], e0z[slot]);
+		glm::vec3 edge1(e1x[slot], e1y[slot], e1z[slot]);
+		if (cullBackFaces && !twoSided[slot] && glm::dot(rayDirection, glm::cross(edge0, edge1)) >= 0.0f) continue;
+		float t, hitU, hitV;
+		if (intersectMollerTrumbore(rayOrigin, rayDirection, vertex, edge0, edge1, t, hitU, hitV)) {
+			considerHit(t, hitU, hitV, triangleIndices[slot], closestT, closestIndex, u, v);
+		}
+	}
+}
+
+void TriangleStore::intersect(size_t first, size_t count, RayPacket &packet, uint32_t mask) const {
+	for (size_t slot = first; slot < first + count; slot++) {
+		if (triangleIndices[slot] == PADDING_INDEX) break;
+		glm::vec3 vertex(v0x[slot], v0y[slot], v0z[slot]);
+		glm::vec3 edge0(e0x[slot], e0y[slot], e0z[slot]);
+		glm::vec3 edge1(e1x[slot], e1y[slot], e1z[slot]);
+		// As in the AVX2 kernel: every hit in front of the origin is on the side of the triangle the origin is on
+		if (packet.cullBackFaces && !twoSided[slot] && glm::dot(edge1, glm::cross(packet.origin - vertex, edge0)) <= 0.0f) continue;
+		for (size_t lane = 0; lane < RayPacket::SIZE; lane++) {
+			if (!(mask & (1u << lane))) continue;
+			float t, hitU, hitV;
+			if (intersectMollerTrumbore(packet.origin, packet.getDirection(lane), vertex, edge0, edge1, t, hitU, hitV)) {
+				considerHit(t, hitU, hitV, triangleIndices[slot], packet, lane);
+			}
+		}
+	}
+}
+
+bool TriangleStore::occluded(size_t first, size_t count, const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection,
+                             float minT, float maxT, size_t ignoreIndex, bool cullBackFaces) const {
+	for (size_t slot = first; slot < first + count; slot++) {
+		if (triangleIndices[slot] == ignoreIndex) continue;
+		glm::vec3 vertex(v0x[slot], v0y[slot], v0z[slot]);
+		glm::vec3 edge0(e0x[slot], e0y[slot], e0z[slot]);
+		glm::vec3 edge1(e1x[slot], e1y[slot], e1z[slot]);
+		if (cullBackFaces && !twoSided[slot] && glm::dot(rayDirection, glm::cross(edge0, edge1)) >= 0.0f) continue;
+		float t, hitU, hitV;
+		if (intersectMollerTrumbore(rayOrigin, rayDirection, vertex, edge0, edge1, t, hitU, hitV) && t > minT && t < maxT) return true;
+	}
+	return false;
+}
+
+#endif
+
+uint32_t TriangleStore::getTriangleIndex(size_t slot) const {
+	return triangleIndices[slot];
+}
+
+size_t TriangleStore::size() const {
+	return triangleIndices.size();
+}
+
+size_t TriangleStore::sizeInBytes() const {
+	return size() * (9 * sizeof(float) + sizeof(uint32_t) + sizeof(uint8_t));
+}
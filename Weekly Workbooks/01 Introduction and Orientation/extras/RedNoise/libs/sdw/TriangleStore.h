@@ -0,0 +1,126 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include "ArrayView.h"
+#include "ModelTriangle.h"
+#include "RayPacket.h"
+
+template<typename T, size_t Alignment>
+struct AlignedAllocator {
+	using value_type = T;
+	template<typename U>
+	struct rebind {
+		using other = AlignedAllocator<U, Alignment>;
+	};
+
+	AlignedAllocator() = default;
+	template<typename U>
+	AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+
+	T *allocate(size_t n) {
+#ifdef _MSC_VER
+		void *memory = _aligned_malloc(n * sizeof(T), Alignment);
+		if (memory == nullptr) throw std::bad_alloc();
+#else
+		void *memory = nullptr;
+		if (posix_memalign(&memory, Alignment, n * sizeof(T)) != 0) throw std::bad_alloc();
+#endif
+		return static_cast<T *>(memory);
+	}
+
+	void deallocate(T *memory, size_t) {
+#ifdef _MSC_VER
+		_aligned_free(memory);
+#else
+		free(memory);
+#endif
+	}
+};
+
+template<typename T, typename U, size_t Alignment>
+bool operator==(const AlignedAllocator<T, Alignment> &, const AlignedAllocator<U, Alignment> &) { return true; }
+template<typename T, typename U, size_t Alignment>
+bool operator!=(const AlignedAllocator<T, Alignment> &, const AlignedAllocator<U, Alignment> &) { return false; }
+
+// Packed geometry for the intersection kernel: the first vertex and both edges of every triangle, one component
+// per 32-byte aligned array, so a batch of LANES triangles is nine aligned loads and nothing else is touched.
+// Triangles are added in blocks padded to LANES slots with degenerate (zero-edge) triangles that can never be hit.
+// A front face is the side that vertices 0, 1, 2 wind anticlockwise around, i.e. the side edge0 x edge1 points to.
+class TriangleStore {
+public:
+	static const size_t LANES = 8;
+	// The triangle index of the slots that pad a block out to LANES
+	static const uint32_t PADDING_INDEX = UINT32_MAX;
+	using FloatArray = std::vector<float, AlignedAllocator<float, 32>>;
+
+	// Every slot array of a store, as getArrays hands them out to be saved and view takes them back
+	struct Arrays {
+		ArrayView<float> v0x, v0y, v0z;
+		ArrayView<float> e0x, e0y, e0z;
+		ArrayView<float> e1x, e1y, e1z;
+		ArrayView<uint32_t> triangleIndices;
+		ArrayView<uint8_t> twoSided;
+	};
+
+	TriangleStore();
+	// A copy has arrays of its own if the original did, and views the same arrays as the original otherwise
+	TriangleStore(const TriangleStore &other);
+	TriangleStore(TriangleStore &&other);
+	TriangleStore &operator=(const TriangleStore &other);
+	TriangleStore &operator=(TriangleStore &&other);
+	void clear();
+	// Returns the slot of the first triangle in the block
+	size_t appendBlock(TriangleView triangles, const uint32_t *indices, size_t count);
+	// Overwrites the triangle in an occupied slot, for when its vertices (and edges) have moved. A store that views
+	// someone else's arrays copies them in first.
+	void update(size_t slot, const ModelTriangle &triangle);
+	// Reads arrays kept elsewhere, such as the sections of a mapped model cache, in place of its own until the next
+	// clear or update; they have to outlive the store. Returns false, leaving the store empty, unless they are all one
+	// whole number of blocks long, the floats are 32-byte aligned and every slot holds a triangle below triangleCount
+	// or padding that can never be hit.
+	bool view(const Arrays &arrays, size_t triangleCount);
+	// Reads another store's arrays, which have to stay where they are for as long as this one is used
+	void view(const TriangleStore &other);
+	Arrays getArrays() const;
+	// Tests slots [first, first + count) and replaces the closest hit if a nearer one (or an equally near one
+	// with a lower triangle index) is found; closestIndex is an index into the original triangle vector.
+	// With cullBackFaces a ray that meets the back of a triangle misses it, unless it is glass.
+	void intersect(size_t first, size_t count, const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection,
+	               float &closestT, size_t &closestIndex, float &u, float &v, bool cullBackFaces = false) const;
+	// The same closest-hit update for each lane of mask in the packet, one triangle at a time against LANES rays.
+	// With packet.cullBackFaces a triangle whose back faces the packet origin is skipped before any ray is tested,
+	// unless it is glass.
+	void intersect(size_t first, size_t count, RayPacket &packet, uint32_t mask) const;
+	// True as soon as any triangle other than ignoreIndex is hit with minT < t < maxT, back faces skipped as above
+	bool occluded(size_t first, size_t count, const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection,
+	              float minT, float maxT, size_t ignoreIndex, bool cullBackFaces = false) const;
+	uint32_t getTriangleIndex(size_t slot) const;
+	size_t size() const;
+	size_t sizeInBytes() const;
+
+private:
+	// The arrays appendBlock fills, empty while the store views someone else's
+	struct OwnArrays {
+		FloatArray v0x, v0y, v0z;
+		FloatArray e0x, e0y, e0z;
+		FloatArray e1x, e1y, e1z;
+		std::vector<uint32_t> triangleIndices;
+		std::vector<uint8_t> twoSided;
+	};
+	OwnArrays own;
+	// What the kernels read: the arrays above, or the ones passed to view
+	ArrayView<float> v0x, v0y, v0z;
+	ArrayView<float> e0x, e0y, e0z;
+	ArrayView<float> e1x, e1y, e1z;
+	ArrayView<uint32_t> triangleIndices;
+	// Glass is seen from both sides, so it is never culled
+	ArrayView<uint8_t> twoSided;
+
+	bool viewsOwnArrays() const;
+	void viewOwnArrays();
+	void setArrays(const Arrays &arrays);
+};
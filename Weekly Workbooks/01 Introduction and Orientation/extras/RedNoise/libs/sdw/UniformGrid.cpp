@@ -0,0 +1,256 @@
+#include "UniformGrid.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "BVH.h"
+
+namespace {
+
+// Above this many triangles a grid fine enough to separate them costs more memory and more empty steps than a tree
+const size_t GRID_MAX_TRIANGLES = 256;
+// Triangles whose sizes spread further than this around the mean leave a grid either too coarse for the small ones
+// or too fine for the large ones. The lecture sphere mesh (0.19, traced by the Gouraud and Phong views with 'm') is
+// faster in a grid; the Cornell and Mirror boxes (0.55) are not.
+const float GRID_MAX_SIZE_VARIATION = 0.4f;
+
+void triangleBounds(const ModelTriangle &triangle, glm::vec3 &boundsMin, glm::vec3 &boundsMax) {
+	const std::array<glm::vec3, 3> &vertices = triangle.vertices;
+	glm::vec3 low = glm::min(glm::min(vertices[0], vertices[1]), vertices[2]);
+	glm::vec3 high = glm::max(glm::max(vertices[0], vertices[1]), vertices[2]);
+	// The same padding as the BVH, so a triangle is filed in every cell the triangle test could hit it in
+	float magnitude = std::max(glm::length(low), glm::length(high));
+	glm::vec3 padding(1e-5f * (1.0f + magnitude));
+	boundsMin = low - padding;
+	boundsMax = high + padding;
+}
+
+// Separating axis test between a triangle and a box (Akenine-Moller): the box axes, the triangle normal and the nine
+// cross products of box axes and triangle edges. Walls that cross a cell only at a corner of their box stay out of it.
+bool triangleOverlapsBox(const ModelTriangle &triangle, const glm::vec3 &boxCentre, const glm::vec3 &boxHalfSize) {
+	const glm::vec3 v[3] = {triangle.vertices[0] - boxCentre, triangle.vertices[1] - boxCentre, triangle.vertices[2] - boxCentre};
+	auto separates = [&](const glm::vec3 &axis) {
+		float p0 = glm::dot(v[0], axis), p1 = glm::dot(v[1], axis), p2 = glm::dot(v[2], axis);
+		float radius = glm::dot(boxHalfSize, glm::abs(axis));
+		return std::min(std::min(p0, p1), p2) > radius || std::max(std::max(p0, p1), p2) < -radius;
+	};
+	const glm::vec3 edges[3] = {v[1] - v[0], v[2] - v[1], v[0] - v[2]};
+	const glm::vec3 boxAxes[3] = {glm::vec3(1, 0, 0), glm::vec3(0, 1, 0), glm::vec3(0, 0, 1)};
+	for (const glm::vec3 &boxAxis : boxAxes) {
+		if (separates(boxAxis)) return false;
+		for (const glm::vec3 &edge : edges) {
+			if (separates(glm::cross(boxAxis, edge))) return false;
+		}
+	}
+	return !separates(glm::cross(edges[0], edges[1]));
+}
+
+}
+
+std::ostream &operator<<(std::ostream &os, const UniformGridStats &stats) {
+	os << stats.triangleCount << " triangles, " << stats.resolution.x << "x" << stats.resolution.y << "x" << stats.resolution.z
+	   << " cells (" << stats.emptyCellCount << " empty), " << stats.referenceCount << " references, largest cell "
+	   << stats.maxCellSize << ", " << stats.bytes / 1024 << " KiB";
+	return os;
+}
+
+std::ostream &operator<<(std::ostream &os, const AcceleratorStatistics &statistics) {
+	os << statistics.triangleCount << " triangles, mean size " << statistics.relativeTriangleSize << " of the model, size variation "
+	   << statistics.sizeVariation << " -> " << (statistics.preferGrid ? "grid" : "BVH");
+	return os;
+}
+
+AcceleratorStatistics chooseAccelerator(TriangleView triangles) {
+	AcceleratorStatistics statistics;
+	statistics.triangleCount = triangles.size();
+	if (triangles.empty()) return statistics;
+
+	glm::vec3 modelMin(std::numeric_limits<float>::infinity());
+	glm::vec3 modelMax(-std::numeric_limits<float>::infinity());
+	double sum = 0.0;
+	double sumOfSquares = 0.0;
+	for (const ModelTriangle &triangle : triangles) {
+		glm::vec3 low, high;
+		triangleBounds(triangle, low, high);
+		modelMin = glm::min(modelMin, low);
+		modelMax = glm::max(modelMax, high);
+		double size = glm::length(high - low);
+		sum += size;
+		sumOfSquares += size * size;
+	}
+	double mean = sum / triangles.size();
+	double variance = std::max(0.0, sumOfSquares / triangles.size() - mean * mean);
+	statistics.relativeTriangleSize = float(mean / glm::length(modelMax - modelMin));
+	statistics.sizeVariation = float(std::sqrt(variance) / mean);
+	statistics.preferGrid = triangles.size() <= GRID_MAX_TRIANGLES && statistics.sizeVariation <= GRID_MAX_SIZE_VARIATION;
+	return statistics;
+}
+
+UniformGrid::UniformGrid() = default;
+
+UniformGrid::UniformGrid(TriangleView triangles, float cellsPerTriangle) {
+	build(triangles, cellsPerTriangle);
+}
+
+void UniformGrid::build(TriangleView triangles, float cellsPerTriangle) {
+	cells.clear();
+	store.clear();
+	stats = UniformGridStats();
+	stats.triangleCount = triangles.size();
+	if (triangles.empty()) return;
+
+	std::vector<glm::vec3> triangleMin(triangles.size());
+	std::vector<glm::vec3> triangleMax(triangles.size());
+	boundsMin = glm::vec3(std::numeric_limits<float>::infinity());
+	boundsMax = glm::vec3(-std::numeric_limits<float>::infinity());
+	for (size_t i = 0; i < triangles.size(); i++) {
+		triangleBounds(triangles[i], triangleMin[i], triangleMax[i]);
+		boundsMin = glm::min(boundsMin, triangleMin[i]);
+		boundsMax = glm::max(boundsMax, triangleMax[i]);
+	}
+
+	// A flat model would have no volume to share out, so every axis gets at least a sliver of the longest one
+	glm::vec3 extent = boundsMax - boundsMin;
+	float longest = std::max(std::max(extent.x, extent.y), extent.z);
+	extent = glm::max(extent, glm::vec3(longest * 1e-3f));
+	boundsMax = boundsMin + extent;
+	float cellsPerUnit = std::cbrt(cellsPerTriangle * triangles.size() / (extent.x * extent.y * extent.z));
+	for (int axis = 0; axis < 3; axis++) {
+		resolution[axis] = std::min(MAX_RESOLUTION, std::max(1, int(std::round(extent[axis] * cellsPerUnit))));
+	}
+	cellSize = extent / glm::vec3(resolution);
+	// Cells are grown by the triangle padding before the exact test, so it never drops a triangle the box test kept
+	auto overlapsCell = [&](size_t triangle, int x, int y, int z) {
+		const std::array<glm::vec3, 3> &vertices = triangles[triangle].vertices;
+		float padding = triangleMax[triangle].x - std::max(std::max(vertices[0].x, vertices[1].x), vertices[2].x);
+		glm::vec3 centre = boundsMin + (glm::vec3(x, y, z) + 0.5f) * cellSize;
+		return triangleOverlapsBox(triangles[triangle], centre, 0.5f * cellSize + padding);
+	};
+
+	// Two passes over the triangles: count the references per cell, then file them, so each cell's list is contiguous
+	// and in triangle order
+	auto cellRange = [&](size_t triangle, glm::ivec3 &low, glm::ivec3 &high) {
+		low = glm::clamp(glm::ivec3(glm::floor((triangleMin[triangle] - boundsMin) / cellSize)), glm::ivec3(0), resolution - 1);
+		high = glm::clamp(glm::ivec3(glm::floor((triangleMax[triangle] - boundsMin) / cellSize)), glm::ivec3(0), resolution - 1);
+	};
+	size_t cellCount = size_t(resolution.x) * resolution.y * resolution.z;
+	std::vector<uint32_t> offsets(cellCount + 1, 0);
+	for (size_t i = 0; i < triangles.size(); i++) {
+		glm::ivec3 low, high;
+		cellRange(i, low, high);
+		for (int z = low.z; z <= high.z; z++)
+			for (int y = low.y; y <= high.y; y++)
+				for (int x = low.x; x <= high.x; x++) {
+					if (overlapsCell(i, x, y, z)) offsets[cellIndex(x, y, z) + 1]++;
+				}
+	}
+	for (size_t cell = 0; cell < cellCount; cell++) offsets[cell + 1] += offsets[cell];
+	std::vector<uint32_t> references(offsets[cellCount]);
+	std::vector<uint32_t> filled(offsets.begin(), offsets.end() - 1);
+	for (size_t i = 0; i < triangles.size(); i++) {
+		glm::ivec3 low, high;
+		cellRange(i, low, high);
+		for (int z = low.z; z <= high.z; z++)
+			for (int y = low.y; y <= high.y; y++)
+				for (int x = low.x; x <= high.x; x++) {
+					if (overlapsCell(i, x, y, z)) references[filled[cellIndex(x, y, z)]++] = i;
+				}
+	}
+
+	cells.resize(cellCount);
+	for (size_t cell = 0; cell < cellCount; cell++) {
+		uint32_t count = offsets[cell + 1] - offsets[cell];
+		cells[cell].count = count;
+		cells[cell].first = count > 0 ? store.appendBlock(triangles, &references[offsets[cell]], count) : 0;
+		if (count == 0) stats.emptyCellCount++;
+		stats.maxCellSize = std::max<size_t>(stats.maxCellSize, count);
+	}
+
+	stats.resolution = resolution;
+	stats.cellCount = cellCount;
+	stats.referenceCount = references.size();
+	stats.bytes = cellCount * sizeof(Cell) + store.sizeInBytes();
+}
+
+template<typename Visitor>
+void UniformGrid::walk(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, float maxDistance, Visitor visit) const {
+	if (cells.empty()) return;
+	glm::vec3 inverseDirection = 1.0f / rayDirection;
+	glm::vec3 t0 = (boundsMin - rayOrigin) * inverseDirection;
+	glm::vec3 t1 = (boundsMax - rayOrigin) * inverseDirection;
+	glm::vec3 tNear = glm::min(t0, t1);
+	glm::vec3 tFar = glm::max(t0, t1);
+	float gridEntry = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+	float gridExit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, maxDistance));
+	if (gridEntry > gridExit) return;
+
+	// Amanatides and Woo: step into whichever neighbouring cell the ray reaches first
+	glm::vec3 start = rayOrigin + rayDirection * gridEntry;
+	int cell[3], step[3], stop[3];
+	float nextBoundary[3];
+	for (int axis = 0; axis < 3; axis++) {
+		cell[axis] = std::min(resolution[axis] - 1, std::max(0, int((start[axis] - boundsMin[axis]) / cellSize[axis])));
+		if (rayDirection[axis] > 0.0f) {
+			step[axis] = 1;
+			stop[axis] = resolution[axis];
+		} else if (rayDirection[axis] < 0.0f) {
+			step[axis] = -1;
+			stop[axis] = -1;
+		} else {
+			step[axis] = 0;
+			stop[axis] = -1;
+		}
+	}
+	// Boundaries are recomputed from the cell index rather than accumulated, so the distances don't drift
+	auto boundaryDistance = [&](int axis) {
+		if (step[axis] == 0) return std::numeric_limits<float>::infinity();
+		int boundary = step[axis] > 0 ? cell[axis] + 1 : cell[axis];
+		return (boundsMin[axis] + boundary * cellSize[axis] - rayOrigin[axis]) * inverseDirection[axis];
+	};
+	for (int axis = 0; axis < 3; axis++) nextBoundary[axis] = boundaryDistance(axis);
+
+	float entry = gridEntry;
+	while (true) {
+		int axis = nextBoundary[0] < nextBoundary[1] ? (nextBoundary[0] < nextBoundary[2] ? 0 : 2) : (nextBoundary[1] < nextBoundary[2] ? 1 : 2);
+		float exit = std::min(nextBoundary[axis], gridExit);
+		if (visit(cells[cellIndex(cell[0], cell[1], cell[2])], entry, exit)) return;
+		if (nextBoundary[axis] > gridExit) return;
+		cell[axis] += step[axis];
+		if (cell[axis] == stop[axis]) return;
+		entry = nextBoundary[axis];
+		nextBoundary[axis] = boundaryDistance(axis);
+	}
+}
+
+bool UniformGrid::intersect(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, float &t, float &u, float &v, size_t &triangleIndex,
+                            bool cullBackFaces) const {
+	float closestDistance = std::numeric_limits<float>::infinity();
+	size_t closestIndex = -1;
+	walk(rayOrigin, rayDirection, std::numeric_limits<float>::infinity(), [&](const Cell &cell, float, float exit) {
+		if (cell.count > 0) store.intersect(cell.first, cell.count, rayOrigin, rayDirection, closestDistance, closestIndex, u, v, cullBackFaces);
+		// A hit beyond this cell may still lose to a nearer one further along; one inside it can't. An exact tie on
+		// the far boundary walks on, so the lower triangle index in the next cell still gets its chance.
+		return closestDistance < exit;
+	});
+	if (closestIndex == size_t(-1)) return false;
+	t = closestDistance;
+	triangleIndex = closestIndex;
+	return true;
+}
+
+bool UniformGrid::occluded(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, float maxDistance, size_t ignoreIndex,
+                           bool cullBackFaces) const {
+	bool hit = false;
+	walk(rayOrigin, rayDirection, maxDistance, [&](const Cell &cell, float, float) {
+		hit = cell.count > 0 && store.occluded(cell.first, cell.count, rayOrigin, rayDirection, OCCLUSION_EPSILON, maxDistance, ignoreIndex, cullBackFaces);
+		return hit;
+	});
+	return hit;
+}
+
+const UniformGridStats &UniformGrid::getStats() const {
+	return stats;
+}
+
+size_t UniformGrid::getTriangleCount() const {
+	return stats.triangleCount;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+#include "ModelTriangle.h"
+#include "TriangleStore.h"
+
+struct UniformGridStats {
+	size_t triangleCount{};
+	glm::ivec3 resolution{};
+	size_t cellCount{};
+	size_t emptyCellCount{};
+	// Triangle references over all cells; a triangle is listed in every cell its box overlaps
+	size_t referenceCount{};
+	size_t maxCellSize{};
+	size_t bytes{};
+};
+
+std::ostream &operator<<(std::ostream &os, const UniformGridStats &stats);
+
+// Cells per triangle the grid resolution aims for
+const float GRID_CELLS_PER_TRIANGLE = 1.0f;
+
+// What chooseAccelerator looked at, kept so the choice can be logged
+struct AcceleratorStatistics {
+	size_t triangleCount{};
+	// Mean diagonal of the triangle boxes relative to the diagonal of the model's box
+	float relativeTriangleSize{};
+	// Standard deviation of the triangle box diagonals over their mean
+	float sizeVariation{};
+	bool preferGrid{};
+};
+
+std::ostream &operator<<(std::ostream &os, const AcceleratorStatistics &statistics);
+
+// Grids win for a few evenly sized triangles: there is no tree to descend and every step of the walk is a constant-time
+// move to the next cell. Many triangles, or sizes that vary a lot, favour the BVH.
+AcceleratorStatistics chooseAccelerator(TriangleView triangles);
+
+// Uniform grid over the model's box, walked cell by cell along the ray with a 3D-DDA. Each cell's triangles are a
+// block of a TriangleStore, so the cell test is the same 8-wide kernel as a BVH leaf and gives the same hits.
+class UniformGrid {
+public:
+	// Per axis, to keep the cell table bounded for huge or badly proportioned models
+	static const int MAX_RESOLUTION = 128;
+
+	UniformGrid();
+	explicit UniformGrid(TriangleView triangles, float cellsPerTriangle = GRID_CELLS_PER_TRIANGLE);
+
+	// The resolution is picked so there are about cellsPerTriangle cells per triangle, as close to cubes as the box allows
+	void build(TriangleView triangles, float cellsPerTriangle = GRID_CELLS_PER_TRIANGLE);
+	// Same results as BVH::intersect, including the tie rule
+	bool intersect(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, float &t, float &u, float &v, size_t &triangleIndex,
+	               bool cullBackFaces = false) const;
+	// Same results as BVH::occluded
+	bool occluded(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, float maxDistance, size_t ignoreIndex,
+	              bool cullBackFaces = false) const;
+	const UniformGridStats &getStats() const;
+	size_t getTriangleCount() const;
+
+private:
+	struct Cell {
+		// Slot of the cell's first triangle in the store, and how many it has
+		uint32_t first;
+		uint32_t count;
+	};
+
+	glm::vec3 boundsMin{};
+	glm::vec3 boundsMax{};
+	glm::vec3 cellSize{};
+	glm::ivec3 resolution{};
+	std::vector<Cell> cells;
+	TriangleStore store;
+	UniformGridStats stats;
+
+	size_t cellIndex(int x, int y, int z) const { return (size_t(z) * resolution.y + y) * resolution.x + x; }
+	// Walks the cells the ray passes through in order, calling visit(cell, entryDistance, exitDistance) until it
+	// returns true or the ray leaves the grid or passes maxDistance
+	template<typename Visitor>
+	void walk(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, float maxDistance, Visitor visit) const;
+};
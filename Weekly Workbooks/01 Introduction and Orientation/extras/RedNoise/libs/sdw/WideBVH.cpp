@@ -0,0 +1,324 @@
+#include "WideBVH.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Every wide level replaces at least one binary level, and a node pushes at most WIDTH - 1 entries more than it pops
+const size_t STACK_SIZE = (WideBVHNode::WIDTH - 1) * (BVH::MAX_DEPTH + 2) + 1;
+
+// Built straight from the exponent bits, exponent has to be in [-126, 127]
+float powerOfTwo(int exponent) {
+	uint32_t bits = uint32_t(exponent + 127) << 23;
+	float result;
+	std::memcpy(&result, &bits, sizeof(result));
+	return result;
+}
+
+float surfaceArea(const glm::vec3 &boundsMin, const glm::vec3 &boundsMax) {
+	glm::vec3 extent = boundsMax - boundsMin;
+	return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+struct StackEntry {
+	// Interior entries: index of a wide node. Leaf entries: first slot in the TriangleStore.
+	uint32_t index;
+	// Zero for interior entries
+	uint32_t triangleCount;
+	float entryDistance;
+};
+
+}
+
+std::ostream &operator<<(std::ostream &os, const WideBVHStats &stats) {
+	float triangleCount = std::max<size_t>(stats.triangleCount, 1);
+	os << stats.triangleCount << " triangles, " << stats.nodeCount << " nodes (" << stats.leafCount << " leaves, "
+	   << stats.fillRate << " children per node), " << stats.nodeBytes / triangleCount << " node bytes and "
+	   << stats.triangleBytes / triangleCount << " triangle bytes per triangle";
+	return os;
+}
+
+WideBVH::WideBVH() = default;
+
+WideBVH::WideBVH(const BVH &bvh) {
+	build(bvh);
+}
+
+void WideBVH::build(const BVH &bvh) {
+	ArrayView<BVHNode> binaryNodes = bvh.getNodes();
+	nodes.clear();
+	savedNodes = ArrayView<WideBVHNode>();
+	store.view(bvh.getStore());
+	sourceRevision = bvh.getRevision();
+	stats = WideBVHStats();
+	stats.triangleCount = bvh.getTriangleCount();
+	if (binaryNodes.empty()) return;
+
+	// Collapsing at least halves the node count (a wide node never has fewer than two children unless it is a lone leaf)
+	nodes.reserve(binaryNodes.size() / 2 + 1);
+	collapse(binaryNodes, 0);
+	updateStats();
+}
+
+bool WideBVH::restore(const BVH &bvh, ArrayView<WideBVHNode> saved) {
+	nodes.clear();
+	savedNodes = ArrayView<WideBVHNode>();
+	store.view(bvh.getStore());
+	sourceRevision = bvh.getRevision();
+	stats = WideBVHStats();
+	stats.triangleCount = bvh.getTriangleCount();
+
+	// Children come after their parent, as collapse adds them, so the walk can't loop and a node's depth is final by
+	// the time it is reached. Every wide level pushes at most WIDTH - 1 entries more than it pops, which STACK_SIZE
+	// allows for down to BVH::MAX_DEPTH + 2 levels.
+	bool valid = saved.empty() == bvh.getNodes().empty();
+	std::vector<size_t> depths(saved.size(), 1);
+	for (uint32_t i = 0; valid && i < saved.size(); i++) {
+		const WideBVHNode &node = saved[i];
+		valid = depths[i] <= BVH::MAX_DEPTH + 2;
+		for (size_t child = 0; valid && child < WideBVHNode::WIDTH; child++) {
+			if (!(node.childMask & (1u << child))) continue;
+			if (node.isLeaf(child)) {
+				size_t paddedCount = (size_t(node.triangleCount[child]) + TriangleStore::LANES - 1) / TriangleStore::LANES * TriangleStore::LANES;
+				valid = node.child[child] % TriangleStore::LANES == 0 && node.child[child] + paddedCount <= store.size();
+			} else {
+				valid = node.child[child] > i && node.child[child] < saved.size();
+				if (valid) depths[node.child[child]] = std::max(depths[node.child[child]], depths[i] + 1);
+			}
+		}
+	}
+	if (!valid) {
+		store.clear();
+		stats = WideBVHStats();
+		return false;
+	}
+	savedNodes = saved;
+	if (!saved.empty()) updateStats();
+	return true;
+}
+
+void WideBVH::updateStats() {
+	ArrayView<WideBVHNode> tree = getNodes();
+	size_t childCount = 0;
+	for (const WideBVHNode &node : tree) {
+		for (size_t i = 0; i < WideBVHNode::WIDTH; i++) {
+			if (!(node.childMask & (1u << i))) continue;
+			childCount++;
+			if (node.isLeaf(i)) stats.leafCount++;
+		}
+	}
+	stats.nodeCount = tree.size();
+	stats.fillRate = float(childCount) / tree.size();
+	stats.nodeBytes = tree.size() * sizeof(WideBVHNode);
+	stats.triangleBytes = store.sizeInBytes();
+}
+
+uint32_t WideBVH::collapse(ArrayView<BVHNode> binaryNodes, uint32_t binaryIndex) {
+	uint32_t wideIndex = nodes.size();
+	nodes.emplace_back();
+
+	// Open up the interior child with the largest surface area until the node is full, a binary leaf at the root
+	// simply becomes the only child
+	std::vector<uint32_t> children;
+	if (binaryNodes[binaryIndex].isLeaf()) {
+		children.push_back(binaryIndex);
+	} else {
+		children.push_back(binaryNodes[binaryIndex].leftFirst);
+		children.push_back(binaryNodes[binaryIndex].leftFirst + 1);
+	}
+	while (children.size() < WideBVHNode::WIDTH) {
+		int largest = -1;
+		float largestArea = -1.0f;
+		for (size_t i = 0; i < children.size(); i++) {
+			const BVHNode &child = binaryNodes[children[i]];
+			if (child.isLeaf()) continue;
+			float area = surfaceArea(child.boundsMin, child.boundsMax);
+			if (area > largestArea) {
+				largest = i;
+				largestArea = area;
+			}
+		}
+		if (largest == -1) break;
+		uint32_t opened = children[largest];
+		children[largest] = binaryNodes[opened].leftFirst;
+		children.insert(children.begin() + largest + 1, binaryNodes[opened].leftFirst + 1);
+	}
+
+	glm::vec3 boundsMin = binaryNodes[binaryIndex].boundsMin;
+	glm::vec3 boundsMax = binaryNodes[binaryIndex].boundsMax;
+	glm::vec3 step;
+	{
+		WideBVHNode &node = nodes[wideIndex];
+		node.origin = boundsMin;
+		for (int axis = 0; axis < 3; axis++) {
+			// Smallest power of two that spans the node in 255 steps
+			float extent = boundsMax[axis] - boundsMin[axis];
+			int exponent = extent > 0.0f ? int(std::ceil(std::log2(extent / 255.0f))) : -126;
+			exponent = std::max(-126, std::min(127, exponent));
+			while (exponent < 127 && powerOfTwo(exponent) * 255.0f < extent) exponent++;
+			node.exponent[axis] = exponent;
+			step[axis] = powerOfTwo(exponent);
+		}
+	}
+
+	for (size_t i = 0; i < children.size(); i++) {
+		const BVHNode &child = binaryNodes[children[i]];
+		uint32_t childIndex = child.isLeaf() ? child.leftFirst : collapse(binaryNodes, children[i]);
+		// collapse may have grown the vector, so the node is looked up again
+		WideBVHNode &node = nodes[wideIndex];
+		node.childMask |= 1u << i;
+		node.child[i] = childIndex;
+		node.triangleCount[i] = child.isLeaf() ? child.triangleCount : 0;
+		for (int axis = 0; axis < 3; axis++) {
+			// Round outwards, then make sure the decoded box (computed exactly as traversal does) still contains the child
+			int low = int(std::floor((child.boundsMin[axis] - node.origin[axis]) / step[axis]));
+			int high = int(std::ceil((child.boundsMax[axis] - node.origin[axis]) / step[axis]));
+			low = std::max(0, std::min(255, low));
+			high = std::max(0, std::min(255, high));
+			while (low > 0 && node.origin[axis] + float(low) * step[axis] > child.boundsMin[axis]) low--;
+			while (high < 255 && node.origin[axis] + float(high) * step[axis] < child.boundsMax[axis]) high++;
+			node.quantizedMin[axis][i] = low;
+			node.quantizedMax[axis][i] = high;
+		}
+	}
+	return wideIndex;
+}
+
+#ifdef __AVX2__
+
+uint32_t WideBVH::intersectChildren(const WideBVHNode &node, const glm::vec3 &rayOrigin, const glm::vec3 &inverseDirection,
+                                    float maxDistance, float *entryDistances) const {
+	__m256 tNear[3], tFar[3];
+	for (int axis = 0; axis < 3; axis++) {
+		__m256 step = _mm256_set1_ps(powerOfTwo(node.exponent[axis]));
+		__m256 origin = _mm256_set1_ps(node.origin[axis]);
+		__m256 low = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(node.quantizedMin[axis]))));
+		__m256 high = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(node.quantizedMax[axis]))));
+		low = _mm256_add_ps(origin, _mm256_mul_ps(low, step));
+		high = _mm256_add_ps(origin, _mm256_mul_ps(high, step));
+		__m256 inverse = _mm256_set1_ps(inverseDirection[axis]);
+		__m256 rayStart = _mm256_set1_ps(rayOrigin[axis]);
+		__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(low, rayStart), inverse);
+		__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(high, rayStart), inverse);
+		tNear[axis] = _mm256_min_ps(t0, t1);
+		tFar[axis] = _mm256_max_ps(t0, t1);
+	}
+	__m256 tEnter = _mm256_max_ps(_mm256_max_ps(tNear[0], tNear[1]), _mm256_max_ps(tNear[2], _mm256_setzero_ps()));
+	__m256 tExit = _mm256_min_ps(_mm256_min_ps(tFar[0], tFar[1]), _mm256_min_ps(tFar[2], _mm256_set1_ps(maxDistance)));
+	_mm256_storeu_ps(entryDistances, tEnter);
+	return uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(tEnter, tExit, _CMP_LE_OQ))) & node.childMask;
+}
+
+#else
+
+uint32_t WideBVH::intersectChildren(const WideBVHNode &node, const glm::vec3 &rayOrigin, const glm::vec3 &inverseDirection,
+                                    float maxDistance, float *entryDistances) const {
+	glm::vec3 step(powerOfTwo(node.exponent[0]), powerOfTwo(node.exponent[1]), powerOfTwo(node.exponent[2]));
+	uint32_t mask = 0;
+	for (size_t i = 0; i < WideBVHNode::WIDTH; i++) {
+		if (!(node.childMask & (1u << i))) continue;
+		glm::vec3 low(node.quantizedMin[0][i], node.quantizedMin[1][i], node.quantizedMin[2][i]);
+		glm::vec3 high(node.quantizedMax[0][i], node.quantizedMax[1][i], node.quantizedMax[2][i]);
+		glm::vec3 t0 = (node.origin + low * step - rayOrigin) * inverseDirection;
+		glm::vec3 t1 = (node.origin + high * step - rayOrigin) * inverseDirection;
+		glm::vec3 tNear = glm::min(t0, t1);
+		glm::vec3 tFar = glm::max(t0, t1);
+		float tEnter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+		float tExit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, maxDistance));
+		entryDistances[i] = tEnter;
+		if (tEnter <= tExit) mask |= 1u << i;
+	}
+	return mask;
+}
+
+#endif
+
+bool WideBVH::intersect(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, float &t, float &u, float &v, size_t &triangleIndex,
+                        bool cullBackFaces) const {
+	ArrayView<WideBVHNode> tree = getNodes();
+	if (tree.empty()) return false;
+	glm::vec3 inverseDirection = 1.0f / rayDirection;
+	float closestDistance = std::numeric_limits<float>::infinity();
+	size_t closestIndex = -1;
+	float entryDistances[WideBVHNode::WIDTH];
+
+	StackEntry stack[STACK_SIZE];
+	size_t stackSize = 0;
+	stack[stackSize++] = {0, 0, 0.0f};
+
+	while (stackSize > 0) {
+		StackEntry entry = stack[--stackSize];
+		if (entry.entryDistance > closestDistance) continue;
+		if (entry.triangleCount > 0) {
+			store.intersect(entry.index, entry.triangleCount, rayOrigin, rayDirection, closestDistance, closestIndex, u, v, cullBackFaces);
+			continue;
+		}
+
+		const WideBVHNode &node = tree[entry.index];
+		uint32_t mask = intersectChildren(node, rayOrigin, inverseDirection, closestDistance, entryDistances);
+		// Push the children that were hit far to near, so the nearest one is traversed first
+		size_t first = stackSize;
+		for (size_t i = 0; i < WideBVHNode::WIDTH; i++) {
+			if (!(mask & (1u << i))) continue;
+			StackEntry childEntry = {node.child[i], node.triangleCount[i], entryDistances[i]};
+			size_t position = stackSize++;
+			while (position > first && stack[position - 1].entryDistance < childEntry.entryDistance) {
+				stack[position] = stack[position - 1];
+				position--;
+			}
+			stack[position] = childEntry;
+		}
+	}
+
+	if (closestIndex == size_t(-1)) return false;
+	t = closestDistance;
+	triangleIndex = closestIndex;
+	return true;
+}
+
+bool WideBVH::occluded(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, float maxDistance, size_t ignoreIndex,
+                       bool cullBackFaces) const {
+	ArrayView<WideBVHNode> tree = getNodes();
+	if (tree.empty()) return false;
+	glm::vec3 inverseDirection = 1.0f / rayDirection;
+	float entryDistances[WideBVHNode::WIDTH];
+
+	StackEntry stack[STACK_SIZE];
+	size_t stackSize = 0;
+	stack[stackSize++] = {0, 0, 0.0f};
+
+	while (stackSize > 0) {
+		StackEntry entry = stack[--stackSize];
+		if (entry.triangleCount > 0) {
+			if (store.occluded(entry.index, entry.triangleCount, rayOrigin, rayDirection, OCCLUSION_EPSILON, maxDistance, ignoreIndex, cullBackFaces)) return true;
+			continue;
+		}
+		const WideBVHNode &node = tree[entry.index];
+		uint32_t mask = intersectChildren(node, rayOrigin, inverseDirection, maxDistance, entryDistances);
+		for (size_t i = 0; i < WideBVHNode::WIDTH; i++) {
+			if (mask & (1u << i)) stack[stackSize++] = {node.child[i], node.triangleCount[i], 0.0f};
+		}
+	}
+	return false;
+}
+
+const WideBVHStats &WideBVH::getStats() const {
+	return stats;
+}
+
+size_t WideBVH::getTriangleCount() const {
+	return stats.triangleCount;
+}
+
+ArrayView<WideBVHNode> WideBVH::getNodes() const {
+	return savedNodes.empty() ? ArrayView<WideBVHNode>(nodes) : savedNodes;
+}
+
+size_t WideBVH::getSourceRevision() const {
+	return sourceRevision;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+#include "ArrayView.h"
+#include "BVH.h"
+#include "TriangleStore.h"
+
+// Eight children per node. Child boxes are stored as 8-bit offsets on a power-of-two grid anchored at the node's own
+// minimum corner, rounded outwards so a decoded box always contains the exact one; a node is two cache lines.
+struct alignas(64) WideBVHNode {
+	static const size_t WIDTH = 8;
+
+	glm::vec3 origin{};
+	// The grid step on each axis is 2^exponent
+	int8_t exponent[3]{};
+	// Bit i is set if child i exists
+	uint8_t childMask{};
+	uint8_t quantizedMin[3][WIDTH]{};
+	uint8_t quantizedMax[3][WIDTH]{};
+	// Interior children: index of the child node. Leaves: slot of the first triangle in the BVH's TriangleStore.
+	uint32_t child[WIDTH]{};
+	// Zero for interior children
+	uint16_t triangleCount[WIDTH]{};
+
+	bool isLeaf(size_t i) const { return triangleCount[i] > 0; }
+};
+
+struct WideBVHStats {
+	size_t triangleCount{};
+	size_t nodeCount{};
+	size_t leafCount{};
+	// Average number of children per node
+	float fillRate{};
+	size_t nodeBytes{};
+	size_t triangleBytes{};
+};
+
+std::ostream &operator<<(std::ostream &os, const WideBVHStats &stats);
+
+// A BVH8 collapsed from a binary BVH, sharing its packed triangles. Single rays test all eight children of a node with
+// one slab test, which keeps the nodes a ray touches small enough to stay in cache for scenes of several meshes.
+// The arrays of the BVH it was built from have to outlive it (the BVH itself may move), and the wide tree has to be
+// built again whenever that BVH is rebuilt or refitted (see getSourceRevision).
+class WideBVH {
+public:
+	WideBVH();
+	explicit WideBVH(const BVH &bvh);
+
+	void build(const BVH &bvh);
+	// Takes back a tree saved from getNodes (see ModelCache) for the BVH it was built from instead of building it again,
+	// and reads it where it lies, so savedNodes has to outlive it. Returns false, leaving the wide BVH empty, if they
+	// do not describe a tree over that BVH's store which the traversal stack has room for.
+	bool restore(const BVH &bvh, ArrayView<WideBVHNode> savedNodes);
+	// Same results as BVH::intersect, including the tie rule
+	bool intersect(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, float &t, float &u, float &v, size_t &triangleIndex,
+	               bool cullBackFaces = false) const;
+	// Same results as BVH::occluded
+	bool occluded(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, float maxDistance, size_t ignoreIndex,
+	              bool cullBackFaces = false) const;
+	const WideBVHStats &getStats() const;
+	size_t getTriangleCount() const;
+	ArrayView<WideBVHNode> getNodes() const;
+	// BVH::getRevision() of the BVH at the time this was built from it
+	size_t getSourceRevision() const;
+
+private:
+	std::vector<WideBVHNode, AlignedAllocator<WideBVHNode, alignof(WideBVHNode)>> nodes;
+	// The tree restore was given, read in place of nodes
+	ArrayView<WideBVHNode> savedNodes;
+	// Views the BVH's store
+	TriangleStore store;
+	WideBVHStats stats;
+	size_t sourceRevision = 0;
+
+	uint32_t collapse(ArrayView<BVHNode> binaryNodes, uint32_t binaryIndex);
+	void updateStats();
+	// Entry distances of all children of a node, and the mask of those the ray enters before maxDistance
+	uint32_t intersectChildren(const WideBVHNode &node, const glm::vec3 &rayOrigin, const glm::vec3 &inverseDirection,
+	                           float maxDistance, float *entryDistances) const;
+};
@@ -11,9 +11,34 @@
 #include <map>
 #include "TextureMap.h"
 #include "ModelTriangle.h"
+#include "HitRecord.h"
 #include "RayTriangleIntersection.h"
+#include "BVH.h"
+#include "ModelCache.h"
+#include "RayPacket.h"
+#include "RayQueue.h"
+#include "RayStack.h"
+#include "Random.h"
+#include "Sphere.h"
+#include "WideBVH.h"
+#include "TLAS.h"
+#include "JobSystem.h"
+#include "TilePool.h"
+#include "TriangleBins.h"
+#include "RenderFarm.h"
+#include "RenderThread.h"
+#include "SampleLattice.h"
+#include "ShadingBatch.h"
+#include "UniformGrid.h"
+#include <glm/gtc/matrix_transform.hpp>
+#include <chrono>
+#include <cctype>
+#include <cerrno>
 #include <cmath>
+#include <memory>
+#include <mutex>
 #include <numeric>
+#include <thread>
 
 
 #define WIDTH 320
@@ -318,6 +343,134 @@ struct Material {
     std::string texturePath;
 };
 
+float triangleArea(const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c) {
+    return glm::length(glm::cross(b - a, c - a)) / 2.0f;
+}
+
+struct VertexOrder {
+    bool operator()(const glm::vec3 &a, const glm::vec3 &b) const {
+        return a.x != b.x ? a.x < b.x : a.y != b.y ? a.y < b.y : a.z < b.z;
+    }
+};
+
+// Gives every corner the area-weighted average of the normals of all triangles that share its position,
+// summed in triangle order so smooth shading comes out exactly as it did when this was worked out per pixel
+void calculateVertexNormals(std::vector<ModelTriangle> &triangles) {
+    struct Sum {
+        glm::vec3 normal{0.0f};
+        float area = 0.0f;
+    };
+    std::map<glm::vec3, Sum, VertexOrder> sums;
+    for (const ModelTriangle &triangle : triangles) {
+        const std::array<glm::vec3, 3> &v = triangle.vertices;
+        float area = triangleArea(v[0], v[1], v[2]);
+        for (int i = 0; i < 3; i++) {
+            // A corner repeated within one triangle still only counts that triangle once
+            if ((i > 0 && v[i] == v[0]) || (i > 1 && v[i] == v[1])) continue;
+            Sum &sum = sums[v[i]];
+            sum.area += area;
+            sum.normal += area * triangle.normal;
+        }
+    }
+    for (ModelTriangle &triangle : triangles) {
+        for (int i = 0; i < 3; i++) {
+            const Sum &sum = sums[triangle.vertices[i]];
+            glm::vec3 normal = sum.normal;
+            if (sum.area > 0.0f) normal /= sum.area;
+            triangle.vertexNormals[i] = glm::normalize(normal);
+        }
+    }
+}
+
+// Every model's BVH, looked up by the address of its triangle storage (see findBVH)
+std::map<const ModelTriangle *, BVH> &loadedBVHs() {
+    static std::map<const ModelTriangle *, BVH> bvhs;
+    return bvhs;
+}
+
+// Every model's wide BVH, filed the same way (see getWideBVH)
+std::map<const ModelTriangle *, WideBVH> &loadedWideBVHs() {
+    static std::map<const ModelTriangle *, WideBVH> wideBvhs;
+    return wideBvhs;
+}
+
+// A model's triangles are either a section of its cache file, mapped read-only and shared with every other process
+// that maps the same cache, or a vector of their own once the model has been parsed or edited
+struct LoadedModel {
+    std::shared_ptr<const void> mapping;
+    std::vector<ModelTriangle> ownTriangles;
+    TriangleView triangles;
+};
+
+// Every model is loaded once and then kept for the rest of the run, so the render functions can ask for it
+// each frame without re-reading the file and its acceleration structures (see getBVH) are only built once.
+// The triangles and both BVHs are also kept on disk beside the OBJ, keyed by a hash of the OBJ and MTL, so later
+// runs trace them straight from a mapping of that file without parsing, building or copying anything until either
+// file changes.
+LoadedModel &findModel(const std::string &filename, const std::string &mtlFilename, bool withTexture) {
+    static std::map<std::string, LoadedModel> loadedModels;
+    const std::string loader = withTexture ? "textured" : "plain";
+    const std::string key = filename + "#" + loader;
+    auto it = loadedModels.find(key);
+    if (it != loadedModels.end()) return it->second;
+
+    LoadedModel &model = loadedModels[key];
+    const BVHBuildOptions options;
+    const std::string cacheFilename = filename + "." + loader + ".cache";
+    const uint64_t cacheKey = modelCacheKey({filename, mtlFilename}, loader, options);
+    CachedModel cached;
+    auto start = std::chrono::steady_clock::now();
+    if (loadModelCache(cacheFilename, cacheKey, options, cached)) {
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Mapped " << cacheFilename << " in " << ms << " ms: " << cached.bvh.getStats() << std::endl;
+        model.mapping = cached.mapping;
+        model.triangles = cached.triangles;
+        loadedBVHs()[model.triangles.data()] = std::move(cached.bvh);
+        loadedWideBVHs()[model.triangles.data()] = std::move(cached.wideBVH);
+        return model;
+    }
+    const std::map<std::string, Colour> palette = loadMTL(mtlFilename);
+    model.ownTriangles = withTexture ? loadOBJWithTexture(filename, palette) : loadOBJ(filename, palette);
+    calculateVertexNormals(model.ownTriangles);
+    model.triangles = model.ownTriangles;
+    BVH &bvh = loadedBVHs()[model.triangles.data()];
+    bvh.build(model.triangles, options);
+    std::cout << "Built BVH: " << bvh.getStats() << std::endl;
+    WideBVH &wideBvh = loadedWideBVHs()[model.triangles.data()];
+    wideBvh.build(bvh);
+    std::cout << "Built wide BVH: " << wideBvh.getStats() << std::endl;
+    if (!saveModelCache(cacheFilename, cacheKey, model.triangles, bvh, wideBvh)) {
+        std::cout << "Could not write " << cacheFilename << std::endl;
+    }
+    return model;
+}
+
+TriangleView loadModel(const std::string &filename, const std::string &mtlFilename, bool withTexture) {
+    return findModel(filename, mtlFilename, withTexture).triangles;
+}
+
+// The triangles of a loaded model to move in place, which then have to be passed to refitBVH. A model mapped from its
+// cache is copied out of the mapping first, since that is read-only and shared; its BVH comes along and keeps reading
+// the mapping until the first refit gives it arrays of its own.
+std::vector<ModelTriangle> &editModel(const std::string &filename, const std::string &mtlFilename, bool withTexture) {
+    LoadedModel &model = findModel(filename, mtlFilename, withTexture);
+    if (model.triangles.data() != model.ownTriangles.data()) {
+        model.ownTriangles.assign(model.triangles.begin(), model.triangles.end());
+        std::map<const ModelTriangle *, BVH> &bvhs = loadedBVHs();
+        bvhs[model.ownTriangles.data()] = bvhs[model.triangles.data()];
+        model.triangles = model.ownTriangles;
+    }
+    return model.ownTriangles;
+}
+
+// Textures are decoded once and kept for the rest of the run, like models
+TextureMap &loadTexture(const std::string &filename) {
+    static std::map<std::string, TextureMap> loadedTextures;
+    auto it = loadedTextures.find(filename);
+    if (it == loadedTextures.end()) it = loadedTextures.emplace(filename, TextureMap(filename)).first;
+    return it->second;
+}
+
 
 
 
@@ -355,7 +508,11 @@ void drawLineWithDepth(DrawingWindow &window, const CanvasPoint &start, const Ca
 }
 
 
-void fillTriangle(DrawingWindow &window, const CanvasTriangle &triangle, const Colour &color, std::vector<std::vector<float>>& depthBuffer) {
+// Calls drawSpan(start, end) for each span fillTriangle draws, left to right, in the rows from firstRow to lastRow. The
+// binned rasteriser fills a triangle one bin at a time with the rows of the bin, which gives the pixels of exactly the
+// spans filling it whole would.
+template<typename DrawSpan>
+void forEachFilledSpan(const CanvasTriangle &triangle, int firstRow, int lastRow, DrawSpan drawSpan) {
     std::array<CanvasPoint, 3> sortedVertices = getSortedVertices(triangle);
 
         auto computeIntersection = [](const CanvasPoint &a, const CanvasPoint &b, float y) {
@@ -370,7 +527,7 @@ void fillTriangle(DrawingWindow &window, const CanvasTriangle &triangle, const C
             };
         };
 
-    for (float y = std::round(sortedVertices[0].y); y <= sortedVertices[1].y; y += 1.0f) {
+    for (float y = std::max(std::round(sortedVertices[0].y), float(firstRow)); y <= std::min(sortedVertices[1].y, float(lastRow)); y += 1.0f) {
         int yInt = std::round(y);
         CanvasPoint start = computeIntersection(sortedVertices[0], sortedVertices[2], yInt);
         CanvasPoint end = computeIntersection(sortedVertices[0], sortedVertices[1], yInt);
@@ -381,12 +538,12 @@ void fillTriangle(DrawingWindow &window, const CanvasTriangle &triangle, const C
 
         if (start.x > end.x) std::swap(start, end);
         if (start.x != end.x) {
-            drawLineWithDepth(window, start, end, color, depthBuffer);
+            drawSpan(start, end);
         }
     }
 
 
-    for (float y = std::round(sortedVertices[1].y); y <= sortedVertices[2].y; y += 1.0f) {
+    for (float y = std::max(std::round(sortedVertices[1].y), float(firstRow)); y <= std::min(sortedVertices[2].y, float(lastRow)); y += 1.0f) {
         int yInt = std::round(y);
         CanvasPoint start = computeIntersection(sortedVertices[1], sortedVertices[2], yInt);
         CanvasPoint end = computeIntersection(sortedVertices[0], sortedVertices[2], yInt);
@@ -395,11 +552,17 @@ void fillTriangle(DrawingWindow &window, const CanvasTriangle &triangle, const C
         end.x = std::max(std::min(end.x, std::max(sortedVertices[0].x, sortedVertices[2].x)), std::min(sortedVertices[0].x, sortedVertices[2].x));
 
         if (start.x > end.x) std::swap(start, end);
-        drawLineWithDepth(window, start, end, color, depthBuffer);
+        drawSpan(start, end);
     }
 
 }
 
+void fillTriangle(DrawingWindow &window, const CanvasTriangle &triangle, const Colour &color, std::vector<std::vector<float>>& depthBuffer) {
+    forEachFilledSpan(triangle, std::numeric_limits<int>::min(), std::numeric_limits<int>::max(), [&](const CanvasPoint &start, const CanvasPoint &end) {
+        drawLineWithDepth(window, start, end, color, depthBuffer);
+    });
+}
+
 
 
 
@@ -438,7 +601,10 @@ void drawTexLineWithDepth(DrawingWindow &window, const CanvasPoint &start, const
 
 
 
-void fillTexturedTriangle(DrawingWindow &window, const CanvasTriangle &triangle, TextureMap &textureMap, std::vector<std::vector<float>>& depthBuffer) {
+// Calls drawSpan(start, end) for each span fillTexturedTriangle draws in the rows from firstRow to lastRow, as
+// forEachFilledSpan does for fillTriangle
+template<typename DrawSpan>
+void forEachTexturedSpan(const CanvasTriangle &triangle, int firstRow, int lastRow, DrawSpan drawSpan) {
     std::array<CanvasPoint, 3> sortedVertices = getSortedVertices(triangle);
 
     auto computeIntersection = [](const CanvasPoint &a, const CanvasPoint &b, float y) -> CanvasPoint {
@@ -454,7 +620,7 @@ void fillTexturedTriangle(DrawingWindow &window, const CanvasTriangle &triangle,
     };
 
 
-    for (int y = static_cast<int>(sortedVertices[0].y); y < static_cast<int>(sortedVertices[1].y); y++) {
+    for (int y = std::max(static_cast<int>(sortedVertices[0].y), firstRow); y < static_cast<int>(sortedVertices[1].y) && y <= lastRow; y++) {
         CanvasPoint start = computeIntersection(sortedVertices[0], sortedVertices[2], y);
         CanvasPoint end = computeIntersection(sortedVertices[0], sortedVertices[1], y);
 
@@ -462,10 +628,10 @@ void fillTexturedTriangle(DrawingWindow &window, const CanvasTriangle &triangle,
             std::swap(start, end);
         }
 
-        drawTexLineWithDepth(window, start, end, textureMap,depthBuffer);
+        drawSpan(start, end);
     }
 
-    for (int y = static_cast<int>(sortedVertices[1].y); y <= static_cast<int>(sortedVertices[2].y); y++) {
+    for (int y = std::max(static_cast<int>(sortedVertices[1].y), firstRow); y <= static_cast<int>(sortedVertices[2].y) && y <= lastRow; y++) {
         CanvasPoint start = computeIntersection(sortedVertices[0], sortedVertices[2], y);
         CanvasPoint end = computeIntersection(sortedVertices[1], sortedVertices[2], y);
 
@@ -473,11 +639,17 @@ void fillTexturedTriangle(DrawingWindow &window, const CanvasTriangle &triangle,
             std::swap(start, end);
         }
 
-        drawTexLineWithDepth(window, start, end, textureMap,depthBuffer);
+        drawSpan(start, end);
     }
 
 }
 
+void fillTexturedTriangle(DrawingWindow &window, const CanvasTriangle &triangle, TextureMap &textureMap, std::vector<std::vector<float>>& depthBuffer) {
+    forEachTexturedSpan(triangle, std::numeric_limits<int>::min(), std::numeric_limits<int>::max(), [&](const CanvasPoint &start, const CanvasPoint &end) {
+        drawTexLineWithDepth(window, start, end, textureMap, depthBuffer);
+    });
+}
+
 
 
 glm::mat3 rotationY(float angle) {
@@ -521,6 +693,13 @@ CanvasPoint getCanvasIntersectionPoint(const glm::vec3& cameraPosition, const gl
     return CanvasPoint(x, y, relativeVertex.z);
 }
 
+// True if the camera sees the back of the triangle, the side edge0 x edge1 points away from (the same test the ray
+// traced primary rays cull with). Glass is seen from both sides and never faces away.
+bool isFacingAway(const ModelTriangle &triangle, const glm::vec3 &cameraPosition) {
+    if (triangle.isGlass) return false;
+    return glm::dot(glm::cross(triangle.edge0, triangle.edge1), cameraPosition - triangle.vertices[0]) <= 0.0f;
+}
+
 
 void animateCameraOrbit(glm::vec3 &cameraPosition) {
     float rotationAmount = glm::radians(0.01f);
@@ -638,7 +817,22 @@ void fillTexturedTriangleWithDepth(DrawingWindow &window, const CanvasTriangle &
 }
 
 
+// The lattice of the image the window being rendered stands for while a progressive preview or a render farm tile draws
+// it, see renderProgressively and renderFarmTile; an empty one means the window is the image
+SampleLattice renderLattice;
+
+// Turns pixel (x, y) of a screenWidth x screenHeight window into the pixel of the image it stands for, and the size into
+// the image's
+void toImagePixel(int &x, int &y, int &screenWidth, int &screenHeight) {
+    if (renderLattice.imageWidth == 0) return;
+    x = int(renderLattice.offsetX + x * renderLattice.step);
+    y = int(renderLattice.offsetY + y * renderLattice.step);
+    screenWidth = int(renderLattice.imageWidth);
+    screenHeight = int(renderLattice.imageHeight);
+}
+
 glm::vec3 getRayDirectionFromPixel(int x, int y, int screenWidth, int screenHeight, float focalLength, const glm::vec3& cameraPosition) {
+    toImagePixel(x, y, screenWidth, screenHeight);
 
     glm::vec3 Point;
     float scaleFactor = 60.0f;
@@ -650,46 +844,198 @@ glm::vec3 getRayDirectionFromPixel(int x, int y, int screenWidth, int screenHeig
     return NormalizeRayDirection;
 }
 
+// BVHs are built the first time a model is traced and looked up by the address of its triangle storage,
+// so a triangle vector must stay alive for as long as it is being rendered, and any triangle that moves
+// has to be passed to refitBVH before the next frame.
+BVH &findBVH(TriangleView triangles) {
+    std::map<const ModelTriangle *, BVH> &bvhs = loadedBVHs();
+    auto it = bvhs.find(triangles.data());
+    if (it == bvhs.end() || it->second.getTriangleCount() != triangles.size()) {
+        BVH &bvh = bvhs[triangles.data()];
+        bvh.build(triangles);
+        std::cout << "Built BVH: " << bvh.getStats() << std::endl;
+        return bvh;
+    }
+    return it->second;
+}
+
+const BVH &getBVH(TriangleView triangles) {
+    return findBVH(triangles);
+}
+
+// Fits the model's BVH around triangles [first, first + count) after they have moved, touching only their leaves
+// and the nodes above them. The BVH is rebuilt instead once refitting has degraded it too far.
+void refitBVH(TriangleView triangles, size_t first, size_t count) {
+    BVH &bvh = findBVH(triangles);
+    if (bvh.update(triangles, first, count)) {
+        std::cout << "Rebuilt BVH: " << bvh.getStats() << std::endl;
+    } else {
+        std::cout << "Refit BVH, SAH cost " << bvh.getStats().sahCost << std::endl;
+    }
+}
+
+// Single rays go through an eight-wide version of the same BVH, packets keep using the binary one (see getBVH)
+const WideBVH &getWideBVH(TriangleView triangles) {
+    std::map<const ModelTriangle *, WideBVH> &wideBvhs = loadedWideBVHs();
+    const BVH &bvh = getBVH(triangles);
+    auto it = wideBvhs.find(triangles.data());
+    // Quantised boxes can't be refitted in place, so a refitted BVH is simply collapsed again
+    if (it == wideBvhs.end() || it->second.getTriangleCount() != triangles.size() || it->second.getSourceRevision() != bvh.getRevision()) {
+        WideBVH &wideBvh = wideBvhs[triangles.data()];
+        wideBvh.build(bvh);
+        std::cout << "Built wide BVH: " << wideBvh.getStats() << std::endl;
+        return wideBvh;
+    }
+    return it->second;
+}
+
+// Models that suit a uniform grid (see chooseAccelerator) trace their single rays through one instead of the wide BVH;
+// packets keep using the binary BVH. The choice is made once per model and returns nullptr for BVH models.
+const UniformGrid *getGrid(TriangleView triangles) {
+    struct GridChoice {
+        size_t triangleCount;
+        size_t bvhRevision;
+        std::unique_ptr<UniformGrid> grid;
+    };
+    static std::map<const ModelTriangle *, GridChoice> choices;
+    const BVH &bvh = getBVH(triangles);
+    auto it = choices.find(triangles.data());
+    if (it == choices.end() || it->second.triangleCount != triangles.size()) {
+        AcceleratorStatistics statistics = chooseAccelerator(triangles);
+        std::cout << "Chose accelerator: " << statistics << std::endl;
+        GridChoice &choice = choices[triangles.data()];
+        choice.triangleCount = triangles.size();
+        choice.bvhRevision = bvh.getRevision();
+        choice.grid.reset(statistics.preferGrid ? new UniformGrid(triangles) : nullptr);
+        if (choice.grid) std::cout << "Built grid: " << choice.grid->getStats() << std::endl;
+        return choice.grid.get();
+    }
+    // The BVH is refitted whenever the model's triangles move (see refitBVH), the grid is simply rebuilt
+    if (it->second.grid && it->second.bvhRevision != bvh.getRevision()) {
+        it->second.grid->build(triangles);
+        it->second.bvhRevision = bvh.getRevision();
+    }
+    return it->second.grid.get();
+}
+
+// Rotates triangles [first, first + count) of a model about their centroid and refits its BVH around them
+void rotateModelPart(std::vector<ModelTriangle> &triangles, size_t first, size_t count, const glm::mat3 &rotation) {
+    glm::vec3 pivot(0.0f);
+    for (size_t i = first; i < first + count; i++) {
+        pivot += triangles[i].vertices[0] + triangles[i].vertices[1] + triangles[i].vertices[2];
+    }
+    pivot /= 3.0f * count;
+    for (size_t i = first; i < first + count; i++) {
+        ModelTriangle &triangle = triangles[i];
+        for (glm::vec3 &vertex : triangle.vertices) vertex = rotation * (vertex - pivot) + pivot;
+        triangle.normal = rotation * triangle.normal;
+        for (glm::vec3 &normal : triangle.vertexNormals) normal = rotation * normal;
+        triangle.edge0 = triangle.vertices[1] - triangle.vertices[0];
+        triangle.edge1 = triangle.vertices[2] - triangle.vertices[0];
+    }
+    refitBVH(triangles, first, count);
+}
+
+// Shadow rays only need to know whether anything is in the way, not what is nearest.
+// cullBackFaces lets the ray through the back of every triangle but glass, for callers that know it can only ever
+// meet a closed mesh from outside; shadow and glass rays leave it off.
+bool isOccluded(
+        const glm::vec3 &rayOrigin,
+        const glm::vec3 &rayDirection,
+        float maxDistance,
+        size_t ignoreTriangleIndex,
+        TriangleView triangles,
+        bool cullBackFaces = false
+) {
+    if (const UniformGrid *grid = getGrid(triangles)) {
+        return grid->occluded(rayOrigin, rayDirection, maxDistance, ignoreTriangleIndex, cullBackFaces);
+    }
+    return getWideBVH(triangles).occluded(rayOrigin, rayDirection, maxDistance, ignoreTriangleIndex, cullBackFaces);
+}
+
+// cullBackFaces as for isOccluded
+HitRecord getClosestHit(
+        const glm::vec3 &rayOrigin,
+        const glm::vec3 &rayDirection,
+        TriangleView triangles,
+        bool cullBackFaces = false
+) {
+    float t, u, v;
+    size_t closestIndex;
+    const UniformGrid *grid = getGrid(triangles);
+    bool hit = grid ? grid->intersect(rayOrigin, rayDirection, t, u, v, closestIndex, cullBackFaces)
+                    : getWideBVH(triangles).intersect(rayOrigin, rayDirection, t, u, v, closestIndex, cullBackFaces);
+    if (!hit) return HitRecord();
+    return HitRecord(rayOrigin + rayDirection * t, t, closestIndex, u, v);
+}
+
 RayTriangleIntersection getClosestValidIntersection(
         const glm::vec3 &rayOrigin,
         const glm::vec3 &rayDirection,
-        const std::vector<ModelTriangle> &triangles
+        TriangleView triangles
 ) {
-    RayTriangleIntersection closestIntersection;
-    float closestDistance = std::numeric_limits<float>::infinity();
-    size_t closestIndex = -1; // Initialized with an invalid index
-
-    for (size_t i = 0; i < triangles.size(); ++i) {
-        const ModelTriangle& triangle = triangles[i];
-        glm::vec3 e0 = triangle.vertices[1] - triangle.vertices[0];
-        glm::vec3 e1 = triangle.vertices[2] - triangle.vertices[0];
-        glm::vec3 SPVector = rayOrigin - triangle.vertices[0];
-        glm::mat3 DEMatrix(-rayDirection, e0, e1);
-        glm::vec3 possibleSolution = glm::inverse(DEMatrix) * SPVector;
-
-        float t = possibleSolution.x;
-        float u = possibleSolution.y;
-        float v = possibleSolution.z;
-
-        if (u >= 0.0f && u <= 1.0f && v >= 0.0f && v <= 1.0f && (u + v) <= 1.0f && t > 0) {
-            if (t < closestDistance) {
-                closestDistance = t;
-                closestIndex = i;
-                closestIntersection = RayTriangleIntersection(
-                        rayOrigin + rayDirection * t,
-                        t,
-                        triangle,
-                        closestIndex // Set the triangleIndex to the current index
-                );
-            }
+    return RayTriangleIntersection(getClosestHit(rayOrigin, rayDirection, triangles), triangles);
+}
+
+// Primary hits for columns [x0, x1) of the RayPacket::ROWS rows starting at y0, traced one block of pixels at a time.
+// The hit for pixel (x, y) ends up in band[(y - y0) * (x1 - x0) + x - x0]; the bounces after it are still traced one
+// ray at a time.
+// cullBackFaces skips the triangles that face away from the camera, which is only safe when the camera is not inside
+// a closed mesh; glass is never culled, and the bounce rays are always traced against both sides.
+void tracePrimaryBand(
+        size_t y0,
+        size_t x0,
+        size_t x1,
+        size_t width,
+        size_t height,
+        float focalLength,
+        const glm::vec3 &cameraPosition,
+        TriangleView triangles,
+        std::vector<HitRecord> &band,
+        bool cullBackFaces = false
+) {
+    size_t bandWidth = x1 - x0;
+    band.assign(bandWidth * RayPacket::ROWS, HitRecord());
+    const BVH &bvh = getBVH(triangles);
+    for (size_t packetX = x0; packetX < x1; packetX += RayPacket::COLUMNS) {
+        RayPacket packet(cameraPosition);
+        packet.cullBackFaces = cullBackFaces;
+        for (size_t lane = 0; lane < RayPacket::SIZE; lane++) {
+            size_t x = packetX + lane % RayPacket::COLUMNS;
+            size_t y = y0 + lane / RayPacket::COLUMNS;
+            // Pixels off the edge of the band still get a ray so the packet frustum keeps its shape, they just aren't traced
+            glm::vec3 rayDirection = getRayDirectionFromPixel(x, y, width, height, focalLength, cameraPosition);
+            packet.setRay(lane, rayDirection, x < x1 && y < height);
+        }
+        packet.prepare();
+        bvh.intersect(packet);
+        for (size_t lane = 0; lane < RayPacket::SIZE; lane++) {
+            if (!(packet.activeMask & (1u << lane)) || packet.triangleIndex[lane] == RayPacket::NO_HIT) continue;
+            size_t x = packetX + lane % RayPacket::COLUMNS;
+            size_t y = y0 + lane / RayPacket::COLUMNS;
+            float t = packet.t[lane];
+            band[(y - y0) * bandWidth + x - x0] = HitRecord(cameraPosition + packet.getDirection(lane) * t, t,
+                                                            packet.triangleIndex[lane], packet.u[lane], packet.v[lane]);
         }
     }
+}
 
-    if (closestDistance == std::numeric_limits<float>::infinity()) {
-        return RayTriangleIntersection(glm::vec3(), std::numeric_limits<float>::infinity(), ModelTriangle(), -1);
-    }
+// Builds everything getClosestHit, isOccluded and tracePrimaryBand look up for a model. Tiles rendered in parallel
+// only ever read those caches, so every renderer calls this before handing its tiles out.
+void prepareModel(TriangleView triangles) {
+    if (!getGrid(triangles)) getWideBVH(triangles);
+}
+
+// Runs the tiles of every ray-traced frame and the loading main does up front, on one thread per core unless main is
+// given --threads
+JobSystem &getJobSystem() {
+    static JobSystem jobs;
+    return jobs;
+}
 
-    return closestIntersection;
+TilePool &getTilePool() {
+    static TilePool pool(getJobSystem());
+    return pool;
 }
 
 Colour Mix(const Colour& a, const Colour& b, float blend) {
@@ -701,13 +1047,28 @@ Colour Mix(const Colour& a, const Colour& b, float blend) {
     );
 }
 
+// Random numbers. Every sample draws from its own Pcg32, seeded from its pixel, its sample index and the frame, and
+// handed down the path that uses it, so an image comes out the same on any number of threads and tracing never
+// touches state another thread writes to (as every call to rand() did).
+
+// Frame the samples belong to, so a renderer that accumulates frames can move it on to draw new samples every frame
+uint32_t renderFrame = 0;
+// Sample index of the path the camera sees directly, apart from the numbered samples of a pixel
+const uint32_t PRIMARY_SAMPLE = uint32_t(-1);
+
+// The generator of a sample of pixel (x, y) of a window screenWidth pixels wide, seeded from the image pixel it is for so
+// that a progressive preview draws the same samples as the whole frame
+Pcg32 sampleRandom(size_t x, size_t y, size_t screenWidth, uint32_t sample) {
+    int imageX = int(x), imageY = int(y), imageWidth = int(screenWidth), imageHeight = 0;
+    toImagePixel(imageX, imageY, imageWidth, imageHeight);
+    return Pcg32::forSample(size_t(imageY) * imageWidth + imageX, sample, renderFrame);
+}
+
 //AIGenerated
-glm::vec3 randomInUnitSphere() {
+glm::vec3 randomInUnitSphere(Pcg32 &random) {
     glm::vec3 p;
     do {
-        p = 2.0f * glm::vec3(static_cast<float>(rand()) / RAND_MAX,
-                             static_cast<float>(rand()) / RAND_MAX,
-                             static_cast<float>(rand()) / RAND_MAX) - glm::vec3(1, 1, 1);
+        p = 2.0f * glm::vec3(random.nextFloat(), random.nextFloat(), random.nextFloat()) - glm::vec3(1, 1, 1);
     } while (glm::length(p) >= 1.0f);
     return p;
 }
@@ -716,71 +1077,21 @@ Colour vec3ToColour(const glm::vec3& vec) {
     return Colour(static_cast<int>(vec.r * 255), static_cast<int>(vec.g * 255), static_cast<int>(vec.b * 255));
 }
 
+// The colour a bounce query ended on, with the tint of a metal surface on the last bounce mixed in
+Colour getHitColour(const HitRecord &hit, TriangleView triangles) {
+    if (hit.tintTriangleIndex == size_t(-1)) return hit.colour(triangles);
+    const ModelTriangle &metal = triangles[hit.tintTriangleIndex];
+    return Mix(vec3ToColour(metal.metalColor), hit.colour(triangles), metal.reflectivity);
+}
 
-RayTriangleIntersection getReflectionIntersection(
-        const glm::vec3 &rayOrigin,
-        const glm::vec3 &rayDirection,
-        const std::vector<ModelTriangle> &triangles,
-        int depth = 0,
-        const int maxDepth = 20
-) {
-
-    RayTriangleIntersection closestIntersection;
-    closestIntersection.distanceFromCamera = std::numeric_limits<float>::infinity();
-    closestIntersection.triangleIndex = -1;
-
-    for (size_t i = 0; i < triangles.size(); ++i) {
-        const ModelTriangle& triangle = triangles[i];
-        glm::vec3 e0 = triangle.vertices[1] - triangle.vertices[0];
-        glm::vec3 e1 = triangle.vertices[2] - triangle.vertices[0];
-        glm::vec3 SPVector = rayOrigin - triangle.vertices[0];
-        glm::mat3 DEMatrix(-rayDirection, e0, e1);
-        glm::vec3 possibleSolution = glm::inverse(DEMatrix) * SPVector;
-
-        float t = possibleSolution.x, u = possibleSolution.y, v = possibleSolution.z;
-        float w = 1 - u - v;
-        glm::vec2 textureCoords = w * glm::vec2(triangle.texturePoints[0].x, triangle.texturePoints[0].y) +
-                                  u * glm::vec2(triangle.texturePoints[1].x, triangle.texturePoints[1].y) +
-                                  v * glm::vec2(triangle.texturePoints[2].x, triangle.texturePoints[2].y);
-
-
-
-        if (u >= 0.0f && u <= 1.0f && v >= 0.0f && v <= 1.0f && (u + v) <= 1.0f && t > 0 && t < closestIntersection.distanceFromCamera) {
-            closestIntersection.distanceFromCamera = t;
-            closestIntersection.intersectedTriangle = triangle;
-            closestIntersection.triangleIndex = i;
-            closestIntersection.intersectionPoint = rayOrigin + rayDirection * t;
-            closestIntersection.textureCoords=textureCoords;
-        }
-    }
-
-    if (depth < maxDepth && closestIntersection.triangleIndex != -1) {
-        const ModelTriangle& triangle = triangles[closestIntersection.triangleIndex];
-        if (triangle.isMirror || triangle.isMetal) {
-            glm::vec3 reflectionDirection = glm::reflect(rayDirection, closestIntersection.intersectedTriangle.normal);
-
-
-            if (triangle.isMetal) {
-                reflectionDirection += randomInUnitSphere() * triangle.roughness;
-                reflectionDirection = glm::normalize(reflectionDirection);
-            }
-
-            glm::vec3 reflectionOrigin = closestIntersection.intersectionPoint + reflectionDirection * 0.001f;
-            RayTriangleIntersection reflectedIntersection = getReflectionIntersection(
-                    reflectionOrigin, reflectionDirection, triangles, depth + 1, maxDepth);
-
-            if (triangle.isMetal && depth == maxDepth - 1) {
-                reflectedIntersection.intersectedTriangle.colour = Mix(vec3ToColour(triangle.metalColor), reflectedIntersection.intersectedTriangle.colour, triangle.reflectivity);
-            }
-
-            return reflectedIntersection;
-        }
-    }
-
-    return closestIntersection;
+RayTriangleIntersection toRayTriangleIntersection(const HitRecord &hit, TriangleView triangles) {
+    RayTriangleIntersection intersection(hit, triangles);
+    if (hit.tintTriangleIndex != size_t(-1)) intersection.intersectedTriangle.colour = getHitColour(hit, triangles);
+    return intersection;
 }
 
 
+
 //AIGenerated
 glm::vec3 ComputeRefractedRay(const glm::vec3& incident, const glm::vec3& normal, float indexOfRefraction) {
     float cosi = glm::clamp(glm::dot(incident, normal), -1.0f, 1.0f);
@@ -804,7 +1115,7 @@ glm::vec3 ComputeRefractedRay(const glm::vec3& incident, const glm::vec3& normal
     }
 
 
-    return eta * incident + (eta * cosi - sqrt(k)) * n;
+    return eta * incident + (eta * cosi - std::sqrt(k)) * n;
 }
 
 
@@ -812,13 +1123,9 @@ glm::vec3 ComputeRefractedRay(const glm::vec3& incident, const glm::vec3& normal
 glm::vec3 lightposition(0,1,1);
 
 
-glm::vec3 calculateScatteredDirection(const glm::vec3& normal) {
+glm::vec3 calculateScatteredDirection(const glm::vec3& normal, Pcg32 &random) {
 
-    glm::vec3 randomPoint = glm::vec3(
-            static_cast<float>(rand()) / static_cast<float>(RAND_MAX),
-            static_cast<float>(rand()) / static_cast<float>(RAND_MAX),
-            static_cast<float>(rand()) / static_cast<float>(RAND_MAX)
-    );
+    glm::vec3 randomPoint = glm::vec3(random.nextFloat(), random.nextFloat(), random.nextFloat());
     randomPoint = glm::normalize(randomPoint);
 
 
@@ -841,187 +1148,177 @@ Colour MixColours(const Colour &c1, const Colour &c2, float ratio) {
     );
 }
 
-RayTriangleIntersection getClosestValidIntersectionWithReflection(
-        const glm::vec3 &rayOrigin,
-        const glm::vec3 &rayDirection,
-        const std::vector<ModelTriangle> &triangles,
-        int depth = 0,
-        const int maxDepth = 5
-) {
+// Bounce queries. Every secondary ray is followed by the one continueRay loop below; what differs between render modes is
+// fixed at compile time by a TracePolicy, so each mode gets its own copy of the loop with the branches it doesn't
+// need folded away. Rays meet the scene only through getClosestHit (closest hit) and isOccluded (any hit), so a
+// faster accelerator lands in those two and every query picks it up.
+
+const size_t NO_TINT = size_t(-1);
+
+template<int MaxDepth, bool ThroughGlass, bool ScatterDiffuse, bool ResolveUVs>
+struct TracePolicy {
+    // Bounces followed before the path stops on whatever it hit
+    static const int MAX_DEPTH = MaxDepth;
+    // Glass refracts the ray instead of stopping it
+    static const bool THROUGH_GLASS = ThroughGlass;
+    // The first bounce off a diffuse surface scatters in a random direction instead of stopping the path
+    static const bool SCATTER_DIFFUSE = ScatterDiffuse;
+    // The final hit gets its texture coordinates, for queries that texture what they see
+    static const bool RESOLVE_UVS = ResolveUVs;
+};
 
-    RayTriangleIntersection closestIntersection;
-    float closestDistance = std::numeric_limits<float>::infinity();
-    size_t closestIndex = -1;
-
-
-    for (size_t i = 0; i < triangles.size(); ++i) {
-        const ModelTriangle& triangle = triangles[i];
-        glm::vec3 e0 = triangle.vertices[1] - triangle.vertices[0];
-        glm::vec3 e1 = triangle.vertices[2] - triangle.vertices[0];
-        glm::vec3 SPVector = rayOrigin - triangle.vertices[0];
-        glm::mat3 DEMatrix(-rayDirection, e0, e1);
-        glm::vec3 possibleSolution = glm::inverse(DEMatrix) * SPVector;
-
-        float t = possibleSolution.x;
-        float u = possibleSolution.y;
-        float v = possibleSolution.z;
-
-        if (u >= 0.0f && u <= 1.0f && v >= 0.0f && v <= 1.0f && (u + v) <= 1.0f && t > 0 && t < closestDistance) {
-            closestDistance = t;
-            closestIndex = i;
-            closestIntersection = RayTriangleIntersection(
-                    rayOrigin + rayDirection * t,
-                    t,
-                    triangle,
-                    closestIndex
-            );
-        }
-    }
-
-    if (depth < maxDepth && closestIndex != -1) {
-        const ModelTriangle &triangle = triangles[closestIndex];
-        if (triangle.isMirror || triangle.isMetal) {
-            glm::vec3 reflectionDirection = glm::reflect(rayDirection, triangle.normal);
-            if (triangle.isMetal) {
-                reflectionDirection += randomInUnitSphere() * triangle.roughness;
-                reflectionDirection = glm::normalize(reflectionDirection);
-            }
-//            glm::vec3 reflectionOrigin = closestIntersection.intersectionPoint + reflectionDirection * 0.001f;
-            glm::vec3 reflectionOrigin = closestIntersection.intersectionPoint + reflectionDirection * 0.001f;
-            RayTriangleIntersection reflectedIntersection = getClosestValidIntersectionWithReflection(
-                    reflectionOrigin, reflectionDirection, triangles, depth + 1, maxDepth);
-            if (triangle.isMetal && depth == maxDepth - 1) {
-                reflectedIntersection.intersectedTriangle.colour = Mix(vec3ToColour(triangle.metalColor),
-                                                                       reflectedIntersection.intersectedTriangle.colour,
-                                                                       triangle.reflectivity);
-            }
-            return reflectedIntersection;
+// Mirrors and metal only, textured: what a mirror reflects and what the textured scenes see
+using ReflectionTrace = TracePolicy<20, false, false, true>;
+// What the camera sees in the Mirror and Metal scenes: mirrors, metal and glass
+using SpecularTrace = TracePolicy<5, true, false, false>;
+// One indirect sample: a diffuse scatter, then mirrors, metal and glass
+using IndirectTrace = TracePolicy<2, true, true, false>;
+
+// Where a ray goes on from a mirror, metal or (with throughGlass) glass surface; false for any other surface
+bool getSpecularBounce(const ModelTriangle &triangle, const glm::vec3 &point, const glm::vec3 &rayDirection, bool throughGlass,
+                       Pcg32 &random, glm::vec3 &origin, glm::vec3 &direction) {
+    if (triangle.isMirror || triangle.isMetal) {
+        direction = glm::reflect(rayDirection, triangle.normal);
+        if (triangle.isMetal) {
+            direction += randomInUnitSphere(random) * triangle.roughness;
+            direction = glm::normalize(direction);
         }
-        if (triangle.isGlass) {
-            glm::vec3 refractedDirection = ComputeRefractedRay(rayDirection, triangle.normal, triangle.refractiveIndex);
+        origin = point + direction * 0.001f;
+        return true;
+    }
+    if (throughGlass && triangle.isGlass) {
+        direction = ComputeRefractedRay(rayDirection, triangle.normal, triangle.refractiveIndex);
+        origin = point + direction * 0.0001f;
+        return true;
+    }
+    return false;
+}
 
-//          glm::vec3 refractedDirection = glm::refract(rayDirection-lightposition, triangle.normal, triangle.refractiveIndex);
-            glm::vec3 refractedOrigin = closestIntersection.intersectionPoint + refractedDirection * 0.0001f;
-//            glm::vec3 refractedOrigin = closestIntersection.intersectionPoint;
-            RayTriangleIntersection refractedIntersection = getClosestValidIntersectionWithReflection(
-                    refractedOrigin, refractedDirection, triangles, depth + 1, maxDepth);
-            return refractedIntersection;
-        }
+// Where a path goes on from the surface it hit on bounce depth, or false if it stops there
+template<typename Policy>
+bool getBounce(const ModelTriangle &triangle, const glm::vec3 &point, const glm::vec3 &rayDirection, int depth,
+               Pcg32 &random, glm::vec3 &origin, glm::vec3 &direction) {
+    if (getSpecularBounce(triangle, point, rayDirection, Policy::THROUGH_GLASS, random, origin, direction)) return true;
+    if (!Policy::SCATTER_DIFFUSE || depth > 0) return false;
+    direction = calculateScatteredDirection(triangle.normal, random);
+    origin = point + direction * 0.01f;
+    return true;
+}
 
-        if (!triangle.isMirror && !triangle.isMetal && !triangle.isGlass) {
-            glm::vec3 scatteredDirection = calculateScatteredDirection(triangle.normal);
-            glm::vec3 scatteredOrigin = closestIntersection.intersectionPoint + scatteredDirection * 0.001f;
-            RayTriangleIntersection scatteredIntersection = getClosestValidIntersectionWithReflection(
-                    scatteredOrigin, scatteredDirection, triangles, depth + 1, maxDepth);
-//            MixColours(closestIntersection.intersectedTriangle.colour, scatteredIntersection.intersectedTriangle.colour, 0.2f);
-//            return scatteredIntersection;
+// Carries on from a closest hit that is already known, such as a primary hit traced as part of a packet
+template<typename Policy>
+HitRecord continueRay(HitRecord hit, glm::vec3 rayDirection, TriangleView triangles, Pcg32 &random) {
+    for (int depth = 0; depth < Policy::MAX_DEPTH && hit.isHit(); depth++) {
+        const ModelTriangle &triangle = triangles[hit.triangleIndex];
+        glm::vec3 origin, direction;
+        if (!getBounce<Policy>(triangle, hit.intersectionPoint, rayDirection, depth, random, origin, direction)) break;
+        // Metal on the last bounce tints whatever it reflects
+        size_t tint = triangle.isMetal && depth == Policy::MAX_DEPTH - 1 ? hit.triangleIndex : NO_TINT;
+        hit = getClosestHit(origin, direction, triangles);
+        hit.tintTriangleIndex = tint;
+        rayDirection = direction;
+    }
+    if (Policy::RESOLVE_UVS) hit.resolveTextureCoords(triangles);
+    return hit;
+}
 
-        }
+template<typename Policy>
+HitRecord traceRay(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, TriangleView triangles,
+                   Pcg32 &random) {
+    return continueRay<Policy>(getClosestHit(rayOrigin, rayDirection, triangles), rayDirection, triangles, random);
+}
 
-    }
-    return closestIntersection;
+template<typename Policy>
+RayTriangleIntersection traceIntersection(const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection,
+                                          TriangleView triangles, Pcg32 &random) {
+    return toRayTriangleIntersection(traceRay<Policy>(rayOrigin, rayDirection, triangles, random), triangles);
 }
 
-RayTriangleIntersection getClosestValidIntersectionWithIndirect(
-        const glm::vec3 &rayOrigin,
-        const glm::vec3 &rayDirection,
-        const std::vector<ModelTriangle> &triangles,
-        int depth = 0,
-        const int maxDepth = 2
-) {
+float ComputeFresnel(const glm::vec3 &I, const glm::vec3 &N, float refractiveIndex) {
+    float cosi = glm::clamp(glm::dot(I, N), -1.0f, 1.0f);
+    float etai = 1, etat = refractiveIndex;
+    if (cosi > 0) { std::swap(etai, etat); }
+    float sint = etai / etat * sqrtf(std::max(0.f, 1 - cosi * cosi));
+    if (sint >= 1) {
+        return 1;
+    }
+    else {
+        float cost = sqrtf(std::max(0.f, 1 - sint * sint));
+        cosi = fabsf(cosi);
+        float Rs = ((etat * cosi) - (etai * cost)) / ((etat * cosi) + (etai * cost));
+        float Rp = ((etai * cosi) - (etat * cost)) / ((etai * cosi) + (etat * cost));
+        return (Rs * Rs + Rp * Rp) / 2;
+    }
+}
 
-    RayTriangleIntersection closestIntersection;
-    float closestDistance = std::numeric_limits<float>::infinity();
-    size_t closestIndex = -1;
-
-
-    for (size_t i = 0; i < triangles.size(); ++i) {
-        const ModelTriangle& triangle = triangles[i];
-        glm::vec3 e0 = triangle.vertices[1] - triangle.vertices[0];
-        glm::vec3 e1 = triangle.vertices[2] - triangle.vertices[0];
-        glm::vec3 SPVector = rayOrigin - triangle.vertices[0];
-        glm::mat3 DEMatrix(-rayDirection, e0, e1);
-        glm::vec3 possibleSolution = glm::inverse(DEMatrix) * SPVector;
-
-        float t = possibleSolution.x;
-        float u = possibleSolution.y;
-        float v = possibleSolution.z;
-
-        if (u >= 0.0f && u <= 1.0f && v >= 0.0f && v <= 1.0f && (u + v) <= 1.0f && t > 0 && t < closestDistance) {
-            closestDistance = t;
-            closestIndex = i;
-            closestIntersection = RayTriangleIntersection(
-                    rayOrigin + rayDirection * t,
-                    t,
-                    triangle,
-                    closestIndex
-            );
-        }
-    }
-
-    if (depth < maxDepth && closestIndex != -1) {
-        const ModelTriangle &triangle = triangles[closestIndex];
-        if (triangle.isMirror || triangle.isMetal) {
-            glm::vec3 reflectionDirection = glm::reflect(rayDirection, triangle.normal);
-            if (triangle.isMetal) {
-                reflectionDirection += randomInUnitSphere() * triangle.roughness;
-                reflectionDirection = glm::normalize(reflectionDirection);
-            }
-//            glm::vec3 reflectionOrigin = closestIntersection.intersectionPoint + reflectionDirection * 0.001f;
-            glm::vec3 reflectionOrigin = closestIntersection.intersectionPoint + reflectionDirection * 0.001f;
-            RayTriangleIntersection reflectedIntersection = getClosestValidIntersectionWithReflection(
-                    reflectionOrigin, reflectionDirection, triangles, depth + 1, maxDepth);
-            if (triangle.isMetal && depth == maxDepth - 1) {
-                reflectedIntersection.intersectedTriangle.colour = Mix(vec3ToColour(triangle.metalColor),
-                                                                       reflectedIntersection.intersectedTriangle.colour,
-                                                                       triangle.reflectivity);
+// Branches a glass path may leave waiting at once, and the least share of a pixel worth tracing as its own ray
+const size_t GLASS_BRANCHES = 8;
+const float MIN_BRANCH_WEIGHT = 1.0f / 255.0f;
+
+// What a ray sees through glass that both reflects and refracts, carrying on from its first hit. A glass hit splits the
+// path: the refracted ray carries on with the transmitted share of the throughput and the reflected one waits on a
+// stack with the Fresnel share. Mirrors and metal pass the whole throughput on, and every other surface ends its ray
+// with weight times its colour.
+template<typename Policy>
+Colour traceGlassColour(const HitRecord &firstHit, const glm::vec3 &rayDirection, TriangleView triangles,
+                        Pcg32 &random) {
+    static_assert(Policy::THROUGH_GLASS, "glass branching needs a policy that traces through glass");
+    RayStack<GLASS_BRANCHES> branches;
+    glm::vec3 sum(0.0f);
+    StackedRay ray;
+    ray.direction = rayDirection;
+    HitRecord hit = firstHit;
+    while (true) {
+        for (; ray.depth < Policy::MAX_DEPTH && hit.isHit(); ray.depth++) {
+            const ModelTriangle &triangle = triangles[hit.triangleIndex];
+            if (triangle.isGlass) {
+                float reflectance = ComputeFresnel(ray.direction, triangle.normal, triangle.refractiveIndex);
+                float reflectedWeight = ray.weight * reflectance;
+                if (reflectedWeight >= MIN_BRANCH_WEIGHT) {
+                    glm::vec3 reflected = glm::reflect(ray.direction, triangle.normal);
+                    // With the stack full the reflection is dropped rather than the path
+                    if (branches.push(hit.intersectionPoint + reflected * 0.001f, reflected, reflectedWeight, ray.depth + 1))
+                        ray.weight -= reflectedWeight;
+                }
             }
-            return reflectedIntersection;
+            glm::vec3 origin, direction;
+            if (!getBounce<Policy>(triangle, hit.intersectionPoint, ray.direction, ray.depth, random, origin, direction)) break;
+            size_t tint = triangle.isMetal && ray.depth == Policy::MAX_DEPTH - 1 ? hit.triangleIndex : NO_TINT;
+            hit = getClosestHit(origin, direction, triangles);
+            hit.tintTriangleIndex = tint;
+            ray.origin = origin;
+            ray.direction = direction;
         }
-        if (triangle.isGlass) {
-            glm::vec3 refractedDirection = ComputeRefractedRay(rayDirection, triangle.normal, triangle.refractiveIndex);
-
-//          glm::vec3 refractedDirection = glm::refract(rayDirection-lightposition, triangle.normal, triangle.refractiveIndex);
-            glm::vec3 refractedOrigin = closestIntersection.intersectionPoint + refractedDirection * 0.0001f;
-//            glm::vec3 refractedOrigin = closestIntersection.intersectionPoint;
-            RayTriangleIntersection refractedIntersection = getClosestValidIntersectionWithReflection(
-                    refractedOrigin, refractedDirection, triangles, depth + 1, maxDepth);
-            return refractedIntersection;
-        }
-
-        if (!triangle.isMirror && !triangle.isMetal && !triangle.isGlass) {
-            glm::vec3 scatteredDirection = calculateScatteredDirection(triangle.normal);
-            glm::vec3 scatteredOrigin = closestIntersection.intersectionPoint + scatteredDirection * 0.01f;
-//            glm::vec3 scatteredOrigin = closestIntersection.intersectionPoint;
-            RayTriangleIntersection scatteredIntersection = getClosestValidIntersectionWithReflection(
-                    scatteredOrigin, scatteredDirection, triangles, depth + 1, maxDepth);
-//            MixColours(closestIntersection.intersectedTriangle.colour, scatteredIntersection.intersectedTriangle.colour, 0.6f);
-            return scatteredIntersection;
-
+        if (hit.isHit()) {
+            Colour colour = getHitColour(hit, triangles);
+            sum += ray.weight * glm::vec3(colour.red, colour.green, colour.blue);
         }
-
+        if (!branches.pop(ray)) break;
+        hit = getClosestHit(ray.origin, ray.direction, triangles);
     }
-    return closestIntersection;
+    return Colour(static_cast<int>(sum.r), static_cast<int>(sum.g), static_cast<int>(sum.b));
 }
 
 
-
+// The light isPointInShadow casts its shadow rays from, whatever light the scene is shaded with
+const glm::vec3 shadowLightPosition = glm::vec3(0, 1, 1.5f);
 
 bool isPointInShadow(
         const glm::vec3 &intersectionPoint,
         size_t intersectedTriangleIndex,
-        const std::vector<ModelTriangle> &modelTriangles
+        TriangleView modelTriangles
 ) {
-    glm::vec3 lightPosition = glm::vec3(0, 1, 1.5f);
+    glm::vec3 lightPosition = shadowLightPosition;
     glm::vec3 shadowRayDirection = glm::normalize(intersectionPoint-lightPosition);
-    RayTriangleIntersection Intersection = getClosestValidIntersection(lightPosition, shadowRayDirection, modelTriangles);
-    return Intersection.triangleIndex == intersectedTriangleIndex;
+    // Lit (true) when nothing but the point's own triangle lies between the light and the point
+    return !isOccluded(lightPosition, shadowRayDirection, glm::length(intersectionPoint - lightPosition),
+                       intersectedTriangleIndex, modelTriangles);
 }
 
 bool isPointInShadow_fix(
         const glm::vec3 &intersectionPoint,
         size_t intersectedTriangleIndex,
-        const std::vector<ModelTriangle> &modelTriangles
+        TriangleView modelTriangles
 ) {
     glm::vec3 lightPosition = glm::vec3(-0.2f, 0.8, 1.5f);
     glm::vec3 shadowRayDirection = glm::normalize(lightPosition - intersectionPoint);
@@ -1029,37 +1326,35 @@ bool isPointInShadow_fix(
 
     glm::vec3 shadowRayOrigin = intersectionPoint + 0.001f * shadowRayDirection; // shadow bias
 
-    RayTriangleIntersection shadowIntersection = getClosestValidIntersection(
-            shadowRayOrigin, shadowRayDirection, modelTriangles
-    );
-
-    bool shadowCheck = (shadowIntersection.triangleIndex != intersectedTriangleIndex);
-    bool isInShadow = shadowCheck && shadowIntersection.distanceFromCamera < glm::length(lightPosition - shadowRayOrigin);
-
-    return isInShadow;
+    return isOccluded(shadowRayOrigin, shadowRayDirection, glm::length(lightPosition - shadowRayOrigin),
+                      intersectedTriangleIndex, modelTriangles);
 }
 
 
 void drawRasterisedScene_fix(DrawingWindow &window, glm::vec3 cameraPosition){
     const std::string filepath = "../04 Wireframes and Rasterising/models/cornell-box.obj";
-    const std::map<std::string, Colour> palette = loadMTL("../04 Wireframes and Rasterising/models/cornell-box.mtl");
-    std::vector<ModelTriangle> models = loadOBJ(filepath, palette);
-    uint32_t colour;
-    for (size_t y = 0; y < window.height; y++) {
-        for (size_t x = 0; x < window.width; x++) {
-            glm::vec3 rayDirection = getRayDirectionFromPixel(x , y, window.width, window.height,1.0f,cameraPosition);
-            RayTriangleIntersection rayIntersection = getClosestValidIntersection(cameraPosition, rayDirection, models);
-            if (rayIntersection.distanceFromCamera != std::numeric_limits<float>::infinity()) {
-                if (isPointInShadow_fix(rayIntersection.intersectionPoint, rayIntersection.triangleIndex, models)) {
-                    uint32_t Black = (255 << 24) + (int(0) << 16) + (int(0) << 8) + int(0);
-                    colour=Black;
-                } else {
-                    colour = (255 << 24) + (rayIntersection.intersectedTriangle.colour.red << 16) + (rayIntersection.intersectedTriangle.colour.green << 8) + rayIntersection.intersectedTriangle.colour.blue;
+    TriangleView models = loadModel(filepath, "../04 Wireframes and Rasterising/models/cornell-box.mtl", false);
+    prepareModel(models);
+    getTilePool().render(window.width, window.height, [&](const Tile &tile) {
+        uint32_t colour;
+        std::vector<HitRecord> primaryHits;
+        for (size_t y = tile.y0; y < tile.y1; y++) {
+            if ((y - tile.y0) % RayPacket::ROWS == 0) tracePrimaryBand(y, tile.x0, tile.x1, window.width, window.height, 1.0f, cameraPosition, models, primaryHits, true);
+            for (size_t x = tile.x0; x < tile.x1; x++) {
+                const HitRecord &primaryHit = primaryHits[(y - tile.y0) % RayPacket::ROWS * tile.width() + x - tile.x0];
+                RayTriangleIntersection rayIntersection(primaryHit, models);
+                if (rayIntersection.distanceFromCamera != std::numeric_limits<float>::infinity()) {
+                    if (isPointInShadow_fix(rayIntersection.intersectionPoint, rayIntersection.triangleIndex, models)) {
+                        uint32_t Black = (255 << 24) + (int(0) << 16) + (int(0) << 8) + int(0);
+                        colour=Black;
+                    } else {
+                        colour = (255 << 24) + (rayIntersection.intersectedTriangle.colour.red << 16) + (rayIntersection.intersectedTriangle.colour.green << 8) + rayIntersection.intersectedTriangle.colour.blue;
+                    }
+                    window.setPixelColour(x, y,colour);
                 }
-                window.setPixelColour(x, y,colour);
             }
         }
-    }
+    });
 
 }
 
@@ -1087,61 +1382,40 @@ Colour addColours(const Colour &colour1, const Colour &colour2) {
     return Colour(red, green, blue);
 }
 
+// A surface the shadow light cannot see, drawn dark and tinted
+uint32_t getShadowedColour(const Colour &colour) {
+    Colour finalColor = adjustBrightness(colour, 0.2f);
+    return (255 << 24) + (finalColor.red/2 << 16) + (finalColor.green << 8) + finalColor.blue/2;
+}
+
 void drawRasterisedScene_A(DrawingWindow &window, glm::vec3 cameraPosition, glm::vec3 lightPosition){
     const std::string filepath = "../04 Wireframes and Rasterising/models/cornell-box.obj";
-    const std::map<std::string, Colour> palette = loadMTL("../04 Wireframes and Rasterising/models/cornell-box.mtl");
 //    const std::string filepath2 = "../07 Lighting and Shading (external lecture)/resources/sphere.obj";
 //    const std::map<std::string, Colour> palette2;
-    std::vector<ModelTriangle> models = loadOBJ(filepath, palette);
+    TriangleView models = loadModel(filepath, "../04 Wireframes and Rasterising/models/cornell-box.mtl", false);
     uint32_t colour;
-    for (size_t y = 0; y < window.height; y++) {
-        for (size_t x = 0; x < window.width; x++) {
-            glm::vec3 rayDirection = getRayDirectionFromPixel(x, y, window.width, window.height, 1.0f, cameraPosition);
-            RayTriangleIntersection rayIntersection = getClosestValidIntersection(cameraPosition, rayDirection, models);
-
-            if (rayIntersection.distanceFromCamera != std::numeric_limits<float>::infinity()) {
-
-
-                float distance = glm::length(lightPosition - rayIntersection.intersectionPoint);
-                float distanceAttenuation = 100.0f / (5.0f * M_PI * distance * distance);
-
-
-                glm::vec3 lightDir = glm::normalize(lightPosition - rayIntersection.intersectionPoint);
-                float dotProduct = glm::dot(rayIntersection.intersectedTriangle.normal, lightDir);
-                float normalBrightness = std::max(dotProduct, 0.0f);
-                float ambientLightThreshold = 0.2f;
-                float calculatedBrightness = std::min(normalBrightness * distanceAttenuation, 1.0f);
-                float combinedBrightness = std::max(ambientLightThreshold, calculatedBrightness);
-
-                glm::vec3 viewDir = glm::normalize(cameraPosition - rayIntersection.intersectionPoint);
-                glm::vec3 reflectDir = glm::reflect(-lightDir, rayIntersection.intersectedTriangle.normal);
-
-
-                float specIntensity = std::pow(std::max(glm::dot(viewDir, reflectDir), 0.0f), 256);
-                float specIntensity2 = std::pow(std::max(glm::dot(viewDir, reflectDir), 0.0f), 128);
-                float specIntensity3 = std::pow(std::max(glm::dot(viewDir, reflectDir), 0.0f), 64);
-
-
-
-                Colour originalColour = rayIntersection.intersectedTriangle.colour;
-                Colour adjustedColour = adjustBrightness(originalColour, combinedBrightness);
-                Colour specularColor = multiplyColour(Colour(255, 255, 255), specIntensity);
-                Colour finalColor = addColours(adjustBrightness(originalColour, combinedBrightness), specularColor);
-
-                if (isPointInShadow(rayIntersection.intersectionPoint, rayIntersection.triangleIndex, models)) {
-                    uint32_t packedColour =
-                            (255 << 24) + (finalColor.red << 16) + (finalColor.green << 8) + finalColor.blue;
-                    window.setPixelColour(x, y, packedColour);
-                }
-                else{
-                    finalColor = adjustBrightness(rayIntersection.intersectedTriangle.colour, 0.2f);
-                    uint32_t packedColour =
-                            (255 << 24) + (finalColor.red/2 << 16) + (finalColor.green << 8) + finalColor.blue/2;
-                    window.setPixelColour(x, y, packedColour);
+    prepareModel(models);
+    getTilePool().render(window.width, window.height, [&](const Tile &tile) {
+        std::vector<HitRecord> primaryHits;
+        ShadingBatch litHits(window, lightPosition, cameraPosition);
+        for (size_t y = tile.y0; y < tile.y1; y++) {
+            if ((y - tile.y0) % RayPacket::ROWS == 0) tracePrimaryBand(y, tile.x0, tile.x1, window.width, window.height, 1.0f, cameraPosition, models, primaryHits, true);
+            for (size_t x = tile.x0; x < tile.x1; x++) {
+                const HitRecord &primaryHit = primaryHits[(y - tile.y0) % RayPacket::ROWS * tile.width() + x - tile.x0];
+                RayTriangleIntersection rayIntersection(primaryHit, models);
+
+                if (rayIntersection.distanceFromCamera != std::numeric_limits<float>::infinity()) {
+                    if (isPointInShadow(rayIntersection.intersectionPoint, rayIntersection.triangleIndex, models)) {
+                        litHits.add(rayIntersection.intersectionPoint, rayIntersection.intersectedTriangle.normal, rayIntersection.intersectedTriangle.colour, x, y);
+                    }
+                    else{
+                        window.setPixelColour(x, y, getShadowedColour(rayIntersection.intersectedTriangle.colour));
+                    }
                 }
             }
         }
-    }
+        litHits.flush();
+    });
 
 
 }
@@ -1194,79 +1468,36 @@ void drawRasterisedScene_Texture(DrawingWindow &window, glm::vec3 cameraPosition
 //    const std::map<std::string, Colour> palette2 = loadMTL("../05 Navigation and Transformation/models/wooden_sphere.mtl");
 
 //    const std::string filepath = "../05 Navigation and Transformation/models/env.obj";
-    const std::map<std::string, Colour> palette = loadMTL(
-            "../05 Navigation and Transformation/models/textured-cornell-box.mtl");
 
-    std::vector<ModelTriangle> models = loadOBJWithTexture(filepath, palette);
-    TextureMap textureMap("../05 Navigation and Transformation/models/texture.ppm");
+    TriangleView models = loadModel(filepath, "../05 Navigation and Transformation/models/textured-cornell-box.mtl", true);
+    TextureMap &textureMap = loadTexture("../05 Navigation and Transformation/models/texture.ppm");
     uint32_t colour;
-    for (size_t y = 0; y < window.height; y++) {
-        for (size_t x = 0; x < window.width; x++) {
-            glm::vec3 rayDirection = getRayDirectionFromPixel(x, y, window.width, window.height, 1.0f, cameraPosition);
-            RayTriangleIntersection rayIntersection = getReflectionIntersection(cameraPosition, rayDirection, models);
-
-            if (rayIntersection.distanceFromCamera != std::numeric_limits<float>::infinity()) {
-
-
-                float distance = glm::length(lightPosition - rayIntersection.intersectionPoint);
-                float distanceAttenuation = 100.0f / (5.0f * M_PI * distance * distance);
-
-
-                glm::vec3 lightDir = glm::normalize(lightPosition - rayIntersection.intersectionPoint);
-                float dotProduct = glm::dot(rayIntersection.intersectedTriangle.normal, lightDir);
-                float normalBrightness = std::max(dotProduct, 0.0f);
-                float ambientLightThreshold = 0.2f;
-                float calculatedBrightness = std::min(normalBrightness * distanceAttenuation, 1.0f);
-                float combinedBrightness = std::max(ambientLightThreshold, calculatedBrightness);
-
-                glm::vec3 viewDir = glm::normalize(cameraPosition - rayIntersection.intersectionPoint);
-                glm::vec3 reflectDir = glm::reflect(-lightDir, rayIntersection.intersectedTriangle.normal);
-
-
-                float specIntensity = std::pow(std::max(glm::dot(viewDir, reflectDir), 0.0f), 256);
-                float specIntensity2 = std::pow(std::max(glm::dot(viewDir, reflectDir), 0.0f), 128);
-                float specIntensity3 = std::pow(std::max(glm::dot(viewDir, reflectDir), 0.0f), 64);
-
-
-//
-//                if (rayIntersection.intersectedTriangle.hasTexture) {
-//                    float xTex = rayIntersection.textureCoords.x * textureMap.width;
-//                    float yTex = rayIntersection.textureCoords.y * textureMap.height;
-//                    glm::vec3 perterbed_normal = getClearNormal(textureMap, xTex, yTex);
-//                    rayIntersection.intersectedTriangle.normal = glm::normalize(perterbed_normal);
-//                }
-
-
-                if (rayIntersection.intersectedTriangle.hasTexture) {
-                    float xTex = rayIntersection.textureCoords.x * textureMap.width;
-                    float yTex = rayIntersection.textureCoords.y * textureMap.height;
-                    glm::vec3 perterbed_normal = getBumpedNormal(textureMap, xTex, yTex);
-                    rayIntersection.intersectedTriangle.normal = glm::normalize(perterbed_normal);
-                }
-
-                Colour baseColour;
-                if (rayIntersection.intersectedTriangle.hasTexture) {
-                    uint32_t textureColour = textureMap.getColourAt(rayIntersection.textureCoords.x, rayIntersection.textureCoords.y);
-                    baseColour = Colour(textureColour >> 16 & 0xFF, textureColour >> 8 & 0xFF, textureColour & 0xFF);
-                } else {
-                    baseColour = rayIntersection.intersectedTriangle.colour;
+    prepareModel(models);
+    getTilePool().render(window.width, window.height, [&](const Tile &tile) {
+        std::vector<HitRecord> primaryHits;
+        ShadingBatch litHits(window, lightPosition, cameraPosition);
+        for (size_t y = tile.y0; y < tile.y1; y++) {
+            if ((y - tile.y0) % RayPacket::ROWS == 0) tracePrimaryBand(y, tile.x0, tile.x1, window.width, window.height, 1.0f, cameraPosition, models, primaryHits);
+            for (size_t x = tile.x0; x < tile.x1; x++) {
+                glm::vec3 rayDirection = getRayDirectionFromPixel(x, y, window.width, window.height, 1.0f, cameraPosition);
+                const HitRecord &primaryHit = primaryHits[(y - tile.y0) % RayPacket::ROWS * tile.width() + x - tile.x0];
+                Pcg32 random = sampleRandom(x, y, window.width, PRIMARY_SAMPLE);
+                RayTriangleIntersection rayIntersection = toRayTriangleIntersection(continueRay<ReflectionTrace>(primaryHit, rayDirection, models, random), models);
+
+                if (rayIntersection.distanceFromCamera != std::numeric_limits<float>::infinity()) {
+                    Colour baseColour;
+                    if (rayIntersection.intersectedTriangle.hasTexture) {
+                        uint32_t textureColour = textureMap.getColourAt(rayIntersection.textureCoords.x, rayIntersection.textureCoords.y);
+                        baseColour = Colour(textureColour >> 16 & 0xFF, textureColour >> 8 & 0xFF, textureColour & 0xFF);
+                    } else {
+                        baseColour = rayIntersection.intersectedTriangle.colour;
+                    }
+                    litHits.add(rayIntersection.intersectionPoint, rayIntersection.intersectedTriangle.normal, baseColour, x, y);
                 }
-
-                Colour adjustedColour = adjustBrightness(baseColour, combinedBrightness);
-                Colour specularColor = multiplyColour(Colour(255, 255, 255), specIntensity);
-                Colour finalColor = addColours(adjustBrightness(baseColour, combinedBrightness), specularColor);
-
-
-
-                    uint32_t packedColour =
-                            (255 << 24) + (finalColor.red << 16) + (finalColor.green << 8) + finalColor.blue;
-                    window.setPixelColour(x, y, packedColour);
-
-
-
             }
         }
-    }
+        litHits.flush();
+    });
 
 
 }
@@ -1277,261 +1508,457 @@ void drawRasterisedScene_Ball(DrawingWindow &window, glm::vec3 cameraPosition, g
 //    const std::map<std::string, Colour> palette2 = loadMTL("../05 Navigation and Transformation/models/wooden_sphere.mtl");
 
 //    const std::string filepath = "../05 Navigation and Transformation/models/env.obj";
-    const std::map<std::string, Colour> palette = loadMTL(
-            "../05 Navigation and Transformation/models/textured-cornell-box.mtl");
 
-    std::vector<ModelTriangle> models = loadOBJWithTexture(filepath2, palette);
-    TextureMap textureMap("../05 Navigation and Transformation/models/texture.ppm");
+    TriangleView models = loadModel(filepath2, "../05 Navigation and Transformation/models/textured-cornell-box.mtl", true);
+    TextureMap &textureMap = loadTexture("../05 Navigation and Transformation/models/texture.ppm");
     uint32_t colour;
-    for (size_t y = 0; y < window.height; y++) {
-        for (size_t x = 0; x < window.width; x++) {
-            glm::vec3 rayDirection = getRayDirectionFromPixel(x, y, window.width, window.height, 1.0f, cameraPosition);
-            RayTriangleIntersection rayIntersection = getReflectionIntersection(cameraPosition, rayDirection, models);
-
-            if (rayIntersection.distanceFromCamera != std::numeric_limits<float>::infinity()) {
-
+    prepareModel(models);
+    getTilePool().render(window.width, window.height, [&](const Tile &tile) {
+        std::vector<HitRecord> primaryHits;
+        ShadingBatch litHits(window, lightPosition, cameraPosition);
+        for (size_t y = tile.y0; y < tile.y1; y++) {
+            if ((y - tile.y0) % RayPacket::ROWS == 0) tracePrimaryBand(y, tile.x0, tile.x1, window.width, window.height, 1.0f, cameraPosition, models, primaryHits);
+            for (size_t x = tile.x0; x < tile.x1; x++) {
+                glm::vec3 rayDirection = getRayDirectionFromPixel(x, y, window.width, window.height, 1.0f, cameraPosition);
+                const HitRecord &primaryHit = primaryHits[(y - tile.y0) % RayPacket::ROWS * tile.width() + x - tile.x0];
+                Pcg32 random = sampleRandom(x, y, window.width, PRIMARY_SAMPLE);
+                RayTriangleIntersection rayIntersection = toRayTriangleIntersection(continueRay<ReflectionTrace>(primaryHit, rayDirection, models, random), models);
+
+                if (rayIntersection.distanceFromCamera != std::numeric_limits<float>::infinity()) {
+                    Colour baseColour;
+                    if (rayIntersection.intersectedTriangle.hasTexture) {
+                        uint32_t textureColour = textureMap.getColourAt(rayIntersection.textureCoords.x, rayIntersection.textureCoords.y);
+                        baseColour = Colour(textureColour >> 16 & 0xFF, textureColour >> 8 & 0xFF, textureColour & 0xFF);
+                    } else {
+                        baseColour = rayIntersection.intersectedTriangle.colour;
+                    }
+                    litHits.add(rayIntersection.intersectionPoint, rayIntersection.intersectedTriangle.normal, baseColour, x, y);
+                }
+            }
+        }
+        litHits.flush();
+    });
 
-                float distance = glm::length(lightPosition - rayIntersection.intersectionPoint);
-                float distanceAttenuation = 100.0f / (5.0f * M_PI * distance * distance);
 
+}
 
-                glm::vec3 lightDir = glm::normalize(lightPosition - rayIntersection.intersectionPoint);
-                float dotProduct = glm::dot(rayIntersection.intersectedTriangle.normal, lightDir);
-                float normalBrightness = std::max(dotProduct, 0.0f);
-                float ambientLightThreshold = 0.2f;
-                float calculatedBrightness = std::min(normalBrightness * distanceAttenuation, 1.0f);
-                float combinedBrightness = std::max(ambientLightThreshold, calculatedBrightness);
 
-                glm::vec3 viewDir = glm::normalize(cameraPosition - rayIntersection.intersectionPoint);
-                glm::vec3 reflectDir = glm::reflect(-lightDir, rayIntersection.intersectedTriangle.normal);
 
+void drawRasterisedScene_Mirror(DrawingWindow &window, glm::vec3 cameraPosition, glm::vec3 lightPosition) {
+    const std::string filepath = "../04 Wireframes and Rasterising/models/Mirror-box.obj";
+    TriangleView models = loadModel(filepath, "../04 Wireframes and Rasterising/models/cornell-box.mtl", true);
+    prepareModel(models);
+    getTilePool().render(window.width, window.height, [&](const Tile &tile) {
+        std::vector<HitRecord> primaryHits;
+        ShadingBatch litHits(window, lightPosition, cameraPosition);
+        for (size_t y = tile.y0; y < tile.y1; y++) {
+            if ((y - tile.y0) % RayPacket::ROWS == 0) tracePrimaryBand(y, tile.x0, tile.x1, window.width, window.height, 1.0f, cameraPosition, models, primaryHits);
+            for (size_t x = tile.x0; x < tile.x1; x++) {
+                glm::vec3 rayDirection = getRayDirectionFromPixel(x, y, window.width, window.height, 1.0f, cameraPosition);
+                const HitRecord &primaryHit = primaryHits[(y - tile.y0) % RayPacket::ROWS * tile.width() + x - tile.x0];
+                Pcg32 random = sampleRandom(x, y, window.width, PRIMARY_SAMPLE);
+
+                // Glass both reflects and refracts, so what the camera sees through it is the sum of a split path
+                if (primaryHit.isHit() && models[primaryHit.triangleIndex].isGlass) {
+                    Colour glassColour = traceGlassColour<SpecularTrace>(primaryHit, rayDirection, models, random);
+                    window.setPixelColour(x, y, (255 << 24) + (glassColour.red << 16) + (glassColour.green << 8) + glassColour.blue);
+                    continue;
+                }
 
-                float specIntensity = std::pow(std::max(glm::dot(viewDir, reflectDir), 0.0f), 256);
-                float specIntensity2 = std::pow(std::max(glm::dot(viewDir, reflectDir), 0.0f), 128);
-                float specIntensity3 = std::pow(std::max(glm::dot(viewDir, reflectDir), 0.0f), 64);
+                RayTriangleIntersection rayIntersection = toRayTriangleIntersection(continueRay<SpecularTrace>(primaryHit, rayDirection, models, random), models);
 
+                if (rayIntersection.distanceFromCamera != std::numeric_limits<float>::infinity()) {
+                    if (rayIntersection.intersectedTriangle.isMirror) {
 
+                        RayTriangleIntersection reflectedIntersection = traceIntersection<ReflectionTrace>(
+                                rayIntersection.intersectionPoint,
+                                glm::reflect(rayDirection, rayIntersection.intersectedTriangle.normal),
+                                models, random
+                        );
 
-//                if (rayIntersection.intersectedTriangle.hasTexture) {
-//                    float xTex = rayIntersection.textureCoords.x * textureMap.width;
-//                    float yTex = rayIntersection.textureCoords.y * textureMap.height;
-//                    glm::vec3 perterbed_normal = getClearNormal(textureMap, xTex, yTex);
-//                    rayIntersection.intersectedTriangle.normal = glm::normalize(perterbed_normal);
-//                }
 
-//
-//                if (rayIntersection.intersectedTriangle.hasTexture) {
-//                    float xTex = rayIntersection.textureCoords.x * textureMap.width;
-//                    float yTex = rayIntersection.textureCoords.y * textureMap.height;
-//                    glm::vec3 perterbed_normal = getBumpedNormal(textureMap, xTex, yTex);
-//                    rayIntersection.intersectedTriangle.normal = glm::normalize(perterbed_normal);
-//                }
-
-                Colour baseColour;
-                if (rayIntersection.intersectedTriangle.hasTexture) {
-                    uint32_t textureColour = textureMap.getColourAt(rayIntersection.textureCoords.x, rayIntersection.textureCoords.y);
-                    baseColour = Colour(textureColour >> 16 & 0xFF, textureColour >> 8 & 0xFF, textureColour & 0xFF);
-                } else {
-                    baseColour = rayIntersection.intersectedTriangle.colour;
+                        Colour reflectedColour = reflectedIntersection.intersectedTriangle.colour;
+                        uint32_t packedReflectedColour = (255 << 24) + (reflectedColour.red << 16) + (reflectedColour.green << 8) + reflectedColour.blue;
+                        window.setPixelColour(x, y, packedReflectedColour);
+                    } else if (isPointInShadow(rayIntersection.intersectionPoint, rayIntersection.triangleIndex, models)) {
+                        litHits.add(rayIntersection.intersectionPoint, rayIntersection.intersectedTriangle.normal, rayIntersection.intersectedTriangle.colour, x, y);
+                    } else {
+                        window.setPixelColour(x, y, getShadowedColour(rayIntersection.intersectedTriangle.colour));
+                    }
                 }
+            }
+        }
+        litHits.flush();
+    });
+}
 
-                Colour adjustedColour = adjustBrightness(baseColour, combinedBrightness);
-                Colour specularColor = multiplyColour(Colour(255, 255, 255), specIntensity);
-                Colour finalColor = addColours(adjustBrightness(baseColour, combinedBrightness), specularColor);
 
+// Direct light on the surface, with the colour gathered by the indirect samples mixed into it
+uint32_t shadeIndirectSceneSurface(const RayTriangleIntersection &rayIntersection, const Colour &averageColour,
+                                   const glm::vec3 &lightPosition) {
+    float distance = glm::length(lightPosition - rayIntersection.intersectionPoint);
+    float distanceAttenuation = 100.0f / (4.0f * M_PI * distance * distance);
 
 
-                uint32_t packedColour =
-                        (255 << 24) + (finalColor.red << 16) + (finalColor.green << 8) + finalColor.blue;
-                window.setPixelColour(x, y, packedColour);
+    glm::vec3 lightDir = glm::normalize(lightPosition - rayIntersection.intersectionPoint);
+    float dotProduct = glm::dot(rayIntersection.intersectedTriangle.normal, lightDir);
+    float normalBrightness = std::max(dotProduct, 0.0f);
 
+    float ambientLightThreshold = 0.1f;
+    float normalBrightnesss = std::max(ambientLightThreshold, normalBrightness);
 
+    float calculatedBrightness = std::min(normalBrightnesss * distanceAttenuation, 1.0f);
 
-            }
-        }
-    }
+    Colour ChangeColor=rayIntersection.intersectedTriangle.colour;
 
+    Colour adjustedColour = adjustBrightness(averageColour,calculatedBrightness);
 
-}
+    Colour NewColor=MixColours(ChangeColor,adjustedColour,0.7);
+    Colour adjustedColour2 = adjustBrightness(NewColor,calculatedBrightness);
+    Colour finalColor = adjustedColour2;
 
+    return (255 << 24) + (finalColor.red << 16) + (finalColor.green << 8) + finalColor.blue;
+}
 
-
-void drawRasterisedScene_Mirror(DrawingWindow &window, glm::vec3 cameraPosition, glm::vec3 lightPosition) {
-    const std::string filepath = "../04 Wireframes and Rasterising/models/Mirror-box.obj";
-    const std::map<std::string, Colour> palette = loadMTL("../04 Wireframes and Rasterising/models/cornell-box.mtl");
-    std::vector<ModelTriangle> models = loadOBJWithTexture(filepath, palette);
-    for (size_t y = 0; y < window.height; y++) {
-        for (size_t x = 0; x < window.width; x++) {
-            glm::vec3 rayDirection = getRayDirectionFromPixel(x, y, window.width, window.height, 1.0f, cameraPosition);
-
-            RayTriangleIntersection rayIntersection = getClosestValidIntersectionWithReflection(cameraPosition, rayDirection, models);
-
-            if (rayIntersection.distanceFromCamera != std::numeric_limits<float>::infinity()) {
-                if (rayIntersection.intersectedTriangle.isMirror) {
-
-                    RayTriangleIntersection reflectedIntersection = getReflectionIntersection(
-                            rayIntersection.intersectionPoint,
-                            glm::reflect(rayDirection, rayIntersection.intersectedTriangle.normal),
-                            models
-                    );
-
-
-                    Colour reflectedColour = reflectedIntersection.intersectedTriangle.colour;
-                    uint32_t packedReflectedColour = (255 << 24) + (reflectedColour.red << 16) + (reflectedColour.green << 8) + reflectedColour.blue;
-                    window.setPixelColour(x, y, packedReflectedColour);
-                } else {
-
-                    float distance = glm::length(lightPosition - rayIntersection.intersectionPoint);
-                    float distanceAttenuation = 100.0f / (5.0f * M_PI * distance * distance);
-
-
-                    glm::vec3 lightDir = glm::normalize(lightPosition - rayIntersection.intersectionPoint);
-                    float dotProduct = glm::dot(rayIntersection.intersectedTriangle.normal, lightDir);
-                    float normalBrightness = std::max(dotProduct, 0.0f);
-
-                    float ambientLightThreshold = 0.2f;
-
-                    float calculatedBrightness = std::min(normalBrightness * distanceAttenuation, 1.0f);
-                    float combinedBrightness = std::max(ambientLightThreshold, calculatedBrightness);
-
-                    glm::vec3 viewDir = glm::normalize(cameraPosition - rayIntersection.intersectionPoint);
-
-
-                    glm::vec3 reflectDir = glm::reflect(-lightDir, rayIntersection.intersectedTriangle.normal);
-
-
-                    float specIntensity = std::pow(std::max(glm::dot(viewDir, reflectDir), 0.0f), 256);
-
-
-                    Colour originalColour = rayIntersection.intersectedTriangle.colour;
-                    Colour adjustedColour = adjustBrightness(originalColour, combinedBrightness);
-                    Colour specularColor = multiplyColour(Colour(255, 255, 255), specIntensity);
-                    Colour finalColor = addColours(adjustedColour, specularColor);
-
-                    if (isPointInShadow(rayIntersection.intersectionPoint, rayIntersection.triangleIndex, models)) {
-                        uint32_t packedColour = (255 << 24) + (finalColor.red << 16) + (finalColor.green << 8) + finalColor.blue;
-                        window.setPixelColour(x, y, packedColour);
-                    } else {
-                        finalColor = adjustBrightness(rayIntersection.intersectedTriangle.colour, 0.2f);
-                        uint32_t packedColour = (255 << 24) + (finalColor.red/2 << 16) + (finalColor.green << 8) + finalColor.blue/2;
-                        window.setPixelColour(x, y, packedColour);
-                    }
+void drawRasterisedScene_indirect(DrawingWindow &window, glm::vec3 cameraPosition, glm::vec3 lightPosition) {
+    const std::string filepath = "../04 Wireframes and Rasterising/models/cornell-box.obj";
+    TriangleView models = loadModel(filepath, "../04 Wireframes and Rasterising/models/cornell-box.mtl", true);
+    prepareModel(models);
+    getTilePool().render(window.width, window.height, [&](const Tile &tile) {
+        std::vector<HitRecord> primaryHits;
+        for (size_t y = tile.y0; y < tile.y1; y++) {
+            if ((y - tile.y0) % RayPacket::ROWS == 0) tracePrimaryBand(y, tile.x0, tile.x1, window.width, window.height, 1.0f, cameraPosition, models, primaryHits);
+            for (size_t x = tile.x0; x < tile.x1; x++) {
+                glm::vec3 rayDirection = getRayDirectionFromPixel(x, y, window.width, window.height, 1.0f, cameraPosition);
+                const HitRecord &primaryHit = primaryHits[(y - tile.y0) % RayPacket::ROWS * tile.width() + x - tile.x0];
+
+                // Sample s scatters the same way on any thread, and the same way drawIndirectSceneWavefront scatters it
+                auto traceSample = [&](uint32_t sample) {
+                    Pcg32 random = sampleRandom(x, y, window.width, sample);
+                    return continueRay<IndirectTrace>(primaryHit, rayDirection, models, random);
+                };
+                HitRecord hit2 = traceSample(0);
+                HitRecord hit3 = traceSample(1);
+                HitRecord hit4 = traceSample(2);
+                HitRecord hit5 = traceSample(3);
+                HitRecord hit6 = traceSample(4);
+                HitRecord hit7 = traceSample(5);
+                HitRecord hit8 = traceSample(6);
+                HitRecord hit9 = traceSample(7);
+                Colour colour2 = getHitColour(hit2, models);
+                Colour colour3 = getHitColour(hit3, models);
+                Colour colour4 = getHitColour(hit4, models);
+                Colour colour5 = getHitColour(hit5, models);
+                Colour colour6 = getHitColour(hit6, models);
+                Colour colour7 = getHitColour(hit7, models);
+                Colour colour8 = getHitColour(hit8, models);
+                Colour colour9 = getHitColour(hit9, models);
+
+                float totalRed = colour2.red + colour3.red + colour4.red + colour5.red +
+                                 colour6.red + colour7.red + colour8.red + colour9.red;
+                float totalGreen = colour2.green + colour3.green + colour4.green + colour5.green +
+                                   colour6.green + colour7.green + colour8.green + colour9.green;
+                float totalBlue = colour2.blue + colour3.blue + colour4.blue + colour5.blue +
+                                  colour6.blue + colour7.blue + colour8.blue + colour9.blue;
+
+
+                int numberOfIntersections = 8;
+                float averageRed = totalRed / numberOfIntersections;
+                float averageGreen = totalGreen / numberOfIntersections;
+                float averageBlue = totalBlue / numberOfIntersections;
+
+                Colour averageColour(averageRed, averageGreen, averageBlue);
+
+
+
+
+
+                Pcg32 random = sampleRandom(x, y, window.width, PRIMARY_SAMPLE);
+                RayTriangleIntersection rayIntersection = toRayTriangleIntersection(continueRay<SpecularTrace>(primaryHit, rayDirection, models, random), models);
+                if (rayIntersection.distanceFromCamera != std::numeric_limits<float>::infinity()) {
+                    window.setPixelColour(x, y, shadeIndirectSceneSurface(rayIntersection, averageColour, lightPosition));
                 }
             }
         }
-    }
+    });
 }
 
 
-void drawRasterisedScene_indirect(DrawingWindow &window, glm::vec3 cameraPosition, glm::vec3 lightPosition) {
-    const std::string filepath = "../04 Wireframes and Rasterising/models/cornell-box.obj";
-    const std::map<std::string, Colour> palette = loadMTL("../04 Wireframes and Rasterising/models/cornell-box.mtl");
-    std::vector<ModelTriangle> models = loadOBJWithTexture(filepath, palette);
-    for (size_t y = 0; y < window.height; y++) {
-        for (size_t x = 0; x < window.width; x++) {
-            glm::vec3 rayDirection = getRayDirectionFromPixel(x, y, window.width, window.height, 1.0f, cameraPosition);
-
-            RayTriangleIntersection rayIntersection2 = getClosestValidIntersectionWithIndirect(cameraPosition, rayDirection, models);
-            RayTriangleIntersection rayIntersection3 = getClosestValidIntersectionWithIndirect(cameraPosition, rayDirection, models);
-            RayTriangleIntersection rayIntersection4 = getClosestValidIntersectionWithIndirect(cameraPosition, rayDirection, models);
-            RayTriangleIntersection rayIntersection5 = getClosestValidIntersectionWithIndirect(cameraPosition, rayDirection, models);
-            RayTriangleIntersection rayIntersection6 = getClosestValidIntersectionWithIndirect(cameraPosition, rayDirection, models);
-            RayTriangleIntersection rayIntersection7 = getClosestValidIntersectionWithIndirect(cameraPosition, rayDirection, models);
-            RayTriangleIntersection rayIntersection8 = getClosestValidIntersectionWithIndirect(cameraPosition, rayDirection, models);
-            RayTriangleIntersection rayIntersection9 = getClosestValidIntersectionWithIndirect(cameraPosition, rayDirection, models);
-            Colour colour2 = rayIntersection2.intersectedTriangle.colour;
-            Colour colour3 = rayIntersection3.intersectedTriangle.colour;
-            Colour colour4 = rayIntersection4.intersectedTriangle.colour;
-            Colour colour5 = rayIntersection5.intersectedTriangle.colour;
-            Colour colour6 = rayIntersection6.intersectedTriangle.colour;
-            Colour colour7 = rayIntersection7.intersectedTriangle.colour;
-            Colour colour8 = rayIntersection8.intersectedTriangle.colour;
-            Colour colour9 = rayIntersection5.intersectedTriangle.colour;
-
-            float totalRed = colour2.red + colour3.red + colour4.red + colour5.red +
-                             colour6.red + colour7.red + colour8.red + colour9.red;
-            float totalGreen = colour2.green + colour3.green + colour4.green + colour5.green +
-                               colour6.green + colour7.green + colour8.green + colour9.green;
-            float totalBlue = colour2.blue + colour3.blue + colour4.blue + colour5.blue +
-                              colour6.blue + colour7.blue + colour8.blue + colour9.blue;
-
-
-            int numberOfIntersections = 8;
-            float averageRed = totalRed / numberOfIntersections;
-            float averageGreen = totalGreen / numberOfIntersections;
-            float averageBlue = totalBlue / numberOfIntersections;
-
-            Colour averageColour(averageRed, averageGreen, averageBlue);
-
-
-
-
-
-            RayTriangleIntersection rayIntersection = getClosestValidIntersectionWithReflection(cameraPosition,
-                                                                                                rayDirection, models);
-            if (rayIntersection.distanceFromCamera != std::numeric_limits<float>::infinity()) {
-//                if (rayIntersection.intersectedTriangle.isMirror) {
-//
-//                    RayTriangleIntersection reflectedIntersection = getReflectionIntersection(
-//                            rayIntersection.intersectionPoint,
-//                            glm::reflect(rayDirection, rayIntersection.intersectedTriangle.normal),
-//                            models
-//                    );
-//
-//
-//                    Colour reflectedColour = reflectedIntersection.intersectedTriangle.colour;
-//                    uint32_t packedReflectedColour = (255 << 24) + (reflectedColour.red << 16) + (reflectedColour.green << 8) + reflectedColour.blue;
-//                    window.setPixelColour(x, y, packedReflectedColour);
-//                } else {
-
-                    float distance = glm::length(lightPosition - rayIntersection.intersectionPoint);
-                    float distanceAttenuation = 100.0f / (4.0f * M_PI * distance * distance);
-
-
-                    glm::vec3 lightDir = glm::normalize(lightPosition - rayIntersection.intersectionPoint);
-                    float dotProduct = glm::dot(rayIntersection.intersectedTriangle.normal, lightDir);
-                    float normalBrightness = std::max(dotProduct, 0.0f);
-
-                    float ambientLightThreshold = 0.1f;
-                    float normalBrightnesss = std::max(ambientLightThreshold, normalBrightness);
-
-                    float calculatedBrightness = std::min(normalBrightnesss * distanceAttenuation, 1.0f);
-//                    float combinedBrightness = std::max(ambientLightThreshold, calculatedBrightness);
-
-
-//                    glm::vec3 viewDir = glm::normalize(cameraPosition - rayIntersection.intersectionPoint);
+// Wavefront versions of the Mirror and indirect scenes. The renderers above follow each pixel's bounces depth-first,
+// so one secondary ray after another starts somewhere else in the scene and points somewhere else. Here every ray of
+// a bounce depth is queued first, sorted by direction octant and origin (see RayQueue) and traced as one batch, and
+// shading only starts once all of them are done, one material at a time.
+
+const int INDIRECT_SAMPLES = 8;
+// Image rows per wavefront. A whole frame of indirect samples would be hundreds of megabytes of path state; a band
+// keeps every queue in cache while still giving the sort tens of thousands of rays to work with.
+const size_t WAVEFRONT_ROWS = 16;
+
+struct WavefrontPath {
+    HitRecord hit;
+    // Direction of the segment that ended at hit
+    glm::vec3 direction{};
+    int depth = 0;
+    // Metal surface that tints whatever the queued ray hits, as in continueRay
+    size_t tint = NO_TINT;
+    // Carried along with the path, so it draws what the per-pixel renderer draws for the same sample
+    Pcg32 random;
+};
 
+// What the wavefront passes of a frame did, for --bench-wavefront
+struct WavefrontStats {
+    size_t passCount = 0;
+    // Summed over the bands, so with several threads this is thread time rather than time on the clock
+    double traceMs = 0.0;
+    // Neighbouring rays in the order they were queued (pixel order) and in the order they were traced
+    RayCoherence queued;
+    RayCoherence traced;
+
+    WavefrontStats &operator+=(const WavefrontStats &other) {
+        passCount += other.passCount;
+        traceMs += other.traceMs;
+        queued += other.queued;
+        traced += other.traced;
+        return *this;
+    }
+};
 
-//                    glm::vec3 reflectDir = glm::reflect(-lightDir, rayIntersection.intersectedTriangle.normal);
+std::ostream &operator<<(std::ostream &os, const WavefrontStats &stats) {
+    os << stats.traced.rayCount << " rays in " << stats.passCount << " passes, traced in " << stats.traceMs << " ms ("
+       << stats.traced.rayCount / (stats.traceMs * 1e3) << " Mrays/s); queued: " << stats.queued << "; traced: " << stats.traced;
+    return os;
+}
 
+// Puts the queue in tracing order (unless sortRays is off, to measure what sorting buys) and records how coherent
+// it was before and after
+void sortWavefront(RayQueue &queue, TriangleView triangles, bool sortRays, WavefrontStats *stats) {
+    ArrayView<BVHNode> nodes = getBVH(triangles).getNodes();
+    if (nodes.empty()) return;
+    const BVHNode &root = nodes[0];
+    if (stats) stats->queued += queue.measureCoherence(root.boundsMin, root.boundsMax);
+    if (sortRays) queue.sort(root.boundsMin, root.boundsMax);
+    if (stats) stats->traced += queue.measureCoherence(root.boundsMin, root.boundsMax);
+}
 
-//                    float specIntensity = std::pow(std::max(glm::dot(viewDir, reflectDir), 0.0f), 256);
+// Traces one bounce depth, moving each queued path on to the closest hit of its ray
+void traceWavefront(RayQueue &queue, std::vector<WavefrontPath> &paths, TriangleView triangles,
+                    bool sortRays, WavefrontStats *stats) {
+    if (queue.empty()) return;
+    sortWavefront(queue, triangles, sortRays, stats);
+    auto start = std::chrono::steady_clock::now();
+    for (const QueuedRay &ray : queue) {
+        WavefrontPath &path = paths[ray.path];
+        path.hit = getClosestHit(ray.origin, ray.direction, triangles);
+        path.hit.tintTriangleIndex = path.tint;
+        path.direction = ray.direction;
+    }
+    if (stats) {
+        stats->traceMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        stats->passCount++;
+    }
+}
 
+// Shadow rays of one pass: occluded[ray.path] is set if anything other than triangle ignoreIndices[ray.path] is in the way
+void traceShadowWavefront(RayQueue &queue, const std::vector<size_t> &ignoreIndices, std::vector<char> &occluded,
+                          TriangleView triangles, bool sortRays, WavefrontStats *stats) {
+    occluded.assign(ignoreIndices.size(), 0);
+    if (queue.empty()) return;
+    sortWavefront(queue, triangles, sortRays, stats);
+    auto start = std::chrono::steady_clock::now();
+    for (const QueuedRay &ray : queue) {
+        occluded[ray.path] = isOccluded(ray.origin, ray.direction, ray.maxDistance, ignoreIndices[ray.path], triangles);
+    }
+    if (stats) {
+        stats->traceMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        stats->passCount++;
+    }
+}
 
-//                    Colour originalColour = rayIntersection2.intersectedTriangle.colour;
-//                    originalColour.green = 0;
-//                    originalColour.red=255;
-                    Colour ChangeColor=rayIntersection.intersectedTriangle.colour;
-//                    Colour adjustedColour3 = adjustBrightness(ChangeColor,calculatedBrightness);
+// Follows the paths' bounces one depth per pass until every path has stopped or reached the policy's depth, which gives
+// the hits continueRay would. Only specular bounces are queued here, a diffuse scatter is up to the caller.
+template<typename Policy>
+void traceSpecularWavefront(std::vector<WavefrontPath> &paths, TriangleView triangles, bool sortRays,
+                            WavefrontStats *stats) {
+    std::vector<uint32_t> active(paths.size());
+    std::iota(active.begin(), active.end(), 0);
+    RayQueue queue;
+    while (!active.empty()) {
+        queue.clear();
+        size_t stillActive = 0;
+        for (uint32_t index : active) {
+            WavefrontPath &path = paths[index];
+            if (path.depth >= Policy::MAX_DEPTH || !path.hit.isHit()) continue;
+            const ModelTriangle &triangle = triangles[path.hit.triangleIndex];
+            glm::vec3 origin, direction;
+            if (!getSpecularBounce(triangle, path.hit.intersectionPoint, path.direction, Policy::THROUGH_GLASS, path.random,
+                                   origin, direction)) {
+                continue;
+            }
+            path.tint = triangle.isMetal && path.depth == Policy::MAX_DEPTH - 1 ? path.hit.triangleIndex : NO_TINT;
+            path.depth++;
+            queue.push(origin, direction, index);
+            active[stillActive++] = index;
+        }
+        active.resize(stillActive);
+        traceWavefront(queue, paths, triangles, sortRays, stats);
+    }
+}
 
-                    Colour adjustedColour = adjustBrightness(averageColour,calculatedBrightness);
+// Primary hits for rows [firstRow, firstRow + WAVEFRONT_ROWS) of the image, traced in packets like the per-pixel
+// renderers do; path p is pixel (p % width, firstRow + p / width)
+std::vector<WavefrontPath> tracePrimaryWavefront(const DrawingWindow &window, size_t firstRow, const glm::vec3 &cameraPosition,
+                                                 TriangleView triangles) {
+    size_t lastRow = std::min(firstRow + WAVEFRONT_ROWS, window.height);
+    std::vector<WavefrontPath> paths(window.width * (lastRow - firstRow));
+    std::vector<HitRecord> band;
+    for (size_t y0 = firstRow; y0 < lastRow; y0 += RayPacket::ROWS) {
+        tracePrimaryBand(y0, 0, window.width, window.width, window.height, 1.0f, cameraPosition, triangles, band);
+        for (size_t y = y0; y < std::min(y0 + RayPacket::ROWS, lastRow); y++) {
+            for (size_t x = 0; x < window.width; x++) {
+                WavefrontPath &path = paths[(y - firstRow) * window.width + x];
+                path.hit = band[(y - y0) * window.width + x];
+                path.direction = getRayDirectionFromPixel(x, y, window.width, window.height, 1.0f, cameraPosition);
+                path.random = sampleRandom(x, y, window.width, PRIMARY_SAMPLE);
+            }
+        }
+    }
+    return paths;
+}
 
-                    Colour NewColor=MixColours(ChangeColor,adjustedColour,0.7);
-                    Colour adjustedColour2 = adjustBrightness(NewColor,calculatedBrightness);
-//                    Colour adjustedColour = adjustBrightness(NewColor, calculatedBrightness);
-//                    Colour specularColor = multiplyColour(Colour(255, 255, 255), specIntensity);
-//                    Colour finalColor = addColours(adjustedColour, specularColor);
-                      Colour finalColor = adjustedColour2;
+// Renders the image one band of WAVEFRONT_ROWS rows per tile, each band with its own queues. A band's stats are
+// added to stats once it is done.
+void renderWavefrontBands(DrawingWindow &window, WavefrontStats *stats,
+                          const std::function<void(size_t firstRow, WavefrontStats *bandStats)> &renderBand) {
+    std::mutex statsMutex;
+    getTilePool().render(window.width, window.height, [&](const Tile &tile) {
+        WavefrontStats bandStats;
+        renderBand(tile.y0, stats ? &bandStats : nullptr);
+        if (!stats) return;
+        std::lock_guard<std::mutex> lock(statsMutex);
+        *stats += bandStats;
+    }, window.width, WAVEFRONT_ROWS);
+}
 
+// The same image as drawRasterisedScene_Mirror, traced a bounce depth at a time
+void drawMirrorSceneWavefront(DrawingWindow &window, glm::vec3 cameraPosition, glm::vec3 lightPosition,
+                              bool sortRays = true, WavefrontStats *stats = nullptr) {
+    const std::string filepath = "../04 Wireframes and Rasterising/models/Mirror-box.obj";
+    TriangleView models = loadModel(filepath, "../04 Wireframes and Rasterising/models/cornell-box.mtl", true);
+    prepareModel(models);
+    renderWavefrontBands(window, stats, [&](size_t firstRow, WavefrontStats *bandStats) {
+        RayQueue queue;
+        std::vector<WavefrontPath> paths = tracePrimaryWavefront(window, firstRow, cameraPosition, models);
+        // A path into glass splits at every glass face, so it is followed on its own ray stack rather than queued, and
+        // dropped from the passes below
+        for (uint32_t pixel = 0; pixel < paths.size(); pixel++) {
+            WavefrontPath &path = paths[pixel];
+            if (!path.hit.isHit() || !models[path.hit.triangleIndex].isGlass) continue;
+            Colour glassColour = traceGlassColour<SpecularTrace>(path.hit, path.direction, models, path.random);
+            window.setPixelColour(pixel % window.width, firstRow + pixel / window.width,
+                                  (255 << 24) + (glassColour.red << 16) + (glassColour.green << 8) + glassColour.blue);
+            path.hit = HitRecord();
+        }
+        traceSpecularWavefront<SpecularTrace>(paths, models, sortRays, bandStats);
 
-                        uint32_t packedColour = (255 << 24) + (finalColor.red << 16) + (finalColor.green << 8) + finalColor.blue;
-                        window.setPixelColour(x, y, packedColour);
+        std::vector<uint32_t> mirrorPixels, surfacePixels;
+        for (uint32_t pixel = 0; pixel < paths.size(); pixel++) {
+            const HitRecord &hit = paths[pixel].hit;
+            if (hit.isHit()) (models[hit.triangleIndex].isMirror ? mirrorPixels : surfacePixels).push_back(pixel);
+        }
 
+        // A path that still ends on a mirror mirrors the camera ray once more from there, and follows mirrors and
+        // metal as far as traceRay<ReflectionTrace> would
+        queue.clear();
+        std::vector<WavefrontPath> reflections(mirrorPixels.size());
+        for (uint32_t i = 0; i < mirrorPixels.size(); i++) {
+            const HitRecord &hit = paths[mirrorPixels[i]].hit;
+            size_t x = mirrorPixels[i] % window.width, y = firstRow + mirrorPixels[i] / window.width;
+            glm::vec3 rayDirection = getRayDirectionFromPixel(x, y, window.width, window.height, 1.0f, cameraPosition);
+            queue.push(hit.intersectionPoint, glm::reflect(rayDirection, models[hit.triangleIndex].normal), i);
+            reflections[i].random = paths[mirrorPixels[i]].random;
+        }
+        traceWavefront(queue, reflections, models, sortRays, bandStats);
+        traceSpecularWavefront<ReflectionTrace>(reflections, models, sortRays, bandStats);
+
+        // Everything else gets a shadow ray, cast from the light towards the point as isPointInShadow does
+        queue.clear();
+        std::vector<size_t> ignoreIndices(surfacePixels.size());
+        for (uint32_t i = 0; i < surfacePixels.size(); i++) {
+            const HitRecord &hit = paths[surfacePixels[i]].hit;
+            glm::vec3 toPoint = hit.intersectionPoint - shadowLightPosition;
+            queue.push(shadowLightPosition, glm::normalize(toPoint), i, glm::length(toPoint));
+            ignoreIndices[i] = hit.triangleIndex;
+        }
+        std::vector<char> occluded;
+        traceShadowWavefront(queue, ignoreIndices, occluded, models, sortRays, bandStats);
 
+        for (uint32_t i = 0; i < mirrorPixels.size(); i++) {
+            Colour reflectedColour = getHitColour(reflections[i].hit, models);
+            uint32_t packedReflectedColour = (255 << 24) + (reflectedColour.red << 16) + (reflectedColour.green << 8) + reflectedColour.blue;
+            window.setPixelColour(mirrorPixels[i] % window.width, firstRow + mirrorPixels[i] / window.width, packedReflectedColour);
+        }
+        ShadingBatch litHits(window, lightPosition, cameraPosition);
+        for (uint32_t i = 0; i < surfacePixels.size(); i++) {
+            const HitRecord &hit = paths[surfacePixels[i]].hit;
+            size_t x = surfacePixels[i] % window.width, y = firstRow + surfacePixels[i] / window.width;
+            Colour colour = getHitColour(hit, models);
+            if (occluded[i]) window.setPixelColour(x, y, getShadowedColour(colour));
+            else litHits.add(hit.intersectionPoint, hit.normal(models), colour, x, y);
+        }
+        litHits.flush();
+    });
+}
 
+// drawRasterisedScene_indirect traced a bounce depth at a time: the same lighting, with the INDIRECT_SAMPLES samples
+// of a pixel averaged evenly
+void drawIndirectSceneWavefront(DrawingWindow &window, glm::vec3 cameraPosition, glm::vec3 lightPosition,
+                                bool sortRays = true, WavefrontStats *stats = nullptr) {
+    const std::string filepath = "../04 Wireframes and Rasterising/models/cornell-box.obj";
+    TriangleView models = loadModel(filepath, "../04 Wireframes and Rasterising/models/cornell-box.mtl", true);
+    prepareModel(models);
+    renderWavefrontBands(window, stats, [&](size_t firstRow, WavefrontStats *bandStats) {
+        RayQueue queue;
+        std::vector<WavefrontPath> paths = tracePrimaryWavefront(window, firstRow, cameraPosition, models);
+
+        // Sample s of pixel p is path p * INDIRECT_SAMPLES + s. Its first bounce scatters off a diffuse surface (or
+        // follows a mirror or glass), after that only mirrors and glass are followed, as in continueRay<IndirectTrace>.
+        std::vector<WavefrontPath> samples(paths.size() * INDIRECT_SAMPLES);
+        queue.clear();
+        for (uint32_t pixel = 0; pixel < paths.size(); pixel++) {
+            const HitRecord &hit = paths[pixel].hit;
+            if (!hit.isHit()) continue;
+            const ModelTriangle &triangle = models[hit.triangleIndex];
+            for (uint32_t s = 0; s < INDIRECT_SAMPLES; s++) {
+                uint32_t index = pixel * INDIRECT_SAMPLES + s;
+                WavefrontPath &sample = samples[index];
+                sample.random = sampleRandom(pixel % window.width, firstRow + pixel / window.width, window.width, s);
+                glm::vec3 origin, direction;
+                getBounce<IndirectTrace>(triangle, hit.intersectionPoint, paths[pixel].direction, 0, sample.random, origin, direction);
+                sample.tint = triangle.isMetal && IndirectTrace::MAX_DEPTH == 1 ? hit.triangleIndex : NO_TINT;
+                sample.depth = 1;
+                queue.push(origin, direction, index);
             }
         }
-    }
+        traceWavefront(queue, samples, models, sortRays, bandStats);
+        traceSpecularWavefront<IndirectTrace>(samples, models, sortRays, bandStats);
+        // The surface itself is seen through mirrors and glass like continueRay<SpecularTrace> sees it
+        traceSpecularWavefront<SpecularTrace>(paths, models, sortRays, bandStats);
+
+        for (uint32_t pixel = 0; pixel < paths.size(); pixel++) {
+            if (!paths[pixel].hit.isHit()) continue;
+            float totalRed = 0.0f, totalGreen = 0.0f, totalBlue = 0.0f;
+            for (uint32_t s = 0; s < INDIRECT_SAMPLES; s++) {
+                Colour colour = getHitColour(samples[pixel * INDIRECT_SAMPLES + s].hit, models);
+                totalRed += colour.red;
+                totalGreen += colour.green;
+                totalBlue += colour.blue;
+            }
+            Colour averageColour(totalRed / INDIRECT_SAMPLES, totalGreen / INDIRECT_SAMPLES, totalBlue / INDIRECT_SAMPLES);
+            RayTriangleIntersection rayIntersection = toRayTriangleIntersection(paths[pixel].hit, models);
+            window.setPixelColour(pixel % window.width, firstRow + pixel / window.width,
+                                  shadeIndirectSceneSurface(rayIntersection, averageColour, lightPosition));
+        }
+    });
 }
 
 
@@ -1559,115 +1986,58 @@ Colour MixColours(Colour& c1, Colour& c2, float ratio) {
 //    );
 //}
 
-float ComputeFresnel(const glm::vec3 &I, const glm::vec3 &N, float refractiveIndex) {
-    float cosi = glm::clamp(glm::dot(I, N), -1.0f, 1.0f);
-    float etai = 1, etat = refractiveIndex;
-    if (cosi > 0) { std::swap(etai, etat); }
-    float sint = etai / etat * sqrtf(std::max(0.f, 1 - cosi * cosi));
-    if (sint >= 1) {
-        return 1;
-    }
-    else {
-        float cost = sqrtf(std::max(0.f, 1 - sint * sint));
-        cosi = fabsf(cosi);
-        float Rs = ((etat * cosi) - (etai * cost)) / ((etat * cosi) + (etai * cost));
-        float Rp = ((etai * cosi) - (etat * cost)) / ((etai * cosi) + (etat * cost));
-        return (Rs * Rs + Rp * Rp) / 2;
-    }
-}
 
 
 void drawRasterisedScene_Metal(DrawingWindow &window, glm::vec3 cameraPosition, glm::vec3 lightPosition) {
     const std::string filepath = "../04 Wireframes and Rasterising/models/cornell-box.obj";
-    const std::map<std::string, Colour> palette = loadMTL(
-            "../04 Wireframes and Rasterising/models/cornell-box.mtl");
-    std::vector<ModelTriangle> models = loadOBJWithTexture(filepath, palette);
-    for (size_t y = 0; y < window.height; y++) {
-        for (size_t x = 0; x < window.width; x++) {
-            glm::vec3 rayDirection = getRayDirectionFromPixel(x, y, window.width, window.height, 1.0f, cameraPosition);
-
-            RayTriangleIntersection rayIntersection = getClosestValidIntersectionWithReflection(cameraPosition,
-                                                                                                rayDirection, models);
-
-            if (rayIntersection.distanceFromCamera != std::numeric_limits<float>::infinity()) {
-                if (rayIntersection.intersectedTriangle.isMirror) {
-
-                    RayTriangleIntersection reflectedIntersection = getReflectionIntersection(
-                            rayIntersection.intersectionPoint,
-                            glm::reflect(rayDirection, rayIntersection.intersectedTriangle.normal),
-                            models
-                    );
-
-                    Colour reflectedColour = reflectedIntersection.intersectedTriangle.colour;
-                    uint32_t packedReflectedColour =
-                            (255 << 24) + (reflectedColour.red << 16) + (reflectedColour.green << 8) +
-                            reflectedColour.blue;
-                    window.setPixelColour(x, y, packedReflectedColour);
-                }
-                if (rayIntersection.intersectedTriangle.isGlass) {
-
-                    glm::vec3 reflectedDirection = glm::reflect(rayDirection, rayIntersection.intersectedTriangle.normal);
-                    glm::vec3 reflectionOrigin = rayIntersection.intersectionPoint + reflectedDirection * 0.001f;
-
-                    RayTriangleIntersection reflectedIntersection = getClosestValidIntersectionWithReflection(
-                            reflectionOrigin, reflectedDirection, models);
-                    Colour reflectedColour = reflectedIntersection.intersectedTriangle.colour;
-
-                    glm::vec3 refractedDirection = glm::refract(rayDirection, rayIntersection.intersectedTriangle.normal, rayIntersection.intersectedTriangle.refractiveIndex);
-                    glm::vec3 refractedOrigin = rayIntersection.intersectionPoint;
-
-                    RayTriangleIntersection refractedIntersection = getClosestValidIntersectionWithReflection(
-                            refractedOrigin, refractedDirection, models);
-                    Colour refractedColour = refractedIntersection.intersectedTriangle.colour;
-
-                    float fresnelReflectance = ComputeFresnel(rayDirection, rayIntersection.intersectedTriangle.normal, rayIntersection.intersectedTriangle.refractiveIndex);
-//                 Colour finalColour = MixColours(reflectedColour, refractedColour, fresnelReflectance);
-                    Colour finalColour=refractedColour;
-
-
-                    uint32_t packedFinalColour =
-                            (255 << 24) + (finalColour.red << 16) + (finalColour.green << 8) + finalColour.blue;
-
-
-                    window.setPixelColour(x, y, packedFinalColour);
-                }else {
-                    float distance = glm::length(lightPosition - rayIntersection.intersectionPoint);
-                    float distanceAttenuation = 100.0f / (5.0f * M_PI * distance * distance);
-
-                    glm::vec3 lightDir = glm::normalize(lightPosition - rayIntersection.intersectionPoint);
-                    float dotProduct = glm::dot(rayIntersection.intersectedTriangle.normal, lightDir);
-                    float normalBrightness = std::max(dotProduct, 0.0f);
-
-                    float ambientLightThreshold = 0.2f;
-                    float calculatedBrightness = std::min(normalBrightness * distanceAttenuation, 1.0f);
-                    float combinedBrightness = std::max(ambientLightThreshold, calculatedBrightness);
-
-                    glm::vec3 viewDir = glm::normalize(cameraPosition - rayIntersection.intersectionPoint);
-
-
-                    glm::vec3 reflectDir = glm::reflect(-lightDir, rayIntersection.intersectedTriangle.normal);
+    TriangleView models = loadModel(filepath, "../04 Wireframes and Rasterising/models/cornell-box.mtl", true);
+    prepareModel(models);
+    getTilePool().render(window.width, window.height, [&](const Tile &tile) {
+        std::vector<HitRecord> primaryHits;
+        ShadingBatch litHits(window, lightPosition, cameraPosition);
+        for (size_t y = tile.y0; y < tile.y1; y++) {
+            if ((y - tile.y0) % RayPacket::ROWS == 0) tracePrimaryBand(y, tile.x0, tile.x1, window.width, window.height, 1.0f, cameraPosition, models, primaryHits);
+            for (size_t x = tile.x0; x < tile.x1; x++) {
+                glm::vec3 rayDirection = getRayDirectionFromPixel(x, y, window.width, window.height, 1.0f, cameraPosition);
+                const HitRecord &primaryHit = primaryHits[(y - tile.y0) % RayPacket::ROWS * tile.width() + x - tile.x0];
+                Pcg32 random = sampleRandom(x, y, window.width, PRIMARY_SAMPLE);
+
+                RayTriangleIntersection rayIntersection = toRayTriangleIntersection(continueRay<SpecularTrace>(primaryHit, rayDirection, models, random), models);
+
+                if (rayIntersection.distanceFromCamera != std::numeric_limits<float>::infinity()) {
+                    if (rayIntersection.intersectedTriangle.isMirror) {
+
+                        RayTriangleIntersection reflectedIntersection = traceIntersection<ReflectionTrace>(
+                                rayIntersection.intersectionPoint,
+                                glm::reflect(rayDirection, rayIntersection.intersectedTriangle.normal),
+                                models, random
+                        );
+
+                        Colour reflectedColour = reflectedIntersection.intersectedTriangle.colour;
+                        uint32_t packedReflectedColour =
+                                (255 << 24) + (reflectedColour.red << 16) + (reflectedColour.green << 8) +
+                                reflectedColour.blue;
+                        window.setPixelColour(x, y, packedReflectedColour);
+                    }
+                    if (rayIntersection.intersectedTriangle.isGlass) {
+                        // The path ran out of bounces still inside glass, so trace it again splitting at every glass face
+                        Colour finalColour = traceGlassColour<SpecularTrace>(primaryHit, rayDirection, models, random);
 
-                    float specIntensity = std::pow(std::max(glm::dot(viewDir, reflectDir), 0.0f), 256);
+                        uint32_t packedFinalColour =
+                                (255 << 24) + (finalColour.red << 16) + (finalColour.green << 8) + finalColour.blue;
 
-                    Colour originalColour = rayIntersection.intersectedTriangle.colour;
-                    Colour adjustedColour = adjustBrightness(originalColour, combinedBrightness);
-                    Colour specularColor = multiplyColour(Colour(255, 255, 255), specIntensity);
-                    Colour finalColor = addColours(adjustedColour, specularColor);
 
-                     if (isPointInShadow(rayIntersection.intersectionPoint, rayIntersection.triangleIndex, models)) {
-                        uint32_t packedColour =
-                                (255 << 24) + (finalColor.red << 16) + (finalColor.green << 8) + finalColor.blue;
-                        window.setPixelColour(x, y, packedColour);
+                        window.setPixelColour(x, y, packedFinalColour);
+                    }else if (isPointInShadow(rayIntersection.intersectionPoint, rayIntersection.triangleIndex, models)) {
+                        litHits.add(rayIntersection.intersectionPoint, rayIntersection.intersectedTriangle.normal, rayIntersection.intersectedTriangle.colour, x, y);
                     } else {
-                        finalColor = adjustBrightness(rayIntersection.intersectedTriangle.colour, 0.2f);
-                        uint32_t packedColour = (255 << 24) + (finalColor.red / 2 << 16) + (finalColor.green << 8) +
-                                                finalColor.blue / 2;
-                        window.setPixelColour(x, y, packedColour);
+                        window.setPixelColour(x, y, getShadowedColour(rayIntersection.intersectedTriangle.colour));
                     }
                 }
             }
         }
-    }
+        litHits.flush();
+    });
 
 }
 
@@ -1675,7 +2045,7 @@ void drawRasterisedScene_Metal(DrawingWindow &window, glm::vec3 cameraPosition,
 bool isPointInShadow_fix(
             const glm::vec3 &intersectionPoint,
             size_t intersectedTriangleIndex,
-            const std::vector<ModelTriangle> &modelTriangles,
+            TriangleView modelTriangles,
             const std::vector<glm::vec3> &lightPositions,
             float &shadowFactor
     ) {
@@ -1686,10 +2056,8 @@ bool isPointInShadow_fix(
             glm::vec3 shadowRayDirection = glm::normalize(lightPosition - intersectionPoint);
             glm::vec3 shadowRayOrigin = intersectionPoint + 0.001f * shadowRayDirection;
 
-            RayTriangleIntersection shadowIntersection = getClosestValidIntersection(shadowRayOrigin, shadowRayDirection, modelTriangles);
-
-            if (shadowIntersection.triangleIndex != intersectedTriangleIndex &&
-                shadowIntersection.distanceFromCamera < glm::length(lightPosition - shadowRayOrigin)) {
+            if (isOccluded(shadowRayOrigin, shadowRayDirection, glm::length(lightPosition - shadowRayOrigin),
+                           intersectedTriangleIndex, modelTriangles)) {
                 float shadowDistance = glm::length(lightPosition - intersectionPoint);
                 float distanceFactor = std::min(100.0f / (shadowDistance * shadowDistance), 1.0f); // 限制衰减因子的最大值
                 shadowSum += distanceFactor;
@@ -1705,91 +2073,287 @@ bool isPointInShadow_fix(
 void drawRasterisedScene_S(DrawingWindow &window, glm::vec3 cameraPosition, std::vector<glm::vec3> lightPositions) {
     const std::string filepath = "../04 Wireframes and Rasterising/models/cornell-box.obj";
 //    const std::string filepath = "../07 Lighting and Shading (external lecture)/resources/sphere.obj";
-    const std::map<std::string, Colour> palette = loadMTL("../04 Wireframes and Rasterising/models/cornell-box.mtl");
 //    const std::map<std::string, Colour> palette;
-    std::vector<ModelTriangle> models = loadOBJWithTexture(filepath, palette);
-    for (size_t y = 0; y < window.height; y++) {
-        for (size_t x = 0; x < window.width; x++) {
-            glm::vec3 rayDirection = getRayDirectionFromPixel(x, y, window.width, window.height, 1.0f, cameraPosition);
-            RayTriangleIntersection rayIntersection = getClosestValidIntersection(cameraPosition, rayDirection, models);
+    TriangleView models = loadModel(filepath, "../04 Wireframes and Rasterising/models/cornell-box.mtl", true);
+    prepareModel(models);
+    getTilePool().render(window.width, window.height, [&](const Tile &tile) {
+        std::vector<HitRecord> primaryHits;
+        for (size_t y = tile.y0; y < tile.y1; y++) {
+            if ((y - tile.y0) % RayPacket::ROWS == 0) tracePrimaryBand(y, tile.x0, tile.x1, window.width, window.height, 1.0f, cameraPosition, models, primaryHits, true);
+            for (size_t x = tile.x0; x < tile.x1; x++) {
+                const HitRecord &primaryHit = primaryHits[(y - tile.y0) % RayPacket::ROWS * tile.width() + x - tile.x0];
+                RayTriangleIntersection rayIntersection(primaryHit, models);
+
+                if (rayIntersection.distanceFromCamera != std::numeric_limits<float>::infinity()) {
+
+                    float shadowFactor=0.5f;
+                    bool inShadow = isPointInShadow_fix(rayIntersection.intersectionPoint, rayIntersection.triangleIndex, models, lightPositions, shadowFactor);
+
+
+                    if (inShadow) {
+    //
+    //                    Colour shadowColour = adjustBrightness(rayIntersection.intersectedTriangle.colour, 1.0f - shadowFactor);
+    //                    Colour shadowColour = adjustBrightness(shadowColours, 0.2f);
+                        float minBrightness = 0.2f;
+                        float shadowBrightness = std::max(1.0f - shadowFactor, minBrightness);
+                        Colour shadowColour = adjustBrightness(rayIntersection.intersectedTriangle.colour, shadowBrightness);
+
+                        uint32_t packedColour = (255 << 24) + (shadowColour.red/2<< 16) + (shadowColour.green/2 << 8) + shadowColour.blue/2;
+                        window.setPixelColour(x, y, packedColour);
+                        continue;
+                    }
 
-            if (rayIntersection.distanceFromCamera != std::numeric_limits<float>::infinity()) {
 
-                float shadowFactor=0.5f;
-                bool inShadow = isPointInShadow_fix(rayIntersection.intersectionPoint, rayIntersection.triangleIndex, models, lightPositions, shadowFactor);
+                    Colour finalColour = rayIntersection.intersectedTriangle.colour;
+                    glm::vec3 normal = rayIntersection.intersectedTriangle.normal;
+                    glm::vec3 viewDirection = glm::normalize(cameraPosition - rayIntersection.intersectionPoint);
+                    float totalDiffuse = 0.0f;
+                    float totalSpecular = 0.0f;
 
+                    for (const auto &lightPosition: lightPositions) {
+                        glm::vec3 lightDirection = glm::normalize(lightPosition - rayIntersection.intersectionPoint);
+                        float lightDistance = glm::length(lightPosition - rayIntersection.intersectionPoint);
+    //                    float attenuation = 5.0f / (5*M_PI*lightDistance * lightDistance);
 
-                if (inShadow) {
-//
-//                    Colour shadowColour = adjustBrightness(rayIntersection.intersectedTriangle.colour, 1.0f - shadowFactor);
-//                    Colour shadowColour = adjustBrightness(shadowColours, 0.2f);
-                    float minBrightness = 0.2f;
-                    float shadowBrightness = std::max(1.0f - shadowFactor, minBrightness);
-                    Colour shadowColour = adjustBrightness(rayIntersection.intersectedTriangle.colour, shadowBrightness);
 
-                    uint32_t packedColour = (255 << 24) + (shadowColour.red/2<< 16) + (shadowColour.green/2 << 8) + shadowColour.blue/2;
+                        float diffuse = std::max(glm::dot(normal, lightDirection), 0.0f);
+    //                    totalDiffuse += diffuse * attenuation;
+                        totalDiffuse += diffuse;
+                        totalDiffuse= std::max(totalDiffuse, 0.0f);
+                        glm::vec3 reflectDirection = glm::reflect(-lightDirection, normal);
+    //                    float specular = std::pow(std::max(glm::dot(viewDirection, reflectDirection), 0.0f), 32);
+    //                    totalSpecular += specular * attenuation;
+                    }
+
+
+                    finalColour = adjustBrightness(finalColour, totalDiffuse);
+                    Colour specularColour(255, 255, 255);
+                    finalColour = addColours(finalColour, multiplyColour(specularColour, totalSpecular));
+
+                    uint32_t packedColour = (255 << 24) + (finalColour.red << 16) + (finalColour.green << 8) + finalColour.blue;
                     window.setPixelColour(x, y, packedColour);
-                    continue;
                 }
+            }
+        }
+    });
+}
 
 
-                Colour finalColour = rayIntersection.intersectedTriangle.colour;
-                glm::vec3 normal = rayIntersection.intersectedTriangle.normal;
-                glm::vec3 viewDirection = glm::normalize(cameraPosition - rayIntersection.intersectionPoint);
-                float totalDiffuse = 0.0f;
-                float totalSpecular = 0.0f;
 
-                for (const auto &lightPosition: lightPositions) {
-                    glm::vec3 lightDirection = glm::normalize(lightPosition - rayIntersection.intersectionPoint);
-                    float lightDistance = glm::length(lightPosition - rayIntersection.intersectionPoint);
-//                    float attenuation = 5.0f / (5*M_PI*lightDistance * lightDistance);
 
+// The lecture sphere circling inside the Cornell box. Each mesh is stored (with its BVHs) once in the TLAS, every
+// sphere is just an instance with its own transform and colour, and turning the ring only moves instances.
+const size_t INSTANCED_SPHERES = 8;
+float instanceRingAngle = 0.0f;
 
-                    float diffuse = std::max(glm::dot(normal, lightDirection), 0.0f);
-//                    totalDiffuse += diffuse * attenuation;
-                    totalDiffuse += diffuse;
-                    totalDiffuse= std::max(totalDiffuse, 0.0f);
-                    glm::vec3 reflectDirection = glm::reflect(-lightDirection, normal);
-//                    float specular = std::pow(std::max(glm::dot(viewDirection, reflectDirection), 0.0f), 32);
-//                    totalSpecular += specular * attenuation;
-                }
+glm::mat4 getRingTransform(size_t sphere, float ringAngle) {
+    // The sphere model has radius 1 around (0, 1.5, 1); shrink it and hang it on a ring above the boxes
+    float angle = ringAngle + 2.0f * float(M_PI) * sphere / INSTANCED_SPHERES;
+    glm::vec3 position(1.8f * std::cos(angle), 0.6f + 0.4f * std::sin(3.0f * angle), 1.8f * std::sin(angle));
+    glm::mat4 transform = glm::translate(glm::mat4(1.0f), position);
+    transform = glm::scale(transform, glm::vec3(0.35f));
+    return glm::translate(transform, -glm::vec3(0.0f, 1.5f, 1.0f));
+}
 
+TLAS &getInstancedScene() {
+    static TLAS scene;
+    if (scene.getInstanceCount() == 0) {
+        const std::string mtlFilepath = "../04 Wireframes and Rasterising/models/cornell-box.mtl";
+        TriangleView cornellBox = loadModel("../04 Wireframes and Rasterising/models/cornell-box.obj", mtlFilepath, true);
+        TriangleView sphere = loadModel("../07 Lighting and Shading (external lecture)/resources/sphere.obj", mtlFilepath, false);
+        const std::map<std::string, Colour> palette = loadMTL(mtlFilepath);
+        const std::string sphereColours[] = {"Red", "Green", "Blue", "Yellow", "Magenta", "Cyan", "White", "Mirror"};
+
+        // Both models trace through the trees loadModel already has rather than the TLAS building copies
+        scene.addInstance(scene.addMesh(cornellBox, getBVH(cornellBox), getWideBVH(cornellBox)), glm::mat4(1.0f));
+        uint32_t sphereMesh = scene.addMesh(sphere, getBVH(sphere), getWideBVH(sphere));
+        for (size_t i = 0; i < INSTANCED_SPHERES; i++) {
+            uint32_t instance = scene.addInstance(sphereMesh, getRingTransform(i, instanceRingAngle));
+            InstanceMaterial material;
+            material.colour = palette.at(sphereColours[i % 8]);
+            material.isMirror = sphereColours[i % 8] == "Mirror";
+            scene.setMaterial(instance, material);
+        }
+        scene.build();
+        std::cout << "Built instanced scene: " << scene.getStats() << std::endl;
+    }
+    return scene;
+}
 
-                finalColour = adjustBrightness(finalColour, totalDiffuse);
-                Colour specularColour(255, 255, 255);
-                finalColour = addColours(finalColour, multiplyColour(specularColour, totalSpecular));
+// Turning the ring is O(1) per sphere: only the instance transforms change, the top level is rebuilt over 9 boxes
+void turnInstanceRing(float angle) {
+    TLAS &scene = getInstancedScene();
+    instanceRingAngle += angle;
+    for (size_t i = 0; i < INSTANCED_SPHERES; i++) scene.setTransform(i + 1, getRingTransform(i, instanceRingAngle));
+    scene.build();
+}
+
+void drawInstancedScene(DrawingWindow &window, glm::vec3 cameraPosition, glm::vec3 lightPosition) {
+    const TLAS &scene = getInstancedScene();
+    const int maxBounces = 4;
+    getTilePool().render(window.width, window.height, [&](const Tile &tile) {
+        for (size_t y = tile.y0; y < tile.y1; y++) {
+            for (size_t x = tile.x0; x < tile.x1; x++) {
+                glm::vec3 rayOrigin = cameraPosition;
+                glm::vec3 rayDirection = getRayDirectionFromPixel(x, y, window.width, window.height, 1.0f, cameraPosition);
+                Colour finalColour(0, 0, 0);
+                for (int bounce = 0; bounce < maxBounces; bounce++) {
+                    float t, u, v;
+                    uint32_t instance;
+                    size_t triangleIndex;
+                    if (!scene.intersect(rayOrigin, rayDirection, t, u, v, instance, triangleIndex)) break;
+                    glm::vec3 point = rayOrigin + rayDirection * t;
+                    glm::vec3 normal = scene.getWorldNormal(instance, triangleIndex);
+                    if (glm::dot(normal, rayDirection) > 0.0f) normal = -normal;
+                    if (scene.isMirror(instance, triangleIndex)) {
+                        rayOrigin = point + normal * 1e-4f;
+                        rayDirection = glm::reflect(rayDirection, normal);
+                        continue;
+                    }
 
+                    glm::vec3 toLight = lightPosition - point;
+                    float lightDistance = glm::length(toLight);
+                    glm::vec3 lightDirection = toLight / lightDistance;
+                    float brightness = 0.2f;
+                    if (!scene.occluded(point, lightDirection, lightDistance, instance, triangleIndex)) {
+                        brightness = std::max(brightness, glm::dot(normal, lightDirection));
+                    }
+                    finalColour = adjustBrightness(scene.getColour(instance, triangleIndex), brightness);
+                    break;
+                }
                 uint32_t packedColour = (255 << 24) + (finalColour.red << 16) + (finalColour.green << 8) + finalColour.blue;
                 window.setPixelColour(x, y, packedColour);
             }
         }
+    });
+}
+
+// Closest hit among a mesh and a few analytic spheres. A sphere hit stands in as a triangle (see Sphere::surfaceAt)
+// with its own texture coordinates, and has triangleIndex triangles.size() + the sphere's index.
+RayTriangleIntersection getClosestIntersection(
+        const glm::vec3 &rayOrigin,
+        const glm::vec3 &rayDirection,
+        TriangleView triangles,
+        const std::vector<Sphere> &spheres
+) {
+    RayTriangleIntersection closest = getClosestValidIntersection(rayOrigin, rayDirection, triangles);
+    for (size_t i = 0; i < spheres.size(); i++) {
+        float t;
+        if (!spheres[i].intersect(rayOrigin, rayDirection, t) || t >= closest.distanceFromCamera) continue;
+        glm::vec3 point = rayOrigin + rayDirection * t;
+        closest = RayTriangleIntersection(point, t, spheres[i].surfaceAt(point), triangles.size() + i);
+        closest.textureCoords = spheres[i].textureCoordsAt(point);
     }
+    return closest;
 }
 
+// Whether anything in the mesh or any sphere lies between the point and the light
+bool isOccludedWithSpheres(
+        const glm::vec3 &point,
+        const glm::vec3 &normal,
+        const glm::vec3 &lightPosition,
+        TriangleView triangles,
+        const std::vector<Sphere> &spheres
+) {
+    // Start a little off the surface instead of skipping the surface's own triangle, a sphere has no index to skip
+    glm::vec3 origin = point + normal * 1e-3f;
+    glm::vec3 toLight = lightPosition - origin;
+    float lightDistance = glm::length(toLight);
+    glm::vec3 lightDirection = toLight / lightDistance;
+    for (const Sphere &sphere : spheres) {
+        float t;
+        if (sphere.intersect(origin, lightDirection, t) && t < lightDistance) return true;
+    }
+    return isOccluded(origin, lightDirection, lightDistance, size_t(-1), triangles);
+}
 
+// Analytic spheres hanging in the Cornell box: a mirror in front of the tall box and a textured ball
+const std::vector<Sphere> &getBoxSpheres() {
+    static std::vector<Sphere> spheres;
+    if (spheres.empty()) {
+        Sphere mirror(glm::vec3(-0.9f, -0.7f, 1.2f), 0.7f, Colour(255, 255, 255));
+        mirror.isMirror = true;
+        spheres.push_back(mirror);
+        Sphere textured(glm::vec3(1.0f, 0.6f, 0.6f), 0.6f, Colour(255, 255, 255));
+        textured.hasTexture = true;
+        spheres.push_back(textured);
+    }
+    return spheres;
+}
 
+void drawSphereScene(DrawingWindow &window, glm::vec3 cameraPosition, glm::vec3 lightPosition) {
+    const std::string mtlFilepath = "../04 Wireframes and Rasterising/models/cornell-box.mtl";
+    TriangleView models = loadModel("../04 Wireframes and Rasterising/models/cornell-box.obj", mtlFilepath, false);
+    const std::vector<Sphere> &spheres = getBoxSpheres();
+    TextureMap &textureMap = loadTexture("../05 Navigation and Transformation/models/texture.ppm");
+    const int maxBounces = 4;
+    prepareModel(models);
+    getTilePool().render(window.width, window.height, [&](const Tile &tile) {
+        for (size_t y = tile.y0; y < tile.y1; y++) {
+            for (size_t x = tile.x0; x < tile.x1; x++) {
+                glm::vec3 rayOrigin = cameraPosition;
+                glm::vec3 rayDirection = getRayDirectionFromPixel(x, y, window.width, window.height, 1.0f, cameraPosition);
+                Colour finalColour(0, 0, 0);
+                for (int bounce = 0; bounce < maxBounces; bounce++) {
+                    RayTriangleIntersection hit = getClosestIntersection(rayOrigin, rayDirection, models, spheres);
+                    if (hit.distanceFromCamera == std::numeric_limits<float>::infinity()) break;
+                    const ModelTriangle &surface = hit.intersectedTriangle;
+                    glm::vec3 normal = glm::normalize(surface.normal);
+                    if (glm::dot(normal, rayDirection) > 0.0f) normal = -normal;
+                    if (surface.isMirror) {
+                        rayOrigin = hit.intersectionPoint + normal * 1e-3f;
+                        rayDirection = glm::reflect(rayDirection, normal);
+                        continue;
+                    }
 
-float triangleArea(const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c) {
-    return glm::length(glm::cross(b - a, c - a)) / 2.0f;
+                    Colour baseColour = surface.colour;
+                    if (surface.hasTexture) {
+                        uint32_t textureColour = textureMap.getColourAt(hit.textureCoords.x, hit.textureCoords.y);
+                        baseColour = Colour(textureColour >> 16 & 0xFF, textureColour >> 8 & 0xFF, textureColour & 0xFF);
+                    }
+                    float brightness = 0.2f;
+                    if (!isOccludedWithSpheres(hit.intersectionPoint, normal, lightPosition, models, spheres)) {
+                        glm::vec3 lightDirection = glm::normalize(lightPosition - hit.intersectionPoint);
+                        brightness = std::max(brightness, glm::dot(normal, lightDirection));
+                    }
+                    finalColour = adjustBrightness(baseColour, brightness);
+                    break;
+                }
+                uint32_t packedColour = (255 << 24) + (finalColour.red << 16) + (finalColour.green << 8) + finalColour.blue;
+                window.setPixelColour(x, y, packedColour);
+            }
+        }
+    });
 }
 
-glm::vec3 vertexNormalCalculator(glm::vec3 vertex, const std::vector<ModelTriangle>& sphereModel) {
-    glm::vec3 vertexNormal = glm::vec3(0.0f, 0.0f, 0.0f);
-    float totalArea = 0.0f;
+// Trace the Gouraud and Phong spheres as the tessellated lecture mesh instead of the exact sphere, toggled with 'm'
+bool tessellatedSphere = false;
 
-    for (const ModelTriangle &triangle : sphereModel) {
-        if (triangle.vertices[0] == vertex || triangle.vertices[1] == vertex || triangle.vertices[2] == vertex) {
-            float area = triangleArea(triangle.vertices[0], triangle.vertices[1], triangle.vertices[2]);
-            totalArea += area;
-            vertexNormal += area * triangle.normal;
-        }
-    }
-    if (totalArea > 0.0f) {
-        vertexNormal /= totalArea;
-    }
-    return glm::normalize(vertexNormal);
+// The lecture sphere's 112 evenly sized triangles are what chooseAccelerator hands to a uniform grid, so this is the mesh
+// getClosestHit walks cell by cell
+TriangleView getLectureSphereMesh() {
+    return loadModel("../07 Lighting and Shading (external lecture)/resources/sphere.obj",
+                     "../04 Wireframes and Rasterising/models/cornell-box.mtl", false);
 }
 
+// Where a ray meets the lecture sphere and the normal there. With an empty mesh that is the exact sphere and its exact
+// normal; otherwise it is the facet the ray hits, with its vertex normals blended by the barycentric weights of the hit.
+bool intersectLectureSphere(const Sphere &sphere, TriangleView mesh, const glm::vec3 &rayOrigin,
+                            const glm::vec3 &rayDirection, glm::vec3 &point, glm::vec3 &normal) {
+    if (mesh.empty()) {
+        float t;
+        if (!sphere.intersect(rayOrigin, rayDirection, t)) return false;
+        point = rayOrigin + rayDirection * t;
+        normal = sphere.normalAt(point);
+        return true;
+    }
+    HitRecord hit = getClosestHit(rayOrigin, rayDirection, mesh);
+    if (!hit.isHit()) return false;
+    const std::array<glm::vec3, 3> &vertexNormals = mesh[hit.triangleIndex].vertexNormals;
+    point = hit.intersectionPoint;
+    normal = glm::normalize((1.0f - hit.u - hit.v) * vertexNormals[0] + hit.u * vertexNormals[1] + hit.v * vertexNormals[2]);
+    return true;
+}
 
 float calculateVertexBrightness(const glm::vec3& vertex, const glm::vec3& vertexNormal,
                                 const glm::vec3& lightPosition, const glm::vec3& cameraPosition,
@@ -1818,121 +2382,75 @@ float calculateVertexBrightness(const glm::vec3& vertex, const glm::vec3& vertex
 
 
 
-void drawSphereWithGourandShading(DrawingWindow &window, const std::vector<ModelTriangle>& sphereModel, glm::vec3 cameraPosition, glm::vec3 lightPosition, float focalLength, float lightPower, float ambient) {
-    for(int y = 0; y < window.height; y++) {
-        for(int x = 0; x < window.width; x++) {
-            CanvasPoint canvasPoint = CanvasPoint(float(x), float(y));
-              glm::vec3 rayDirection = getRayDirectionFromPixel(x, y, window.width, window.height, 2.0f, cameraPosition);
-
-            RayTriangleIntersection closestIntersection = getClosestValidIntersection(cameraPosition, rayDirection, sphereModel);
-            if(closestIntersection.intersectionPoint == glm::vec3(0, 0, 0)) {
-                uint32_t c = (255 << 24) + (0 << 16) + (0 << 8) + (0);
-                window.setPixelColour(x, y, c);
-                continue;
-            }
+void drawSphereWithGourandShading(DrawingWindow &window, const Sphere &sphere, glm::vec3 cameraPosition, glm::vec3 lightPosition, float focalLength, float lightPower, float ambient) {
+    TriangleView mesh = tessellatedSphere ? getLectureSphereMesh() : TriangleView();
+    if (!mesh.empty()) prepareModel(mesh);
+    getTilePool().render(window.width, window.height, [&](const Tile &tile) {
+        for (size_t y = tile.y0; y < tile.y1; y++) {
+            for (size_t x = tile.x0; x < tile.x1; x++) {
+                CanvasPoint canvasPoint = CanvasPoint(float(x), float(y));
+                  glm::vec3 rayDirection = getRayDirectionFromPixel(x, y, window.width, window.height, 2.0f, cameraPosition);
 
-            glm::vec3 v0 = closestIntersection.intersectedTriangle.vertices[0];
-            glm::vec3 v1 = closestIntersection.intersectedTriangle.vertices[1];
-            glm::vec3 v2 = closestIntersection.intersectedTriangle.vertices[2];
-            glm::vec3 point = closestIntersection.intersectionPoint;
-
-            glm::vec3 vn0 = vertexNormalCalculator(v0, sphereModel);
-            glm::vec3 vn1 = vertexNormalCalculator(v1, sphereModel);
-            glm::vec3 vn2 = vertexNormalCalculator(v2, sphereModel);
-
-            float brightness0 = calculateVertexBrightness(v0, vn0, lightPosition, cameraPosition, lightPower, 256, 0.1);
-            float brightness1 = calculateVertexBrightness(v1, vn1, lightPosition, cameraPosition, lightPower, 256, 0.1);
-            float brightness2 = calculateVertexBrightness(v2, vn2, lightPosition, cameraPosition, lightPower, 256, 0.1);
-
-            // Calculate Barycentric coordinates
-            float areaTotal = triangleArea(v0, v1, v2);
-            float u = triangleArea(point, v1, v2) / areaTotal;
-            float v = triangleArea(point, v2, v0) / areaTotal;
-            float w = 1.0f - u - v;
-            // Interpolation
-//            canvasPoint.brightness = u* brightness0 +v * brightness1 + w* brightness2;
-//            std::cout << "canvasPoint.brightness: " << canvasPoint.brightness << std::endl;
-//
-            glm::vec3 interpolatedNormal = u * vn0 + v * vn1 + w * vn2;
-            interpolatedNormal = glm::normalize(interpolatedNormal);
+                glm::vec3 point, normal;
+                if (!intersectLectureSphere(sphere, mesh, cameraPosition, rayDirection, point, normal)) {
+                    uint32_t c = (255 << 24) + (0 << 16) + (0 << 8) + (0);
+                    window.setPixelColour(x, y, c);
+                    continue;
+                }
 
-            canvasPoint.brightness = calculateVertexBrightness(point, interpolatedNormal, lightPosition, cameraPosition, lightPower, 64, 0.1);
+                canvasPoint.brightness = calculateVertexBrightness(point, normal, lightPosition, cameraPosition, lightPower, 64, 0.1);
 
 
-            // Draw colour
-            Colour originalColour(255,0,0);
-            Colour adjustedColour = adjustBrightness(originalColour, canvasPoint.brightness);
+                // Draw colour
+                Colour originalColour(255,0,0);
+                Colour adjustedColour = adjustBrightness(originalColour, canvasPoint.brightness);
 
-            // 设置像素颜色
-            uint32_t c = (255 << 24) + (adjustedColour.red << 16) + (adjustedColour.green << 8) + adjustedColour.blue;
-            window.setPixelColour(x, y, c);
+                // 设置像素颜色
+                uint32_t c = (255 << 24) + (adjustedColour.red << 16) + (adjustedColour.green << 8) + adjustedColour.blue;
+                window.setPixelColour(x, y, c);
+            }
         }
-    }
+    });
 }
 
 
 
-glm::vec3 interpolateNormalAtPoint(const glm::vec3& targetPoint,
-                            const glm::vec3& vertex0, const glm::vec3& vertex1, const glm::vec3& vertex2,
-                            const glm::vec3& normal0, const glm::vec3& normal1, const glm::vec3& normal2) {
-
-    float sharedTermForU = -(vertex0.x - vertex1.x) * (vertex2.y - vertex1.y) + (vertex0.y - vertex1.y) * (vertex2.x - vertex1.x);
-    float sharedTermForV = -(vertex1.x - vertex2.x) * (vertex0.y - vertex2.y) + (vertex1.y - vertex2.y) * (vertex0.x - vertex2.x);
-    float uNumerator = -(targetPoint.x - vertex1.x) * (vertex2.y - vertex1.y) + (targetPoint.y - vertex1.y) * (vertex2.x - vertex1.x);
-    float u = uNumerator / sharedTermForU;
-    float vNumerator = -(targetPoint.x - vertex2.x) * (vertex0.y - vertex2.y) + (targetPoint.y - vertex2.y) * (vertex0.x - vertex2.x);
-    float v = vNumerator / sharedTermForV;
-
-    float w = 1 - u - v;
-
-    glm::vec3 interpolatedNormal = u * normal0 + v * normal1 + w * normal2;
-
-    return glm::normalize(interpolatedNormal);
-}
 
 
-void drawRaytracingPhongCameraView(DrawingWindow &window, glm::vec3 campos, std::vector<ModelTriangle> sphereModel, glm::vec3 lightPosition){
-    for (int y = 0; y < window.height; y++) {
-        for (int x = 0; x < window.width; x++) {
-            glm::vec3 rayDirection = getRayDirectionFromPixel(x, y, window.width, window.height, 2.0f, campos);
-            RayTriangleIntersection closestIntersection = getClosestValidIntersection(campos, rayDirection,
-                                                                                      sphereModel);
+void drawRaytracingPhongCameraView(DrawingWindow &window, glm::vec3 campos, const Sphere &sphere, glm::vec3 lightPosition){
+    TriangleView mesh = tessellatedSphere ? getLectureSphereMesh() : TriangleView();
+    if (!mesh.empty()) prepareModel(mesh);
+    getTilePool().render(window.width, window.height, [&](const Tile &tile) {
+        for (size_t y = tile.y0; y < tile.y1; y++) {
+            for (size_t x = tile.x0; x < tile.x1; x++) {
+                glm::vec3 rayDirection = getRayDirectionFromPixel(x, y, window.width, window.height, 2.0f, campos);
+                glm::vec3 point, Normal;
 
-            if (closestIntersection.triangleIndex != -1) {
-                glm::vec3 v0 = closestIntersection.intersectedTriangle.vertices[0];
-                glm::vec3 v1 = closestIntersection.intersectedTriangle.vertices[1];
-                glm::vec3 v2 = closestIntersection.intersectedTriangle.vertices[2];
-                glm::vec3 vn0 = vertexNormalCalculator(v0, sphereModel);
-                glm::vec3 vn1 = vertexNormalCalculator(v1, sphereModel);
-                glm::vec3 vn2 = vertexNormalCalculator(v2, sphereModel);
+                if (intersectLectureSphere(sphere, mesh, campos, rayDirection, point, Normal)) {
+                    glm::vec3 lightDirection = glm::normalize(lightPosition - point);
+                    float diffuseIntensity = std::max(glm::dot(Normal, lightDirection), 0.0f);
+                    glm::vec3 viewDir = glm::normalize(campos - point);
 
-                glm::vec3 point = closestIntersection.intersectionPoint;
-                glm::vec3 Normal = interpolateNormalAtPoint(point, v0, v1, v2, vn0, vn1, vn2);
-                glm::vec3 lightDirection = glm::normalize(lightPosition - point);
-                float diffuseIntensity = std::max(glm::dot(Normal, lightDirection), 0.0f);
-                glm::vec3 viewDir = glm::normalize(campos - point);
+                    glm::vec3 reflectDir = glm::reflect(-lightDirection, Normal);
 
-                glm::vec3 reflectDir = glm::reflect(-lightDirection, Normal);
+                    float specularIntensity = 1.0f * pow(std::max(glm::dot(reflectDir, viewDir), 0.0f), 64);
 
-                float specularIntensity = 1.0f * pow(std::max(glm::dot(reflectDir, viewDir), 0.0f), 64);
+                    float ambient = 0.1f;
+                    float combinedBrightness = std::max(ambient, diffuseIntensity);
+                    Colour originalColour(255, 0, 0);
+                    Colour adjustedColour = adjustBrightness(originalColour, diffuseIntensity);
 
-                float ambient = 0.1f;
-                float combinedBrightness = std::max(ambient, diffuseIntensity);
-                Colour originalColour(255, 0, 0);
-                Colour adjustedColour = adjustBrightness(originalColour, diffuseIntensity);
-
-                Colour specularColor = multiplyColour(Colour(255, 255, 255), specularIntensity);
-                Colour finalColor = addColours(adjustBrightness(originalColour, combinedBrightness), specularColor);
+                    Colour specularColor = multiplyColour(Colour(255, 255, 255), specularIntensity);
+                    Colour finalColor = addColours(adjustBrightness(originalColour, combinedBrightness), specularColor);
 
                     uint32_t packedColour =
                             (255 << 24) + (finalColor.red << 16) + (finalColor.green << 8) + finalColor.blue;
                     window.setPixelColour(x, y, packedColour);
-
-
                 }
             }
         }
-    }
+    });
+}
 
 
 
@@ -1948,12 +2466,137 @@ enum class RenderMode {
     depth,
     SoftShadows,
     Mirror,
-    Refrection
+    Refrection,
+    Instances,
+    Spheres
 };
 
 RenderMode currentRenderMode = RenderMode::Rasterization;
+// Trace the Mirror scene a bounce depth at a time instead of pixel by pixel, toggled with 'v'
+bool wavefrontTracing = false;
+// Skip the triangles that face away from the camera before filling them in the rasterised modes, toggled with 'b'
+bool backFaceCulling = true;
+// Show a coarse preview of a ray-traced frame first and refine it in place, toggled with 'p'
+bool progressiveRendering = true;
+
+// The modes that trace a ray per pixel rather than rasterise triangles onto a canvas of their own size
+bool isRayTraced(RenderMode mode) {
+    return mode != RenderMode::Wireframe && mode != RenderMode::Rasterization && mode != RenderMode::Texture;
+}
+
+// The ray-traced mode a key selects in the window, for choosing one from the command line; false for any other key
+bool getRayTracedMode(char key, RenderMode &mode) {
+    switch (key) {
+        case '4': case '7': mode = RenderMode::SoftShadows; return true;
+        case '5': mode = RenderMode::ball; return true;
+        case '6': mode = RenderMode::ball2; return true;
+        case '8': mode = RenderMode::Mirror; return true;
+        case '9': mode = RenderMode::Refrection; return true;
+        case '0': mode = RenderMode::Instances; return true;
+        case 'o': mode = RenderMode::Spheres; return true;
+        default: return false;
+    }
+}
 
-void renderScene(DrawingWindow &window, glm::vec3 &cameraPosition, glm::vec3 &lightPosition,glm::vec3 &lightPosition1, glm::vec3 &lightPosition2,std::vector<ModelTriangle> sphereModel,std::vector<ModelTriangle> models,std::vector<ModelTriangle> Texturemodels,TextureMap textureMap) {
+// drawLineWithDepth for a span of one row, drawing only the part of it in tile, against the depth buffer of the tile
+void drawSpanInTile(DrawingWindow &window, const Tile &tile, std::vector<float> &depthTile, const CanvasPoint &start, const CanvasPoint &end, uint32_t packedColor) {
+    int y = static_cast<int>(start.y);
+    int numberOfSteps = std::abs(static_cast<int>(end.x - start.x));
+    // A step moves one pixel right, so the steps left of the tile are skipped rather than walked
+    for (int i = static_cast<int>(std::max(0.0f, float(tile.x0) - start.x - 1.0f)); i <= numberOfSteps; i++) {
+        int x = static_cast<int>(start.x + float(i));
+        if (x < int(tile.x0)) continue;
+        if (x >= int(tile.x1)) break;
+        float alpha = static_cast<float>(i) / numberOfSteps;
+        float depth = 1.0f / interpolate(1.0f / start.depth, 1.0f / end.depth, alpha);
+        float &tileDepth = depthTile[(y - tile.y0) * TriangleBins::BIN_SIZE + (x - tile.x0)];
+        if (depth < tileDepth) {
+            window.setPixelColour(x, y, packedColor);
+            tileDepth = depth;
+        }
+    }
+}
+
+// drawTexLineWithDepth for a span of one row, drawing only the part of it in tile
+void drawTexturedSpanInTile(DrawingWindow &window, const Tile &tile, TextureMap &textureMap, const CanvasPoint &start, const CanvasPoint &end) {
+    int y = static_cast<int>(start.y);
+    int numberOfSteps = std::abs(static_cast<int>(end.x - start.x));
+    for (int i = static_cast<int>(std::max(0.0f, float(tile.x0) - start.x - 1.0f)); i <= numberOfSteps; i++) {
+        int x = static_cast<int>(start.x + float(i));
+        if (x < int(tile.x0)) continue;
+        if (x >= int(tile.x1)) break;
+        float alpha = static_cast<float>(i) / numberOfSteps;
+        float textureX = start.texturePoint.x + alpha * (end.texturePoint.x - start.texturePoint.x);
+        float textureY = start.texturePoint.y + alpha * (end.texturePoint.y - start.texturePoint.y);
+        window.setPixelColour(x, y, textureMap.getColourAt(textureX, textureY));
+    }
+}
+
+// Fills triangles as the rasterised modes draw them: in their colours, or with textureMap for the ones that have
+// texture coordinates if it isn't null. A sort-middle rasteriser, so the triangles of a big model are filled on every
+// core: chunks of them are projected and binned into screen tiles in parallel, then each bin is filled by one thread
+// with a depth buffer of its own, so no two threads ever touch the same pixel. A bin fills its triangles in the order
+// they are in triangles, which makes the frame the same as filling them one after another.
+void rasteriseTriangles(DrawingWindow &window, TriangleView triangles, const glm::vec3 &cameraPosition, TextureMap *textureMap) {
+    const size_t TRIANGLES_PER_CHUNK = 256;
+    TriangleBins bins(window.width, window.height, (triangles.size() + TRIANGLES_PER_CHUNK - 1) / TRIANGLES_PER_CHUNK);
+    std::vector<CanvasTriangle> canvasTriangles(triangles.size());
+    getJobSystem().parallelFor(0, triangles.size(), TRIANGLES_PER_CHUNK, [&](size_t first, size_t last) {
+        for (size_t index = first; index < last; index++) {
+            const ModelTriangle &triangle = triangles[index];
+            if (backFaceCulling && isFacingAway(triangle, cameraPosition)) continue;
+            CanvasTriangle &canvasTriangle = canvasTriangles[index];
+            for (int i = 0; i < 3; i++) {
+                canvasTriangle.vertices[i] = getCanvasIntersectionPoint(cameraPosition, triangle.vertices[i], 2.0, window.width, window.height);
+                canvasTriangle.vertices[i].texturePoint = triangle.texturePoints[i];
+            }
+            // Binned by the spans the triangle fills rather than its corners, which the rows of a thin textured
+            // triangle can overshoot. A pixel of margin covers the spans' rounding.
+            float minX = std::numeric_limits<float>::infinity(), minY = minX;
+            float maxX = -minX, maxY = -minX;
+            auto addSpan = [&](const CanvasPoint &start, const CanvasPoint &end) {
+                minX = std::min(minX, start.x - 1.0f);
+                maxX = std::max(maxX, end.x + 1.0f);
+                minY = std::min(minY, start.y);
+                maxY = std::max(maxY, start.y);
+            };
+            if (textureMap && triangle.hasTexture) {
+                forEachTexturedSpan(canvasTriangle, std::numeric_limits<int>::min(), std::numeric_limits<int>::max(), addSpan);
+            } else {
+                forEachFilledSpan(canvasTriangle, std::numeric_limits<int>::min(), std::numeric_limits<int>::max(), addSpan);
+            }
+            auto toPixel = [](float coordinate, size_t size) {
+                return static_cast<int>(std::floor(std::max(-1.0f, std::min(coordinate, float(size)))));
+            };
+            bins.add(first / TRIANGLES_PER_CHUNK, uint32_t(index), toPixel(minX, window.width), toPixel(minY, window.height),
+                     toPixel(maxX, window.width), toPixel(maxY, window.height));
+        }
+    });
+
+    getTilePool().render(window.width, window.height, [&](const Tile &tile) {
+        std::vector<float> depthTile(TriangleBins::BIN_SIZE * TriangleBins::BIN_SIZE, std::numeric_limits<float>::infinity());
+        size_t bin = bins.getBin(tile);
+        int firstRow = int(tile.y0);
+        int lastRow = int(tile.y1) - 1;
+        for (size_t chunk = 0; chunk < bins.getChunkCount(); chunk++) {
+            for (uint32_t index : bins.getTriangles(chunk, bin)) {
+                const ModelTriangle &triangle = triangles[index];
+                if (textureMap && triangle.hasTexture) {
+                    forEachTexturedSpan(canvasTriangles[index], firstRow, lastRow, [&](const CanvasPoint &start, const CanvasPoint &end) {
+                        drawTexturedSpanInTile(window, tile, *textureMap, start, end);
+                    });
+                } else {
+                    uint32_t packedColor = (triangle.colour.red << 16) | (triangle.colour.green << 8) | triangle.colour.blue;
+                    forEachFilledSpan(canvasTriangles[index], firstRow, lastRow, [&](const CanvasPoint &start, const CanvasPoint &end) {
+                        drawSpanInTile(window, tile, depthTile, start, end, packedColor);
+                    });
+                }
+            }
+        }
+    }, TriangleBins::BIN_SIZE, TriangleBins::BIN_SIZE);
+}
+
+void renderScene(DrawingWindow &window, glm::vec3 &cameraPosition, glm::vec3 &lightPosition,glm::vec3 &lightPosition1, glm::vec3 &lightPosition2,const Sphere &sphere,TriangleView models,TriangleView Texturemodels,TextureMap &textureMap) {
 
     Colour white(255, 255, 255);
     glm::vec3 cameraForGouraud(0, 0, 100);
@@ -1993,23 +2636,10 @@ void renderScene(DrawingWindow &window, glm::vec3 &cameraPosition, glm::vec3 &li
     };
 
 
-    std::vector<std::vector<float>> depthBuffer(3 * WIDTH, std::vector<float>(3 * HEIGHT, std::numeric_limits<float>::infinity()));
-
         switch (currentRenderMode) {
 
             case RenderMode::Rasterization: {
-                for (const ModelTriangle &triangle: models) {
-                    CanvasPoint points[3];
-                    for (int i = 0; i < 3; i++) {
-                        const glm::vec3 &vertex = triangle.vertices[i];
-                        points[i] = getCanvasIntersectionPoint(cameraPosition, vertex, 2.0, 3 * WIDTH, 3 * HEIGHT);
-                        points[i].texturePoint = triangle.texturePoints[i];
-                    }
-
-                    CanvasTriangle canvasTriangle(points[0], points[1], points[2]);
-                    colour = triangle.colour;
-                    fillTriangle(window, canvasTriangle, colour, depthBuffer);
-                }
+                rasteriseTriangles(window, models, cameraPosition, nullptr);
                 std::cout << "Switched to Rasterization mode." << std::endl;
                 break;
             }
@@ -2029,27 +2659,7 @@ void renderScene(DrawingWindow &window, glm::vec3 &cameraPosition, glm::vec3 &li
                 std::cout << "Switched to Wireframe mode." << std::endl;
                 break;}
             case RenderMode::Texture: {
-                for (const ModelTriangle &triangle: Texturemodels) {
-                    CanvasPoint points[3];
-                    for (int i = 0; i < 3; i++) {
-                        const glm::vec3 &vertex = triangle.vertices[i];
-                        points[i] = getCanvasIntersectionPoint(cameraPosition, vertex, 2.0, 3 * WIDTH, 3 * HEIGHT);
-                        points[i].texturePoint = triangle.texturePoints[i];
-
-//
-                    }
-                    CanvasTriangle canvasTriangle(points[0], points[1], points[2]);
-
-
-                    if (triangle.hasTexture) {
-//                        fillTextureTriangle(window, canvasTriangle, textureMap,depthBuffer);
-                        fillTexturedTriangle(window, canvasTriangle, textureMap,depthBuffer);
-                    } else {
-                        fillTriangle(window, canvasTriangle, triangle.colour, depthBuffer);
-                    }
-                }
-
-
+                rasteriseTriangles(window, Texturemodels, cameraPosition, &textureMap);
                 break;
             }
 
@@ -2063,11 +2673,11 @@ void renderScene(DrawingWindow &window, glm::vec3 &cameraPosition, glm::vec3 &li
                 break;
             }
             case RenderMode::ball: {
-                drawSphereWithGourandShading(window, sphereModel, cameraForGouraud, lightPosition, 2.0, 1, 0);
+                drawSphereWithGourandShading(window, sphere, cameraForGouraud, lightPosition, 2.0, 1, 0);
                 break;
             }
             case RenderMode::ball2: {
-                drawRaytracingPhongCameraView(window, cameraForGouraud, sphereModel, lightPosition1);
+                drawRaytracingPhongCameraView(window, cameraForGouraud, sphere, lightPosition1);
                 break;
             }
             case RenderMode::SoftShadows: {
@@ -2075,7 +2685,8 @@ void renderScene(DrawingWindow &window, glm::vec3 &cameraPosition, glm::vec3 &li
                 break;
             }
             case RenderMode::Mirror: {
-                drawRasterisedScene_Mirror(window, cameraPosition,lightPosition2);
+                if (wavefrontTracing) drawMirrorSceneWavefront(window, cameraPosition, lightPosition2);
+                else drawRasterisedScene_Mirror(window, cameraPosition,lightPosition2);
                 break;
             }
             case RenderMode::Refrection: {
@@ -2085,6 +2696,14 @@ void renderScene(DrawingWindow &window, glm::vec3 &cameraPosition, glm::vec3 &li
             }
                 std::cout << "Switched to RayTracing mode." << std::endl;
                 break;
+            case RenderMode::Instances: {
+                drawInstancedScene(window, cameraPosition, lightPosition2);
+                break;
+            }
+            case RenderMode::Spheres: {
+                drawSphereScene(window, cameraPosition, lightPosition2);
+                break;
+            }
         }
 
 
@@ -2093,7 +2712,27 @@ void renderScene(DrawingWindow &window, glm::vec3 &cameraPosition, glm::vec3 &li
 
 
 
-void handleEvent_week7(SDL_Event event, DrawingWindow &window, glm::vec3 &cameraPosition,glm::vec3 &lightPosition,glm::vec3 &lightPosition1,glm::vec3 &lightPosition2,std::vector<ModelTriangle> sphereModel,std::vector<ModelTriangle> models,std::vector<ModelTriangle> Texturemodels,TextureMap textureMap) {
+// Pixels of the image a traced pixel of the first preview stands for, across and down
+const size_t PREVIEW_STEP = 8;
+
+// Draws what render draws into window, one lattice of pixels at a time (see getRefinementLattices): every
+// PREVIEW_STEP-th pixel first, each filling the block around it, then the pixels between those, halving the block until
+// every pixel has been traced exactly once. Each level is shown as soon as it is done, so a new view appears after a
+// 64th of the frame and sharpens while it stays put. Stops after the lattice in flight once the tile pool is cancelled.
+void renderProgressively(DrawingWindow &window, const std::function<void(DrawingWindow &)> &render) {
+    std::vector<SampleLattice> lattices = getRefinementLattices(window.width, window.height, PREVIEW_STEP);
+    for (size_t i = 0; i < lattices.size(); i++) {
+        DrawingWindow preview(lattices[i].width(), lattices[i].height());
+        renderLattice = lattices[i];
+        render(preview);
+        renderLattice = SampleLattice();
+        if (getTilePool().isCancelled()) return;
+        fillBlocks(window, preview, lattices[i]);
+        if (i + 1 == lattices.size() || lattices[i + 1].blockSize != lattices[i].blockSize) window.completeFrame();
+    }
+}
+
+void handleEvent_week7(SDL_Event event, DrawingWindow &window, glm::vec3 &cameraPosition,glm::vec3 &lightPosition,glm::vec3 &lightPosition1,glm::vec3 &lightPosition2,const Sphere &sphere,TriangleView models,TriangleView Texturemodels,TextureMap &textureMap) {
 
 //    glm::vec3 cameraPosition(0, 0, 8.0f);
 //    glm::vec3 lightPosition(0, 5.1f,5);
@@ -2209,11 +2848,15 @@ void handleEvent_week7(SDL_Event event, DrawingWindow &window, glm::vec3 &camera
                 window.clearPixels();
                 currentRenderMode = RenderMode::Refrection;
             }
-
-            else if (event.type == SDL_MOUSEBUTTONDOWN) {
-                window.savePPM("output.ppm");
-                window.saveBMP("output.bmp");
-            }else if (event.key.keysym.sym == SDLK_i) {
+            else if (event.key.keysym.sym == SDLK_0) {
+                window.clearPixels();
+                currentRenderMode = RenderMode::Instances;
+            }
+            else if (event.key.keysym.sym == SDLK_o) {
+                window.clearPixels();
+                currentRenderMode = RenderMode::Spheres;
+            }
+            else if (event.key.keysym.sym == SDLK_i) {
             std::cout << "Light UP" << std::endl;
             lightPosition2.y += translationAmount;
             lightPosition1.y += translationAmount;
@@ -2238,11 +2881,43 @@ void handleEvent_week7(SDL_Event event, DrawingWindow &window, glm::vec3 &camera
            lightPosition.x += translationAmount;
 
             }
+        else if (event.key.keysym.sym == SDLK_r) {
+            // Spin the tall box of the ray-traced Cornell box (its 10 triangles are the last in the file)
+            std::vector<ModelTriangle> &cornellBox = editModel("../04 Wireframes and Rasterising/models/cornell-box.obj", "../04 Wireframes and Rasterising/models/cornell-box.mtl", true);
+            const size_t tallBoxTriangles = 10;
+            std::cout << "Rotate tall box" << std::endl;
+            rotateModelPart(cornellBox, cornellBox.size() - tallBoxTriangles, tallBoxTriangles, rotationY(rotationAmount));
+        }
+        else if (event.key.keysym.sym == SDLK_t) {
+            std::cout << "Turn sphere ring" << std::endl;
+            turnInstanceRing(rotationAmount);
+        }
+        else if (event.key.keysym.sym == SDLK_v) {
+            wavefrontTracing = !wavefrontTracing;
+            std::cout << "Wavefront tracing " << (wavefrontTracing ? "on" : "off") << std::endl;
+        }
+        else if (event.key.keysym.sym == SDLK_b) {
+            backFaceCulling = !backFaceCulling;
+            std::cout << "Back-face culling " << (backFaceCulling ? "on" : "off") << std::endl;
+        }
+        else if (event.key.keysym.sym == SDLK_p) {
+            progressiveRendering = !progressiveRendering;
+            std::cout << "Progressive rendering " << (progressiveRendering ? "on" : "off") << std::endl;
+        }
+        else if (event.key.keysym.sym == SDLK_m) {
+            tessellatedSphere = !tessellatedSphere;
+            std::cout << "Tessellated sphere " << (tessellatedSphere ? "on" : "off") << std::endl;
+        }
 
         }
-    window.clearPixels();
+        else if (event.type == SDL_MOUSEBUTTONDOWN) {
+            // Both files are written from the same pixels, so they can be encoded side by side
+            JobSystem &jobs = getJobSystem();
+            JobHandle saved = jobs.run(nullptr, {jobs.run([&] { window.savePPM("output.ppm"); }),
+                                                 jobs.run([&] { window.saveBMP("output.bmp"); })});
+            jobs.wait(saved);
+        }
     std::cout << "Camera Position: x=" << cameraPosition.x << ", y=" << cameraPosition.y << ", z=" << cameraPosition.z << std::endl;
-    renderScene(window,cameraPosition,lightPosition,lightPosition1,lightPosition2,sphereModel,models,Texturemodels,textureMap);
 
 }
 
@@ -2283,34 +2958,349 @@ std::vector<glm::vec3> lightPositions = {
 
 
 
-int main() {
+// Splits every triangle into four at its edge midpoints, levels times over, to get production-sized meshes
+// out of the small models that ship with the workbooks
+std::vector<ModelTriangle> subdivideModel(TriangleView triangles, int levels) {
+    std::vector<ModelTriangle> result(triangles.begin(), triangles.end());
+    for (int level = 0; level < levels; level++) {
+        std::vector<ModelTriangle> finer;
+        finer.reserve(result.size() * 4);
+        for (const ModelTriangle &triangle : result) {
+            const std::array<glm::vec3, 3> &v = triangle.vertices;
+            glm::vec3 m01 = (v[0] + v[1]) * 0.5f, m12 = (v[1] + v[2]) * 0.5f, m20 = (v[2] + v[0]) * 0.5f;
+            for (const std::array<glm::vec3, 3> &corners : {std::array<glm::vec3, 3>{{v[0], m01, m20}}, std::array<glm::vec3, 3>{{m01, v[1], m12}},
+                                                           std::array<glm::vec3, 3>{{m20, m12, v[2]}}, std::array<glm::vec3, 3>{{m01, m12, m20}}}) {
+                ModelTriangle part(corners[0], corners[1], corners[2], triangle.colour);
+                part.normal = triangle.normal;
+                finer.push_back(part);
+            }
+        }
+        result.swap(finer);
+    }
+    return result;
+}
+
+// Builds the same mesh single-threaded and on every core and traces a grid of rays through each tree.
+// Run with --bench-bvh [levels], every level of subdivision multiplies the triangle count by four.
+void benchmarkBVHBuild(int levels) {
+    struct BenchmarkModel {
+        std::string filepath;
+        std::vector<ModelTriangle> triangles;
+    };
+    std::vector<BenchmarkModel> benchmarkModels;
+    const std::map<std::string, Colour> palette = loadMTL("../05 Navigation and Transformation/models/textured-cornell-box.mtl");
+    benchmarkModels.push_back({"../05 Navigation and Transformation/models/sphere2.obj",
+                               loadOBJWithTexture("../05 Navigation and Transformation/models/sphere2.obj", palette)});
+    benchmarkModels.push_back({"../07 Lighting and Shading (external lecture)/resources/sphere.obj",
+                               loadOBJ("../07 Lighting and Shading (external lecture)/resources/sphere.obj", palette)});
+
+    for (const BenchmarkModel &model : benchmarkModels) {
+        std::vector<ModelTriangle> triangles = subdivideModel(model.triangles, levels);
+        glm::vec3 boundsMin(std::numeric_limits<float>::infinity()), boundsMax(-std::numeric_limits<float>::infinity());
+        for (const ModelTriangle &triangle : triangles) {
+            for (const glm::vec3 &vertex : triangle.vertices) {
+                boundsMin = glm::min(boundsMin, vertex);
+                boundsMax = glm::max(boundsMax, vertex);
+            }
+        }
+        glm::vec3 centre = (boundsMin + boundsMax) * 0.5f;
+        float radius = glm::length(boundsMax - centre);
+        glm::vec3 rayOrigin = centre + glm::vec3(0, 0, 3.0f * radius);
+        std::cout << model.filepath << " subdivided " << levels << " times: " << triangles.size() << " triangles" << std::endl;
+
+        BVHBuildOptions singleThreaded;
+        singleThreaded.threadCount = 1;
+        BVHBuildOptions multiThreaded;
+        std::vector<BVHBuildOptions> builds = {singleThreaded, multiThreaded};
+        // The full sweep sorts the triangles at every node, so it is only run on the smaller meshes
+        if (triangles.size() <= 100000) {
+            BVHBuildOptions fullSweep = singleThreaded;
+            fullSweep.binCount = 0;
+            builds.push_back(fullSweep);
+        }
+        double singleThreadedBuild = 0.0;
+        for (const BVHBuildOptions &options : builds) {
+            BVH bvh;
+            auto start = std::chrono::steady_clock::now();
+            bvh.build(triangles, options);
+            double buildTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            if (singleThreadedBuild == 0.0) singleThreadedBuild = buildTime;
+
+            const int gridSize = 512;
+            size_t hits = 0;
+            start = std::chrono::steady_clock::now();
+            for (int y = 0; y < gridSize; y++) {
+                for (int x = 0; x < gridSize; x++) {
+                    glm::vec3 target = centre + radius * glm::vec3(2.0f * x / gridSize - 1.0f, 2.0f * y / gridSize - 1.0f, 0.0f);
+                    float t, u, v;
+                    size_t index;
+                    if (bvh.intersect(rayOrigin, glm::normalize(target - rayOrigin), t, u, v, index)) hits++;
+                }
+            }
+            double traceTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            size_t threadCount = options.threadCount > 0 ? options.threadCount : std::max(1u, std::thread::hardware_concurrency());
+            std::cout << "  " << threadCount << " thread(s), " << options.binCount << " bins: build " << buildTime << " ms ("
+                      << singleThreadedBuild / buildTime << "x), " << bvh.getStats() << ", trace "
+                      << gridSize * gridSize / traceTime / 1e6 << " Mrays/s (" << hits << " hits)" << std::endl;
+        }
+    }
+}
+
+// Renders the Mirror and indirect scenes pixel by pixel and as wavefronts, once traced in the order the rays were
+// queued and once sorted, and reports how alike neighbouring secondary rays were and how fast they were traced.
+// Run with --bench-wavefront.
+void benchmarkWavefront() {
+    DrawingWindow window(3 * WIDTH, 3 * HEIGHT, false);
+    glm::vec3 cameraPosition(0, 0, 8.0f);
+    glm::vec3 lightPosition(0, 0, 1);
+    using Renderer = void (*)(DrawingWindow &, glm::vec3, glm::vec3);
+    using WavefrontRenderer = void (*)(DrawingWindow &, glm::vec3, glm::vec3, bool, WavefrontStats *);
+    struct BenchmarkScene {
+        std::string name;
+        Renderer perPixel;
+        WavefrontRenderer wavefront;
+    };
+    std::vector<BenchmarkScene> scenes = {{"Mirror", drawRasterisedScene_Mirror, drawMirrorSceneWavefront},
+                                          {"indirect", drawRasterisedScene_indirect, drawIndirectSceneWavefront}};
+    auto millisecondsSince = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+    for (const BenchmarkScene &scene : scenes) {
+        // Loads the model and builds its trees, so none of the timed frames pays for that
+        scene.wavefront(window, cameraPosition, lightPosition, true, nullptr);
+
+        auto start = std::chrono::steady_clock::now();
+        scene.perPixel(window, cameraPosition, lightPosition);
+        double perPixelTime = millisecondsSince(start);
+        std::cout << scene.name << " (" << window.width << "x" << window.height << "): pixel by pixel " << perPixelTime << " ms" << std::endl;
+        for (bool sortRays : {false, true}) {
+            WavefrontStats stats;
+            start = std::chrono::steady_clock::now();
+            scene.wavefront(window, cameraPosition, lightPosition, sortRays, &stats);
+            double wavefrontTime = millisecondsSince(start);
+            std::cout << "  wavefront, " << (sortRays ? "sorted" : "unsorted") << ": " << wavefrontTime << " ms ("
+                      << perPixelTime / wavefrontTime << "x), " << stats << std::endl;
+        }
+    }
+}
+
+// Loads the models the ray-traced modes trace and builds their trees, so that switching to a mode doesn't stall on its
+// first frame. loadModel and the tree caches are only safe on one thread at a time, so this is a single job's work.
+void loadRayTracedScenes() {
+    const std::string mtlFilepath = "../04 Wireframes and Rasterising/models/cornell-box.mtl";
+    prepareModel(loadModel("../04 Wireframes and Rasterising/models/cornell-box.obj", mtlFilepath, false));
+    prepareModel(loadModel("../04 Wireframes and Rasterising/models/cornell-box.obj", mtlFilepath, true));
+    prepareModel(loadModel("../04 Wireframes and Rasterising/models/Mirror-box.obj", mtlFilepath, true));
+    prepareModel(loadModel("../05 Navigation and Transformation/models/textured-cornell-box.obj",
+                           "../05 Navigation and Transformation/models/textured-cornell-box.mtl", true));
+}
+
+// Renders Cornell box and sphere scenes on 1, 2, 4, ... threads up to maxThreads (0 for every hardware thread) and
+// reports the best of three frames at each count against one thread. Run with --bench-threads [maxThreads].
+void benchmarkThreads(size_t maxThreads) {
+    DrawingWindow window(3 * WIDTH, 3 * HEIGHT, false);
+    glm::vec3 cameraPosition(0, 0, 8.0f);
+    glm::vec3 lightPosition(0, 0, 1);
+    // The lecture sphere lit and seen as in the 'g' and 'h' modes
+    Sphere sphere = fitSphere(loadOBJ("../07 Lighting and Shading (external lecture)/resources/sphere.obj", std::map<std::string, Colour>()));
+    glm::vec3 sphereCamera(0, 0, 100);
+    // The rasterised modes' Cornell box, and the lecture sphere subdivided into a mesh of 28672 triangles
+    std::vector<ModelTriangle> cornellBox = loadOBJ("../04 Wireframes and Rasterising/models/cornell-box.obj",
+                                                    loadMTL("../04 Wireframes and Rasterising/models/cornell-box.mtl"));
+    std::vector<ModelTriangle> sphereMesh = subdivideModel(loadOBJ("../07 Lighting and Shading (external lecture)/resources/sphere.obj", std::map<std::string, Colour>()), 4);
+    glm::vec3 sphereMeshCamera(0, 1.5f, 4);
+    struct BenchmarkScene {
+        std::string name;
+        std::function<void()> render;
+    };
+    std::vector<BenchmarkScene> scenes = {
+            {"Cornell box, hard shadows", [&] { drawRasterisedScene_A(window, cameraPosition, lightPosition); }},
+            {"Cornell box, soft shadows", [&] { drawRasterisedScene_S(window, cameraPosition, lightPositions); }},
+            {"Cornell box, indirect", [&] { drawRasterisedScene_indirect(window, cameraPosition, lightPosition); }},
+            {"Mirror box", [&] { drawRasterisedScene_Mirror(window, cameraPosition, lightPosition); }},
+            {"Mirror box, wavefront", [&] { drawMirrorSceneWavefront(window, cameraPosition, lightPosition); }},
+            {"Cornell box with spheres", [&] { drawSphereScene(window, cameraPosition, lightPosition); }},
+            {"Sphere, Gouraud", [&] { drawSphereWithGourandShading(window, sphere, sphereCamera, glm::vec3(0, 5.1f, 5), 2.0, 1, 0); }},
+            {"Sphere, Phong", [&] { drawRaytracingPhongCameraView(window, sphereCamera, sphere, glm::vec3(0.4f, 1.8f, 2.4f)); }},
+            {"Cornell box, rasterised", [&] { window.clearPixels(); rasteriseTriangles(window, cornellBox, cameraPosition, nullptr); }},
+            {"Sphere mesh, rasterised", [&] { window.clearPixels(); rasteriseTriangles(window, sphereMesh, sphereMeshCamera, nullptr); }}};
+    if (maxThreads == 0) maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<size_t> threadCounts;
+    for (size_t threads = 1; threads < maxThreads; threads *= 2) threadCounts.push_back(threads);
+    threadCounts.push_back(maxThreads);
+
+    JobSystem &jobs = getJobSystem();
+    size_t poolThreads = jobs.getThreadCount();
+    for (const BenchmarkScene &scene : scenes) {
+        std::cout << scene.name << " (" << window.width << "x" << window.height << "):" << std::endl;
+        double singleThreaded = 0.0;
+        for (size_t threads : threadCounts) {
+            jobs.setThreadCount(threads);
+            // The first frame at one thread also loads the model and builds its trees
+            if (threads == 1) scene.render();
+            double best = std::numeric_limits<double>::infinity();
+            for (int frame = 0; frame < 3; frame++) {
+                auto start = std::chrono::steady_clock::now();
+                scene.render();
+                best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+            }
+            if (threads == 1) singleThreaded = best;
+            std::cout << "  " << threads << " thread(s): " << best << " ms (" << singleThreaded / best << "x)" << std::endl;
+        }
+    }
+    jobs.setThreadCount(poolThreads);
+}
+
+// Offline renders on a render farm of worker processes (see RenderFarm.h), started with
+//   --farm <workers> <frames> [mode key, 8 by default] [socket path, or tcp:PORT]
+// for one of the ray-traced modes. The frames follow getFarmCameraPosition and are written to frame_0000.ppm and on.
+
+// Square tiles of the image leased to a worker at a time: big enough that a worker spends far longer tracing one than
+// sending it back, small enough that a 960x720 frame keeps a dozen workers busy
+const uint32_t FARM_TILE_SIZE = 128;
+// Degrees the camera swings either side of straight ahead over a farmed render
+const float FARM_CAMERA_SWING = 20.0f;
+
+// Where the camera is for frame of a frameCount-frame render: swinging about the y axis on the circle the default camera
+// is on, from FARM_CAMERA_SWING degrees one side of it to the other
+glm::vec3 getFarmCameraPosition(uint32_t frame, uint32_t frameCount) {
+    float along = frameCount > 1 ? float(frame) / float(frameCount - 1) : 0.5f;
+    return rotationY(glm::radians(FARM_CAMERA_SWING * (2.0f * along - 1.0f))) * glm::vec3(0, 0, 8.0f);
+}
+
+// What a worker does with a lease: draws the scene of the job from the frame's camera position with render into a
+// window the size of the tile, as the part of the whole image the tile covers, and copies it into pixels. False,
+// drawing nothing, if the job's scene is not one of the ray-traced modes.
+bool renderFarmTile(const FarmJob &job, const FarmLease &lease, uint32_t *pixels,
+                    const std::function<void(DrawingWindow &, glm::vec3 &)> &render) {
+    if (job.scene > uint32_t(RenderMode::Spheres) || !isRayTraced(RenderMode(job.scene))) {
+        std::cerr << "The render farm asked for scene " << job.scene << ", which is not a ray-traced mode" << std::endl;
+        return false;
+    }
+    currentRenderMode = RenderMode(job.scene);
+    glm::vec3 cameraPosition = getFarmCameraPosition(lease.frame, job.frameCount);
+    DrawingWindow tile(size_t(lease.x1 - lease.x0), size_t(lease.y1 - lease.y0));
+    renderLattice.offsetX = lease.x0;
+    renderLattice.offsetY = lease.y0;
+    renderLattice.imageWidth = job.width;
+    renderLattice.imageHeight = job.height;
+    render(tile, cameraPosition);
+    renderLattice = SampleLattice();
+    for (size_t y = 0; y < tile.height; y++) {
+        for (size_t x = 0; x < tile.width; x++) pixels[y * tile.width + x] = tile.getPixelColour(x, y);
+    }
+    return true;
+}
+
+// Renders frameCount frames of mode on workers copies of this program, spread over the cores, and saves each frame as
+// it comes in; false if the farm couldn't be set up or gave up
+bool renderOnFarm(size_t workers, uint32_t frameCount, RenderMode mode, const std::string &address) {
+    FarmJob job;
+    job.width = 3 * WIDTH;
+    job.height = 3 * HEIGHT;
+    job.frameCount = frameCount;
+    job.scene = uint32_t(mode);
+    RenderFarmCoordinator farm(job, FARM_TILE_SIZE);
+    if (!farm.listen(address)) return false;
+    size_t threads = std::max<size_t>(1, std::thread::hardware_concurrency() / workers);
+    // This program, wherever it was started from; the workers inherit the working directory the models are found from
+    farm.startWorkers({"/proc/self/exe", "--farm-worker", farm.getAddress(), std::to_string(threads)}, workers);
+
+    auto start = std::chrono::steady_clock::now();
+    bool done = farm.run([&](uint32_t frame, const std::vector<uint32_t> &pixels) {
+        DrawingWindow image(size_t(job.width), size_t(job.height));
+        for (size_t y = 0; y < job.height; y++) {
+            for (size_t x = 0; x < job.width; x++) image.setPixelColour(x, y, pixels[y * job.width + x]);
+        }
+        image.completeFrame();
+        char filename[32];
+        std::snprintf(filename, sizeof(filename), "frame_%04u.ppm", frame);
+        image.savePPM(filename);
+        std::cout << "Saved " << filename << std::endl;
+    });
+    if (done) {
+        std::cout << frameCount << " frame(s) on " << workers << " worker(s) in "
+                  << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s" << std::endl;
+    }
+    return done;
+}
+
+// The largest worker or thread count the command line takes, far more than any machine has cores
+const unsigned long MAX_PROCESS_COUNT = 1024;
+
+// text as a whole number from 1 to maxValue, for the counts given on the command line; false for anything else
+bool parseCount(const char *text, unsigned long maxValue, unsigned long &value) {
+    if (!std::isdigit(static_cast<unsigned char>(text[0]))) return false;
+    char *end;
+    errno = 0;
+    unsigned long parsed = std::strtoul(text, &end, 10);
+    if (*end != '\0' || errno == ERANGE || parsed == 0 || parsed > maxValue) return false;
+    value = parsed;
+    return true;
+}
+
+// How often the event loop shows the latest finished frame while there is no input to wake it
+const uint32_t PRESENT_INTERVAL_MS = 15;
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "--bench-bvh") {
+        benchmarkBVHBuild(argc > 2 ? std::stoi(argv[2]) : 4);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--bench-wavefront") {
+        benchmarkWavefront();
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--bench-threads") {
+        benchmarkThreads(argc > 2 ? std::stoul(argv[2]) : 0);
+        return 0;
+    }
+    // Render on this many threads instead of one per core
+    const char *threadCount = nullptr;
+    if (argc > 2 && std::string(argv[1]) == "--threads") threadCount = argv[2];
+    if (argc > 3 && std::string(argv[1]) == "--farm-worker") threadCount = argv[3];
+    if (threadCount) {
+        unsigned long threads;
+        if (!parseCount(threadCount, MAX_PROCESS_COUNT, threads)) {
+            std::cerr << "The thread count has to be a whole number from 1 to " << MAX_PROCESS_COUNT << std::endl;
+            return 1;
+        }
+        getJobSystem().setThreadCount(threads);
+    }
 
 //    const std::string filepath = "../07 Lighting and Shading (external lecture)/resources/sphere.obj";
 //    const std::map<std::string, Colour> palette;
 //    std::vector<ModelTriangle> model = loadOBJ(filepath, palette);
 
+    // The files are independent of each other, so they are parsed side by side while the ray-traced scenes are loaded
+    // and their trees built; only fitting the sphere has to wait for its mesh
+    JobSystem &jobs = getJobSystem();
     const std::string filepath = "../07 Lighting and Shading (external lecture)/resources/sphere.obj";
     const std::map<std::string, Colour> palette;
-    std::vector<ModelTriangle> sphereModel = loadOBJ(filepath, palette);
+    std::vector<ModelTriangle> sphereMesh;
+    Sphere sphere;
+    JobHandle sphereParsed = jobs.run([&] { sphereMesh = loadOBJ(filepath, palette); });
+    // The lecture sphere is only ever drawn whole, so it is traced as the exact sphere its mesh approximates
+    JobHandle sphereFitted = jobs.run([&] { sphere = fitSphere(sphereMesh); }, {sphereParsed});
 
     const std::string filepath2 = "../04 Wireframes and Rasterising/models/cornell-box.obj";
-    const std::map<std::string, Colour> palette2 = loadMTL(
-            "../04 Wireframes and Rasterising/models/cornell-box.mtl");
-    std::vector<ModelTriangle> models = loadOBJ(filepath2, palette2);
+    std::vector<ModelTriangle> models;
+    JobHandle boxParsed = jobs.run([&] {
+        models = loadOBJ(filepath2, loadMTL("../04 Wireframes and Rasterising/models/cornell-box.mtl"));
+    });
 
     const std::string filepath3 = "../05 Navigation and Transformation/models/textured-cornell-box.obj";
-    const std::map<std::string, Colour> palette3 = loadMTL(
-            "../05 Navigation and Transformation/models/textured-cornell-box.mtl");
-    std::vector<ModelTriangle> Texturemodels = loadOBJWithTexture(filepath3, palette3);
-    TextureMap textureMap("../05 Navigation and Transformation/models/texture.ppm");
+    std::vector<ModelTriangle> Texturemodels;
+    JobHandle texturedBoxParsed = jobs.run([&] {
+        Texturemodels = loadOBJWithTexture(filepath3, loadMTL("../05 Navigation and Transformation/models/textured-cornell-box.mtl"));
+    });
 
-
-    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
-        std::cerr << "SDL initialization failed: " << SDL_GetError() << std::endl;
-        return -1;
-    }
-    DrawingWindow window(3 * WIDTH, 3 * HEIGHT, false);
-    bool running = true;
+    const std::string texturePath = "../05 Navigation and Transformation/models/texture.ppm";
+    JobHandle textureDecoded = jobs.run([&] { loadTexture(texturePath); });
+    JobHandle scenesLoaded = jobs.run(loadRayTracedScenes);
+    jobs.wait(jobs.run(nullptr, {sphereFitted, boxParsed, texturedBoxParsed, textureDecoded, scenesLoaded}));
+    TextureMap &textureMap = loadTexture(texturePath);
 
     glm::vec3 cameraPosition(0, 0, 8.0f);
     glm::vec3 cameraForGouraud(0.0f,1,100);
@@ -2323,27 +3313,79 @@ int main() {
     glm::vec3 lightPosition1(0.4f, 1.8f, 2.4f);
     glm::vec3 lightPosition2(0, 0, 1);
 
+    // The scenes are loaded, and their model caches written, before any worker is started, so every worker maps the
+    // same cache files and traces the models in them where they lie instead of parsing and building them again
+    if (argc > 3 && std::string(argv[1]) == "--farm") {
+        unsigned long workers, frameCount;
+        if (!parseCount(argv[2], MAX_PROCESS_COUNT, workers) || !parseCount(argv[3], UINT32_MAX, frameCount)) {
+            std::cerr << "The render farm takes from 1 to " << MAX_PROCESS_COUNT << " workers and at least one frame" << std::endl;
+            return 1;
+        }
+        RenderMode mode = RenderMode::Mirror;
+        if (argc > 4 && !getRayTracedMode(argv[4][0], mode)) {
+            std::cerr << "The render farm only draws the ray-traced modes, keys 4-9, 0 and o" << std::endl;
+            return 1;
+        }
+        return renderOnFarm(workers, uint32_t(frameCount), mode, argc > 5 ? argv[5] : getDefaultFarmAddress()) ? 0 : 1;
+    }
+    if (argc > 2 && std::string(argv[1]) == "--farm-worker") {
+        return runRenderFarmWorker(argv[2], [&](const FarmJob &job, const FarmLease &lease, uint32_t *pixels) {
+            return renderFarmTile(job, lease, pixels, [&](DrawingWindow &tile, glm::vec3 &camera) {
+                renderScene(tile,camera,lightPosition,lightPosition1,lightPosition2,sphere,models,Texturemodels,textureMap);
+            });
+        }) ? 0 : 1;
+    }
+
+    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+        std::cerr << "SDL initialization failed: " << SDL_GetError() << std::endl;
+        return -1;
+    }
+    DrawingWindow window(3 * WIDTH, 3 * HEIGHT, false);
+    bool running = true;
+
+
+    // Frames are drawn on their own thread, so a key press only waits for the tile in flight instead of the whole
+    // frame; the scene is only changed while no frame is being drawn from it
+    RenderThread renderThread(window, getTilePool());
+    auto drawScene = [&] {
+        renderThread.start([&] {
+            window.clearPixels();
+            auto draw = [&](DrawingWindow &target) {
+                renderScene(target,cameraPosition,lightPosition,lightPosition1,lightPosition2,sphere,models,Texturemodels,textureMap);
+            };
+            if (progressiveRendering && isRayTraced(currentRenderMode)) renderProgressively(window, draw);
+            else draw(window);
+        });
+    };
+    drawScene();
 
     SDL_Event event;
     while (running) {
-        while (SDL_PollEvent(&event)) {
-            //if u want to see other model, just //here
-            handleEvent_week7(event,window,cameraPosition,lightPosition,lightPosition1,lightPosition2,sphereModel,models,Texturemodels,textureMap);
-
+        // Sleeps until there is input, waking every so often to show the last finished frame
+        if (SDL_WaitEventTimeout(&event, PRESENT_INTERVAL_MS)) {
+            do {
+                // A click saves the last finished frame; the frame in flight is cancelled for it and drawn again after
+                if (event.type == SDL_KEYDOWN || event.type == SDL_MOUSEBUTTONDOWN) {
+                    renderThread.cancel();
+                    //if u want to see other model, just //here
+                    handleEvent_week7(event,window,cameraPosition,lightPosition,lightPosition1,lightPosition2,sphere,models,Texturemodels,textureMap);
+                    drawScene();
+                }
 
-            if (event.type == SDL_QUIT) {
-                running = false;
-            }
+                if (event.type == SDL_QUIT) {
+                    running = false;
+                }
+            } while (SDL_PollEvent(&event));
         }
 //        drawRasterisedScene_M(window, cameraPosition,lightPosition);
         window.renderFrame();
 //
-//       renderScene(window,cameraPosition,lightPosition,lightPosition1,lightPosition2,sphereModel,models,Texturemodels,textureMap);
+//       renderScene(window,cameraPosition,lightPosition,lightPosition1,lightPosition2,sphere,models,Texturemodels,textureMap);
 
 //         this is fuction u can see in the video
 //        drawRasterisedScene_Texture(window, cameraPosition,lightPosition2);
-//        drawSphereWithGourandShading(window, sphereModel, cameraForGouraud, lightPosition, 2.0, 1, 0);
-//        drawRaytracingPhongCameraView(window, cameraForGouraud, sphereModel, lightPosition1);
+//        drawSphereWithGourandShading(window, sphere, cameraForGouraud, lightPosition, 2.0, 1, 0);
+//        drawRaytracingPhongCameraView(window, cameraForGouraud, sphere, lightPosition1);
 //        drawRasterisedScene_Mirror(window, cameraPosition,lightPosition2);
 //         drawRasterisedScene_indirect(window, cameraPosition,lightPosition2);
 //        drawRasterisedScene_S(window, cameraPosition,lightPositions);